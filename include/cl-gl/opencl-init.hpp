@@ -36,17 +36,34 @@ class CLInfo
 private:
         bool     m_initialized;
         bool     m_sync;
+        bool     m_profiling;
+        bool     m_partitioned;
+        bool     m_gl_sharing;
         static CLInfo*  pinstance;
         std::vector<cl_command_queue> command_queues;
+        /* Context of each device, an index into contexts */
+        std::vector<size_t> m_device_contexts;
+
+        cl_int   split_by_numa_node();
+        /* Index in device_ids of the device command queue i enqueues on */
+        size_t   queue_device_index(size_t i) const;
+        /* Device the GL context renders on, device_ids[0] if unknown */
+        cl_device_id gl_context_device();
 
 public:
         static CLInfo* instance();
 
 	cl_context context;
+	/* One context per platform the devices come from, context first */
+	std::vector<cl_context> contexts;
 	cl_uint num_of_platforms;
 	cl_platform_id platform_id;
 	cl_device_id device_id;
 	cl_uint num_of_devices;
+	/* Every device in the context, device_ids[0] is device_id */
+	std::vector<cl_device_id> device_ids;
+	/* Device the context devices were split from, if they were */
+	cl_device_id root_device_id;
 	cl_context_properties properties[10];
 
 
@@ -57,17 +74,59 @@ public:
 
 	cl_uint  max_compute_units;
 	cl_ulong max_mem_alloc_size;
+	cl_bool  host_unified_memory;
 	size_t   max_work_group_size;
 	size_t   max_work_item_sizes[3];
 
 	CLInfo();
 	bool initialized();	
-        cl_int  initialize(size_t command_queues = 1);
+        /* Up to max_devices gpus share the context. The command_queues
+           requested go to device_id, each other device gets one more queue
+           after them (see device_queue).
+
+           The GL context is shared with a single platform, the first one
+           with a gpu. Without gl_sharing the gpus of every platform are
+           used, each platform with a context of its own: memory and 
+           functions belong to the context of the queue they were created
+           for (see DeviceInterface::new_memory) and can't be used on the
+           queues of other contexts.
+
+           With numa_fission the cpu device of the first platform that has
+           one is used instead, split in one sub-device per NUMA node when
+           the driver supports it. The sub-devices are then the devices of
+           the context, so each one gets its queue the same way. The
+           context is then made without gl_sharing. If the GL context can't
+           be shared with several gpus, the context falls back to a single
+           device.
+
+           Without gl_sharing the context has no GL properties and needs no
+           GL context (nor a display): graphic resources are then plain
+           images (see DeviceMemory::initialize_image) and acquiring them
+           does nothing */
+        cl_int  initialize(size_t command_queues = 1, bool profiling = false,
+                           size_t max_devices = 1, bool numa_fission = false,
+                           bool gl_sharing = true);
+        bool    gl_sharing() const {return m_gl_sharing;}
+        size_t  device_count() const {return device_ids.size();}
+        bool    partitioned() const {return m_partitioned;}
+        size_t  device_queue(size_t device_i) const;
+        /* Device command queue i enqueues on */
+        cl_device_id queue_device(size_t i) const;
+        size_t  context_count() const {return contexts.size();}
+        cl_context get_context(size_t context_i);
+        size_t  device_context(size_t device_i) const;
+        /* Context of the device command queue i enqueues on */
+        size_t  queue_context(size_t i) const;
+        /* First queue of a device of the context, and that device */
+        size_t  context_queue(size_t context_i) const;
+        cl_device_id context_device(size_t context_i) const;
         void set_sync(bool s);
         bool sync();
+        bool profiling();
 	void release_resources();
         cl_command_queue get_command_queue(size_t i);
         bool             has_command_queue(size_t i);
+        size_t           command_queue_count() const {return command_queues.size();}
         void             print_info();
 };
 
@@ -64,6 +64,12 @@ void   delete_buf_gl(GLuint id);
 int32_t create_tex_gl_from_file(uint32_t& width, uint32_t& height, 
                                 const char* file, GLuint* tex_id);
 
+/* Loads an image file as RGBA8 pixels. *data is allocated with new[] */
+int32_t read_tex_data_from_file(uint32_t& width, uint32_t& height, 
+                                const char* file, uint8_t** data);
+GLuint  create_tex_gl_from_data(uint32_t width, uint32_t height, 
+                                const uint8_t* data);
+
 void print_gl_info();
 void print_gl_tex_2d_info(GLuint tex);
 
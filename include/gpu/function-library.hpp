@@ -4,13 +4,14 @@
 
 #include <stdint.h>
 #include <map>
+#include <vector>
 #include <gpu/interface.hpp>
 
 namespace gpu{
 
         enum LibraryFunction {
-                scan_local_uint,
-                scan_post_uint
+                scan_lookback_uint,
+                compact_lookback_uint
         };
         
 };
@@ -26,19 +27,37 @@ public:
         }
         int32_t initialize();
 
-        DeviceFunction& function(gpu::LibraryFunction f) {
-                DeviceInterface* device = DeviceInterface::instance();
-                return device->function(ids[f]);
-        }
+        /* Every command queue has its own kernels, so queues driven from
+           different threads don't race on the arguments */
+        DeviceFunction& function(gpu::LibraryFunction f, size_t command_queue_i = 0);
         
         bool valid(){return m_initialized;}
 
+        /* Scratch used by the look-back kernels: the status of each tile and
+           the tile counter. Grows the status memory to hold tiles entries and
+           returns the epoch to tag this launch with. Each command queue has
+           its own scratch, scans on the same queue share it, so they must
+           not overlap. */
+        int32_t lookback_scratch(size_t tiles,
+                                 memory_id* status_id, memory_id* counter_id,
+                                 cl_uint* epoch, size_t command_queue_i = 0);
+
         DeviceFunctionLibrary(){}
 private:
+        /* Kernels and look-back scratch of a command queue */
+        struct QueueFunctions {
+                std::map<gpu::LibraryFunction, function_id> ids;
+                memory_id status_mem_id;
+                memory_id counter_mem_id;
+                cl_uint   epoch;
+        };
+
         int32_t load_functions();
+        int32_t load_queue_functions(QueueFunctions* queue, size_t command_queue_i);
+        int32_t clear_memory(memory_id id, size_t command_queue_i);
 
         static DeviceFunctionLibrary* s_instance;
-        std::map<gpu::LibraryFunction, function_id> ids;
+        std::vector<QueueFunctions> queues;
         bool m_initialized;
 };
 
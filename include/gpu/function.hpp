@@ -20,6 +20,8 @@
 
 #include <cl-gl/opencl-init.hpp>
 #include <gpu/memory.hpp>
+#include <gpu/program-cache.hpp>
+#include <gpu/work-size-tuner.hpp>
 
 class DeviceInterface;
 
@@ -30,9 +32,17 @@ class DeviceFunction {
 public:
         static bool sync;
 
-        DeviceFunction();
+        /* The program is built for context context_i (see CLInfo) */
+        DeviceFunction(size_t context_i = 0);
         bool valid();
-        int32_t initialize(std::string file, std::string name);
+        int32_t initialize(std::string file, std::string name,
+                           const BuildOptions& options = BuildOptions());
+
+        /* Records what to build, the program is compiled the first time the
+           function is fetched through DeviceInterface::function */
+        void    defer(std::string file, std::string name,
+                      const BuildOptions& options = BuildOptions());
+        bool    deferred() const {return m_deferred;}
         int32_t set_arg(int32_t arg_num, size_t arg_size, void* arg);
         int32_t set_arg(int32_t arg_num, DeviceMemory& mem);
         int32_t set_dims(uint8_t dims);
@@ -52,11 +62,31 @@ public:
         int32_t release();
         size_t max_group_size();
 
+        /* Local size for a launch over global_size: the one in the work
+           size profile, a candidate to time in tuning mode, or default_size
+           (max_group_size if 0). Passing 0 as the local size of the single
+           dim launches does the same. The tag tunes separately the uses of
+           a kernel that behave differently (i.e. secondary rays). Sizes are
+           kept per device, the one of the queue the launch goes to. */
+        size_t work_group_size(size_t global_size, size_t default_size = 0,
+                               const std::string& tag = "",
+                               size_t command_queue_i = 0);
+
 private:
 
         int32_t initialize(std::string name);
+        int32_t build_deferred();
+
+        bool    is_trial(size_t global_size, size_t local_size);
+        int32_t finish_trial(size_t global_size, size_t local_size, 
+                             double start_msec, cl_command_queue command_queue);
 
         bool m_initialized;
+        bool m_deferred;
+        size_t m_context;
+        std::string  m_file;
+        std::string  m_name;
+        BuildOptions m_options;
         cl_program m_program;
         cl_kernel m_kernel;
         int32_t m_arg_count;
@@ -65,6 +95,11 @@ private:
 	size_t m_global_offset[3];
 	size_t m_local_size[3];
         size_t m_max_group_size;
+        size_t m_group_multiple;
+        size_t m_trial_size;
+        size_t m_trial_global_size;
+        std::string m_trial_key;
+        cl_device_id m_trial_device;
 };
 
 #endif /* GPU_FUNCTION_HPP */
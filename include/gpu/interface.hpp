@@ -2,9 +2,11 @@
 #define GPU_INTERFACE_HPP
 
 #include <stdint.h>
+#include <pthread.h>
 #include <string>
 #include <vector>
 #include <bitset>
+#include <map>
 
 #include <cl-gl/opencl-init.hpp>
 
@@ -16,6 +18,10 @@ typedef size_t function_id;
 
 #define PREALLOC_SIZE (1<<10)
 
+/* Creating, deleting and lazily building objects is serialized, so the
+   render threads of several devices can share the interface. Fetching and
+   using objects takes no lock: each thread must use objects of its own */
+
 //// Singleton
 class DeviceInterface
 {
@@ -30,13 +36,36 @@ public:
         bool good();
         int32_t initialize();
 
-        memory_id new_memory();
-        function_id new_function();
+        /* Objects belong to the context of the command queue they are
+           created for, and can only be used with the queues of that context
+           (see CLInfo::queue_context) */
+        memory_id new_memory(size_t command_queue_i = 0);
+        function_id new_function(size_t command_queue_i = 0);
         DeviceMemory& memory(memory_id id);
         DeviceFunction& function(function_id id);
 
         std::vector<function_id> build_functions(std::string file,
-                                                 std::vector<std::string>& names);
+                                                 std::vector<std::string>& names,
+                                                 const BuildOptions& options = 
+                                                 BuildOptions(),
+                                                 size_t command_queue_i = 0);
+
+        /* Same as build_functions, but nothing is compiled until each 
+           function is first fetched */
+        std::vector<function_id> defer_functions(std::string file,
+                                                 std::vector<std::string>& names,
+                                                 const BuildOptions& options = 
+                                                 BuildOptions(),
+                                                 size_t command_queue_i = 0);
+
+        /* Kernel name from file built with options, the function is created
+           the first time a variant is asked for and kept afterwards. Each
+           command queue gets a function of its own, so threads driving 
+           different queues don't race on the arguments. Returns an invalid
+           id if it can't be built */
+        function_id function_variant(const std::string& file, const std::string& name,
+                                     const BuildOptions& options,
+                                     size_t command_queue_i = 0);
 
         int32_t delete_memory(memory_id id);
         int32_t delete_function(function_id id);
@@ -63,6 +92,8 @@ public:
         DeviceInterface();
 
 private:
+        void add_memory_chunk();
+        void add_function_chunk();
 
         static DeviceInterface* s_instance;
         bool m_initialized;
@@ -73,14 +104,19 @@ private:
         DeviceFunction invalid_function;
 
 
+        /* Objects are stored in chunks of PREALLOC_SIZE, the maps have a set
+           bit for every free id and the free lists hold those same ids so
+           new ids are handed out in constant time */
         std::vector<std::bitset<PREALLOC_SIZE> > memory_map;
         std::vector<std::bitset<PREALLOC_SIZE> > function_map;
         std::vector<std::vector<DeviceMemory> >  memory_objects;
         std::vector<std::vector<DeviceFunction> > function_objects;
-};
+        std::vector<memory_id>   free_memory_ids;
+        std::vector<function_id> free_function_ids;
 
-/*Very sucky implementation here. 
-  TODO: make it so released memory objects are not stored 
-    and we deal with invalid ids better */
+        std::map<std::string, function_id> function_variants;
+
+        pthread_mutex_t m_lock;
+};
 
 #endif /* GPU_INTERFACE_HPP */
@@ -0,0 +1,21 @@
+#ifndef GPU_KERNEL_SOURCES_HPP
+#define GPU_KERNEL_SOURCES_HPP
+
+#include <stddef.h>
+
+/* Kernel files compiled into the library, generated by SConstruct from
+   src/kernel. path is the name the kernels are requested with (i.e.
+   "src/kernel/trace-bvh.cl"), source has its includes already inlined, and
+   il is the SPIR-V of the build without options, NULL unless the library
+   was built with spirv=1. */
+struct EmbeddedKernel {
+        const char*          path;
+        const char*          source;
+        const unsigned char* il;
+        size_t               il_size;
+};
+
+extern const EmbeddedKernel embedded_kernels[];
+extern const size_t         embedded_kernel_count;
+
+#endif /* GPU_KERNEL_SOURCES_HPP */
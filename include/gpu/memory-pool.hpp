@@ -0,0 +1,104 @@
+#ifndef GPU_MEMORY_POOL_HPP
+#define GPU_MEMORY_POOL_HPP
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+
+#include <cl-gl/opencl-init.hpp>
+
+/* Pooling allocator behind DeviceMemory.
+
+   Sizes are rounded up to a size class (four classes per power of two,
+   starting at 256 bytes). Small classes are carved as sub-buffers from
+   large slabs, bigger ones get a buffer of their own. Released blocks are
+   kept in a free list per class and handed out again without any OpenCL
+   call, so the churn of resizing ray bundles and scene buffers doesn't go
+   back to the driver each time.
+
+   The transient arena is a bump allocator for memory that lives only while
+   a frame or a build is being computed (i.e. the bvh builder temporaries).
+   It rewinds once every transient block has been released.
+
+   A released block may still be in use by commands of any queue (the
+   pipelines of each device, the builder), so release enqueues a marker on
+   every command queue and the block is handed out again only once all of
+   them completed. The pool itself can be used from several threads.
+
+   Buffers can't move between contexts, each context has its pool (see
+   CLInfo::contexts) and only its queues get the markers. */
+
+//// Singleton per context
+class DeviceMemoryPool {
+public:
+        static DeviceMemoryPool* instance(size_t context_i = 0) {
+                if (context_i >= s_instances.size())
+                        s_instances.resize(context_i + 1, NULL);
+                if (s_instances[context_i] == NULL) {
+                        s_instances[context_i] = new DeviceMemoryPool(context_i);
+                }
+                return s_instances[context_i];
+        }
+
+        int32_t allocate(size_t size, cl_mem* mem, int32_t* size_class);
+        int32_t release(cl_mem mem, int32_t size_class);
+
+        int32_t allocate_transient(size_t size, cl_mem* mem);
+        int32_t release_transient(cl_mem mem);
+        size_t  max_transient_size();
+
+        /* Frees the cached blocks that don't belong to a slab */
+        int32_t trim();
+
+        static size_t class_size(int32_t size_class);
+        static int32_t size_class(size_t size);
+
+        size_t slab_bytes() const {return m_slab_bytes;}
+        size_t cached_bytes() const {return m_cached_bytes;}
+        size_t transient_bytes() const {return m_arena_bytes;}
+
+        DeviceMemoryPool(size_t context_i = 0);
+private:
+        int32_t initialize();
+        int32_t new_buffer(size_t size, cl_mem* mem);
+        int32_t new_sub_buffer(cl_mem parent, size_t offset, size_t size, cl_mem* mem);
+        int32_t carve(size_t size, cl_mem* mem);
+        size_t  align(size_t offset) const;
+        int32_t trim_cached();
+        void    rewind_arena();
+
+        /* Released block and the markers it waits for */
+        struct FreeBlock {
+                cl_mem mem;
+                std::vector<cl_event> markers;
+        };
+        int32_t mark_released(FreeBlock* block);
+        bool    idle(FreeBlock* block);
+        void    release_markers(FreeBlock* block);
+
+        static std::vector<DeviceMemoryPool*> s_instances;
+        size_t m_context;
+        bool   m_initialized;
+        pthread_mutex_t m_lock;
+
+        size_t m_alignment;
+        size_t m_slab_size;
+        size_t m_max_carved_size;
+        size_t m_max_cached_bytes;
+
+        std::vector<std::vector<FreeBlock> > m_free;
+        std::vector<cl_mem> m_slabs;
+        size_t m_slab_offset;
+        size_t m_slab_bytes;
+        size_t m_cached_bytes;
+
+        std::vector<cl_mem> m_arena_slabs;
+        std::vector<size_t> m_arena_sizes;
+        size_t m_arena_slab;
+        size_t m_arena_offset;
+        size_t m_arena_live;
+        size_t m_arena_reserve;
+        size_t m_arena_bytes;
+};
+
+#endif /* GPU_MEMORY_POOL_HPP */
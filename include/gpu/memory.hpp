@@ -17,24 +17,51 @@ enum DeviceMemoryMode
 class DeviceMemory {
 
 public:
-        DeviceMemory();
+        /* The memory is created in context context_i (see CLInfo) */
+        DeviceMemory(size_t context_i = 0);
         bool valid() const;
         int32_t initialize(size_t size, DeviceMemoryMode mode = READ_WRITE_MEMORY);
         int32_t initialize(size_t size, const void* values, 
                            DeviceMemoryMode mode = READ_WRITE_MEMORY);
+        /* Memory from the transient arena, it must be released before the
+           end of the frame (or build) that uses it */
+        int32_t initialize_transient(size_t size);
+        /* Zero copy memory allocated in host memory (CL_MEM_ALLOC_HOST_PTR)
+           when the device shares memory with the host, i.e. CPU devices and
+           integrated GPUs. write/read then go through map/unmap instead of
+           a copy. On other devices it's a regular buffer. */
+        int32_t initialize_host_mapped(size_t size, 
+                                       DeviceMemoryMode mode = READ_WRITE_MEMORY);
+        int32_t initialize_host_mapped(size_t size, const void* values,
+                                       DeviceMemoryMode mode = READ_WRITE_MEMORY);
         int32_t initialize_from_gl_texture(const GLuint gl_tex);
+        /* RGBA8 image, what the GL textures are made of, for contexts that
+           don't share GL (see CLInfo::gl_sharing). pixels may be NULL */
+        int32_t initialize_image(size_t width, size_t height, 
+                                 const void* pixels = NULL);
         size_t write(size_t nbytes, const void* values, 
                      size_t offset = 0, size_t command_queue_i = 0);
         size_t read(size_t nbytes, void* buffer, 
                     size_t offset = 0, size_t command_queue_i = 0);
+        /* Blocking read of a whole image made by initialize_image, on a
+           queue of the context of the image */
+        int32_t read_image(size_t width, size_t height, void* pixels);
         int32_t resize(size_t new_size);
+        /* Across contexts the copy goes through the host */
         int32_t copy_to(DeviceMemory& dst, size_t bytes = 0,
                         size_t offset = 0, size_t dst_offset = 0,
                         size_t command_queue_i = 0);
         int32_t copy_all_to(DeviceMemory& dst, size_t command_queue_i); //Convenience
 
+        /* Blocking map of a range of the memory, NULL on error */
+        void*   map(size_t nbytes, size_t offset = 0, bool for_writing = true,
+                    size_t command_queue_i = 0);
+        int32_t unmap(void* mapped_ptr, size_t command_queue_i = 0);
+        bool    host_mapped() const {return m_host_mapped;}
+
         int32_t release();
         size_t size() const;
+        size_t context() const {return m_context;}
         cl_mem* ptr();
 private:
 
@@ -42,6 +69,10 @@ private:
         cl_mem m_mem;
         size_t m_size;
         DeviceMemoryMode m_mode;
+        int32_t m_pool_class; /* -1 if not taken from the pool */
+        bool m_transient;
+        bool m_host_mapped;
+        size_t m_context;
 };
 
 #endif /* GPU_MEMORY_HPP */
@@ -0,0 +1,116 @@
+#ifndef GPU_PROGRAM_CACHE_HPP
+#define GPU_PROGRAM_CACHE_HPP
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+
+#include <cl-gl/opencl-init.hpp>
+
+/* Set of -D defines a program is built with. Defines are kept sorted, so
+   the same set always gives the same string (and the same cache key) no
+   matter the order they were added in. */
+class BuildOptions {
+public:
+        BuildOptions& define(const std::string& name);
+        BuildOptions& define(const std::string& name, int32_t value);
+        BuildOptions& define(const std::string& name, const std::string& value);
+
+        bool        empty() const {return m_defines.empty();}
+        std::string str() const;
+
+private:
+        std::map<std::string, std::string> m_defines;
+};
+
+/* Built programs, one per kernel file and option set. Every DeviceFunction
+   takes its program from here, so kernels of the same file and options
+   share a single build, and specialized variants stay built once they
+   have been requested. The key (file and canonical options) is also what
+   identifies a program binary, should binaries be cached to disk.
+
+   prefetch queues a build and returns right away. Queued builds are run
+   by a few host threads, each one a blocking clBuildProgram, so several
+   programs build at the same time whether the driver compiles in the 
+   background or not (CPU runtimes don't). get waits only for the build of
+   the program it asks for, and builds it itself if nobody has. Every 
+   method can be called from any thread.
+
+   Sources come from the kernels embedded in the library (see
+   kernel-sources.hpp), files that aren't embedded are read relative to the
+   working directory. Builds without options use the embedded SPIR-V when
+   every device of the context takes it, falling back to the source when
+   the driver rejects it.
+
+   Programs belong to a context, each context of CLInfo builds its own
+   (the index is part of the key). */
+
+//// Singleton
+class ProgramCache {
+public:
+        static ProgramCache* instance() {
+                if (s_instance == NULL) {
+                        s_instance = new ProgramCache;
+                }
+                return s_instance;
+        }
+
+        /* Returns a retained program, the caller releases it */
+        int32_t get(const std::string& file, const BuildOptions& options,
+                    cl_program* program, size_t context_i = 0);
+
+        /* Starts building in the background, errors are reported by get */
+        int32_t prefetch(const std::string& file,
+                         const BuildOptions& options = BuildOptions(),
+                         size_t context_i = 0);
+
+        static std::string key(const std::string& file, const BuildOptions& options,
+                               size_t context_i = 0);
+
+        size_t  size();
+        int32_t clear();
+
+        ProgramCache();
+private:
+        enum ProgramSource {
+                SOURCE_FILE,
+                SOURCE_EMBEDDED,
+                SOURCE_IL
+        };
+
+        /* A build queued or running. Failed prefetched builds stay, with
+           done set, so they are not retried */
+        struct PendingBuild {
+                std::string   file;
+                BuildOptions  options;
+                size_t        context;
+                bool          done;
+        };
+
+        int32_t build(const std::string& file, const BuildOptions& options,
+                      size_t context_i, cl_program* program, bool allow_il = true);
+        int32_t create(const std::string& file, const BuildOptions& options,
+                       size_t context_i, bool allow_il, cl_program* program, 
+                       ProgramSource* source);
+        bool    il_supported(size_t context_i);
+        void    print_build_log(cl_program program, const std::string& file,
+                                const BuildOptions& options, size_t context_i);
+
+        static void* build_thread(void* arg);
+
+        static ProgramCache* s_instance;
+
+        /* Everything below is guarded by m_lock */
+        std::map<std::string, cl_program> m_programs;
+        std::map<std::string, PendingBuild> m_pending;
+        std::deque<std::string> m_queue;   /* Keys waiting for a thread */
+        size_t          m_build_threads;
+        pthread_mutex_t m_lock;
+        std::vector<int32_t> m_il_supported; /* Per context, -1 until checked */
+        pthread_cond_t  m_build_done;
+};
+
+#endif /* GPU_PROGRAM_CACHE_HPP */
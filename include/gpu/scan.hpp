@@ -10,5 +10,12 @@ int32_t gpu_scan_uint(DeviceInterface& device,
                       memory_id in_mem_id, size_t size,
                       memory_id out_mem_id, size_t command_queue_i = 0);
 
+/* Writes the indices of the non zero entries of flags_mem, in order, to
+   ids_mem and their number to the first uint of count_mem */
+int32_t gpu_compact_uint(DeviceInterface& device, 
+                         memory_id flags_mem_id, size_t size,
+                         memory_id ids_mem_id, memory_id count_mem_id,
+                         size_t command_queue_i = 0);
+
 
 #endif /* RT_SCAN_HPP */
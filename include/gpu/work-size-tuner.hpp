@@ -0,0 +1,90 @@
+#ifndef GPU_WORK_SIZE_TUNER_HPP
+#define GPU_WORK_SIZE_TUNER_HPP
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include <cl-gl/opencl-init.hpp>
+
+/* Local work sizes measured per kernel and problem size on this device.
+
+   Launches that let DeviceFunction pick their local size (see
+   DeviceFunction::local_size) use the size stored here for the kernel
+   name and the power of two bucket of the global size. In tuning mode a
+   kernel without an entry cycles through the candidate sizes on its real
+   launches, each one timed on the host, and the fastest becomes the entry.
+   Kernels are never run twice for a measurement, so it is safe with
+   kernels that update their outputs in place.
+
+   Entries are kept per device, each in a profile file named after the
+   device and driver, loaded the first time the device is used and 
+   rewritten every time one of its kernels is tuned. Devices with the same
+   name and driver share one profile. Every method may be called from 
+   several pipeline threads at once. */
+
+//// Singleton
+class WorkSizeTuner {
+public:
+        static WorkSizeTuner* instance();
+
+        /* Directory of the profiles, the ones of the context devices are
+           loaded. A missing profile is not an error, it starts empty */
+        int32_t load_profile(const std::string& dir = ".");
+        int32_t save_profile(cl_device_id device);
+
+        void    set_tuning(bool b);
+        bool    tuning();
+
+        /* 0 if this kernel and size have no entry for the device */
+        size_t  tuned_size(cl_device_id device, 
+                           const std::string& kernel, size_t global_size);
+
+        /* Next size to try in tuning mode, 0 if there's nothing to try */
+        size_t  trial_size(cl_device_id device,
+                           const std::string& kernel, size_t global_size,
+                           size_t max_size, size_t multiple);
+        int32_t record_trial(cl_device_id device,
+                             const std::string& kernel, size_t global_size,
+                             size_t local_size, double msec);
+
+        static uint32_t    bucket(size_t global_size);
+        static std::string profile_name(cl_device_id device);
+
+        WorkSizeTuner();
+private:
+        struct Trial {
+                std::vector<size_t> candidates;
+                std::vector<std::vector<double> > times;
+                size_t next;
+        };
+
+        struct Profile {
+                std::string path;
+                bool        loaded;
+                /* kernel -> bucket -> local size */
+                std::map<std::string, std::map<uint32_t, size_t> > sizes;
+                std::map<std::string, Trial> trials;
+                Profile() : loaded(false) {}
+        };
+
+        /* Called with m_lock held */
+        Profile& profile(cl_device_id device);
+        int32_t  load(Profile& p);
+        int32_t  save(Profile& p);
+        size_t   lookup(Profile& p, const std::string& kernel, size_t global_size);
+
+        static WorkSizeTuner*  s_instance;
+        static pthread_mutex_t s_instance_lock;
+        pthread_mutex_t        m_lock;
+        bool                   m_tuning;
+        std::string            m_dir;
+
+        /* Profiles by path, and the path of each device asked for */
+        std::map<std::string, Profile>       m_profiles;
+        std::map<cl_device_id, std::string>  m_device_paths;
+};
+
+#endif /* GPU_WORK_SIZE_TUNER_HPP */
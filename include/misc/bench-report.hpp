@@ -0,0 +1,42 @@
+#pragma once
+#ifndef BENCH_REPORT_HPP
+#define BENCH_REPORT_HPP
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/* Helpers of the JSON reports written by rt-bench and prim-bench */
+
+/* Nearest rank percentile, values must be sorted */
+inline double percentile(const std::vector<double>& values, double p)
+{
+        if (values.empty())
+                return 0;
+        size_t rank = size_t(p * 0.01 * values.size() + 0.5);
+        rank = std::min(std::max(rank, size_t(1)), values.size());
+        return values[rank-1];
+}
+
+/* Quoted JSON string, names reported by drivers may have anything */
+inline std::string json_string(const std::string& s)
+{
+        const char* hex = "0123456789abcdef";
+        std::string out = "\"";
+        for (size_t i = 0; i < s.size(); ++i) {
+                unsigned char c = s[i];
+                if (c == '"' || c == '\\') {
+                        out += '\\';
+                        out += c;
+                } else if (c < 0x20) {
+                        out += "\\u00";
+                        out += hex[c >> 4];
+                        out += hex[c & 0xf];
+                } else {
+                        out += c;
+                }
+        }
+        return out + "\"";
+}
+
+#endif /* BENCH_REPORT_HPP */
@@ -27,6 +27,8 @@ public:
         std::vector<int>         get_int_list(section_name_t, property_name_t);
         std::vector<bool>        get_bool_list(section_name_t, property_name_t);
 
+        const std::map<section_name_t, section_t>& get_sections() const {return m_values;}
+
 private:
 
         // input string are assumed to be trimmed (front and back)
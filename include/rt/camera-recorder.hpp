@@ -0,0 +1,77 @@
+#pragma once
+#ifndef RT_CAMERA_RECORDER_HPP
+#define RT_CAMERA_RECORDER_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <rt/vector.hpp>
+#include <rt/camera-trajectory.hpp>
+#include <rt/scene.hpp>
+
+/* Camera paths are stored in a compact binary file:
+     "RTCP", uint32 version, uint32 object count,
+     then for each frame 9 floats for the camera (pos, dir, up) followed by
+     9 floats for each object (pos, rpy, scale), all little endian. */
+
+/* Records the camera and object transforms of each frame of an interactive
+   run, to be replayed with RecordedCameraTrajectory. */
+class CameraRecorder {
+
+public:
+
+        CameraRecorder();
+        ~CameraRecorder();
+
+        /* The number of objects recorded is fixed to the scene's at start */
+        int32_t start(const std::string& file, Scene& scene);
+        int32_t record_frame(Scene& scene);
+        int32_t stop();
+
+        bool     recording() const {return m_recording;}
+        uint32_t frames() const {return m_frames;}
+
+private:
+
+        std::ofstream m_file;
+        bool          m_recording;
+        uint32_t      m_frames;
+        uint32_t      m_object_count;
+};
+
+/* Replays a file written by CameraRecorder. The frames setting is ignored,
+   the trajectory has as many frames as were recorded. */
+class RecordedCameraTrajectory : public CameraTrajectory {
+
+public:
+        RecordedCameraTrajectory(){
+                frames = 0;
+                current_frame = 0;
+                repeating = false;
+                m_frame_count = 0;
+                m_object_count = 0;
+                m_last_frame = 0;
+        }
+
+        int32_t  load(const std::string& file);
+        uint32_t frame_count() const {return m_frame_count;}
+        uint32_t object_count() const {return m_object_count;}
+
+        void get_next_camera_params(vec3* cam_pos, vec3* cam_dir, vec3* cam_up);
+
+        /* Sets the recorded transforms of the frame last returned by
+           get_next_camera_params, and updates the bvh roots if any object
+           moved */
+        int32_t apply_object_transforms(Scene& scene);
+
+private:
+
+        std::vector<float> m_data;
+        uint32_t m_frame_count;
+        uint32_t m_object_count;
+        uint32_t m_last_frame;
+};
+
+#endif /* RT_CAMERA_RECORDER_HPP */
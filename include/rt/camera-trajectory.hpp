@@ -2,6 +2,8 @@
 #ifndef CAMERA_TRAJECTORY_HPP
 #define CAMERA_TRAJECTORY_HPP
 
+#include <vector>
+
 #include <rt/vector.hpp>
 
 class CameraTrajectory {
@@ -43,4 +45,35 @@ private:
         vec3 end_pos;
 };
 
+/* Catmull-Rom spline through a list of waypoints, each with its own look at
+   position (also interpolated). The frames are spread evenly over the 
+   segments, the first and last frames are the first and last waypoints. */
+class SplineCameraTrajectory : public CameraTrajectory {
+
+public:
+        SplineCameraTrajectory(){
+                frames = 0;
+                current_frame = 0;
+                repeating = false;
+                up_vec = makeVector(0.f,1.f,0.f);
+        }
+        void add_waypoint(vec3 pos, vec3 look_at_pos){
+                positions.push_back(pos);
+                look_at_positions.push_back(look_at_pos);
+        }
+        void clear_waypoints(){
+                positions.clear();
+                look_at_positions.clear();
+        }
+        void set_up_vec(vec3 up) {up_vec = up;} 
+        void get_next_camera_params(vec3* cam_pos, vec3* cam_dir, vec3* cam_up);
+private:
+
+        vec3 interpolate(const std::vector<vec3>& points, float t) const;
+
+        std::vector<vec3> positions;
+        std::vector<vec3> look_at_positions;
+        vec3 up_vec;
+};
+
 #endif /* CAMERA_TRAJECTORY_HPP */
@@ -0,0 +1,75 @@
+#pragma once
+#ifndef RT_CONFIG_TUNER_HPP
+#define RT_CONFIG_TUNER_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <misc/ini.hpp>
+#include <gpu/interface.hpp>
+#include <rt/renderer.hpp>
+#include <rt/renderer-config.hpp>
+
+enum tuner_param {
+        TUNE_TILE_TO_CORES_RATIO = 0,
+        TUNE_PRIM_QUAD_SIZE,
+        TUNE_PRIM_USE_ZCURVE,
+        TUNE_SEC_USE_DISC,
+        TUNE_SEC_USE_ATOMICS,
+        TUNE_BVH_MAX_DEPTH,
+        TUNE_BVH_MIN_LEAF_SIZE,
+        TUNE_PARAM_COUNT
+};
+
+/* Searches the RendererConfig that renders a scene fastest on the current
+   device by coordinate descent: each parameter in turn is set to all its
+   candidate values, keeping the one with the lowest median frame time over
+   a short window of frames, until a pass over all parameters brings no
+   improvement (or max_passes is reached).
+   Results are kept per scene_key() in an ini file, with one section per 
+   scene and the same keys as the [Renderer] section. Renderer loads it from
+   the [Renderer] tuning_file value of its ini file. */
+class ConfigTuner {
+
+public:
+
+        ConfigTuner();
+
+        void    set_window(uint32_t warmup_frames, uint32_t frames);
+        void    set_max_passes(uint32_t passes);
+
+        /* Starts from the current renderer configuration (or the stored one
+           for the scene) and leaves the best one found set in renderer */
+        int32_t tune(Renderer& renderer, Scene& scene, memory_id tex_id);
+
+        const RendererConfig& best_config() {return m_best;}
+        double  best_frame_time() {return m_best_time;}
+
+        /* Section name identifying the scene, framebuffer size and device */
+        static std::string scene_key(Renderer& renderer, Scene& scene);
+
+        /* Only the tuned parameters are read and written */
+        static int32_t load(INIReader& ini, const std::string& key, 
+                            RendererConfig* conf);
+        static int32_t save(const std::string& file, const std::string& key,
+                            const RendererConfig& conf, double frame_time);
+
+        static const char* param_name(tuner_param p);
+
+private:
+
+        int32_t measure(Renderer& renderer, Scene& scene, memory_id tex_id,
+                        const RendererConfig& conf, double* frame_time);
+
+        uint32_t m_warmup_frames;
+        uint32_t m_frames;
+        uint32_t m_max_passes;
+
+        std::vector<double> m_candidates[TUNE_PARAM_COUNT];
+
+        RendererConfig m_best;
+        double         m_best_time;
+};
+
+#endif /* RT_CONFIG_TUNER_HPP */
@@ -17,6 +17,10 @@ public:
                            std::string posz, std::string negz);
         int32_t destroy();
 
+        /* Copy of cubemap for the context of the queue, read back through
+           the host. Only for cubemaps of plain images (no GL sharing) */
+        int32_t copy_from(Cubemap& cubemap, size_t command_queue_i);
+
 
         int32_t acquire_graphic_resources();
         int32_t release_graphic_resources();
@@ -38,6 +42,10 @@ public:
 
         private:
 
+        /* Faces of a context that doesn't share GL are plain images */
+        int32_t load_face_image(const std::string& file, memory_id* id);
+        int32_t copy_face(memory_id src_id, memory_id* id, size_t command_queue_i);
+
         bool m_initialized;
         uint32_t tex_width,tex_height;
 
@@ -2,6 +2,9 @@
 #ifndef FRAMESTATS_HPP
 #define FRAMESTATS_HPP
 
+#include <math.h>
+#include <stdint.h>
+
 enum rt_stage {
         BVH_BUILD = 0,
         PRIM_RAY_GEN,
@@ -16,6 +19,125 @@ enum rt_stage {
         STAGE_COUNT
 };
 
+static inline const char* rt_stage_name(rt_stage stage)
+{
+        static const char* names[STAGE_COUNT] = {"bvh_build",
+                                                 "prim_ray_gen",
+                                                 "sec_ray_gen",
+                                                 "prim_trace",
+                                                 "prim_shadow_trace",
+                                                 "sec_trace",
+                                                 "sec_shadow_trace",
+                                                 "shade",
+                                                 "fb_clear",
+                                                 "fb_copy"};
+        return names[stage];
+}
+
+/* Fixed size histogram of times (in milliseconds) with logarithmic buckets,
+   HISTOGRAM_BUCKETS_PER_OCTAVE buckets for each power of 2 starting at 
+   HISTOGRAM_MIN_TIME. Percentiles are returned as the upper bound of the
+   bucket they fall in, so they are accurate to about 9%. */
+#define HISTOGRAM_BUCKETS_PER_OCTAVE 8
+#define HISTOGRAM_OCTAVES            28
+#define HISTOGRAM_BUCKETS            (HISTOGRAM_BUCKETS_PER_OCTAVE*HISTOGRAM_OCTAVES+1)
+#define HISTOGRAM_MIN_TIME           0.001 /* 1 microsecond */
+
+struct TimeHistogram {
+
+        TimeHistogram() {clear();}
+
+        void clear() {
+                for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+                        buckets[i] = 0;
+                samples = 0;
+                max_time = 0;
+        }
+
+        void add(double ms) {
+                buckets[bucket(ms)]++;
+                samples++;
+                if (ms > max_time)
+                        max_time = ms;
+        }
+
+        /* p in [0,100] */
+        double percentile(double p) const {
+                if (!samples)
+                        return 0;
+                uint64_t rank = uint64_t(p * 0.01 * samples + 0.5);
+                if (rank < 1)
+                        rank = 1;
+                uint64_t acc = 0;
+                for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+                        acc += buckets[i];
+                        if (acc >= rank) {
+                                double upper = bucket_upper_bound(i);
+                                return upper < max_time ? upper : max_time;
+                        }
+                }
+                return max_time;
+        }
+
+        double   max() const {return max_time;}
+        uint64_t count() const {return samples;}
+
+private:
+
+        /* Bucket 0 holds everything below HISTOGRAM_MIN_TIME */
+        static uint32_t bucket(double ms) {
+                if (ms < HISTOGRAM_MIN_TIME)
+                        return 0;
+                double b = log(ms/HISTOGRAM_MIN_TIME) / log(2.0);
+                b *= HISTOGRAM_BUCKETS_PER_OCTAVE;
+                uint32_t i = uint32_t(b) + 1;
+                return i < HISTOGRAM_BUCKETS ? i : HISTOGRAM_BUCKETS - 1;
+        }
+
+        static double bucket_upper_bound(uint32_t i) {
+                return HISTOGRAM_MIN_TIME * 
+                        pow(2.0, i / double(HISTOGRAM_BUCKETS_PER_OCTAVE));
+        }
+
+        uint32_t buckets[HISTOGRAM_BUCKETS];
+        uint64_t samples;
+        double   max_time;
+};
+
+/* Traversal counters of the traced rays (see Tracer). Only filled when
+   RendererConfig::trav_stats or trav_heatmap are set. */
+struct TraversalStats {
+
+        TraversalStats() {clear();}
+
+        void clear() {
+                rays = node_visits = box_tests = triangle_tests = 0;
+                max_node_visits = 0;
+        }
+
+        void add(const TraversalStats& s) {
+                rays += s.rays;
+                node_visits += s.node_visits;
+                box_tests += s.box_tests;
+                triangle_tests += s.triangle_tests;
+                if (s.max_node_visits > max_node_visits)
+                        max_node_visits = s.max_node_visits;
+        }
+
+        double mean_node_visits() const {
+                return rays? double(node_visits)/rays : 0;}
+        double mean_box_tests() const {
+                return rays? double(box_tests)/rays : 0;}
+        double mean_triangle_tests() const {
+                return rays? double(triangle_tests)/rays : 0;}
+
+        uint64_t rays;
+        uint64_t node_visits;
+        uint64_t box_tests;
+        uint64_t triangle_tests;
+        uint32_t max_node_visits;
+};
+
 struct FrameStats {
         double   get_stage_time(rt_stage stage) const {
                 return stage_times[stage];}
@@ -33,11 +155,24 @@ struct FrameStats {
                 return 0;
         };
 
+        /* Percentiles over the frames since the last clear_histograms() */
+        double   get_stage_percentile(rt_stage stage, double p) const {
+                return stage_histograms[stage].percentile(p);}
+        double   get_stage_max_time(rt_stage stage) const {
+                return stage_histograms[stage].max();}
+        double   get_frame_percentile(double p) const {
+                return frame_histogram.percentile(p);}
+        double   get_max_frame_time() const {
+                return frame_histogram.max();}
+
         size_t  get_ray_count() const {
                return total_ray_count;}
         size_t  get_secondary_ray_count() const {
                return total_sec_ray_count;}
 
+        const TraversalStats& get_traversal_stats() const {
+               return traversal;}
+
         void clear_times() {
                 for (uint32_t i = 0; i < STAGE_COUNT; ++i) {
                         stage_times[i] = 0;
@@ -51,6 +186,21 @@ struct FrameStats {
                 }
         }
 
+        void clear_histograms() {
+                frame_histogram.clear();
+                for (uint32_t i = 0; i < STAGE_COUNT; ++i) {
+                        stage_histograms[i].clear();
+                }
+        }
+
+        /* Adds the current frame and stage times to the histograms */
+        void add_to_histograms() {
+                frame_histogram.add(frame_time);
+                for (uint32_t i = 0; i < STAGE_COUNT; ++i) {
+                        stage_histograms[i].add(stage_times[i]);
+                }
+        }
+
         double stage_times[STAGE_COUNT];
         double stage_acc_times[STAGE_COUNT];
         uint32_t acc_frames;
@@ -58,9 +208,13 @@ struct FrameStats {
         double frame_time;
         double frame_acc_time;
 
+        TimeHistogram stage_histograms[STAGE_COUNT];
+        TimeHistogram frame_histogram;
+
         size_t total_ray_count;
         size_t total_sec_ray_count;
 
+        TraversalStats traversal;
 };
 
 #endif // FRAMESTATS_HPP
@@ -23,23 +23,57 @@ public:
 
         DeviceMemory& image_mem();
 
+        /* Per pixel traversal cost (one cl_uint per pixel) filled by the 
+           Tracer when the heatmap is enabled. resolve_heatmap overwrites 
+           the image with its false color view and clears it. */
+        memory_id     heat_mem_id();
+        int32_t       resolve_heatmap(float scale);
+
 	int32_t clear();
 	int32_t copy(DeviceMemory& tex_mem);
 
+        /* Adds the image and heat of fb, which must have the same size. 
+           Enqueued on this framebuffer's queue, fb's queue must be done 
+           with them. If fb is in another context they are first copied
+           here through the host */
+        int32_t merge(FrameBuffer& fb);
+
+        /* Progressive accumulation of frames in a float4 HDR buffer. When 
+           enabled each copy adds the frame to the buffer and resolves the
+           mean of the frames since the last reset. */
+        void     set_accumulation(bool b);
+        void     reset_accumulation();
+        uint32_t accumulated_frames();
+        void     set_exposure(float e);
+
 	void timing(bool b);
+        void set_command_queue(size_t cq) {m_cq = cq;}
 	double get_clear_exec_time();
 	double get_copy_exec_time();
 
 private:
 
+        int32_t stage(DeviceMemory& mem, memory_id staging_id);
+
 	size_t size[2];
 
         memory_id img_mem_id;
+        memory_id acc_mem_id;
+        memory_id heat_id;
         function_id init_id;
         function_id copy_id;
+        function_id heatmap_id;
+        function_id merge_id;
+        memory_id staging_img_id;
+        memory_id staging_heat_id;
+
+	bool         m_accumulate;
+	cl_int       m_frame_count;
+	cl_float     m_exposure;
 
 	bool         m_initialized;
 	bool         m_timing;
+        size_t       m_cq;
 	rt_time_t    m_clear_timer;
 	double       m_clear_time_ms;
 	rt_time_t    m_copy_timer;
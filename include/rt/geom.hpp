@@ -17,6 +17,18 @@ public:
 			updateTransform();
 		}
 
+	/* Assigned transforms count as changed, whatever the flag of g */
+	GeometricProperties& operator=(const GeometricProperties& g)
+		{
+			pos = g.pos;
+			rpy = g.rpy;
+			scale = g.scale;
+			M = g.M;
+			Minv = g.Minv;
+			dirty = true;
+			return *this;
+		}
+
 	void setPos(const vec3& new_pos);
 	void setRpy(const vec3& new_rpy);
 	void setScale(float new_scale);
@@ -24,9 +36,18 @@ public:
 
 	void transform(Vertex& v);
 
+        const vec3& getPos() const {return pos;}
+        const vec3& getRpy() const {return rpy;}
+        const vec3& getScale() const {return scale;}
+
 
         mat4x4 getTransformMatrix(){return M;}
         mat4x4 getTransformMatrixInv(){return Minv;}
+
+        /* Set whenever the transform changes, cleared by whoever uploads 
+           it (see Scene::update_bvh_roots) */
+        bool isDirty() const {return dirty;}
+        void clearDirty() {dirty = false;}
 private:
 
 	void updateTransform();
@@ -37,6 +58,8 @@ private:
 
 	mat4x4 M;
 	mat4x4 Minv;
+
+	bool dirty;
 };
 
 #endif /* RT_GEOM_HPP */
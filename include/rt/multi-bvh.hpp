@@ -5,6 +5,7 @@
 #include <cl-gl/opencl-init.hpp>
 #include <rt/math.hpp>
 #include <rt/cl_aux.hpp>
+#include <rt/bbox.hpp>
 
 RT_ALIGN(16)
 struct BVHRoot {
@@ -13,6 +14,16 @@ struct BVHRoot {
         cl_sqmat4 trInv;
 };
 
+/* Node of the bvh over the world bounds of the roots (the top level).
+   Children come after their parent, a leaf holds one root as 
+   left = -1 - root index */
+RT_ALIGN(16)
+struct TopNode {
+        BBox   bbox;
+        cl_int left;
+        cl_int right;
+};
+
 struct MultiBVH {
         cl_int cant;
         BVHRoot* roots;
@@ -27,17 +27,25 @@ public:
 	size_t  get_spp() const;
 	DeviceMemory&       get_pixel_samples();
 
+        /* Subpixel offset added to every pixel sample (in pixels) */
+        void    set_jitter(float ox, float oy);
+
 
 	int32_t generate(const Camera& cam, RayBundle& bundle, size_t size[2],
                      const size_t ray_count, const size_t offset);
 
 	void   timing(bool b);
+        void   set_command_queue(size_t cq) {m_cq = cq;}
 	double get_exec_time();
 
         void update_configuration(const RendererConfig& conf);
 	
 private:
 
+        /* Defines of the generate_primary_rays variant for the current
+           quad size and sample count */
+        BuildOptions variant_options() const;
+
         function_id generator_id;
         function_id generator_zcurve_id;
         memory_id pixel_samples_id;
@@ -46,11 +54,13 @@ private:
 
         bool         m_initialized;
 	bool         m_timing;
+        size_t       m_cq;
 	rt_time_t    m_timer;
 	double       m_time_ms;
         bool         m_use_zcurve;
 	cl_int       m_quad_size;
 	cl_int       m_spp;
+	cl_float2    m_jitter;
 };
 
 #endif /* PRIMARY_RAY_GENERATOR_HPP */
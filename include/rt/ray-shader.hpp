@@ -11,25 +11,47 @@
 #include <rt/framebuffer.hpp>
 #include <rt/renderer-config.hpp>
 
+#define MAX_SHADE_BUCKETS 1024
+
 class RayShader {
 
 public:
 	
+        RayShader();
 	int32_t initialize();
 	int32_t shade(RayBundle& rays, HitBundle& hb, Scene& scene, 
                       Cubemap& cm, FrameBuffer& fb, size_t size, bool primary = false);
 
 	void timing(bool b);
+        void set_command_queue(size_t cq) {m_cq = cq;}
 	double get_exec_time();
 
         void update_configuration(const RendererConfig& conf);
 
 private:
 
+        int32_t update_bucket_map(Scene& scene);
+        int32_t sort_by_material(HitBundle& hb, Scene& scene, size_t size);
+
         function_id p_shade_id;
         function_id s_shade_id;
 
+        /* Material sorted shading */
+        function_id sorted_shade_id;
+        function_id histogram_id;
+        function_id scatter_id;
+
+        memory_id   bucket_map_id;
+        memory_id   keys_id;
+        memory_id   counts_id;
+        memory_id   order_id;
+
+        std::vector<cl_uint> m_bucket_map;
+        cl_uint      m_bucket_count;
+        bool         m_sort;
+
 	bool         m_timing;
+        size_t       m_cq;
 	rt_time_t    m_timer;
 	double       m_time_ms;
 };
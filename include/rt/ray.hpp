@@ -67,7 +67,8 @@ public:
 	RayBundle();
 	~RayBundle();
 
-	int32_t initialize(const size_t rays); // Create mem object
+	int32_t initialize(const size_t rays,  // Create mem object, for the
+                           size_t command_queue_i = 0); // context of the queue
 	int32_t resize(const size_t rays);     // resize mem object
 	bool    valid();                    // Check that it's correctly initialized 
 	int32_t count();                // Return number of rays in the bundle
@@ -87,7 +88,8 @@ class HitBundle {
 public:
 
 	HitBundle();
-	int32_t initialize(const size_t sz);   // create mem object
+	int32_t initialize(const size_t sz,    // create mem object, for the
+                           size_t command_queue_i = 0); // context of the queue
 	int32_t resize(const size_t rays);     // resize mem object
 	bool    valid();                    // Check that it's correctly initialized 
 	int32_t count();                // Return number of rays in the bundle
@@ -11,6 +11,7 @@ class RendererConfig {
 protected:
 
         friend class Renderer;
+        friend class ConfigTuner;
         void set_target(Renderer* r);
 
 private:
@@ -28,11 +29,28 @@ public:
 
         int sec_ray_use_atomics;     // Done
         int sec_ray_use_disc;        // Done
+        double sec_ray_min_contribution; // Done
+        int sec_ray_use_roulette;    // Done
+
+        int shadow_ray_compaction;   // Done
+
+        int shade_sort_materials;    // Done
+
+        int trav_stats;              // Done
+        int trav_heatmap;            // Done
+        double trav_heatmap_scale;   // Done
+
+        int fb_accumulate;           // Done
+        double fb_exposure;          // Done
 
         int prim_ray_quad_size;      // Done
         int prim_ray_use_zcurve;     // Done
 
         double tile_to_cores_ratio;  // Done
+
+        int tune_work_sizes;         // Done
+
+        int async_build;             // Done
 };
 
 #endif // RTCONFIG_HPP
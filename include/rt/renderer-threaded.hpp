@@ -54,7 +54,8 @@ public:
         void     set_max_bounces(uint32_t b){max_bounces = b;}
         uint32_t get_max_bounces(){return max_bounces;}
 
-        void     clear_stats() {stats.clear_times(); stats.clear_mean_times();}
+        void     clear_stats() {stats.clear_times(); stats.clear_mean_times();
+                                stats.clear_histograms();}
         const FrameStats& get_frame_stats() {return stats;}
 
         int32_t  init_loop(Scene& scene);
@@ -19,8 +19,11 @@
 #include <rt/tracer.hpp>
 #include <rt/bvh-builder.hpp>
 #include <rt/frame-stats.hpp>
+#include <rt/trace-recorder.hpp>
 
 #include <string>
+#include <vector>
+#include <pthread.h>
 
 
 class Renderer {
@@ -28,6 +31,7 @@ class Renderer {
 public:
 
         Renderer();
+        ~Renderer();
 
         uint32_t set_up_frame(memory_id tex_id, Scene& scene);
         uint32_t update_accelerator(Scene& scene);
@@ -63,17 +67,118 @@ public:
         void     set_max_bounces(uint32_t b){max_bounces = b;}
         uint32_t get_max_bounces(){return max_bounces;}
 
-        void     clear_stats() {stats.clear_times(); stats.clear_mean_times();}
+        /* Restarts progressive accumulation (config.fb_accumulate). Camera
+           moves, scene updates (see Scene::geometry_version) and 
+           accelerator builds restart it automatically, call this for 
+           changes the scene doesn't track, like materials or lights. */
+        void     reset_accumulation();
+
+        /* Tuned configurations (see ConfigTuner), loaded from the 
+           [Renderer] tuning_file value in configure_from_ini_file. The 
+           entry of a scene is applied the first time a frame of it is set 
+           up, on top of the rest of the configuration. */
+        int32_t  load_tuned_configurations(std::string file_path);
+        int32_t  apply_tuned_configuration(Scene& scene);
+        const std::string& get_tuning_file() {return tuning_file;}
+
+        void     clear_stats() {stats.clear_times(); stats.clear_mean_times();
+                                stats.clear_histograms();}
         const FrameStats& get_frame_stats() {return stats;}
 
         INIReader ini;
 
         Log                   log;
 
+        /* Stage timeline recorder, see trace.start() */
+        TraceRecorder         trace;
+
         RendererConfig        config;
 
 private:
 
+        /* Components that render tiles on one device. The first pipeline
+           is made of the renderer's own components and is the only one 
+           timed and traced, every other device of the context gets one 
+           more, with a framebuffer of its own that is merged into the
+           renderer's before the copy. Tiles are dealt to the pipelines as
+           they finish the previous ones (see next_tile) */
+        struct TilePipeline {
+                size_t                 cq;
+                bool                   owned;
+                RayBundle*             ray_bundle_1;
+                RayBundle*             ray_bundle_2;
+                HitBundle*             hit_bundle;
+                FrameBuffer*           framebuffer;
+                PrimaryRayGenerator*   prim_ray_gen;
+                SecondaryRayGenerator* sec_ray_gen;
+                RayShader*             ray_shader;
+                Tracer*                tracer;
+
+                /* Copy of the scene memory made on this device, for NUMA
+                   nodes of a split device and devices of another platform
+                   (see CLInfo). NULL when the scene is shared. Redone when
+                   the source or its geometry version change, otherwise 
+                   only moved roots are written */
+                Scene*                 scene_replica;
+                bool                   use_replica;
+                Scene*                 replica_source;
+                uint32_t               replica_geometry;
+
+                double                 samples_per_ms; /* Moving average */
+                size_t                 ray_count;      /* Of this frame */
+                size_t                 sec_ray_count;
+        };
+
+        int32_t               initialize_pipelines();
+        int32_t               resize_pipelines(size_t ray_bundle_size);
+        int32_t               update_replicas(Scene& scene);
+        int32_t               render_tile(Scene& scene, TilePipeline& p,
+                                          size_t offset, size_t tile);
+        int32_t               render_tiles(Scene& scene, size_t pipeline_i);
+        bool                  next_tile(size_t pipeline_i, size_t* offset, 
+                                        size_t* tile);
+        static void*          render_thread(void* arg);
+
+        std::vector<TilePipeline> pipelines;
+        pthread_mutex_t       tile_lock;
+        size_t                next_sample;
+        size_t                frame_samples;
+
+        /* Accelerator builds pipelined with the frames (config.async_build).
+           When the geometry changed, a builder thread on a command queue
+           of its own builds the accelerator of a copy of the scene (the
+           back scene) while the frame traces the previous copy (the front
+           scene), and the frame swaps them once it is over. The copies 
+           own the vertices they were built from (see 
+           Scene::share_mem_from), so a vertex update shows one frame 
+           late. The camera and moved objects show with no delay, lbvh 
+           refits copy the vertices to the front and are done on it 
+           before the frame */
+        int32_t               start_builder();
+        void                  stop_builder();
+        int32_t               submit_build(Scene& scene);
+        int32_t               wait_build();
+        int32_t               swap_accelerator(Scene& scene);
+        Scene&                frame_scene(Scene& scene);
+        static void*          builder_thread(void* arg);
+
+        Scene*                build_scenes[2];
+        size_t                front_scene;
+        bool                  front_ready;
+        bool                  async_frame;
+        size_t                build_cq;
+        bool                  builder_running;
+        bool                  builder_quit;
+        bool                  build_pending;  /* Submitted, not swapped yet */
+        bool                  build_done;
+        int32_t               build_status;
+        double                build_time;
+        Scene*                build_source;   /* Last submitted, and its */
+        uint32_t              build_geometry; /* geometry version */
+        pthread_t             builder;
+        pthread_mutex_t       build_lock;
+        pthread_cond_t        build_cond;
+
         bool                  initialized;
 
         RayBundle             ray_bundle_1,ray_bundle_2;
@@ -97,6 +202,22 @@ private:
         rt_time_t             frame_timer;
 
         memory_id             target_tex_id;
+
+        Camera                last_camera;
+        void                  update_accumulation(Scene& scene);
+
+        /* Scene the frames accumulated so far traced, and its versions */
+        const Scene*          accumulated_scene;
+        uint32_t              accumulated_geometry;
+        uint32_t              accumulated_roots;
+        /* Scene and version of it the lbvh was last built for */
+        const Scene*          built_scene;
+        uint32_t              built_geometry;
+
+        INIReader             tuning;
+        std::string           tuning_file;
+        bool                  tuning_loaded;
+        std::string           tuned_scene_key;
 };
 
 #endif /* RENDERER_HPP */
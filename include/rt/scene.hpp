@@ -63,18 +63,50 @@ public:
 
         Scene();
         ~Scene();
-        int32_t initialize();
+        /* Memories are made for the context of the queue. Copies in a
+           context other than their source's take their own atlas and 
+           cubemap */
+        int32_t initialize(size_t command_queue_i = 0);
         int32_t copy_mem_from(Scene& scene, size_t command_queue_i = 0);
+        /* Host copy of the aggregate mesh, which copy_mem_from leaves out,
+           for copies that rebuild their own aggregate bvh */
+        int32_t copy_aggregate_mesh_from(Scene& scene);
+        /* Copy for accelerator builds: the memories a build reads or 
+           writes (vertices, index, material map, bvh nodes and roots) are
+           copied, materials and lights are read from scene, which must
+           outlive the copy */
+        int32_t share_mem_from(Scene& scene, size_t command_queue_i = 0);
+        /* Brings the vertices of a copy to those of scene, before a refit
+           of the copy */
+        int32_t copy_vertices_from(Scene& scene, size_t command_queue_i = 0);
+        /* Brings a copy up to date when only the roots of its source 
+           moved: the root transforms that differ are written, lights and
+           materials copied again unless they are shared */
+        int32_t update_from(Scene& scene, size_t command_queue_i = 0);
         int32_t destroy();
         bool    valid();
         bool    valid_aggregate();
         bool    valid_bvhs();
         bool    ready();
 
+        /* With instancing, create_aggregate_mesh leaves out the objects 
+           that share their mesh and material with others. Their mesh is
+           kept once, in object space, with a bvh built once per mesh, and
+           each of them is traced through a root of its own next to the
+           root of the aggregate bvh. Only SAH bvh aggregates are instanced,
+           the lbvh builder and the kd-tree need every triangle baked */
+        void    set_instancing(bool b){m_instancing = b;}
+        bool    instancing(){return m_instancing;}
+        bool    has_instances(){return m_aggregate_mesh_built && 
+                                       !instance_groups.empty();}
+
         int32_t create_aggregate_mesh();
         int32_t create_aggregate_accelerator();
         int32_t create_aggregate_bvh();
         int32_t create_aggregate_kdtree();
+        /* Host (SAH) build of the aggregate bvh, uploaded along with the
+           triangles and materials it reorders on command queue cq_i */
+        int32_t rebuild_aggregate_bvh(size_t command_queue_i = 0);
 
         Mesh&   get_aggregate_mesh(){return aggregate_mesh;}
         BVH&    get_aggregate_bvh (){return aggregate_bvh;}
@@ -97,10 +129,19 @@ public:
         BVH&     get_object_bvh(object_id oid);
         int32_t  update_aggregate_mesh_vertices();
         int32_t  update_mesh_vertices(mesh_id mid);
+        /* Uploads the roots of the objects whose geom changed since the
+           last call, in as few ranged writes as the changes allow */
         uint32_t update_bvh_roots();
         
         size_t   root_count();
 
+        /* Count the changes made to the scene on the device: the geometry
+           one vertex updates and accelerator builds, the roots one moved
+           objects. Copies take the values of their source. Compared with
+           values seen earlier they tell whether the scene stayed static */
+        uint32_t geometry_version(){return m_geometry_version;}
+        uint32_t roots_version(){return m_roots_version;}
+
         /* Ligthing methods */
         int32_t set_dir_light(const directional_light_cl& dl);
         int32_t set_spot_light(const spot_light_cl& sp);
@@ -113,6 +154,8 @@ public:
 
         /*Object methods*/
         size_t   object_count(){return bvh_roots.size();}
+        /* Valid object ids are below this (removed objects included) */
+        size_t   object_slot_count(){return objects.size();}
         object_id add_object(mesh_id mid);
         std::vector<object_id> add_objects(std::vector<mesh_id> mids);
         void remove_object(object_id id);
@@ -128,12 +171,20 @@ public:
         DeviceMemory& material_map_mem();
         DeviceMemory& bvh_nodes_mem();
         DeviceMemory& bvh_roots_mem();
+        DeviceMemory& top_nodes_mem();
         DeviceMemory& kdtree_nodes_mem();
         DeviceMemory& kdtree_leaf_tris_mem();
         DeviceMemory& lights_mem();
 
         std::vector<material_cl>& get_material_list (){return material_list;}
         std::vector<cl_int>&      get_material_map (){return material_map;}
+        const lights_cl&          get_lights () const {
+                return m_shared_scene ? m_shared_scene->lights : lights;
+        }
+        /* Copies read the atlas of the scene they were copied from */
+        TextureAtlas&             get_texture_atlas () {
+                return m_atlas_scene ? m_atlas_scene->texture_atlas : texture_atlas;
+        }
 
         bool reorderTriangles(const std::vector<uint32_t>& new_order);
 
@@ -166,6 +217,45 @@ private:
                                         are offset, they need to be ordered the same way
                                         when we move them to device mem*/
         std::vector<BVHRoot> bvh_roots;
+        std::vector<BBox>    root_bounds; /* Of each root, untransformed */
+        std::vector<TopNode> top_nodes;
+
+        /* Objects sharing a mesh and material in an instanced aggregate */
+        struct InstanceGroup {
+                mesh_id                mesh;
+                uint32_t               vertex_start; /* Into instance_mesh */
+                uint32_t               node_start;   /* Into instance_nodes */
+                std::vector<object_id> objects;
+        };
+        void    group_instances();
+        int32_t create_instance_meshes();
+        void    add_instances_to_aggregate_bvh();
+
+        /* Writes the roots in [first, end) of each run */
+        typedef std::vector<std::pair<size_t, size_t> > RootRuns;
+        int32_t write_root_runs(RootRuns& runs, size_t command_queue_i = 0);
+
+        /* The multi root kernels find the roots a ray meets through the
+           top level bvh. It is built when the roots are created, from 
+           root_bounds, and refit when they move */
+        int32_t build_top_level(size_t command_queue_i = 0);
+        int32_t refit_top_level(size_t command_queue_i = 0);
+        int32_t write_top_level(size_t command_queue_i = 0);
+        int32_t build_top_node(std::vector<uint32_t>& roots, 
+                               const std::vector<BBox>& bounds,
+                               size_t first, size_t end);
+        void    root_world_bounds(std::vector<BBox>& bounds);
+
+        bool                       m_instancing;
+        std::vector<InstanceGroup> instance_groups;
+        std::vector<bool>          object_instanced;
+        /* Appended to the aggregate when uploaded. Node and triangle 
+           indices count from the first instanced mesh, vertex indices 
+           already count the aggregate vertices */
+        Mesh                       instance_mesh;
+        std::vector<cl_int>        instance_material_map;
+        std::vector<BVHNode>       instance_nodes;
+        std::map<mesh_id, BVH>     instance_bvhs; /* Kept between builds */
 
 
         AcceleratorType m_accelerator_type;
@@ -179,6 +269,15 @@ private:
         bool m_aggregate_bvh_transfered;
         bool m_aggregate_kdt_transfered;
         bool m_bvhs_transfered;
+        bool m_bvh_roots_moved; /* Objects removed, every root shifts */
+
+        uint32_t m_geometry_version;
+        uint32_t m_roots_version;
+        Scene*   m_shared_scene; /* Of share_mem_from */
+        Scene*   m_atlas_scene;  /* Owner of the atlas, for any copy */
+        bool     m_own_cubemap;  /* Copied from another context */
+        size_t   m_cq;           /* Queue of initialize */
+        int32_t  copy_mem(Scene& scene, size_t command_queue_i, bool shared);
 
         lights_cl lights;
 
@@ -191,6 +290,7 @@ private:
         memory_id kdt_leaf_tris_id;
         memory_id lights_id;
         memory_id bvh_roots_id;
+        memory_id top_nodes_id;
 
 public:
         uint32_t bvh_node_count;
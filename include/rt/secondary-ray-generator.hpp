@@ -22,6 +22,7 @@ public:
         void set_max_rays(size_t max);
 
 	void timing(bool b);
+        void set_command_queue(size_t cq) {m_cq = cq;}
 	double get_exec_time();
 
         void update_configuration(const RendererConfig& conf);
@@ -51,8 +52,12 @@ private:
 
         bool         m_tasks;
         bool         m_disc;
+        cl_float     m_min_contribution;
+        cl_int       m_use_roulette;
+        cl_uint      m_seed;
         bool         m_initialized;
 	bool         m_timing;
+        size_t       m_cq;
 	rt_time_t    m_timer;
 	double       m_time_ms;
 
@@ -5,6 +5,7 @@
 #include <cl-gl/opengl-init.hpp>
 #include <cl-gl/opencl-init.hpp>
 #include <rt/rt.hpp>
+#include <rt/camera-recorder.hpp>
 
 struct resolution_t 
 {
@@ -56,6 +57,11 @@ private:
         vec3* stats_camera_pos;
         vec3* stats_camera_dir;
 
+        /* When set ([RT] camera_path), each configuration is measured over
+           the recorded path instead of the fixed view positions */
+        bool                     use_camera_path;
+        RecordedCameraTrajectory camera_path;
+
 /////////// test parameters
         std::vector<int>          scenes;
         std::vector<resolution_t> window_sizes;
@@ -13,31 +13,67 @@
 
 typedef int32_t texture_id;
 
+/* All loaded textures are packed in a single image (the atlas). The shader
+   finds each texture through its uv rectangle in rects_mem(), stored as
+   (u, v, width, height) in normalized atlas coordinates. */
 class TextureAtlas 
 {
 
 public:
-        int32_t       initialize();
+        TextureAtlas();
+
+        /* The atlas is made for the context of the queue */
+        int32_t       initialize(size_t command_queue_i = 0);
         int32_t       destroy();
         texture_id    load_texture(std::string filename);
-        DeviceMemory& texture_mem(texture_id);
-        
+        size_t        texture_count();
+
+        /* Packs the textures loaded so far and moves the atlas to the 
+           device. Does nothing if no texture was loaded since last call */
+        int32_t       update_atlas();
+
+        /* Takes the packed atlas of another context, read back through the
+           host. Only for atlases of plain images (no GL sharing) */
+        int32_t       copy_from(TextureAtlas& atlas);
+
+        DeviceMemory& atlas_mem();
+        DeviceMemory& rects_mem();
 
         int32_t acquire_graphic_resources();
         int32_t release_graphic_resources();
         
 private:
+
+        /* Pixels are kept only until the atlas is uploaded, a later
+           repack reads them again from the file */
+        struct texture_data {
+                std::string filename;
+                uint32_t width;
+                uint32_t height;
+                std::vector<uint8_t> pixels;
+        };
+
+        int32_t read_pixels(texture_data& tex);
+        int32_t release_atlas();
+
         memory_id invalid_tex_mem_id;
         GLuint invalid_gl_tex_id;
 
         static const texture_id invalid_tex_id = -1;
-        static const size_t MAX_TEXTURE_COUNT = 25;
 
         bool m_initialized;
+        bool m_atlas_dirty;
+        bool m_atlas_built;
+        size_t m_cq;
 
         std::map<std::string,texture_id> file_map;
-        std::vector<memory_id> tex_mem_ids;
-        std::vector<GLuint> gl_tex_ids;
+        std::vector<texture_data> textures;
+        std::vector<cl_float4> tex_rects;
+
+        memory_id atlas_mem_id;
+        memory_id rects_mem_id;
+        GLuint    atlas_gl_tex_id;
+        uint32_t  atlas_size[2];
 };
 
 
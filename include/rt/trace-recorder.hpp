@@ -0,0 +1,71 @@
+#pragma once
+#ifndef RT_TRACE_RECORDER_HPP
+#define RT_TRACE_RECORDER_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <cl-gl/opencl-init.hpp>
+#include <rt/timing.hpp>
+#include <rt/frame-stats.hpp>
+
+/* Records the render stages of each frame as Chrome trace_event JSON
+   (load it in chrome://tracing). If the command queue was created with
+   profiling enabled (CLInfo::initialize(n, true)) stages are bracketed with
+   markers and device timestamps are used, otherwise host timestamps are
+   taken when begin/end are called. */
+class TraceRecorder {
+
+public:
+
+        TraceRecorder();
+        ~TraceRecorder();
+
+        int32_t start(const std::string& file, size_t command_queue_i = 0);
+        int32_t stop();
+        bool    recording() const {return m_recording;}
+
+        /* Opens a stage event. tile_offset and bounce are -1 when they
+           don't apply (i.e. for the bvh build or the framebuffer clear) */
+        void    begin(rt_stage stage, int64_t tile_offset = -1, int32_t bounce = -1);
+        void    end(size_t ray_count = 0);
+
+        /* Resolves and writes the events of the frame, the queue must be
+           finished */
+        int32_t end_frame();
+
+private:
+
+        struct TraceEvent {
+                rt_stage stage;
+                int64_t  tile_offset;
+                int32_t  bounce;
+                size_t   ray_count;
+                uint32_t frame;
+                cl_event start_event;
+                cl_event end_event;
+                double   start_us;
+                double   end_us;
+                bool     ended;    /* end() ran, a stage may bail out */
+        };
+
+        cl_event enqueue_marker();
+        void     release_events();
+
+        bool           m_recording;
+        bool           m_device_timestamps;
+        bool           m_first_event;
+        size_t         m_cq_i;
+        uint32_t       m_frame;
+
+        rt_time_t      m_host_origin;
+        cl_ulong       m_device_origin;
+        bool           m_device_origin_set;
+
+        std::vector<TraceEvent> m_events;
+        std::ofstream  m_file;
+};
+
+#endif /* RT_TRACE_RECORDER_HPP */
@@ -8,6 +8,7 @@
 #include <rt/scene.hpp>
 #include <rt/ray.hpp>
 #include <rt/renderer-config.hpp>
+#include <rt/frame-stats.hpp>
 
 class Tracer {
 
@@ -28,9 +29,23 @@ public:
 
 
 	void timing(bool b);
+
+        /* Queue every command is enqueued on, 0 unless the renderer uses
+           several devices */
+        void set_command_queue(size_t cq) {m_cq = cq;}
 	double get_trace_exec_time();
 	double get_shadow_exec_time();
 
+        /* Counters of the last trace call, when traversal stats are enabled
+           the instrumented trace kernels are used and their per ray counts
+           are reduced after each call. */
+        const TraversalStats& get_traversal_stats();
+        bool traversal_stats_enabled();
+
+        /* Per pixel cost buffer (one cl_uint per pixel, see FrameBuffer)
+           accumulated into when the heatmap is enabled */
+        void set_heat_mem(memory_id heat_id);
+
         void update_configuration(const RendererConfig& conf);
 
 private:
@@ -46,6 +61,12 @@ private:
 	int32_t shadow_trace_bvh(Scene& scene, int32_t ray_count, 
                                  RayBundle& rays, HitBundle& hits, 
                                  bool secondary = false);
+	int32_t shadow_trace_bvh_compact(Scene& scene, int32_t ray_count, 
+                                         RayBundle& rays, HitBundle& hits, 
+                                         bool secondary = false);
+        int32_t compact_shadow_rays(Scene& scene, int32_t ray_count, 
+                                    HitBundle& hits, int32_t* compact_count);
+        int32_t reduce_traversal_stats(int32_t ray_count, RayBundle& rays);
 
         function_id kdt_single_tracer_id;
         function_id kdt_multi_tracer_id;
@@ -54,14 +75,36 @@ private:
 
         function_id bvh_single_tracer_id;
         function_id bvh_multi_tracer_id;
+        function_id bvh_single_stats_id;
+        function_id bvh_multi_stats_id;
+        function_id kdt_single_stats_id;
         function_id bvh_single_shadow_id;
         function_id bvh_multi_shadow_id;
 
+        function_id bvh_single_shadow_compact_id;
+        function_id bvh_multi_shadow_compact_id;
+        function_id shadow_marker_id;
+
+        memory_id   shadow_flags_id;
+        memory_id   shadow_ids_id;
+        memory_id   shadow_count_id;
+        bool        m_shadow_compaction;
+
+        function_id trav_reduce_id;
+        memory_id   ray_trav_stats_id;
+        memory_id   trav_totals_id;
+        memory_id   heat_mem_id;
+        bool        m_traversal_stats;
+        bool        m_heatmap;
+        bool        m_heat_mem_set;
+        TraversalStats m_trav_stats;
+
 	// CLKernelInfo tracer_clk;
 	// CLKernelInfo shadow_clk;
 
 	bool         m_initialized;
 	bool         m_timing;
+        size_t       m_cq;
 	rt_time_t    m_tracer_timer;
 	double       m_tracer_time_ms;
 	rt_time_t    m_shadow_timer;
@@ -69,6 +112,8 @@ private:
 
 };
 
+/* Local sizes for secondary rays until the kernel is in the work size
+   profile (see WorkSizeTuner) */
 namespace RT{
         static const size_t KDT_SECONDARY_GROUP_SIZE = 64;
         static const size_t BVH_SECONDARY_GROUP_SIZE = 64;
@@ -142,6 +142,19 @@ void delete_buf_gl(GLuint id)
 
 int32_t create_tex_gl_from_file(uint32_t& width, uint32_t& height, 
                                 const char* file, GLuint* tex_id){
+
+	uint8_t* tex_data;
+	if (read_tex_data_from_file(width, height, file, &tex_data))
+		return -1;
+
+	*tex_id = create_tex_gl_from_data(width, height, tex_data);
+	delete[] tex_data;
+
+	return 0;
+}
+
+int32_t read_tex_data_from_file(uint32_t& width, uint32_t& height, 
+                                const char* file, uint8_t** data){
 	
 	fipImage img;
 	if (!img.load(file)) 
@@ -170,8 +183,16 @@ int32_t create_tex_gl_from_file(uint32_t& width, uint32_t& height,
 		}
 	}
 
-        glGenTextures(1,tex_id);
-	glBindTexture(GL_TEXTURE_2D, *tex_id);
+	*data = tex_data;
+	return 0;
+}
+
+GLuint create_tex_gl_from_data(uint32_t width, uint32_t height, 
+                               const uint8_t* tex_data){
+
+	GLuint tex_id;
+        glGenTextures(1,&tex_id);
+	glBindTexture(GL_TEXTURE_2D, tex_id);
 
 	// select modulate to mix texture with color for shading
 	glTexEnvf( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL );
@@ -198,9 +219,8 @@ int32_t create_tex_gl_from_file(uint32_t& width, uint32_t& height,
 	// (NO MIPMAPS)
 
 	glBindTexture(GL_TEXTURE_2D, 0);
-	delete[] tex_data;
 
-	return 0;
+	return tex_id;
 
 }
 
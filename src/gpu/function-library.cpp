@@ -19,23 +19,105 @@ DeviceFunctionLibrary::load_functions()
         if (!device->good())
                 return -1;
 
-        function_id scan_local_uint_id = device->new_function();
-        DeviceFunction& scan_local_uint = device->function(scan_local_uint_id);
-        if (scan_local_uint.initialize("src/kernel/scan.cl",
-                                       "scan_local_uint"))
+        /* Everything is created up front, the render threads of several
+           devices only ever read the queue list */
+        CLInfo* clinfo = CLInfo::instance();
+        queues.clear();
+        queues.resize(clinfo->command_queue_count());
+        for (size_t i = 0; i < queues.size(); ++i) {
+                if (load_queue_functions(&queues[i], i))
+                        return -1;
+        }
+
+        m_initialized = true;
+        std::cerr << "Initialized gpu function library" << std::endl;
+        return 0;
+}
+
+DeviceFunction&
+DeviceFunctionLibrary::function(gpu::LibraryFunction f, size_t command_queue_i)
+{
+        DeviceInterface* device = DeviceInterface::instance();
+        if (command_queue_i >= queues.size())
+                return device->function(-1);
+        return device->function(queues[command_queue_i].ids[f]);
+}
+
+int32_t
+DeviceFunctionLibrary::clear_memory(memory_id id, size_t command_queue_i)
+{
+        DeviceInterface* device = DeviceInterface::instance();
+        DeviceMemory& mem = device->memory(id);
+        std::vector<cl_uint> zeros(mem.size() / sizeof(cl_uint), 0);
+        if (zeros.empty())
+                return 0;
+        /* Whole memory from offset 0, on the queue that will use it */
+        if (mem.write(zeros.size() * sizeof(cl_uint), &(zeros[0]), 0, command_queue_i))
                 return -1;
-        ids[gpu::scan_local_uint] = scan_local_uint_id;
+        return 0;
+}
 
+int32_t
+DeviceFunctionLibrary::load_queue_functions(QueueFunctions* s, size_t command_queue_i)
+{
+        DeviceInterface* device = DeviceInterface::instance();
 
-        function_id scan_post_uint_id  = device->new_function();
-        DeviceFunction& scan_post_uint = device->function(scan_post_uint_id);
-        if (scan_post_uint.initialize("src/kernel/scan.cl",
-                                      "scan_post_uint"))
+        std::vector<std::string> names;
+        names.push_back("scan_lookback_uint");
+        names.push_back("compact_lookback_uint");
+
+        std::vector<function_id> function_ids = 
+                device->defer_functions("src/kernel/scan.cl", names, 
+                                        BuildOptions(), command_queue_i);
+        if (!function_ids.size())
                 return -1;
-        ids[gpu::scan_post_uint] = scan_post_uint_id;
+        s->ids[gpu::scan_lookback_uint] = function_ids[0];
+        s->ids[gpu::compact_lookback_uint] = function_ids[1];
 
-        
-        m_initialized = true;
-        std::cerr << "Initialized gpu function library" << std::endl;
+        s->status_mem_id = device->new_memory(command_queue_i);
+        s->counter_mem_id = device->new_memory(command_queue_i);
+        s->epoch = 0;
+        if (device->memory(s->status_mem_id).initialize(3 * sizeof(cl_uint)) ||
+            device->memory(s->counter_mem_id).initialize(sizeof(cl_uint)) ||
+            clear_memory(s->status_mem_id, command_queue_i) || 
+            clear_memory(s->counter_mem_id, command_queue_i))
+                return -1;
+        return 0;
+}
+
+int32_t
+DeviceFunctionLibrary::lookback_scratch(size_t tiles,
+                                        memory_id* status_id, memory_id* counter_id,
+                                        cl_uint* epoch, size_t command_queue_i)
+{
+        if (!m_initialized || command_queue_i >= queues.size())
+                return -1;
+        QueueFunctions& s = queues[command_queue_i];
+
+        DeviceInterface* device = DeviceInterface::instance();
+        DeviceMemory& status_mem = device->memory(s.status_mem_id);
+
+        /* The old memory goes back to the pool, where another queue could
+           take it before the scans already enqueued here are done */
+        size_t status_size = 3 * sizeof(cl_uint) * tiles;
+        if (status_mem.size() < status_size) {
+                if (device->finish_commands(command_queue_i) ||
+                    status_mem.resize(status_size) || 
+                    clear_memory(s.status_mem_id, command_queue_i))
+                        return -1;
+        }
+
+        /* The epoch is stored in the upper 30 bits of the tile flags, start
+           over from a clear status memory when it wraps */
+        s.epoch++;
+        if (s.epoch >= (1u << 30)) {
+                if (clear_memory(s.status_mem_id, command_queue_i))
+                        return -1;
+                s.epoch = 1;
+        }
+
+        *status_id = s.status_mem_id;
+        *counter_id = s.counter_mem_id;
+        *epoch = s.epoch;
         return 0;
 }
@@ -1,11 +1,22 @@
-#include <fstream>
 #include <sstream>
-#include <cstring>
+#include <ctime>
 #include <gpu/function.hpp>
 
+/* Wall clock in milliseconds, for the launches timed by the tuner */
+static double wall_msec()
+{
+#if defined __linux__
+        timespec tp;
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        return tp.tv_sec * 1e3 + tp.tv_nsec * 1e-6;
+#else
+        return 1e3 * std::clock() / CLOCKS_PER_SEC;
+#endif
+}
 
-DeviceFunction::DeviceFunction() 
+DeviceFunction::DeviceFunction(size_t context_i) 
 {
+        m_context = context_i;
         for (int8_t i = 0; i < 3; ++i) {
                 m_local_size[i] = 0;
                 m_global_size[i] = 0;
@@ -13,6 +24,12 @@ DeviceFunction::DeviceFunction()
         }
         m_work_dim = 0;
         m_initialized = false;
+        m_deferred = false;
+        m_max_group_size = 0;
+        m_group_multiple = 1;
+        m_trial_size = 0;
+        m_trial_global_size = 0;
+        m_trial_device = NULL;
 }
 
 bool 
@@ -22,99 +39,40 @@ DeviceFunction::valid()
 }
 
 int32_t 
-DeviceFunction::initialize(std::string file, std::string name)
+DeviceFunction::initialize(std::string file, std::string name, 
+                           const BuildOptions& options)
 {
-	cl_int err;
-        
-        CLInfo* clinfo = CLInfo::instance();
-
-        if (!clinfo->initialized())
+        if (ProgramCache::instance()->get(file, options, &m_program, m_context))
                 return -1;
 
-	//Create a program from the kernel source code
-	std::ifstream kernel_source_file(file.c_str());
-	if (!kernel_source_file.good()){
-		std::cerr << "Error: could not read kernel file." << std::endl;
-		return -1;
-	}
-
-	std::streampos file_size;
-	kernel_source_file.seekg (0, std::ios::beg);
-	file_size = kernel_source_file.tellg();
-	kernel_source_file.seekg (0, std::ios::end);
-	file_size = kernel_source_file.tellg() - file_size;
-
-	char *kernel_source = new char[(int)file_size+1];
-	std::memset(kernel_source,0,file_size);
-
-	kernel_source_file.seekg (0, std::ios::beg);
-	kernel_source_file.read(kernel_source,file_size);
-	kernel_source_file.close();
-	kernel_source[file_size] = 0;
-	
-	m_program = clCreateProgramWithSource(clinfo->context,
-                                              1,
-                                              (const char**)&kernel_source,
-                                              NULL,
-                                              &err);
-
-	delete[] kernel_source;
-	if (error_cl(err, "clCreateProgramWithSource"))
-		return -1;
-
-	err = clBuildProgram(m_program,
-                             0,
-                             NULL,
-                             /*"-cl-fast-relaxed-math",*/ NULL,
-                             NULL,
-                             NULL);
-	if (error_cl(err, "clBuildProgram")){
-		char build_log[8196];
-		size_t bytes_returned;
-		err = clGetProgramBuildInfo (m_program,
-					     clinfo->device_id,
-					     CL_PROGRAM_BUILD_LOG,
-					     sizeof(build_log),
-					     build_log,
-					     &bytes_returned);
-
-		if (!error_cl(err, "clGetProgramBuildInfo")){
-			std::cerr << "Program build error log:" << std::endl
-				  << build_log << std::endl;
-		}
-		return -1;
-	}
-
-	//specify which kernel from the program to execute
-	m_kernel = clCreateKernel(m_program,
-                                  name.c_str(),&err);
-	if (error_cl(err, "clCreateKernel"))
-		return -1;
-
-        err = clGetKernelWorkGroupInfo(m_kernel,
-                                       clinfo->device_id,
-                                       CL_KERNEL_WORK_GROUP_SIZE,
-                                       sizeof(size_t),
-                                       &m_max_group_size,
-                                       NULL);
-	if (error_cl(err, "clGetKernelWorkGroupInfo CL_KERNEL_WORK_GROUP_SIZE"))
-		return -1;
-
-        size_t multiple;
-        err = clGetKernelWorkGroupInfo(m_kernel,
-                                       clinfo->device_id,
-                                       CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
-                                       sizeof(size_t),
-                                       &multiple,
-                                       NULL);
-	if (error_cl(err, "clGetKernelWorkGroupInfo PREFERRED_WORK_GROUP_SIZE_MULTIPLE"))
-		return -1;
+        if (initialize(name)) {
+                clReleaseProgram(m_program);
+                return -1;
+        }
+        return 0;
+}
 
-        if (m_max_group_size > multiple)
-                m_max_group_size =  (m_max_group_size / multiple) * multiple;
+void
+DeviceFunction::defer(std::string file, std::string name, 
+                      const BuildOptions& options)
+{
+        m_file = file;
+        m_name = name;
+        m_options = options;
+        m_deferred = true;
+}
 
-        m_initialized = true;
-	return 0;
+int32_t
+DeviceFunction::build_deferred()
+{
+        /* Only tried once, a function that fails to build stays invalid */
+        m_deferred = false;
+        if (initialize(m_file, m_name, m_options)) {
+                std::cerr << "Error building deferred function " << m_name 
+                          << " from " << m_file << std::endl;
+                return -1;
+        }
+        return 0;
 }
 
 
@@ -273,7 +231,16 @@ DeviceFunction::execute_single_dim(size_t global_size, size_t local_size,
         }
 
         if (local_size == 0) {
-                local_size = m_max_group_size;
+                local_size = work_group_size(global_size, 0, "", command_queue_i);
+        }
+
+        /* A launch picked by the tuner is timed on its own */
+        bool trial = is_trial(global_size, local_size);
+        double trial_start = 0.;
+        if (trial) {
+                if (error_cl(clFinish(command_queue), "clFinish"))
+                        return -1;
+                trial_start = wall_msec();
         }
 
         size_t leftover = global_size > local_size? global_size % local_size : 0;
@@ -310,6 +277,9 @@ DeviceFunction::execute_single_dim(size_t global_size, size_t local_size,
                         return -1;
         }
 
+        if (trial)
+                return finish_trial(global_size, local_size, trial_start, command_queue);
+
 	/* finish command queue */
 	err = clFinish(command_queue);
 	if (error_cl(err, "clFinish"))
@@ -335,7 +305,16 @@ DeviceFunction::enqueue_single_dim(size_t global_size, size_t local_size,
         }
 
         if (local_size == 0) {
-                local_size = m_max_group_size;
+                local_size = work_group_size(global_size, 0, "", command_queue_i);
+        }
+
+        /* A launch picked by the tuner is timed on its own */
+        bool trial = is_trial(global_size, local_size);
+        double trial_start = 0.;
+        if (trial) {
+                if (error_cl(clFinish(command_queue), "clFinish"))
+                        return -1;
+                trial_start = wall_msec();
         }
 
         size_t leftover = global_size > local_size? global_size % local_size : 0;
@@ -371,6 +350,9 @@ DeviceFunction::enqueue_single_dim(size_t global_size, size_t local_size,
                         return -1;
         }
 
+        if (trial)
+                return finish_trial(global_size, local_size, trial_start, command_queue);
+
 	/* finish command queue */
         if (!clinfo->sync()) {
         	err = clFlush(command_queue);
@@ -499,8 +481,9 @@ DeviceFunction::initialize(std::string name)
 	if (error_cl(err, "clCreateKernel"))
 		return -1;
 
+        cl_device_id device = clinfo->context_device(m_context);
         err = clGetKernelWorkGroupInfo(m_kernel,
-                                       clinfo->device_id,
+                                       device,
                                        CL_KERNEL_WORK_GROUP_SIZE,
                                        sizeof(size_t),
                                        &m_max_group_size,
@@ -510,7 +493,7 @@ DeviceFunction::initialize(std::string name)
 
         size_t multiple;
         err = clGetKernelWorkGroupInfo(m_kernel,
-                                       clinfo->device_id,
+                                       device,
                                        CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
                                        sizeof(size_t),
                                        &multiple,
@@ -519,6 +502,8 @@ DeviceFunction::initialize(std::string name)
 		return -1;
         if (m_max_group_size > multiple)
                 m_max_group_size =  (m_max_group_size / multiple) * multiple;
+        m_group_multiple = multiple;
+        m_name = name;
 
         m_initialized = true;
 	return 0;
@@ -529,3 +514,50 @@ DeviceFunction::max_group_size()
 {
         return m_max_group_size;
 }
+
+size_t
+DeviceFunction::work_group_size(size_t global_size, size_t default_size,
+                                const std::string& tag, size_t command_queue_i)
+{
+        WorkSizeTuner* tuner = WorkSizeTuner::instance();
+        cl_device_id device = CLInfo::instance()->queue_device(command_queue_i);
+        std::string key = tag.empty() ? m_name : m_name + "." + tag;
+
+        size_t size = tuner->tuned_size(device, key, global_size);
+        if (size)
+                return std::min(size, m_max_group_size);
+
+        size = tuner->trial_size(device, key, global_size, 
+                                 m_max_group_size, m_group_multiple);
+        if (size) {
+                m_trial_size = size;
+                m_trial_global_size = global_size;
+                m_trial_key = key;
+                m_trial_device = device;
+                return size;
+        }
+
+        return default_size ? default_size : m_max_group_size;
+}
+
+bool
+DeviceFunction::is_trial(size_t global_size, size_t local_size)
+{
+        return m_trial_size && 
+                m_trial_size == local_size && 
+                m_trial_global_size == global_size;
+}
+
+int32_t
+DeviceFunction::finish_trial(size_t global_size, size_t local_size,
+                             double start_msec, cl_command_queue command_queue)
+{
+        m_trial_size = 0;
+        if (error_cl(clFinish(command_queue), "clFinish"))
+                return -1;
+
+        double msec = wall_msec() - start_msec;
+        WorkSizeTuner::instance()->record_trial(m_trial_device, m_trial_key,
+                                                global_size, local_size, msec);
+        return 0;
+}
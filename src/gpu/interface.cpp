@@ -1,22 +1,49 @@
 #include <gpu/interface.hpp>
 
+#include <sstream>
+
 DeviceInterface* DeviceInterface::s_instance = NULL;
 
 DeviceInterface::DeviceInterface() 
 {
-        memory_map.resize(1);
-        memory_map[0].set();
+        add_memory_chunk();
+        add_function_chunk();
 
-        memory_objects.resize(1);
-        memory_objects[0].resize(PREALLOC_SIZE);
+        /* Recursive, function_variant creates and fetches under the lock */
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&m_lock, &attr);
+        pthread_mutexattr_destroy(&attr);
 
-        function_map.resize(1);
-        function_map[0].set();
+        m_initialized = false;
+}
 
-        function_objects.resize(1);
-        function_objects[0].resize(PREALLOC_SIZE);
+void
+DeviceInterface::add_memory_chunk()
+{
+        size_t i = memory_map.size();
+        memory_map.push_back(std::bitset<PREALLOC_SIZE>());
+        memory_map[i].set();
+        memory_objects.push_back(
+                std::vector<DeviceMemory>(PREALLOC_SIZE,DeviceMemory()));
 
-        m_initialized = false;
+        /* Reversed so the lowest ids are handed out first */
+        for (size_t j = PREALLOC_SIZE; j > 0; --j)
+                free_memory_ids.push_back(i * PREALLOC_SIZE + j - 1);
+}
+
+void
+DeviceInterface::add_function_chunk()
+{
+        size_t i = function_map.size();
+        function_map.push_back(std::bitset<PREALLOC_SIZE>());
+        function_map[i].set();
+        function_objects.push_back(
+                std::vector<DeviceFunction>(PREALLOC_SIZE,DeviceFunction()));
+
+        for (size_t j = PREALLOC_SIZE; j > 0; --j)
+                free_function_ids.push_back(i * PREALLOC_SIZE + j - 1);
 }
 
 bool DeviceInterface::good()
@@ -38,61 +65,45 @@ DeviceInterface::initialize()
 }
 
 memory_id 
-DeviceInterface::new_memory()
+DeviceInterface::new_memory(size_t command_queue_i)
 {
         if (!good())
                 return -1;
-        for (size_t i = 0; i < memory_map.size(); ++i) {
-                if (memory_map[i].none()) 
-                        continue;
-
-                for (size_t j = 0; j < memory_map[i].size(); j++)
-                        if (memory_map[i][j]) {
-                                memory_map[i].flip(j);
-                                memory_objects[i][j] = DeviceMemory();
-                                return (i*PREALLOC_SIZE + j);
-                        }
-        }
 
-        size_t i = memory_map.size();
-        memory_map.push_back(std::bitset<PREALLOC_SIZE>());
-        memory_objects.push_back(
-                std::vector<DeviceMemory>(PREALLOC_SIZE,DeviceMemory()));
-        
-        memory_map[i].set();
-        memory_map[i][0].flip();
+        size_t context_i = CLInfo::instance()->queue_context(command_queue_i);
+
+        pthread_mutex_lock(&m_lock);
+        if (free_memory_ids.empty())
+                add_memory_chunk();
+
+        memory_id id = free_memory_ids.back();
+        free_memory_ids.pop_back();
 
-        memory_objects[i][0] = DeviceMemory();
-        return i * PREALLOC_SIZE;
+        memory_map[id/PREALLOC_SIZE].flip(id%PREALLOC_SIZE);
+        memory_objects[id/PREALLOC_SIZE][id%PREALLOC_SIZE] = DeviceMemory(context_i);
+        pthread_mutex_unlock(&m_lock);
+        return id;
 }
 
 function_id 
-DeviceInterface::new_function()
+DeviceInterface::new_function(size_t command_queue_i)
 {
         if (!good())
                 return -1;
-        for (size_t i = 0; i < function_map.size(); ++i) {
-                if (function_map[i].none()) 
-                        continue;
-
-                for (size_t j = 0; j < function_map[i].size(); j++)
-                        if (function_map[i][j]) {
-                                function_map[i].flip(j);
-                                function_objects[i][j] = DeviceFunction();
-                                return (i*PREALLOC_SIZE + j);
-                        }
-        }
 
-        size_t i = function_map.size();
-        function_map.push_back(std::bitset<PREALLOC_SIZE>());
-        function_objects.push_back(
-                std::vector<DeviceFunction>(PREALLOC_SIZE,DeviceFunction()));
-        
-        function_map[i].set();
-        function_map[i][0].flip();
+        size_t context_i = CLInfo::instance()->queue_context(command_queue_i);
+
+        pthread_mutex_lock(&m_lock);
+        if (free_function_ids.empty())
+                add_function_chunk();
 
-        function_objects[i][0] = DeviceFunction();
-        return i * PREALLOC_SIZE;
+        function_id id = free_function_ids.back();
+        free_function_ids.pop_back();
+
+        function_map[id/PREALLOC_SIZE].flip(id%PREALLOC_SIZE);
+        function_objects[id/PREALLOC_SIZE][id%PREALLOC_SIZE] = DeviceFunction(context_i);
+        pthread_mutex_unlock(&m_lock);
+        return id;
 
 
 
@@ -118,41 +129,33 @@ DeviceInterface::function(function_id id)
         if (!good() || !valid_function_id(id))
                 return invalid_function;
 
-        return function_objects[id/PREALLOC_SIZE][id%PREALLOC_SIZE];
+        DeviceFunction& f = function_objects[id/PREALLOC_SIZE][id%PREALLOC_SIZE];
+        if (f.deferred()) {
+                pthread_mutex_lock(&m_lock);
+                if (f.deferred())
+                        f.build_deferred();
+                pthread_mutex_unlock(&m_lock);
+        }
+        return f;
 }
 
 std::vector<function_id>
-DeviceInterface::build_functions(std::string file, std::vector<std::string>& names)
+DeviceInterface::build_functions(std::string file, std::vector<std::string>& names,
+                                 const BuildOptions& options, size_t command_queue_i)
 {
         std::vector<function_id> ids;
 
-        if (names.size() == 0)
-                return ids;
-
-        ids.push_back(new_function());
-        DeviceFunction& f = function(ids[0]);
-
-        if (f.initialize(file, names[0]))  {
-                for (size_t i = 0; i < ids.size(); ++i) {
-                        delete_function(ids[i]);
-                        ids.clear();
-                }
-                return ids;
-        }
-
-        cl_program file_program = f.m_program;
-
-        for (size_t i = 1; i < names.size(); ++i) {
+        /* The program is built once, by the first function, and the rest 
+           take it from the program cache */
+        for (size_t i = 0; i < names.size(); ++i) {
                 
-                function_id fid = new_function();
+                function_id fid = new_function(command_queue_i);
                 ids.push_back(fid);
                 DeviceFunction& f = function(fid);
-                f.m_program = file_program;
-                if (f.initialize(names[i])) {
-                        for (size_t i = 0; i < ids.size(); ++i) {
-                                delete_function(ids[i]);
-                                ids.clear();
-                        }
+                if (f.initialize(file, names[i], options)) {
+                        for (size_t j = 0; j < ids.size(); ++j)
+                                delete_function(ids[j]);
+                        ids.clear();
                         return ids;
                 }
         }
@@ -161,6 +164,52 @@ DeviceInterface::build_functions(std::string file, std::vector<std::string>& nam
 
 }
 
+std::vector<function_id>
+DeviceInterface::defer_functions(std::string file, std::vector<std::string>& names,
+                                 const BuildOptions& options, size_t command_queue_i)
+{
+        std::vector<function_id> ids;
+        if (!good())
+                return ids;
+
+        for (size_t i = 0; i < names.size(); ++i) {
+                function_id fid = new_function(command_queue_i);
+                ids.push_back(fid);
+                function_objects[fid/PREALLOC_SIZE][fid%PREALLOC_SIZE].
+                        defer(file, names[i], options);
+        }
+        return ids;
+}
+
+function_id
+DeviceInterface::function_variant(const std::string& file, const std::string& name,
+                                  const BuildOptions& options, size_t command_queue_i)
+{
+        std::stringstream key_str;
+        key_str << ProgramCache::key(file, options) << "|" << name 
+                << "|" << command_queue_i;
+        std::string key = key_str.str();
+
+        pthread_mutex_lock(&m_lock);
+        std::map<std::string, function_id>::iterator it = function_variants.find(key);
+        if (it != function_variants.end()) {
+                function_id fid = it->second;
+                pthread_mutex_unlock(&m_lock);
+                return fid;
+        }
+
+        /* A variant that fails to build is remembered too, so callers can
+           fall back to the generic kernel without retrying every frame */
+        function_id fid = new_function(command_queue_i);
+        if (function(fid).initialize(file, name, options)) {
+                delete_function(fid);
+                fid = -1;
+        }
+        function_variants[key] = fid;
+        pthread_mutex_unlock(&m_lock);
+        return fid;
+}
+
 
 bool 
 DeviceInterface::valid_memory_id(memory_id id)
@@ -188,7 +237,10 @@ DeviceInterface::delete_memory(memory_id id)
                 if (memory(id).release())
                         return -1;
 
+        pthread_mutex_lock(&m_lock);
         memory_map[id/PREALLOC_SIZE].flip(id%PREALLOC_SIZE);
+        free_memory_ids.push_back(id);
+        pthread_mutex_unlock(&m_lock);
         return 0;
 }
 
@@ -200,11 +252,17 @@ DeviceInterface::delete_function(function_id id)
 
         if (!valid_function_id(id))
                 return -1;
-        if (function(id).valid())
-                if (function(id).release())
+
+        /* Not through function(), which would build a deferred one */
+        DeviceFunction& f = function_objects[id/PREALLOC_SIZE][id%PREALLOC_SIZE];
+        if (f.valid())
+                if (f.release())
                         return -1;
 
+        pthread_mutex_lock(&m_lock);
         function_map[id/PREALLOC_SIZE].flip(id%PREALLOC_SIZE);
+        free_function_ids.push_back(id);
+        pthread_mutex_unlock(&m_lock);
         return 0;
 }
 
@@ -223,14 +281,17 @@ DeviceInterface::acquire_graphic_resource(memory_id tex_id, bool enqueue_barrier
 
 
         cl_int err;
-        err = clEnqueueAcquireGLObjects(command_queue,
-                1,
-                memory(tex_id).ptr(),
-                0,
-                NULL,
-                NULL);
-        if (error_cl(err, "clEnqueueAcquireGLObjects"))
-                return -1;
+        /* Without GL sharing the resource is an image of the context */
+        if (clinfo->gl_sharing()) {
+                err = clEnqueueAcquireGLObjects(command_queue,
+                                                1,
+                                                memory(tex_id).ptr(),
+                                                0,
+                                                NULL,
+                                                NULL);
+                if (error_cl(err, "clEnqueueAcquireGLObjects"))
+                        return -1;
+        }
 
         if (enqueue_barrier) {
                 err = clEnqueueBarrier(command_queue);
@@ -253,14 +314,16 @@ DeviceInterface::release_graphic_resource(memory_id tex_id, bool enqueue_barrier
         cl_command_queue command_queue = clinfo->get_command_queue(command_queue_i);
 
         cl_int err;
-        err = clEnqueueReleaseGLObjects(command_queue,
-                1,
-                memory(tex_id).ptr(),
-                0,
-                NULL,
-                NULL);
-        if (error_cl(err, "clEnqueueReleaseGLObjects"))
-                return -1;
+        if (clinfo->gl_sharing()) {
+                err = clEnqueueReleaseGLObjects(command_queue,
+                                                1,
+                                                memory(tex_id).ptr(),
+                                                0,
+                                                NULL,
+                                                NULL);
+                if (error_cl(err, "clEnqueueReleaseGLObjects"))
+                        return -1;
+        }
 
         if (enqueue_barrier) {
                 err = clEnqueueBarrier(command_queue);
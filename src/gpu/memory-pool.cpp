@@ -0,0 +1,375 @@
+#include <algorithm>
+#include <iostream>
+#include <gpu/memory-pool.hpp>
+
+#define MIN_CLASS_SIZE    256
+#define CLASSES_PER_OCTAVE  4
+#define MAX_SLAB_SIZE     (32 << 20)
+#define MAX_CACHED_BYTES  (256 << 20)
+
+std::vector<DeviceMemoryPool*> DeviceMemoryPool::s_instances;
+
+/* Holds the pool lock until the end of the scope */
+class PoolLock {
+public:
+        PoolLock(pthread_mutex_t* lock) : m_lock(lock) {pthread_mutex_lock(m_lock);}
+        ~PoolLock() {pthread_mutex_unlock(m_lock);}
+private:
+        pthread_mutex_t* m_lock;
+};
+
+DeviceMemoryPool::DeviceMemoryPool(size_t context_i)
+{
+        m_context = context_i;
+        m_initialized = false;
+        m_alignment = 1;
+        m_slab_size = 0;
+        m_max_carved_size = 0;
+        m_max_cached_bytes = 0;
+        m_slab_offset = 0;
+        m_slab_bytes = 0;
+        m_cached_bytes = 0;
+        m_arena_slab = 0;
+        m_arena_offset = 0;
+        m_arena_live = 0;
+        m_arena_reserve = 0;
+        m_arena_bytes = 0;
+        pthread_mutex_init(&m_lock, NULL);
+}
+
+int32_t
+DeviceMemoryPool::initialize()
+{
+        CLInfo* clinfo = CLInfo::instance();
+        if (!clinfo->initialized())
+                return -1;
+
+        /* Sub-buffer origins must be aligned to this (reported in bits) on
+           every device of the context */
+        cl_uint max_align_bits = 8;
+        for (size_t i = 0; i < clinfo->device_ids.size(); ++i) {
+                if (clinfo->device_context(i) != m_context)
+                        continue;
+                cl_uint align_bits;
+                cl_int err = clGetDeviceInfo(clinfo->device_ids[i],
+                                             CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                                             sizeof(cl_uint), &align_bits, NULL);
+                if (error_cl(err, "clGetDeviceInfo CL_DEVICE_MEM_BASE_ADDR_ALIGN"))
+                        return -1;
+                max_align_bits = std::max(max_align_bits, align_bits);
+        }
+
+        m_alignment = max_align_bits / 8;
+        m_slab_size = std::min((cl_ulong)MAX_SLAB_SIZE, clinfo->max_mem_alloc_size);
+        m_max_carved_size = m_slab_size / 8;
+        m_max_cached_bytes = std::min((cl_ulong)MAX_CACHED_BYTES,
+                                      clinfo->global_mem_size / 8);
+        m_initialized = true;
+        return 0;
+}
+
+size_t
+DeviceMemoryPool::class_size(int32_t size_class)
+{
+        size_t octave = size_class / CLASSES_PER_OCTAVE;
+        size_t step = size_class % CLASSES_PER_OCTAVE;
+        return ((size_t)MIN_CLASS_SIZE << octave) / CLASSES_PER_OCTAVE *
+                (CLASSES_PER_OCTAVE + step);
+}
+
+int32_t
+DeviceMemoryPool::size_class(size_t size)
+{
+        if (!size)
+                return -1;
+        int32_t c = 0;
+        while (class_size(c) < size)
+                c++;
+        return c;
+}
+
+size_t
+DeviceMemoryPool::align(size_t offset) const
+{
+        return (offset + m_alignment - 1) / m_alignment * m_alignment;
+}
+
+int32_t
+DeviceMemoryPool::new_buffer(size_t size, cl_mem* mem)
+{
+        CLInfo* clinfo = CLInfo::instance();
+        cl_int err;
+        *mem = clCreateBuffer(clinfo->get_context(m_context),
+                              CL_MEM_READ_WRITE,
+                              size,
+                              NULL,
+                              &err);
+        if (error_cl(err, "clCreateBuffer"))
+                return -1;
+        return 0;
+}
+
+int32_t
+DeviceMemoryPool::new_sub_buffer(cl_mem parent, size_t offset, size_t size,
+                                 cl_mem* mem)
+{
+        cl_buffer_region region;
+        region.origin = offset;
+        region.size = size;
+
+        cl_int err;
+        *mem = clCreateSubBuffer(parent,
+                                 CL_MEM_READ_WRITE,
+                                 CL_BUFFER_CREATE_TYPE_REGION,
+                                 &region,
+                                 &err);
+        if (error_cl(err, "clCreateSubBuffer"))
+                return -1;
+        return 0;
+}
+
+int32_t
+DeviceMemoryPool::carve(size_t size, cl_mem* mem)
+{
+        if (m_slabs.empty() || align(m_slab_offset) + size > m_slab_size) {
+                cl_mem slab;
+                if (new_buffer(m_slab_size, &slab))
+                        return -1;
+                m_slabs.push_back(slab);
+                m_slab_offset = 0;
+                m_slab_bytes += m_slab_size;
+        }
+
+        size_t offset = align(m_slab_offset);
+        if (new_sub_buffer(m_slabs.back(), offset, size, mem))
+                return -1;
+        m_slab_offset = offset + size;
+        return 0;
+}
+
+int32_t
+DeviceMemoryPool::allocate(size_t size, cl_mem* mem, int32_t* size_class_out)
+{
+        PoolLock lock(&m_lock);
+        if (!m_initialized && initialize())
+                return -1;
+
+        int32_t c = size_class(size);
+        if (c < 0)
+                return -1;
+        size_t csize = class_size(c);
+
+        /* Most recently released last, the oldest are the likeliest idle */
+        for (size_t i = 0; (size_t)c < m_free.size() && i < m_free[c].size(); ++i) {
+                if (!idle(&m_free[c][i]))
+                        continue;
+                *mem = m_free[c][i].mem;
+                release_markers(&m_free[c][i]);
+                m_free[c].erase(m_free[c].begin() + i);
+                if (csize > m_max_carved_size)
+                        m_cached_bytes -= csize;
+                *size_class_out = c;
+                return 0;
+        }
+
+        /* Rounding up would go past the allocation limit, this one is not
+           pooled */
+        if (csize > CLInfo::instance()->max_mem_alloc_size) {
+                *size_class_out = -1;
+                return new_buffer(size, mem);
+        }
+
+        if (csize <= m_max_carved_size) {
+                if (carve(csize, mem))
+                        return -1;
+        } else if (new_buffer(csize, mem)) {
+                /* Give the cached blocks back to the driver and try again */
+                if (!m_cached_bytes || trim_cached() || new_buffer(csize, mem))
+                        return -1;
+        }
+
+        *size_class_out = c;
+        return 0;
+}
+
+int32_t
+DeviceMemoryPool::release(cl_mem mem, int32_t size_class)
+{
+        PoolLock lock(&m_lock);
+        size_t csize = size_class < 0 ? 0 : class_size(size_class);
+        bool dedicated = csize > m_max_carved_size;
+
+        if (size_class < 0 ||
+            (dedicated && m_cached_bytes + csize > m_max_cached_bytes)) {
+                cl_int err = clReleaseMemObject(mem);
+                if (error_cl(err, "clReleaseMemObject"))
+                        return -1;
+                return 0;
+        }
+
+        FreeBlock block;
+        block.mem = mem;
+        if (mark_released(&block))
+                return -1;
+
+        if ((size_t)size_class >= m_free.size())
+                m_free.resize(size_class + 1);
+        m_free[size_class].push_back(block);
+        if (dedicated)
+                m_cached_bytes += csize;
+        return 0;
+}
+
+int32_t
+DeviceMemoryPool::mark_released(FreeBlock* block)
+{
+        CLInfo* clinfo = CLInfo::instance();
+        for (size_t i = 0; i < clinfo->command_queue_count(); ++i) {
+                if (clinfo->queue_context(i) != m_context)
+                        continue;
+                cl_command_queue cq = clinfo->get_command_queue(i);
+                cl_event marker;
+                cl_int err = clEnqueueMarker(cq, &marker);
+                if (error_cl(err, "clEnqueueMarker")) {
+                        release_markers(block);
+                        return -1;
+                }
+                block->markers.push_back(marker);
+                /* Or the marker may never be submitted */
+                clFlush(cq);
+        }
+        return 0;
+}
+
+bool
+DeviceMemoryPool::idle(FreeBlock* block)
+{
+        while (!block->markers.empty()) {
+                cl_int status;
+                cl_int err = clGetEventInfo(block->markers.back(),
+                                            CL_EVENT_COMMAND_EXECUTION_STATUS,
+                                            sizeof(cl_int), &status, NULL);
+                /* Negative status is an aborted queue, nothing runs on it */
+                if (err == CL_SUCCESS && status > CL_COMPLETE)
+                        return false;
+                clReleaseEvent(block->markers.back());
+                block->markers.pop_back();
+        }
+        return true;
+}
+
+void
+DeviceMemoryPool::release_markers(FreeBlock* block)
+{
+        for (size_t i = 0; i < block->markers.size(); ++i)
+                clReleaseEvent(block->markers[i]);
+        block->markers.clear();
+}
+
+int32_t
+DeviceMemoryPool::trim()
+{
+        PoolLock lock(&m_lock);
+        return trim_cached();
+}
+
+int32_t
+DeviceMemoryPool::trim_cached()
+{
+        for (size_t c = 0; c < m_free.size(); ++c) {
+                if (class_size(c) <= m_max_carved_size)
+                        continue;
+                for (size_t i = 0; i < m_free[c].size(); ++i) {
+                        /* The driver keeps it alive for pending commands */
+                        release_markers(&m_free[c][i]);
+                        cl_int err = clReleaseMemObject(m_free[c][i].mem);
+                        if (error_cl(err, "clReleaseMemObject"))
+                                return -1;
+                }
+                m_free[c].clear();
+        }
+        m_cached_bytes = 0;
+        return 0;
+}
+
+size_t
+DeviceMemoryPool::max_transient_size()
+{
+        PoolLock lock(&m_lock);
+        if (!m_initialized && initialize())
+                return 0;
+        return m_slab_size;
+}
+
+int32_t
+DeviceMemoryPool::allocate_transient(size_t size, cl_mem* mem)
+{
+        PoolLock lock(&m_lock);
+        if (!m_initialized && initialize())
+                return -1;
+
+        if (!size || size > m_slab_size)
+                return -1;
+
+        while (true) {
+                if (m_arena_slab < m_arena_slabs.size()) {
+                        size_t offset = align(m_arena_offset);
+                        if (offset + size <= m_arena_sizes[m_arena_slab]) {
+                                if (new_sub_buffer(m_arena_slabs[m_arena_slab],
+                                                   offset, size, mem))
+                                        return -1;
+                                m_arena_offset = offset + size;
+                                m_arena_live++;
+                                return 0;
+                        }
+                        m_arena_slab++;
+                        m_arena_offset = 0;
+                        continue;
+                }
+
+                /* After an overflow the arena comes back as a single slab
+                   big enough for the whole frame */
+                size_t slab_size = std::max(m_slab_size, m_arena_reserve);
+                slab_size = std::min((cl_ulong)slab_size,
+                                     CLInfo::instance()->max_mem_alloc_size);
+                m_arena_reserve = 0;
+
+                cl_mem slab;
+                if (new_buffer(slab_size, &slab))
+                        return -1;
+                m_arena_slabs.push_back(slab);
+                m_arena_sizes.push_back(slab_size);
+                m_arena_bytes += slab_size;
+        }
+}
+
+int32_t
+DeviceMemoryPool::release_transient(cl_mem mem)
+{
+        PoolLock lock(&m_lock);
+        cl_int err = clReleaseMemObject(mem);
+        if (error_cl(err, "clReleaseMemObject"))
+                return -1;
+
+        if (m_arena_live && --m_arena_live == 0)
+                rewind_arena();
+        return 0;
+}
+
+void
+DeviceMemoryPool::rewind_arena()
+{
+        if (m_arena_slabs.size() > 1) {
+                size_t total = 0;
+                for (size_t i = 0; i < m_arena_slabs.size(); ++i) {
+                        total += m_arena_sizes[i];
+                        clReleaseMemObject(m_arena_slabs[i]);
+                }
+                m_arena_slabs.clear();
+                m_arena_sizes.clear();
+                m_arena_bytes = 0;
+                m_arena_reserve = total;
+        }
+        m_arena_slab = 0;
+        m_arena_offset = 0;
+}
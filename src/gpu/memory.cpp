@@ -1,7 +1,17 @@
+#include <cstring>
+#include <vector>
 #include <gpu/memory.hpp>
+#include <gpu/memory-pool.hpp>
 
-DeviceMemory::DeviceMemory() :
-        m_initialized(false)
+/* Buffers come from DeviceMemoryPool and are always allocated read-write,
+   the mode is kept as a hint of how the memory is used. */
+
+DeviceMemory::DeviceMemory(size_t context_i) :
+        m_initialized(false),
+        m_pool_class(-1),
+        m_transient(false),
+        m_host_mapped(false),
+        m_context(context_i)
 {
 }
 
@@ -16,43 +26,68 @@ int32_t DeviceMemory::initialize(size_t size, DeviceMemoryMode mode)
         if (!clinfo->initialized() || m_initialized)
                 return -1;
 
-        cl_mem_flags flags;
-        switch (mode)
-        {
-        case(READ_ONLY_MEMORY):
-                flags = CL_MEM_READ_ONLY;
-                break;
-        case(WRITE_ONLY_MEMORY):
-                flags = CL_MEM_WRITE_ONLY;
-                break;
-        case(READ_WRITE_MEMORY):
-                flags = CL_MEM_READ_WRITE;
-                break;
-        default:
+        if (mode != READ_ONLY_MEMORY && 
+            mode != WRITE_ONLY_MEMORY &&
+            mode != READ_WRITE_MEMORY)
                 return -1;
-        }
 
-	cl_int err;
-	m_mem = clCreateBuffer(clinfo->context,
-                               flags,
-                               size,
-                               NULL,
-                               &err);
-	if (error_cl(err, "clCreateBuffer"))
-		return -1;
+        DeviceMemoryPool* pool = DeviceMemoryPool::instance(m_context);
+        if (pool->allocate(size, &m_mem, &m_pool_class))
+                return -1;
 
         m_mode = mode;
+        m_transient = false;
+        m_host_mapped = false;
         m_initialized = true;
         m_size = size;
 	return 0;
         
 }
 int32_t DeviceMemory::initialize(size_t size, const void* values, DeviceMemoryMode mode)
+{
+        if (initialize(size, mode))
+                return -1;
+
+        CLInfo* clinfo = CLInfo::instance();
+        if (write(size, values, 0, clinfo->context_queue(m_context))) {
+                release();
+                return -1;
+        }
+	return 0;
+
+}
+
+int32_t DeviceMemory::initialize_transient(size_t size)
+{
+        CLInfo* clinfo = CLInfo::instance();
+        if (!clinfo->initialized() || m_initialized)
+                return -1;
+
+        DeviceMemoryPool* pool = DeviceMemoryPool::instance(m_context);
+        if (size > pool->max_transient_size())
+                return initialize(size);
+
+        if (pool->allocate_transient(size, &m_mem))
+                return -1;
+
+        m_mode = READ_WRITE_MEMORY;
+        m_pool_class = -1;
+        m_transient = true;
+        m_host_mapped = false;
+        m_initialized = true;
+        m_size = size;
+        return 0;
+}
+
+int32_t DeviceMemory::initialize_host_mapped(size_t size, DeviceMemoryMode mode)
 {
         CLInfo* clinfo = CLInfo::instance();
         if (!clinfo->initialized() || m_initialized)
                 return -1;
 
+        if (!clinfo->host_unified_memory)
+                return initialize(size, mode);
+
         cl_mem_flags flags;
         switch (mode)
         {
@@ -70,20 +105,35 @@ int32_t DeviceMemory::initialize(size_t size, const void* values, DeviceMemoryMo
         }
 
 	cl_int err;
-	m_mem = clCreateBuffer(clinfo->context,
-                               flags | CL_MEM_COPY_HOST_PTR,
+	m_mem = clCreateBuffer(clinfo->get_context(m_context),
+                               flags | CL_MEM_ALLOC_HOST_PTR,
                                size,
-                               const_cast<void*>(values), //This is ugly but necessary
-                               // Khronos, why u not have a const variant ?!?!
+                               NULL,
                                &err);
 	if (error_cl(err, "clCreateBuffer"))
-		return 1;
+		return -1;
 
         m_mode = mode;
+        m_pool_class = -1;
+        m_transient = false;
+        m_host_mapped = true;
         m_initialized = true;
         m_size = size;
-	return 0;
+        return 0;
+}
 
+int32_t DeviceMemory::initialize_host_mapped(size_t size, const void* values, 
+                                             DeviceMemoryMode mode)
+{
+        if (initialize_host_mapped(size, mode))
+                return -1;
+
+        CLInfo* clinfo = CLInfo::instance();
+        if (write(size, values, 0, clinfo->context_queue(m_context))) {
+                release();
+                return -1;
+        }
+        return 0;
 }
 
 int32_t DeviceMemory::initialize_from_gl_texture(const GLuint gl_tex)
@@ -103,11 +153,45 @@ int32_t DeviceMemory::initialize_from_gl_texture(const GLuint gl_tex)
 		return -1;
 
         m_mode = READ_WRITE_MEMORY;
+        m_pool_class = -1;
+        m_transient = false;
+        m_host_mapped = false;
         m_initialized = true;
         /* TODO: set appropiate size! */
         return 0;
 }
 
+int32_t DeviceMemory::initialize_image(size_t width, size_t height, 
+                                       const void* pixels)
+{
+        CLInfo* clinfo = CLInfo::instance();
+        if (!clinfo->initialized() || m_initialized)
+                return -1;
+
+        cl_image_format format;
+        format.image_channel_order = CL_RGBA;
+        format.image_channel_data_type = CL_UNORM_INT8;
+
+        cl_int err;
+        m_mem = clCreateImage2D(clinfo->get_context(m_context),
+                                CL_MEM_READ_WRITE | 
+                                (pixels? CL_MEM_COPY_HOST_PTR : 0),
+                                &format,
+                                width, height, 0,
+                                const_cast<void*>(pixels),
+                                &err);
+	if (error_cl(err, "clCreateImage2D"))
+		return -1;
+
+        m_mode = READ_WRITE_MEMORY;
+        m_pool_class = -1;
+        m_transient = false;
+        m_host_mapped = false;
+        m_initialized = true;
+        m_size = 4 * width * height;
+        return 0;
+}
+
 size_t DeviceMemory::write(size_t nbytes, const void* values, size_t offset, 
                            size_t command_queue_i)
 {
@@ -118,6 +202,15 @@ size_t DeviceMemory::write(size_t nbytes, const void* values, size_t offset,
         if (!valid())
                 return -1;
 
+        /* The data goes straight to the memory the device reads */
+        if (m_host_mapped) {
+                void* mapped = map(nbytes, offset, true, command_queue_i);
+                if (!mapped)
+                        return -1;
+                std::memcpy(mapped, values, nbytes);
+                return unmap(mapped, command_queue_i);
+        }
+
         cl_command_queue command_queue = clinfo->get_command_queue(command_queue_i);
 
 	cl_int err;
@@ -151,6 +244,14 @@ size_t DeviceMemory::read(size_t nbytes, void* buffer,
         if (!valid())
                 return -1;
 
+        if (m_host_mapped) {
+                void* mapped = map(nbytes, offset, false, command_queue_i);
+                if (!mapped)
+                        return -1;
+                std::memcpy(buffer, mapped, nbytes);
+                return unmap(mapped, command_queue_i);
+        }
+
         cl_command_queue command_queue = clinfo->get_command_queue(command_queue_i);
 	cl_int err;
 	err = clEnqueueReadBuffer(command_queue,
@@ -172,46 +273,101 @@ size_t DeviceMemory::read(size_t nbytes, void* buffer,
 	return 0;
 }
 
+int32_t
+DeviceMemory::read_image(size_t width, size_t height, void* pixels)
+{
+        CLInfo* clinfo = CLInfo::instance();
+        if (!clinfo->initialized() || !valid())
+                return -1;
+
+        cl_command_queue command_queue = 
+                clinfo->get_command_queue(clinfo->context_queue(m_context));
+
+        size_t origin[3] = {0, 0, 0};
+        size_t region[3] = {width, height, 1};
+        cl_int err;
+        err = clEnqueueReadImage(command_queue,
+                                 m_mem,
+                                 true, /* Blocking read */
+                                 origin,
+                                 region,
+                                 0, 0,
+                                 pixels,
+                                 0, NULL, NULL);
+        if (error_cl(err, "clEnqueueReadImage"))
+                return -1;
+        return 0;
+}
+
 int32_t
 DeviceMemory::resize(size_t new_size)
 {
         if (!new_size)
                 return -1;
 
+        /* The pooled block already has room for it */
+        if (valid() && m_pool_class >= 0 &&
+            new_size <= DeviceMemoryPool::class_size(m_pool_class)) {
+                m_size = new_size;
+                return 0;
+        }
+
+        bool transient = valid() && m_transient;
+        bool host_mapped = valid() && m_host_mapped;
         if (valid() && release())
                 return -1;
 
+        if (transient)
+                return initialize_transient(new_size);
+        if (host_mapped)
+                return initialize_host_mapped(new_size, m_mode);
+        return initialize(new_size, m_mode);
+}
+
+void*
+DeviceMemory::map(size_t nbytes, size_t offset, bool for_writing, 
+                  size_t command_queue_i)
+{
         CLInfo* clinfo = CLInfo::instance();
-        if (!clinfo->initialized())
-                return -1;
+        if (!clinfo->initialized() || !clinfo->has_command_queue(command_queue_i))
+                return NULL;
+
+        if (!valid())
+                return NULL;
+
+        cl_command_queue command_queue = clinfo->get_command_queue(command_queue_i);
 
         cl_int err;
-        cl_mem_flags flags;
-        switch (m_mode)
-        {
-        case(READ_ONLY_MEMORY):
-                flags = CL_MEM_READ_ONLY;
-                break;
-        case(WRITE_ONLY_MEMORY):
-                flags = CL_MEM_WRITE_ONLY;
-                break;
-        case(READ_WRITE_MEMORY):
-                flags = CL_MEM_READ_WRITE;
-                break;
-        default:
+        void* mapped = clEnqueueMapBuffer(command_queue,
+                                          m_mem,
+                                          true, /* Blocking map */
+                                          for_writing? CL_MAP_WRITE : CL_MAP_READ,
+                                          offset,
+                                          nbytes,
+                                          0, NULL, NULL,
+                                          &err);
+        if (error_cl(err, "clEnqueueMapBuffer"))
+                return NULL;
+        return mapped;
+}
+
+int32_t
+DeviceMemory::unmap(void* mapped_ptr, size_t command_queue_i)
+{
+        CLInfo* clinfo = CLInfo::instance();
+        if (!clinfo->initialized() || !clinfo->has_command_queue(command_queue_i))
                 return -1;
-        }
 
-	m_mem = clCreateBuffer(clinfo->context,
-                               flags,
-                               new_size,
-                               NULL,
-                               &err);
-	if (error_cl(err, "clCreateBuffer"))
-		return -1;
+        if (!valid())
+                return -1;
 
-        m_initialized = true;
-        m_size = new_size;
+        cl_command_queue command_queue = clinfo->get_command_queue(command_queue_i);
+
+        cl_int err;
+        err = clEnqueueUnmapMemObject(command_queue, m_mem, mapped_ptr, 
+                                      0, NULL, NULL);
+        if (error_cl(err, "clEnqueueUnmapMemObject"))
+                return -1;
         return 0;
 }
 
@@ -235,6 +391,18 @@ DeviceMemory::copy_to(DeviceMemory& dst, size_t bytes, size_t offset,
             bytes + dst_offset > dst.size())
                 return -1;
 
+        /* Read on a queue of this memory's context, written on the one
+           given, which belongs to the context of dst */
+        if (dst.context() != m_context) {
+                std::vector<uint8_t> staging(bytes);
+                if (read(bytes, &staging[0], offset, 
+                         clinfo->context_queue(m_context)))
+                        return -1;
+                if (dst.write(bytes, &staging[0], dst_offset, command_queue_i))
+                        return -1;
+                return 0;
+        }
+
         cl_int err;
         err = clEnqueueCopyBuffer(command_queue,
                                   m_mem,
@@ -267,11 +435,23 @@ DeviceMemory::release()
         if (!valid())
                 return -1;
 
-        cl_int err;
-        err = clReleaseMemObject(m_mem);	
-        if (error_cl(err, "clReleaseMemObject"))
-	    return -1;
+        DeviceMemoryPool* pool = DeviceMemoryPool::instance(m_context);
+        if (m_transient) {
+                if (pool->release_transient(m_mem))
+                        return -1;
+        } else if (m_pool_class >= 0) {
+                if (pool->release(m_mem, m_pool_class))
+                        return -1;
+        } else {
+                cl_int err;
+                err = clReleaseMemObject(m_mem);	
+                if (error_cl(err, "clReleaseMemObject"))
+                        return -1;
+        }
         m_initialized = false;
+        m_pool_class = -1;
+        m_transient = false;
+        m_host_mapped = false;
         return 0;
 }
 
@@ -280,6 +460,9 @@ DeviceMemory::size() const
 {
         if (!valid())
                 return 0;
+        /* Pooled blocks can be bigger than what was asked for */
+        if (m_transient || m_pool_class >= 0)
+                return m_size;
         return cl_mem_size(m_mem);
 }
 
@@ -0,0 +1,423 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <gpu/program-cache.hpp>
+#include <gpu/kernel-sources.hpp>
+
+/* Kernel files that aren't embedded are loaded relative to the working
+   directory, so are the headers they include (i.e. prefix-sum.h) */
+#define KERNEL_BUILD_OPTIONS "-I src/kernel"
+
+ProgramCache* ProgramCache::s_instance = NULL;
+
+static std::string
+build_options_str(const BuildOptions& options, bool from_file)
+{
+        std::string build_options = from_file ? KERNEL_BUILD_OPTIONS : "";
+        if (!options.empty()) {
+                if (!build_options.empty())
+                        build_options += " ";
+                build_options += options.str();
+        }
+        return build_options;
+}
+
+static const EmbeddedKernel*
+find_embedded_kernel(const std::string& file)
+{
+        for (size_t i = 0; i < embedded_kernel_count; ++i) {
+                if (file == embedded_kernels[i].path)
+                        return &embedded_kernels[i];
+        }
+        return NULL;
+}
+
+BuildOptions&
+BuildOptions::define(const std::string& name)
+{
+        m_defines[name] = "";
+        return *this;
+}
+
+BuildOptions&
+BuildOptions::define(const std::string& name, int32_t value)
+{
+        std::stringstream value_str;
+        value_str << value;
+        m_defines[name] = value_str.str();
+        return *this;
+}
+
+BuildOptions&
+BuildOptions::define(const std::string& name, const std::string& value)
+{
+        m_defines[name] = value;
+        return *this;
+}
+
+std::string
+BuildOptions::str() const
+{
+        std::string s;
+        std::map<std::string, std::string>::const_iterator it;
+        for (it = m_defines.begin(); it != m_defines.end(); ++it) {
+                if (!s.empty())
+                        s += " ";
+                s += "-D " + it->first;
+                if (!it->second.empty())
+                        s += "=" + it->second;
+        }
+        return s;
+}
+
+ProgramCache::ProgramCache()
+{
+        pthread_mutex_init(&m_lock, NULL);
+        pthread_cond_init(&m_build_done, NULL);
+        m_build_threads = 0;
+}
+
+std::string
+ProgramCache::key(const std::string& file, const BuildOptions& options,
+                  size_t context_i)
+{
+        std::string k = file + "|" + options.str();
+        if (context_i) {
+                std::stringstream context_str;
+                context_str << "|context " << context_i;
+                k += context_str.str();
+        }
+        return k;
+}
+
+int32_t
+ProgramCache::get(const std::string& file, const BuildOptions& options,
+                  cl_program* program, size_t context_i)
+{
+        std::string k = key(file, options, context_i);
+
+        pthread_mutex_lock(&m_lock);
+        for (;;) {
+                std::map<std::string, cl_program>::iterator it = m_programs.find(k);
+                if (it != m_programs.end()) {
+                        cl_int err = clRetainProgram(it->second);
+                        *program = it->second;
+                        pthread_mutex_unlock(&m_lock);
+                        return error_cl(err, "clRetainProgram") ? -1 : 0;
+                }
+
+                std::map<std::string, PendingBuild>::iterator pending_it = 
+                        m_pending.find(k);
+                if (pending_it == m_pending.end())
+                        break;
+                if (pending_it->second.done) {
+                        pthread_mutex_unlock(&m_lock);
+                        return -1;
+                }
+                pthread_cond_wait(&m_build_done, &m_lock);
+        }
+
+        /* Not requested before, build it here. Other threads asking for it
+           wait for this build */
+        PendingBuild& pending = m_pending[k];
+        pending.file = file;
+        pending.options = options;
+        pending.context = context_i;
+        pending.done = false;
+        pthread_mutex_unlock(&m_lock);
+
+        cl_program built;
+        int32_t ret = build(file, options, context_i, &built);
+
+        pthread_mutex_lock(&m_lock);
+        m_pending.erase(k);
+        if (!ret) {
+                m_programs[k] = built;
+                cl_int err = clRetainProgram(built);
+                if (error_cl(err, "clRetainProgram"))
+                        ret = -1;
+                *program = built;
+        }
+        pthread_cond_broadcast(&m_build_done);
+        pthread_mutex_unlock(&m_lock);
+        return ret;
+}
+
+/* Enough to keep a many core CPU compiler busy, with the ten or so
+   programs the renderer uses */
+#define MAX_BUILD_THREADS 8
+
+int32_t
+ProgramCache::prefetch(const std::string& file, const BuildOptions& options,
+                       size_t context_i)
+{
+        std::string k = key(file, options, context_i);
+
+        pthread_mutex_lock(&m_lock);
+        if (m_programs.count(k) || m_pending.count(k)) {
+                pthread_mutex_unlock(&m_lock);
+                return 0;
+        }
+
+        PendingBuild& pending = m_pending[k];
+        pending.file = file;
+        pending.options = options;
+        pending.context = context_i;
+        pending.done = false;
+        m_queue.push_back(k);
+
+        /* Threads leave when the queue is empty, start one more while 
+           there's a build for it */
+        if (m_build_threads < std::min(m_queue.size(), (size_t)MAX_BUILD_THREADS)) {
+                pthread_t thread;
+                if (!pthread_create(&thread, NULL, &build_thread, this)) {
+                        pthread_detach(thread);
+                        m_build_threads++;
+                }
+        }
+
+        /* Without a thread to run it, get will build it */
+        if (!m_build_threads) {
+                m_queue.pop_back();
+                m_pending.erase(k);
+        }
+        pthread_mutex_unlock(&m_lock);
+        return 0;
+}
+
+void*
+ProgramCache::build_thread(void* arg)
+{
+        ProgramCache* cache = (ProgramCache*)arg;
+
+        pthread_mutex_lock(&cache->m_lock);
+        while (!cache->m_queue.empty()) {
+                std::string k = cache->m_queue.front();
+                cache->m_queue.pop_front();
+                PendingBuild pending = cache->m_pending[k];
+                pthread_mutex_unlock(&cache->m_lock);
+
+                cl_program program;
+                int32_t ret = cache->build(pending.file, pending.options, 
+                                           pending.context, &program);
+
+                pthread_mutex_lock(&cache->m_lock);
+                if (ret) {
+                        std::cerr << "Error building program in the background" 
+                                  << std::endl;
+                        cache->m_pending[k].done = true;
+                } else {
+                        cache->m_programs[k] = program;
+                        cache->m_pending.erase(k);
+                }
+                pthread_cond_broadcast(&cache->m_build_done);
+        }
+        cache->m_build_threads--;
+        pthread_cond_broadcast(&cache->m_build_done);
+        pthread_mutex_unlock(&cache->m_lock);
+        return NULL;
+}
+
+size_t
+ProgramCache::size()
+{
+        pthread_mutex_lock(&m_lock);
+        size_t count = m_programs.size();
+        pthread_mutex_unlock(&m_lock);
+        return count;
+}
+
+int32_t
+ProgramCache::clear()
+{
+        pthread_mutex_lock(&m_lock);
+
+        /* Builds still running store their programs when they finish */
+        for (;;) {
+                bool building = !m_queue.empty();
+                std::map<std::string, PendingBuild>::iterator pending_it;
+                for (pending_it = m_pending.begin(); 
+                     pending_it != m_pending.end(); ++pending_it) {
+                        if (!pending_it->second.done)
+                                building = true;
+                }
+                if (!building)
+                        break;
+                pthread_cond_wait(&m_build_done, &m_lock);
+        }
+        m_pending.clear();
+
+        int32_t ret = 0;
+        std::map<std::string, cl_program>::iterator it;
+        for (it = m_programs.begin(); it != m_programs.end(); ++it) {
+                cl_int err = clReleaseProgram(it->second);
+                if (error_cl(err, "clReleaseProgram"))
+                        ret = -1;
+        }
+        m_programs.clear();
+        pthread_mutex_unlock(&m_lock);
+        return ret;
+}
+
+int32_t
+ProgramCache::build(const std::string& file, const BuildOptions& options,
+                    size_t context_i, cl_program* program, bool allow_il)
+{
+        ProgramSource source;
+        if (create(file, options, context_i, allow_il, program, &source))
+                return -1;
+
+        std::string build_options = 
+                build_options_str(options, source == SOURCE_FILE);
+	cl_int err = clBuildProgram(*program,
+                                    0,
+                                    NULL,
+                                    /*"-cl-fast-relaxed-math",*/ build_options.c_str(),
+                                    NULL,
+                                    NULL);
+        if (err != CL_SUCCESS && source == SOURCE_IL) {
+                std::cerr << "SPIR-V build of " << file
+                          << " failed, building from source" << std::endl;
+                clReleaseProgram(*program);
+                return build(file, options, context_i, program, false);
+        }
+	if (error_cl(err, "clBuildProgram")){
+                print_build_log(*program, file, options, context_i);
+                clReleaseProgram(*program);
+		return -1;
+	}
+
+        return 0;
+}
+
+bool
+ProgramCache::il_supported(size_t context_i)
+{
+        pthread_mutex_lock(&m_lock);
+        if (context_i >= m_il_supported.size())
+                m_il_supported.resize(context_i + 1, -1);
+        if (m_il_supported[context_i] < 0) {
+                m_il_supported[context_i] = 1;
+#ifdef CL_VERSION_2_1
+                /* Devices older than 2.1 don't know the query and fail it */
+                CLInfo* clinfo = CLInfo::instance();
+                for (size_t d = 0; d < clinfo->device_ids.size(); ++d) {
+                        if (clinfo->device_context(d) != context_i)
+                                continue;
+                        char il_version[256] = "";
+                        cl_int err = clGetDeviceInfo(clinfo->device_ids[d],
+                                                     CL_DEVICE_IL_VERSION,
+                                                     sizeof(il_version), 
+                                                     il_version, NULL);
+                        if (err != CL_SUCCESS || 
+                            !std::strstr(il_version, "SPIR-V"))
+                                m_il_supported[context_i] = 0;
+                }
+#else
+                m_il_supported[context_i] = 0;
+#endif
+        }
+        bool supported = m_il_supported[context_i];
+        pthread_mutex_unlock(&m_lock);
+        return supported;
+}
+
+int32_t
+ProgramCache::create(const std::string& file, const BuildOptions& options,
+                     size_t context_i, bool allow_il, cl_program* program, 
+                     ProgramSource* source)
+{
+	cl_int err;
+        
+        CLInfo* clinfo = CLInfo::instance();
+
+        if (!clinfo->initialized())
+                return -1;
+
+        const EmbeddedKernel* embedded = find_embedded_kernel(file);
+
+#ifdef CL_VERSION_2_1
+        /* The SPIR-V was compiled without defines, variants need the source */
+        if (embedded && embedded->il && options.empty() && allow_il &&
+            il_supported(context_i)) {
+                *program = clCreateProgramWithIL(clinfo->get_context(context_i),
+                                                 embedded->il,
+                                                 embedded->il_size,
+                                                 &err);
+                if (err == CL_SUCCESS) {
+                        *source = SOURCE_IL;
+                        return 0;
+                }
+                std::cerr << "SPIR-V of " << file << " rejected (" << err
+                          << "), building from source" << std::endl;
+        }
+#endif
+
+        if (embedded) {
+                const char* embedded_source = embedded->source;
+                *program = clCreateProgramWithSource(clinfo->get_context(context_i),
+                                                     1,
+                                                     &embedded_source,
+                                                     NULL,
+                                                     &err);
+                if (error_cl(err, "clCreateProgramWithSource"))
+                        return -1;
+                *source = SOURCE_EMBEDDED;
+                return 0;
+        }
+
+	//Create a program from the kernel source code
+	std::ifstream kernel_source_file(file.c_str());
+	if (!kernel_source_file.good()){
+		std::cerr << "Error: could not read kernel file." << std::endl;
+		return -1;
+	}
+
+	std::streampos file_size;
+	kernel_source_file.seekg (0, std::ios::beg);
+	file_size = kernel_source_file.tellg();
+	kernel_source_file.seekg (0, std::ios::end);
+	file_size = kernel_source_file.tellg() - file_size;
+
+	char *kernel_source = new char[(int)file_size+1];
+	std::memset(kernel_source,0,file_size);
+
+	kernel_source_file.seekg (0, std::ios::beg);
+	kernel_source_file.read(kernel_source,file_size);
+	kernel_source_file.close();
+	kernel_source[file_size] = 0;
+	
+	*program = clCreateProgramWithSource(clinfo->get_context(context_i),
+                                             1,
+                                             (const char**)&kernel_source,
+                                             NULL,
+                                             &err);
+
+	delete[] kernel_source;
+	if (error_cl(err, "clCreateProgramWithSource"))
+		return -1;
+
+        *source = SOURCE_FILE;
+        return 0;
+}
+
+void
+ProgramCache::print_build_log(cl_program program, const std::string& file,
+                              const BuildOptions& options, size_t context_i)
+{
+        char build_log[8196];
+        size_t bytes_returned;
+        cl_int err = clGetProgramBuildInfo (program,
+                                            CLInfo::instance()->context_device(context_i),
+                                            CL_PROGRAM_BUILD_LOG,
+                                            sizeof(build_log),
+                                            build_log,
+                                            &bytes_returned);
+
+        if (!error_cl(err, "clGetProgramBuildInfo")){
+                std::cerr << "Program build error log (" << file << " "
+                          << options.str() << "):" << std::endl
+                          << build_log << std::endl;
+        }
+}
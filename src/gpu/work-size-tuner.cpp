@@ -0,0 +1,304 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <misc/ini.hpp>
+#include <gpu/work-size-tuner.hpp>
+
+/* Launches timed per candidate size, the median one counts */
+#define TUNE_SAMPLES 3
+
+WorkSizeTuner* WorkSizeTuner::s_instance = NULL;
+pthread_mutex_t WorkSizeTuner::s_instance_lock = PTHREAD_MUTEX_INITIALIZER;
+
+WorkSizeTuner*
+WorkSizeTuner::instance()
+{
+        pthread_mutex_lock(&s_instance_lock);
+        if (s_instance == NULL) {
+                s_instance = new WorkSizeTuner;
+        }
+        pthread_mutex_unlock(&s_instance_lock);
+        return s_instance;
+}
+
+WorkSizeTuner::WorkSizeTuner()
+{
+        m_tuning = false;
+        m_dir = ".";
+        pthread_mutex_init(&m_lock, NULL);
+}
+
+void
+WorkSizeTuner::set_tuning(bool b)
+{
+        pthread_mutex_lock(&m_lock);
+        m_tuning = b;
+        pthread_mutex_unlock(&m_lock);
+}
+
+bool
+WorkSizeTuner::tuning()
+{
+        pthread_mutex_lock(&m_lock);
+        bool b = m_tuning;
+        pthread_mutex_unlock(&m_lock);
+        return b;
+}
+
+uint32_t
+WorkSizeTuner::bucket(size_t global_size)
+{
+        uint32_t b = 0;
+        while (global_size > 1) {
+                global_size >>= 1;
+                b++;
+        }
+        return b;
+}
+
+std::string
+WorkSizeTuner::profile_name(cl_device_id device)
+{
+        char device_name[256] = "unknown";
+        char driver_version[256] = "unknown";
+        if (device) {
+                clGetDeviceInfo(device, CL_DEVICE_NAME,
+                                sizeof(device_name), device_name, NULL);
+                clGetDeviceInfo(device, CL_DRIVER_VERSION,
+                                sizeof(driver_version), driver_version, NULL);
+        }
+
+        std::string name = std::string(device_name) + "-" + driver_version;
+        for (size_t i = 0; i < name.size(); ++i) {
+                char c = name[i];
+                bool keep = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                        (c >= '0' && c <= '9') || c == '.' || c == '-';
+                if (!keep)
+                        name[i] = '_';
+        }
+        return "work-sizes-" + name + ".ini";
+}
+
+WorkSizeTuner::Profile&
+WorkSizeTuner::profile(cl_device_id device)
+{
+        std::map<cl_device_id, std::string>::iterator d = m_device_paths.find(device);
+        if (d == m_device_paths.end())
+                d = m_device_paths.insert(std::make_pair(device, m_dir + "/" + 
+                                                         profile_name(device))).first;
+
+        Profile& p = m_profiles[d->second];
+        if (!p.loaded) {
+                p.path = d->second;
+                p.loaded = true;
+                load(p);
+        }
+        return p;
+}
+
+int32_t
+WorkSizeTuner::load_profile(const std::string& dir)
+{
+        CLInfo* clinfo = CLInfo::instance();
+
+        pthread_mutex_lock(&m_lock);
+        m_dir = dir;
+        m_device_paths.clear();
+        m_profiles.clear();
+
+        int32_t ret = 0;
+        if (clinfo->initialized()) {
+                for (size_t i = 0; i < clinfo->device_ids.size(); ++i) {
+                        cl_device_id device = clinfo->device_ids[i];
+                        std::string path = m_dir + "/" + profile_name(device);
+                        m_device_paths[device] = path;
+                        Profile& p = m_profiles[path];
+                        if (p.loaded)
+                                continue;
+                        p.path = path;
+                        p.loaded = true;
+                        if (load(p))
+                                ret = -1;
+                }
+        }
+        pthread_mutex_unlock(&m_lock);
+        return ret;
+}
+
+int32_t
+WorkSizeTuner::load(Profile& p)
+{
+        p.sizes.clear();
+
+        INIReader ini;
+        int32_t ret = ini.load_file(p.path);
+        if (ret > 0)
+                return 0;
+        if (ret < 0) {
+                std::cerr << "Error reading work size profile " << p.path
+                          << " at line " << -ret << std::endl;
+                return -1;
+        }
+
+        const std::map<section_name_t, section_t>& sections = ini.get_sections();
+        std::map<section_name_t, section_t>::const_iterator s;
+        for (s = sections.begin(); s != sections.end(); ++s) {
+                section_t::const_iterator e;
+                for (e = s->second.begin(); e != s->second.end(); ++e) {
+                        if (e->first.size() < 2 || e->first[0] != 'b')
+                                continue;
+                        uint32_t b = std::atoi(e->first.c_str() + 1);
+                        size_t size = std::atoi(e->second.c_str());
+                        if (size)
+                                p.sizes[s->first][b] = size;
+                }
+        }
+        std::cout << "Loaded work size profile " << p.path << std::endl;
+        return 0;
+}
+
+int32_t
+WorkSizeTuner::save_profile(cl_device_id device)
+{
+        pthread_mutex_lock(&m_lock);
+        int32_t ret = save(profile(device));
+        pthread_mutex_unlock(&m_lock);
+        return ret;
+}
+
+int32_t
+WorkSizeTuner::save(Profile& p)
+{
+        std::ofstream out(p.path.c_str());
+        if (!out.good()) {
+                std::cerr << "Unable to write work size profile " << p.path << "\n";
+                return -1;
+        }
+
+        out << "; Local work sizes per kernel, the property is the log2 of the\n";
+        out << "; global size (b10 = 1024 to 2047 work items)\n";
+        std::map<std::string, std::map<uint32_t, size_t> >::iterator k;
+        for (k = p.sizes.begin(); k != p.sizes.end(); ++k) {
+                out << "\n[" << k->first << "]\n";
+                std::map<uint32_t, size_t>::iterator b;
+                for (b = k->second.begin(); b != k->second.end(); ++b)
+                        out << "b" << b->first << " = " << b->second << "\n";
+        }
+
+        out.close();
+        return 0;
+}
+
+size_t
+WorkSizeTuner::lookup(Profile& p, const std::string& kernel, size_t global_size)
+{
+        std::map<std::string, std::map<uint32_t, size_t> >::iterator k =
+                p.sizes.find(kernel);
+        if (k == p.sizes.end())
+                return 0;
+        std::map<uint32_t, size_t>::iterator b = k->second.find(bucket(global_size));
+        if (b == k->second.end())
+                return 0;
+        return b->second;
+}
+
+size_t
+WorkSizeTuner::tuned_size(cl_device_id device,
+                          const std::string& kernel, size_t global_size)
+{
+        pthread_mutex_lock(&m_lock);
+        size_t size = lookup(profile(device), kernel, global_size);
+        pthread_mutex_unlock(&m_lock);
+        return size;
+}
+
+size_t
+WorkSizeTuner::trial_size(cl_device_id device,
+                          const std::string& kernel, size_t global_size,
+                          size_t max_size, size_t multiple)
+{
+        std::stringstream key;
+        key << kernel << "|" << bucket(global_size);
+
+        pthread_mutex_lock(&m_lock);
+        Profile& p = profile(device);
+        if (!m_tuning || !max_size || lookup(p, kernel, global_size)) {
+                pthread_mutex_unlock(&m_lock);
+                return 0;
+        }
+
+        std::map<std::string, Trial>::iterator it = p.trials.find(key.str());
+        if (it == p.trials.end()) {
+                Trial trial;
+                multiple = std::max(multiple, (size_t)1);
+                for (size_t c = multiple; c <= max_size; c *= 2)
+                        trial.candidates.push_back(c);
+                if (trial.candidates.empty() || trial.candidates.back() != max_size)
+                        trial.candidates.push_back(max_size);
+                trial.times.resize(trial.candidates.size());
+                trial.next = 0;
+                it = p.trials.insert(std::make_pair(key.str(), trial)).first;
+        }
+
+        /* Round robin, so drifts in the frame content spread evenly */
+        Trial& trial = it->second;
+        size_t size = trial.candidates[trial.next % trial.candidates.size()];
+        pthread_mutex_unlock(&m_lock);
+        return size;
+}
+
+int32_t
+WorkSizeTuner::record_trial(cl_device_id device,
+                            const std::string& kernel, size_t global_size,
+                            size_t local_size, double msec)
+{
+        std::stringstream key;
+        key << kernel << "|" << bucket(global_size);
+
+        pthread_mutex_lock(&m_lock);
+        Profile& p = profile(device);
+        std::map<std::string, Trial>::iterator it = p.trials.find(key.str());
+        if (it == p.trials.end()) {
+                pthread_mutex_unlock(&m_lock);
+                return -1;
+        }
+        Trial& trial = it->second;
+
+        size_t c = std::find(trial.candidates.begin(), trial.candidates.end(),
+                             local_size) - trial.candidates.begin();
+        if (c == trial.candidates.size()) {
+                pthread_mutex_unlock(&m_lock);
+                return -1;
+        }
+        trial.times[c].push_back(msec);
+        trial.next++;
+
+        if (trial.next < trial.candidates.size() * TUNE_SAMPLES) {
+                pthread_mutex_unlock(&m_lock);
+                return 0;
+        }
+
+        size_t best = 0;
+        double best_time = 0.;
+        for (size_t i = 0; i < trial.candidates.size(); ++i) {
+                std::vector<double>& times = trial.times[i];
+                if (times.empty())
+                        continue;
+                std::sort(times.begin(), times.end());
+                double median = times[times.size()/2];
+                if (best == 0 || median < best_time) {
+                        best = trial.candidates[i];
+                        best_time = median;
+                }
+        }
+
+        p.sizes[kernel][bucket(global_size)] = best;
+        p.trials.erase(it);
+        std::cout << "Tuned " << kernel << " for 2^" << bucket(global_size)
+                  << " work items: local size " << best
+                  << " (" << best_time << " ms) in " << p.path << std::endl;
+        int32_t ret = save(p);
+        pthread_mutex_unlock(&m_lock);
+        return ret;
+}
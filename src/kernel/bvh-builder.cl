@@ -1,3 +1,5 @@
+#include "prefix-sum.h"
+
 #define M_UINT_COUNT 2 
 
 typedef struct 
@@ -390,97 +392,6 @@ max_local_bbox(global BBox*   in_bboxes,
         }
 }
 
-void prefix_sum_double(local   int* bit,
-                       local   int* sum)
-{
-        size_t lid = get_local_id(0);
-        size_t lsz = get_local_size(0);
-
-        int offset = 1;
-
-        sum[lid] = bit[lid];
-        sum[lid+lsz] = bit[lid+lsz];
-
-        for (int d = lsz; d > 0; d >>= 1) {
-                barrier(CLK_LOCAL_MEM_FENCE);
-
-                if (lid < d) {
-                        int ai = offset * (2*lid+1)-1;
-                        int bi = ai + offset;
-                        sum[bi] += sum[ai];
-                }
-                offset <<= 1;
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);
-
-        if (lid == 0) {
-                sum[lsz*2 - 1] = 0;
-        }
-        
-        for (int d = 1; d < lsz<<1; d <<= 1) // traverse down tree & build scan
-        {
-                offset >>= 1;
-                barrier(CLK_LOCAL_MEM_FENCE);
-                if (lid < d) {
-                        int ai = offset * (2*lid+1)-1;
-                        int bi = ai + offset;
-                        int t = sum[ai];
-                        sum[ai] = sum[bi];
-                        sum[bi] += t;
-                }
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (lid == 0) {
-                sum[lsz*2] = bit[lsz*2-1] + sum[lsz*2-1];
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);
-}
-
-void prefix_sum(local   int* bit,
-                local   int* sum)
-{
-        size_t lid = get_local_id(0);
-        size_t lsz = get_local_size(0) / 2;
-
-        int offset = 1;
-
-        sum[lid] = bit[lid];
-
-        for (int d = lsz; d > 0; d >>= 1) {
-                barrier(CLK_LOCAL_MEM_FENCE);
-
-                if (lid < d) {
-                        int ai = offset * (2*lid+1)-1;
-                        int bi = ai + offset;
-                        sum[bi] += sum[ai];
-                }
-                offset <<= 1;
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);
-
-        if (lid == 0) {
-                sum[lsz*2 - 1] = 0;
-        }
-        
-        for (int d = 1; d < lsz<<1; d <<= 1) // traverse down tree & build scan
-        {
-                offset >>= 1;
-                barrier(CLK_LOCAL_MEM_FENCE);
-                if (lid < d) {
-                        int ai = offset * (2*lid+1)-1;
-                        int bi = ai + offset;
-                        int t = sum[ai];
-                        sum[ai] = sum[bi];
-                        sum[bi] += t;
-                }
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (lid == 0) {
-                sum[lsz*2] = bit[lsz*2-1] + sum[lsz*2-1];
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);
-}
-
 int find_middle(global  BVHNode* node, 
                 global morton_code_t* codes,
                 int max_level,
@@ -27,9 +27,16 @@ init(global ColorInt* image)
 	image[index].b = 0.f;
 }
 
+/* Resolves the frame into tex. The frame is added to the HDR accumulation
+   buffer acc (each work item owns its pixel, so no atomics are needed) and
+   the mean of the frame_count accumulated frames is written scaled by 
+   exposure. frame_count == 1 restarts the accumulation. */
 kernel void 
 copy(global ColorInt* image,
-     write_only image2d_t tex)
+     write_only image2d_t tex,
+     global float4* acc,
+     int   frame_count,
+     float exposure)
 {
 	int width = get_image_width(tex);
 	int heihgt = get_image_height(tex);
@@ -48,8 +55,55 @@ copy(global ColorInt* image,
 	float g = ((float)image[index].g) * cint_max_inv;
 	float b = ((float)image[index].b) * cint_max_inv;
 
-	float4 texval = (float4)(r,g,b,1.f);
+	float4 hdr = (float4)(r,g,b,0.f);
+        if (frame_count > 1)
+                hdr += acc[index];
+        acc[index] = hdr;
+
+	float4 texval = clamp(hdr * (exposure / (float)frame_count), 0.f, 1.f);
+        texval.w = 1.f;
 
 	write_imagef(tex, xy, texval);
 }
 
+
+/* False color view of the traversal cost of each pixel (see Tracer), from
+   blue for no cost to red for 1/inv_scale or more. heat is cleared for the
+   next frame. */
+kernel void
+heatmap(global ColorInt* image,
+        global unsigned int* heat,
+        float inv_scale)
+{
+	int index = get_global_id(0);
+
+        float x = clamp(heat[index] * inv_scale, 0.f, 1.f);
+        heat[index] = 0;
+
+        float3 rgb = (float3)(4.f * x - 2.f,
+                              2.f - fabs(4.f * x - 2.f),
+                              2.f - 4.f * x);
+        rgb = clamp(rgb, 0.f, 1.f);
+
+	image[index].r = rgb.x * CINT_MAX;
+	image[index].g = rgb.y * CINT_MAX;
+	image[index].b = rgb.z * CINT_MAX;
+}
+
+/* Adds the image and traversal heat of another framebuffer (one a second
+   device rendered its tiles into) to this one, clearing its heat */
+kernel void
+merge(global ColorInt* image,
+      global unsigned int* heat,
+      global ColorInt* src_image,
+      global unsigned int* src_heat)
+{
+	int index = get_global_id(0);
+
+	image[index].r += src_image[index].r;
+	image[index].g += src_image[index].g;
+	image[index].b += src_image[index].b;
+
+        heat[index] += src_heat[index];
+        src_heat[index] = 0;
+}
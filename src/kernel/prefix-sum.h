@@ -0,0 +1,52 @@
+#ifndef RT_PREFIX_SUM_H
+#define RT_PREFIX_SUM_H
+
+/* Work group exclusive prefix sum of one element per work item.
+   sum needs local_size+1 elements and gets the group total in
+   sum[local_size]. local_size must be a power of two. */
+void prefix_sum(local   int* bit,
+                local   int* sum)
+{
+        size_t lid = get_local_id(0);
+        size_t lsz = get_local_size(0) / 2;
+
+        int offset = 1;
+
+        sum[lid] = bit[lid];
+
+        for (int d = lsz; d > 0; d >>= 1) {
+                barrier(CLK_LOCAL_MEM_FENCE);
+
+                if (lid < d) {
+                        int ai = offset * (2*lid+1)-1;
+                        int bi = ai + offset;
+                        sum[bi] += sum[ai];
+                }
+                offset <<= 1;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        if (lid == 0) {
+                sum[lsz*2 - 1] = 0;
+        }
+
+        for (int d = 1; d < lsz<<1; d <<= 1) // traverse down tree & build scan
+        {
+                offset >>= 1;
+                barrier(CLK_LOCAL_MEM_FENCE);
+                if (lid < d) {
+                        int ai = offset * (2*lid+1)-1;
+                        int bi = ai + offset;
+                        int t = sum[ai];
+                        sum[ai] = sum[bi];
+                        sum[bi] += t;
+                }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid == 0) {
+                sum[lsz*2] = bit[lsz*2-1] + sum[lsz*2-1];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+#endif /* RT_PREFIX_SUM_H */
@@ -24,6 +24,14 @@ typedef struct
 	float contribution;
 } PixelSample;
 
+/* Set by the host when it builds a variant for the current quad size and
+   sample count, so the block indexing works on constants. */
+#ifdef PRIMARY_QUAD_SIZE
+#define QUAD_SIZE(arg) PRIMARY_QUAD_SIZE
+#else
+#define QUAD_SIZE(arg) (arg)
+#endif
+
 kernel void
 generate_primary_rays(global Sample* samples,
 		      read_only float4 pos,
@@ -34,7 +42,8 @@ generate_primary_rays(global Sample* samples,
 		      read_only int height,
                       read_only int quad_size,
 		      read_only int spp,
-		      global    PixelSample* pixel_samples)
+		      global    PixelSample* pixel_samples,
+		      read_only float2 jitter)
 
 {
 	int gid = get_global_id(0);
@@ -42,11 +51,16 @@ generate_primary_rays(global Sample* samples,
   	int index = (gid-offset);
 
         int pixels = width * height;
+#if PRIMARY_SPP == 1
+        int i = gid;
+	PixelSample psample = pixel_samples[0];
+#else
         int i = gid%pixels;
 	PixelSample psample = pixel_samples[gid/pixels];
+#endif
 
-        int block_side = quad_size;
-        int block_area = quad_size * quad_size;
+        int block_side = QUAD_SIZE(quad_size);
+        int block_area = block_side * block_side;
 
 	int x_blocks = width / block_side;
 	int y_blocks = height / block_side;
@@ -84,8 +98,8 @@ generate_primary_rays(global Sample* samples,
 	}
 
   	global Ray* ray = &(samples[index].ray);
-	float xPosNDC = (0.5f + (float)x + psample.ox) / (float)width;
-	float yPosNDC = (0.5f + (float)y + psample.oy) / (float)height;
+	float xPosNDC = (0.5f + (float)x + psample.ox + jitter.x) / (float)width;
+	float yPosNDC = (0.5f + (float)y + psample.oy + jitter.y) / (float)height;
 	
 	ray->ori = pos.xyz;
 	ray->dir = normalize((dir + 
@@ -113,7 +127,8 @@ generate_primary_rays_zcurve(global Sample* samples,
                              read_only int height,
                              read_only int quad_size,
                              read_only int spp,
-                             global    PixelSample* pixel_samples)
+                             global    PixelSample* pixel_samples,
+                             read_only float2 jitter)
 {
         ///////////// Value
 	int gid = get_global_id(0);        // Id of this item
@@ -159,8 +174,8 @@ generate_primary_rays_zcurve(global Sample* samples,
 
   	global Ray* ray = &(samples[index].ray);
 
-	float xPosNDC = (0.5f + (float)x + psample.ox) / (float)width;
-	float yPosNDC = (0.5f + (float)y + psample.oy) / (float)height;
+	float xPosNDC = (0.5f + (float)x + psample.ox + jitter.x) / (float)width;
+	float yPosNDC = (0.5f + (float)y + psample.oy + jitter.y) / (float)height;
 	
 	ray->ori = pos.xyz;
 	ray->dir = normalize((dir + 
@@ -1,5 +1,20 @@
 #define CINT_MAX 1e6f
 
+/* The host may build a variant of this file for the active configuration,
+   defining these so the branches on the light type and on the cubemap
+   fold away at compile time. Otherwise they are read from the arguments. */
+#ifdef SHADE_USE_CUBEMAP
+#define USE_CUBEMAP(arg) SHADE_USE_CUBEMAP
+#else
+#define USE_CUBEMAP(arg) (arg)
+#endif
+
+#ifdef SHADE_LIGHT_TYPE
+#define LIGHT_TYPE(l) SHADE_LIGHT_TYPE
+#else
+#define LIGHT_TYPE(l) ((l)->light.type)
+#endif
+
 typedef float3 Color;
 /* typedef int    ColorInt; */
 typedef struct {
@@ -114,7 +129,7 @@ in_range(float f1,float f2){
 }
 
 void 
-shade_sample(write_only global ColorInt* image,
+shade_sample(global ColorInt* image,
              /* global SampleTraceInfo* trace_info, */
              /* global Sample*   samples, */
              const  SampleTraceInfo info,
@@ -127,26 +142,16 @@ shade_sample(write_only global ColorInt* image,
              read_only image2d_t y_neg,
              read_only image2d_t z_pos,
              read_only image2d_t z_neg,
-             read_only image2d_t texture_0, read_only image2d_t texture_1,
-             read_only image2d_t texture_2, read_only image2d_t texture_3,
-             read_only image2d_t texture_4, read_only image2d_t texture_5,
-             read_only image2d_t texture_6, read_only image2d_t texture_7,
-             read_only image2d_t texture_8, read_only image2d_t texture_9,
-             read_only image2d_t texture_10, read_only image2d_t texture_11,
-             read_only image2d_t texture_12, read_only image2d_t texture_13,
-             read_only image2d_t texture_14, read_only image2d_t texture_15,
-             read_only image2d_t texture_16, read_only image2d_t texture_17,
-             read_only image2d_t texture_18, read_only image2d_t texture_19,
-             read_only image2d_t texture_20, read_only image2d_t texture_21,
-             read_only image2d_t texture_22, read_only image2d_t texture_23,
-             read_only image2d_t texture_24, read_only image2d_t texture_25,
+             read_only image2d_t atlas,
+             global float4* tex_rects,
              const int use_cubemap,
-             constant Lights* lights)
+             constant Lights* lights,
+             const int use_atomics)
 {
 
 	const sampler_t sampler = 
 		CLK_NORMALIZED_COORDS_TRUE |
-		CLK_ADDRESS_REPEAT |
+		CLK_ADDRESS_CLAMP_TO_EDGE |
 		CLK_FILTER_LINEAR;
 
 	const sampler_t cb_sampler = 
@@ -161,11 +166,11 @@ shade_sample(write_only global ColorInt* image,
 	float3 L;
         float  LD;
         float3 dir_rgb;  
-        if (lights->light.type == DIR_L) {
+        if (LIGHT_TYPE(lights) == DIR_L) {
                 L = lights->light.directional.dir;
                 dir_rgb = lights->light.directional.color;
                 LD = 1.f;
-        }  else if (lights->light.type == SPOT_L) {
+        }  else if (LIGHT_TYPE(lights) == SPOT_L) {
                 L = normalize(info.hit_point - lights->light.spot.pos);
                 dir_rgb = lights->light.spot.color;
                 LD = dot(L,lights->light.spot.dir) - lights->light.spot.angle;
@@ -184,60 +189,20 @@ shade_sample(write_only global ColorInt* image,
 		Material mat = material_list[material_index];
 
                 float3 diffuse_rgb;
-                if (mat.texture < 0)
+                if (mat.texture < 0) {
                         diffuse_rgb = mat.diffuse;
-                else if (mat.texture == 0)
-                        diffuse_rgb = read_imagef(texture_0, sampler, info.uv).xyz;
-                else if (mat.texture == 1)
-                        diffuse_rgb = read_imagef(texture_1, sampler, info.uv).xyz;
-                else if (mat.texture == 2)
-                        diffuse_rgb = read_imagef(texture_2, sampler, info.uv).xyz;
-                else if (mat.texture == 3)
-                        diffuse_rgb = read_imagef(texture_3, sampler, info.uv).xyz;
-                else if (mat.texture == 4)
-                        diffuse_rgb = read_imagef(texture_4, sampler, info.uv).xyz;
-                else if (mat.texture == 5)
-                        diffuse_rgb = read_imagef(texture_5, sampler, info.uv).xyz;
-                else if (mat.texture == 6)
-                        diffuse_rgb = read_imagef(texture_6, sampler, info.uv).xyz;
-                else if (mat.texture == 7)
-                        diffuse_rgb = read_imagef(texture_7, sampler, info.uv).xyz;
-                else if (mat.texture == 8)
-                        diffuse_rgb = read_imagef(texture_8, sampler, info.uv).xyz;
-                else if (mat.texture == 9)
-                        diffuse_rgb = read_imagef(texture_9, sampler, info.uv).xyz;
-                else if (mat.texture == 10)
-                        diffuse_rgb = read_imagef(texture_10, sampler, info.uv).xyz;
-                else if (mat.texture == 11)
-                        diffuse_rgb = read_imagef(texture_11, sampler, info.uv).xyz;
-                else if (mat.texture == 12)
-                        diffuse_rgb = read_imagef(texture_12, sampler, info.uv).xyz;
-                else if (mat.texture == 13)
-                        diffuse_rgb = read_imagef(texture_13, sampler, info.uv).xyz;
-                else if (mat.texture == 14)
-                        diffuse_rgb = read_imagef(texture_14, sampler, info.uv).xyz;
-                else if (mat.texture == 15)
-                        diffuse_rgb = read_imagef(texture_15, sampler, info.uv).xyz;
-                else if (mat.texture == 16)
-                        diffuse_rgb = read_imagef(texture_16, sampler, info.uv).xyz;
-                else if (mat.texture == 17)
-                        diffuse_rgb = read_imagef(texture_17, sampler, info.uv).xyz;
-                else if (mat.texture == 18)
-                        diffuse_rgb = read_imagef(texture_18, sampler, info.uv).xyz;
-                else if (mat.texture == 19)
-                        diffuse_rgb = read_imagef(texture_19, sampler, info.uv).xyz;
-                else if (mat.texture == 20)
-                        diffuse_rgb = read_imagef(texture_20, sampler, info.uv).xyz;
-                else if (mat.texture == 21)
-                        diffuse_rgb = read_imagef(texture_21, sampler, info.uv).xyz;
-                else if (mat.texture == 22)
-                        diffuse_rgb = read_imagef(texture_22, sampler, info.uv).xyz;
-                else if (mat.texture == 23)
-                        diffuse_rgb = read_imagef(texture_23, sampler, info.uv).xyz;
-                else if (mat.texture == 24)
-                        diffuse_rgb = read_imagef(texture_24, sampler, info.uv).xyz;
-                else if (mat.texture == 25)
-                        diffuse_rgb = read_imagef(texture_25, sampler, info.uv).xyz;
+                } else {
+                        /* Wrap uv inside the texture rectangle of the atlas,
+                           keeping half a texel away from its borders so 
+                           the linear filter doesn't read the neighbours */
+                        float4 rect = tex_rects[mat.texture];
+                        float2 half_texel = 
+                                (float2)(0.5f / get_image_width(atlas),
+                                         0.5f / get_image_height(atlas));
+                        float2 uv = info.uv - floor(info.uv);
+                        uv = clamp(uv * rect.zw, half_texel, rect.zw - half_texel);
+                        diffuse_rgb = read_imagef(atlas, sampler, rect.xy + uv).xyz;
+                }
 
 		float3 ambient_rgb = lights->ambient * diffuse_rgb;
 		valrgb = ambient_rgb;
@@ -272,7 +237,7 @@ shade_sample(write_only global ColorInt* image,
 		/* 	valrgb = (float3)(0.f,1.f,0.f); */
 
 	/* Miss branch: compute color from cubemap */
-	} else if (use_cubemap) {
+	} else if (USE_CUBEMAP(use_cubemap)) {
 		
 		float3 x_proy = sample.ray.dir *  sample.ray.invDir.x;
 		float3 y_proy = sample.ray.dir *  sample.ray.invDir.y;
@@ -315,20 +280,20 @@ shade_sample(write_only global ColorInt* image,
 	float3 f_rgb = clamp(sample.contribution * valrgb,minrgb,maxrgb);
 	ColorInt rgb = to_color_int(f_rgb);
 
-        /* if (use_atomics) { */
-        /*         global unsigned int* r_ptr = &(image[sample.pixel].r); */
-        /*         global unsigned int* g_ptr = &(image[sample.pixel].g); */
-        /*         global unsigned int* b_ptr = &(image[sample.pixel].b); */
+        if (use_atomics) {
+                global unsigned int* r_ptr = &(image[sample.pixel].r);
+                global unsigned int* g_ptr = &(image[sample.pixel].g);
+                global unsigned int* b_ptr = &(image[sample.pixel].b);
                 
-        /*         atomic_add(r_ptr, rgb.r); */
-        /*         atomic_add(g_ptr, rgb.g); */
-        /*         atomic_add(b_ptr, rgb.b); */
+                atomic_add(r_ptr, rgb.r);
+                atomic_add(g_ptr, rgb.g);
+                atomic_add(b_ptr, rgb.b);
 
-        /* } else { */
+        } else {
                 image[sample.pixel].r += rgb.r;
                 image[sample.pixel].g += rgb.g;
                 image[sample.pixel].b += rgb.b;
-        /* } */
+        }
 
 }
 
@@ -341,19 +306,8 @@ shade_primary(write_only global ColorInt* image,
               read_only image2d_t x_pos, read_only image2d_t x_neg,
               read_only image2d_t y_pos, read_only image2d_t y_neg,
               read_only image2d_t z_pos, read_only image2d_t z_neg,
-              read_only image2d_t texture_0, read_only image2d_t texture_1,
-              read_only image2d_t texture_2, read_only image2d_t texture_3,
-              read_only image2d_t texture_4, read_only image2d_t texture_5,
-              read_only image2d_t texture_6, read_only image2d_t texture_7,
-              read_only image2d_t texture_8, read_only image2d_t texture_9,
-              read_only image2d_t texture_10, read_only image2d_t texture_11,
-              read_only image2d_t texture_12, read_only image2d_t texture_13,
-              read_only image2d_t texture_14, read_only image2d_t texture_15,
-              read_only image2d_t texture_16, read_only image2d_t texture_17,
-              read_only image2d_t texture_18, read_only image2d_t texture_19,
-              read_only image2d_t texture_20, read_only image2d_t texture_21,
-              read_only image2d_t texture_22, read_only image2d_t texture_23,
-              read_only image2d_t texture_24, read_only image2d_t texture_25,
+              read_only image2d_t atlas,
+              global float4* tex_rects,
               unsigned int sample_count, 
               int use_cubemap, 
               constant Lights* lights)
@@ -369,21 +323,11 @@ shade_primary(write_only global ColorInt* image,
                      x_pos, x_neg,
                      y_pos, y_neg,
                      z_pos, z_neg,
-                     texture_0, texture_1,
-                     texture_2, texture_3,
-                     texture_4, texture_5,
-                     texture_6, texture_7,
-                     texture_8, texture_9,
-                     texture_10, texture_11,
-                     texture_12, texture_13,
-                     texture_14, texture_15,
-                     texture_16, texture_17,
-                     texture_18, texture_19,
-                     texture_20, texture_21,
-                     texture_22, texture_23,
-                     texture_24, texture_25,
+                     atlas,
+                     tex_rects,
                      use_cubemap,
-                     lights);
+                     lights,
+                     0);
 }
 
 kernel void 
@@ -395,19 +339,8 @@ shade_secondary(write_only global ColorInt* image,
                 read_only image2d_t x_pos, read_only image2d_t x_neg,
                 read_only image2d_t y_pos, read_only image2d_t y_neg,
                 read_only image2d_t z_pos, read_only image2d_t z_neg,
-                read_only image2d_t texture_0, read_only image2d_t texture_1,
-                read_only image2d_t texture_2, read_only image2d_t texture_3,
-                read_only image2d_t texture_4, read_only image2d_t texture_5,
-                read_only image2d_t texture_6, read_only image2d_t texture_7,
-                read_only image2d_t texture_8, read_only image2d_t texture_9,
-                read_only image2d_t texture_10, read_only image2d_t texture_11,
-                read_only image2d_t texture_12, read_only image2d_t texture_13,
-                read_only image2d_t texture_14, read_only image2d_t texture_15,
-                read_only image2d_t texture_16, read_only image2d_t texture_17,
-                read_only image2d_t texture_18, read_only image2d_t texture_19,
-                read_only image2d_t texture_20, read_only image2d_t texture_21,
-                read_only image2d_t texture_22, read_only image2d_t texture_23,
-                read_only image2d_t texture_24, read_only image2d_t texture_25,
+                read_only image2d_t atlas,
+                global float4* tex_rects,
                 unsigned int sample_count, 
                 int use_cubemap, 
                 constant Lights* lights)
@@ -434,21 +367,11 @@ shade_secondary(write_only global ColorInt* image,
                              x_pos, x_neg,
                              y_pos, y_neg,
                              z_pos, z_neg,
-                             texture_0, texture_1,
-                             texture_2, texture_3,
-                             texture_4, texture_5,
-                             texture_6, texture_7,
-                             texture_8, texture_9,
-                             texture_10, texture_11,
-                             texture_12, texture_13,
-                             texture_14, texture_15,
-                             texture_16, texture_17,
-                             texture_18, texture_19,
-                             texture_20, texture_21,
-                             texture_22, texture_23,
-                             texture_24, texture_25,
+                             atlas,
+                             tex_rects,
                              use_cubemap,
-                             lights);
+                             lights,
+                             0);
                 index++;
                 sample = samples[index];
                 if (sample.pixel != pixel || index >= sample_count)
@@ -457,3 +380,109 @@ shade_secondary(write_only global ColorInt* image,
         }
                 
 }
+
+/* Material sorted shading:
+   material_histogram counts the samples that fall in each bucket (one per 
+   material, ordered by texture, plus a last one for misses), the counts are
+   scanned on the host side and material_scatter writes the sample ids of 
+   each bucket contiguously in order. shade_sorted then shades the samples 
+   in that order, so neighbouring work-items read the same material and 
+   texture. Since samples of one pixel are no longer contiguous, the image
+   is accumulated with atomics. */
+
+kernel void
+material_histogram(read_only global SampleTraceInfo* trace_info,
+                   read_only global unsigned int* material_map,
+                   read_only global unsigned int* bucket_map,
+                   global unsigned int* keys,
+                   global unsigned int* counts,
+                   local unsigned int* l_counts,
+                   unsigned int bucket_count)
+{
+        size_t index = get_global_id(0);
+        size_t l_index = get_local_id(0);
+        size_t l_size = get_local_size(0);
+
+        for (unsigned int b = l_index; b < bucket_count; b += l_size)
+                l_counts[b] = 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        SampleTraceInfo info = trace_info[index];
+        unsigned int key = bucket_count - 1;
+        if (info.hit)
+                key = bucket_map[material_map[info.id]];
+        keys[index] = key;
+        atomic_inc(&l_counts[key]);
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (unsigned int b = l_index; b < bucket_count; b += l_size) {
+                if (l_counts[b])
+                        atomic_add(&counts[b], l_counts[b]);
+        }
+}
+
+kernel void
+material_scatter(read_only global unsigned int* keys,
+                 global unsigned int* offsets,
+                 global int* order,
+                 local unsigned int* l_counts,
+                 local unsigned int* l_base,
+                 unsigned int bucket_count)
+{
+        size_t index = get_global_id(0);
+        size_t l_index = get_local_id(0);
+        size_t l_size = get_local_size(0);
+
+        for (unsigned int b = l_index; b < bucket_count; b += l_size)
+                l_counts[b] = 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        unsigned int key = keys[index];
+        unsigned int rank = atomic_inc(&l_counts[key]);
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        /* Reserve a range of each bucket for the whole group at once */
+        for (unsigned int b = l_index; b < bucket_count; b += l_size) {
+                if (l_counts[b])
+                        l_base[b] = atomic_add(&offsets[b], l_counts[b]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        order[l_base[key] + rank] = index;
+}
+
+kernel void 
+shade_sorted(global ColorInt* image,
+             read_only global SampleTraceInfo* trace_info,
+             read_only global Sample* samples,
+             read_only global Material* material_list,
+             read_only global unsigned int* material_map,
+             read_only image2d_t x_pos, read_only image2d_t x_neg,
+             read_only image2d_t y_pos, read_only image2d_t y_neg,
+             read_only image2d_t z_pos, read_only image2d_t z_neg,
+             read_only image2d_t atlas,
+             global float4* tex_rects,
+             unsigned int sample_count, 
+             int use_cubemap, 
+             constant Lights* lights,
+             read_only global int* order)
+{
+        int index = order[get_global_id(0)];
+
+        SampleTraceInfo hit_info = trace_info[index];
+        Sample    sample = samples[index];
+
+        shade_sample(image,
+                     hit_info,
+                     sample,
+                     material_list,
+                     material_map,
+                     x_pos, x_neg,
+                     y_pos, y_neg,
+                     z_pos, z_neg,
+                     atlas,
+                     tex_rects,
+                     use_cubemap,
+                     lights,
+                     1);
+}
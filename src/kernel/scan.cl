@@ -1,173 +1,173 @@
-#define NUM_BANKS 32  
-#define LOG_NUM_BANKS 5 
-#define CONFLICT_FREE_OFFSET(n) (((n) >> LOG_NUM_BANKS) + ((n) >> (2 * LOG_NUM_BANKS)))
-
-/* #define CONFLICT_FREE_OFFSET(n) ((n) >> (LOG_NUM_BANKS)) */
-/* #define CONFLICT_FREE_OFFSET(n) (n) */
-
-void kernel scan_local_uint(global unsigned int* in,
-                            global unsigned int* sums,
-                            local  unsigned int* aux,
-                            unsigned int size,
-                            global unsigned int* out)
+#include "prefix-sum.h"
+
+/* Single pass scan with decoupled look-back. Each work group takes a tile of
+   SCAN_ITEMS_PER_THREAD * local_size elements in launch order (the tile id
+   comes from an atomic counter, so predecessors are always running or done),
+   scans it in local memory, publishes its aggregate and then walks back over
+   the status of the previous tiles until it finds an inclusive prefix.
+
+   status holds three uints per tile: the flag ((epoch << 2) | state), the
+   aggregate and the inclusive prefix. Flags written in older epochs read as
+   invalid, so the buffer doesn't need to be cleared between scans.
+   The last tile resets the tile counter for the next launch. */
+
+#define SCAN_ITEMS_PER_THREAD 4
+
+#define TILE_INVALID   0
+#define TILE_AGGREGATE 1
+#define TILE_PREFIX    2
+
+unsigned int
+lookback_tile_prefix(global volatile unsigned int* status,
+                     unsigned int tile,
+                     unsigned int aggregate,
+                     unsigned int epoch)
 {
-        int global_size = get_global_size(0);
-        int local_size = get_local_size(0);
-        int group_id   = get_group_id(0);
-
-        int in_start_idx = group_id * local_size * 2;
-
-        /////////// Have to check range
-        if (group_id == get_num_groups(0) - 1) {
-        /* if (group_id == get_num_groups(0) - 1) { */
-
-                int g_idx = get_global_id(0);
-                int l_idx = get_local_id(0);
-
-                in  += in_start_idx;
-                out += in_start_idx;
-
-                int ai = l_idx;
-                int bi = l_idx + local_size;
-                int bankOffsetA = CONFLICT_FREE_OFFSET(ai);
-                int bankOffsetB = CONFLICT_FREE_OFFSET(bi);
-
-                if (in_start_idx + ai < size)
-                        aux[ai+bankOffsetA] = in[ai];
-                else
-                        aux[ai+bankOffsetA] = 0;
+        unsigned int tag = epoch << 2;
+        global volatile unsigned int* tile_status = status + 3*tile;
+
+        if (tile == 0) {
+                tile_status[2] = aggregate;
+                mem_fence(CLK_GLOBAL_MEM_FENCE);
+                atomic_xchg(tile_status, tag | TILE_PREFIX);
+                return 0;
+        }
 
-                if (in_start_idx + bi < size)
-                        aux[bi+bankOffsetB] = in[bi];
-                else
-                        aux[bi+bankOffsetB] = 0;
+        tile_status[1] = aggregate;
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        atomic_xchg(tile_status, tag | TILE_AGGREGATE);
+
+        unsigned int exclusive = 0;
+        int pred = tile - 1;
+        while (pred >= 0) {
+                global volatile unsigned int* pred_status = status + 3*pred;
+                unsigned int flag = atomic_or(pred_status, 0);
+                if ((flag & ~3u) != tag || (flag & 3u) == TILE_INVALID)
+                        continue; /* Predecessor hasn't published yet */
+                mem_fence(CLK_GLOBAL_MEM_FENCE);
+                if ((flag & 3u) == TILE_PREFIX) {
+                        exclusive += pred_status[2];
+                        break;
+                }
+                exclusive += pred_status[1];
+                pred--;
+        }
 
-                int offset = 1;
+        tile_status[2] = exclusive + aggregate;
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        atomic_xchg(tile_status, tag | TILE_PREFIX);
+        return exclusive;
+}
 
-                for (int d = local_size; d > 0; d >>= 1) {
-                        barrier(CLK_LOCAL_MEM_FENCE);
+unsigned int
+next_tile(global unsigned int* tile_counter)
+{
+        unsigned int tile = atomic_inc(tile_counter);
+        if (tile == get_num_groups(0) - 1)
+                atomic_xchg(tile_counter, 0);
+        return tile;
+}
 
-                        if (l_idx < d) {
-                                int ai = offset * (2*l_idx+1)-1;
-                                int bi = ai + offset;
-                                ai += CONFLICT_FREE_OFFSET(ai);
-                                bi += CONFLICT_FREE_OFFSET(bi);
-                                aux[bi] += aux[ai];
-                        }
-                        offset <<= 1;
-                }
-                barrier(CLK_LOCAL_MEM_FENCE);
+/* Exclusive scan of size elements, out needs size+1 elements and gets the
+   total in out[size]. in and out may be the same buffer. */
+void kernel scan_lookback_uint(global unsigned int* in,
+                               global unsigned int* out,
+                               global unsigned int* status,
+                               global unsigned int* tile_counter,
+                               local  int* aux, // 2 * local_size + 1
+                               unsigned int size,
+                               unsigned int epoch)
+{
+        int l_idx = get_local_id(0);
+        int local_size = get_local_size(0);
 
+        local unsigned int tile;
+        local unsigned int tile_prefix;
 
-                if (l_idx == 0) {
-                        int sum_id = local_size*2-1 + CONFLICT_FREE_OFFSET(local_size*2-1);
-                        sums[group_id] = aux[sum_id];
-                        aux[sum_id] = 0;
-                }
-        
-                // traverse down tree & build scan  
-                for (int d = 1; d < local_size<<1; d <<= 1) 
-                {  
-                        offset >>= 1;  
-                        barrier(CLK_LOCAL_MEM_FENCE);
-                        if (l_idx < d) {          
-                                int ai = offset * (2*l_idx+1)-1;
-                                int bi = ai + offset;
-                                ai += CONFLICT_FREE_OFFSET(ai);
-                                bi += CONFLICT_FREE_OFFSET(bi);
-                                int t = aux[ai];  
-                                aux[ai] = aux[bi];  
-                                aux[bi] += t;   
-                        }
-                }
-                barrier(CLK_LOCAL_MEM_FENCE);
+        if (l_idx == 0)
+                tile = next_tile(tile_counter);
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-                if (in_start_idx + ai <= size)
-                        out[ai]   = aux[ai + bankOffsetA];
+        size_t first = ((size_t)tile * local_size + l_idx) * SCAN_ITEMS_PER_THREAD;
 
-                if (in_start_idx + bi <= size)
-                        out[bi]   = aux[bi + bankOffsetB];
+        unsigned int items[SCAN_ITEMS_PER_THREAD];
+        unsigned int thread_sum = 0;
+        for (int i = 0; i < SCAN_ITEMS_PER_THREAD; ++i) {
+                items[i] = first + i < size ? in[first + i] : 0;
+                thread_sum += items[i];
+        }
 
-        ///////////// Don't have to check range
-        } else {
+        local int* bit = aux;
+        local int* sum = aux + local_size;
+        bit[l_idx] = thread_sum;
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-                int g_idx = get_global_id(0);
-                int l_idx = get_local_id(0);
+        prefix_sum(bit, sum);
 
-                in  += in_start_idx;
-                out += in_start_idx;
+        if (l_idx == 0)
+                tile_prefix = lookback_tile_prefix(status, tile,
+                                                   sum[local_size], epoch);
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-                int ai = l_idx;
-                int bi = l_idx + local_size;
-                int bankOffsetA = CONFLICT_FREE_OFFSET(ai);
-                int bankOffsetB = CONFLICT_FREE_OFFSET(bi);
+        unsigned int running = tile_prefix + sum[l_idx];
+        for (int i = 0; i < SCAN_ITEMS_PER_THREAD; ++i) {
+                if (first + i < size)
+                        out[first + i] = running;
+                running += items[i];
+        }
 
-                aux[ai+bankOffsetA] = in[ai];
-                aux[bi+bankOffsetB] = in[bi];
+        if (tile == get_num_groups(0) - 1 && l_idx == local_size - 1)
+                out[size] = running;
+}
 
-                int offset = 1;
+/* Writes, in order, the index of every non zero flag to ids and the number
+   of ids written to count[0]. */
+void kernel compact_lookback_uint(global unsigned int* flags,
+                                  global unsigned int* ids,
+                                  global unsigned int* count,
+                                  global unsigned int* status,
+                                  global unsigned int* tile_counter,
+                                  local  int* aux, // 2 * local_size + 1
+                                  unsigned int size,
+                                  unsigned int epoch)
+{
+        int l_idx = get_local_id(0);
+        int local_size = get_local_size(0);
 
-                for (int d = local_size; d > 0; d >>= 1) {
-                        barrier(CLK_LOCAL_MEM_FENCE);
+        local unsigned int tile;
+        local unsigned int tile_prefix;
 
-                        if (l_idx < d) {
-                                int ai = offset * (2*l_idx+1)-1;
-                                int bi = ai + offset;
-                                ai += CONFLICT_FREE_OFFSET(ai);
-                                bi += CONFLICT_FREE_OFFSET(bi);
-                                aux[bi] += aux[ai];
-                        }
-                        offset <<= 1;
-                }
-                barrier(CLK_LOCAL_MEM_FENCE);
+        if (l_idx == 0)
+                tile = next_tile(tile_counter);
+        barrier(CLK_LOCAL_MEM_FENCE);
 
+        size_t first = ((size_t)tile * local_size + l_idx) * SCAN_ITEMS_PER_THREAD;
 
-                if (l_idx == 0) {
-                        int sum_id = local_size*2-1 + CONFLICT_FREE_OFFSET(local_size*2-1);
-                        sums[group_id] = aux[sum_id];
-                        aux[sum_id] = 0;
-                }
-        
-                // traverse down tree & build scan  
-                for (int d = 1; d < local_size<<1; d <<= 1) 
-                {  
-                        offset >>= 1;  
-                        barrier(CLK_LOCAL_MEM_FENCE);
-                        if (l_idx < d) {          
-                                int ai = offset * (2*l_idx+1)-1;
-                                int bi = ai + offset;
-                                ai += CONFLICT_FREE_OFFSET(ai);
-                                bi += CONFLICT_FREE_OFFSET(bi);
-                                int t = aux[ai];  
-                                aux[ai] = aux[bi];  
-                                aux[bi] += t;   
-                        }
-                }
-                barrier(CLK_LOCAL_MEM_FENCE);
+        int keep[SCAN_ITEMS_PER_THREAD];
+        unsigned int thread_sum = 0;
+        for (int i = 0; i < SCAN_ITEMS_PER_THREAD; ++i) {
+                keep[i] = first + i < size && flags[first + i];
+                thread_sum += keep[i];
+        }
 
-                out[ai]   = aux[ai + bankOffsetA];
-                out[bi]   = aux[bi + bankOffsetB];
+        local int* bit = aux;
+        local int* sum = aux + local_size;
+        bit[l_idx] = thread_sum;
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-        }
-}
+        prefix_sum(bit, sum);
 
-void kernel scan_post_uint(global unsigned int* out,
-                           global unsigned int* sums,
-                           unsigned int block_size)
+        if (l_idx == 0)
+                tile_prefix = lookback_tile_prefix(status, tile,
+                                                   sum[local_size], epoch);
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-{
-        size_t global_id = get_global_id(0);
-        size_t local_id = get_local_id(0);
-
-        local unsigned int sum;
-        if (local_id == 0) {
-                if (global_id >= block_size)
-                        sum = sums[global_id/block_size];
-                else
-                        sum = 0;
+        unsigned int running = tile_prefix + sum[l_idx];
+        for (int i = 0; i < SCAN_ITEMS_PER_THREAD; ++i) {
+                if (keep[i])
+                        ids[running++] = first + i;
         }
-        barrier(CLK_LOCAL_MEM_FENCE);
 
-        out[global_id] += sum;
+        if (tile == get_num_groups(0) - 1 && l_idx == local_size - 1)
+                count[0] = running;
 }
-
@@ -1,3 +1,5 @@
+#include "prefix-sum.h"
+
 typedef struct
 {
 	float3 ori;
@@ -40,6 +42,48 @@ typedef struct {
   
 } SampleTraceInfo;
 
+/* Hash based random number in [0,1) for russian roulette. It only depends
+   on its arguments so the marker and generator kernels take the same 
+   decision for the same sample. */
+float roulette_rand(int pixel, int index, int branch, unsigned int seed)
+{
+        unsigned int h = (unsigned int)pixel * 9781u + 
+                (unsigned int)index * 6271u + (unsigned int)branch * 1103u + seed;
+        h = (h ^ 61u) ^ (h >> 16);
+        h *= 9u;
+        h = h ^ (h >> 4);
+        h *= 0x27d4eb2du;
+        h = h ^ (h >> 15);
+        return (float)(h >> 8) * (1.f / 16777216.f);
+}
+
+/* Decides if a secondary sample with the given contribution is created.
+   Samples under min_contribution are discarded, or if use_roulette is set,
+   kept with probability contribution/min_contribution and their contribution
+   raised to min_contribution to keep the estimate unbiased. */
+bool keep_sample(float* contribution,
+                 int pixel, int index, int branch,
+                 float min_contribution,
+                 int   use_roulette,
+                 unsigned int seed)
+{
+        if (*contribution <= 0.f)
+                return false;
+
+        if (*contribution >= min_contribution)
+                return true;
+
+        if (!use_roulette)
+                return false;
+
+        float p = *contribution / min_contribution;
+        if (roulette_rand(pixel, index, branch, seed) >= p)
+                return false;
+
+        *contribution = min_contribution;
+        return true;
+}
+
 kernel void
 generate_secondary_rays(global SampleTraceInfo* sample_trace_info,
                         global Sample* old_samples,
@@ -47,7 +91,10 @@ generate_secondary_rays(global SampleTraceInfo* sample_trace_info,
                         global unsigned int* material_map,
                         global Sample* new_samples,
                         global int* sample_count,
-                        int    max_sample_count)
+                        int    max_sample_count,
+                        float  min_contribution,
+                        int    use_roulette,
+                        unsigned int seed)
 {
         int local_size = get_local_size(0);
         int group_id   = get_group_id(0);
@@ -102,18 +149,25 @@ generate_secondary_rays(global SampleTraceInfo* sample_trace_info,
 
 			k = sqrt(k);
 
-                        new_ray.ori = info.hit_point;
-			new_ray.dir = normalize((w-k)* n - etai*d);
-			new_ray.invDir = 1.f/new_ray.dir;
-			new_samples[new_ray_id].ray = new_ray;
-			new_samples[new_ray_id].pixel = sample.pixel;
-			new_samples[new_ray_id].contribution =
-				sample.contribution * mat.reflectiveness * (1.f-R);
-                        new_ray_id++;
+                        float contribution = 
+                                sample.contribution * mat.reflectiveness * (1.f-R);
+                        if (keep_sample(&contribution, sample.pixel, index, 1,
+                                        min_contribution, use_roulette, seed)) {
+                                new_ray.ori = info.hit_point;
+                                new_ray.dir = normalize((w-k)* n - etai*d);
+                                new_ray.invDir = 1.f/new_ray.dir;
+                                new_samples[new_ray_id].ray = new_ray;
+                                new_samples[new_ray_id].pixel = sample.pixel;
+                                new_samples[new_ray_id].contribution = contribution;
+                                new_ray_id++;
+                        }
 		}
         }
 
-        if (mat.reflectiveness > 0.f) {
+        float contribution = sample.contribution * mat.reflectiveness * R;
+        if (mat.reflectiveness > 0.f && 
+            keep_sample(&contribution, sample.pixel, index, 0,
+                        min_contribution, use_roulette, seed)) {
 
 		d = -d;
                 new_ray.ori = info.hit_point;
@@ -121,8 +175,7 @@ generate_secondary_rays(global SampleTraceInfo* sample_trace_info,
 		new_ray.invDir = 1.f/new_ray.dir;
 		new_samples[new_ray_id].ray = new_ray;
 		new_samples[new_ray_id].pixel = sample.pixel;
-		new_samples[new_ray_id].contribution =
-			sample.contribution * mat.reflectiveness * R;
+		new_samples[new_ray_id].contribution = contribution;
 	}
 
 }
@@ -132,7 +185,10 @@ mark_secondary_rays(global SampleTraceInfo* sample_trace_info,
                     global Sample* old_samples,
                     global Material* material_list,
                     global unsigned int* material_map,
-                    global int* sample_count)
+                    global int* sample_count,
+                    float  min_contribution,
+                    int    use_roulette,
+                    unsigned int seed)
 {
 	int index = get_global_id(0);
 	SampleTraceInfo info = sample_trace_info[index];
@@ -149,6 +205,7 @@ mark_secondary_rays(global SampleTraceInfo* sample_trace_info,
 
         float3 d = -normalize(sample.ray.dir);
         float3 n = normalize(info.n);
+        float R = 1.f;
 
 	if (mat.refractive_index > 0.f) {
 
@@ -169,11 +226,24 @@ mark_secondary_rays(global SampleTraceInfo* sample_trace_info,
 
 		if (k > 0.f) {
 
-                        sample_count[index]+=1;
+			/*Schlik approximation*/
+			float R0 = (etat - 1.f) / (etat+1.f);
+			R0 *= R0;
+			float cos5 = pow((1.f-cosi),5.f);
+			R = R0 + (1.f-R0)*cos5;
+
+                        float contribution = 
+                                sample.contribution * mat.reflectiveness * (1.f-R);
+                        if (keep_sample(&contribution, sample.pixel, index, 1,
+                                        min_contribution, use_roulette, seed))
+                                sample_count[index]+=1;
 		}
         }
 
-        if (mat.reflectiveness > 0.f) {
+        float contribution = sample.contribution * mat.reflectiveness * R;
+        if (mat.reflectiveness > 0.f &&
+            keep_sample(&contribution, sample.pixel, index, 0,
+                        min_contribution, use_roulette, seed)) {
 
                 sample_count[index]+=1;
 	}
@@ -189,7 +259,10 @@ generate_secondary_rays_disc(global SampleTraceInfo* sample_trace_info,
                              global Sample* new_samples,
                              global int* sample_count,
                              int    refract_offset,
-                             int    max_sample_count)
+                             int    max_sample_count,
+                             float  min_contribution,
+                             int    use_roulette,
+                             unsigned int seed)
 {
         int local_size = get_local_size(0);
         int group_id   = get_group_id(0);
@@ -245,17 +318,25 @@ generate_secondary_rays_disc(global SampleTraceInfo* sample_trace_info,
 
 			k = sqrt(k);
 
-                        new_ray.ori = info.hit_point;
-			new_ray.dir = normalize((w-k)* n - etai*d);
-			new_ray.invDir = 1.f/new_ray.dir;
-			new_samples[new_refract_ray_id].ray = new_ray;
-			new_samples[new_refract_ray_id].pixel = sample.pixel;
-			new_samples[new_refract_ray_id].contribution =
-				sample.contribution * mat.reflectiveness * (1.f-R);
+                        float contribution = 
+                                sample.contribution * mat.reflectiveness * (1.f-R);
+                        if (keep_sample(&contribution, sample.pixel, index, 1,
+                                        min_contribution, use_roulette, seed)) {
+                                new_ray.ori = info.hit_point;
+                                new_ray.dir = normalize((w-k)* n - etai*d);
+                                new_ray.invDir = 1.f/new_ray.dir;
+                                new_samples[new_refract_ray_id].ray = new_ray;
+                                new_samples[new_refract_ray_id].pixel = sample.pixel;
+                                new_samples[new_refract_ray_id].contribution = 
+                                        contribution;
+                        }
 		}
         }
 
-        if (mat.reflectiveness > 0.f && new_reflect_ray_id < max_sample_count) {
+        float contribution = sample.contribution * mat.reflectiveness * R;
+        if (mat.reflectiveness > 0.f && new_reflect_ray_id < max_sample_count &&
+            keep_sample(&contribution, sample.pixel, index, 0,
+                        min_contribution, use_roulette, seed)) {
 
 		d = -d;
 
@@ -264,8 +345,7 @@ generate_secondary_rays_disc(global SampleTraceInfo* sample_trace_info,
 		new_ray.invDir = 1.f/new_ray.dir;
 		new_samples[new_reflect_ray_id].ray = new_ray;
 		new_samples[new_reflect_ray_id].pixel = sample.pixel;
-		new_samples[new_reflect_ray_id].contribution =
-			sample.contribution * mat.reflectiveness * R;
+		new_samples[new_reflect_ray_id].contribution = contribution;
 
 	}
 
@@ -277,7 +357,10 @@ mark_secondary_rays_disc(global SampleTraceInfo* sample_trace_info,
                          global Material* material_list,
                          global unsigned int* material_map,
                          global int* sample_count,
-                                int  refract_offset)
+                                int  refract_offset,
+                         float  min_contribution,
+                         int    use_roulette,
+                         unsigned int seed)
 {
 	int index = get_global_id(0);
 	SampleTraceInfo info = sample_trace_info[index];
@@ -295,6 +378,7 @@ mark_secondary_rays_disc(global SampleTraceInfo* sample_trace_info,
 
         float3 d = -normalize(sample.ray.dir);
         float3 n = normalize(info.n);
+        float R = 1.f;
 
 	if (mat.refractive_index > 0.f) {
 
@@ -314,68 +398,41 @@ mark_secondary_rays_disc(global SampleTraceInfo* sample_trace_info,
 		float k  = (1.f + (w-rel_eta) * (w+rel_eta));
 
 		if (k > 0.f) {
-                        sample_count[index+refract_offset]=1;
+
+			/*Schlik approximation*/
+			float R0 = (etat - 1.f) / (etat+1.f);
+			R0 *= R0;
+			float cos5 = pow((1.f-cosi),5.f);
+			R = R0 + (1.f-R0)*cos5;
+
+                        float contribution = 
+                                sample.contribution * mat.reflectiveness * (1.f-R);
+                        if (keep_sample(&contribution, sample.pixel, index, 1,
+                                        min_contribution, use_roulette, seed))
+                                sample_count[index+refract_offset]=1;
 		}
         }
 
-        if (mat.reflectiveness > 0.f) {
+        float contribution = sample.contribution * mat.reflectiveness * R;
+        if (mat.reflectiveness > 0.f &&
+            keep_sample(&contribution, sample.pixel, index, 0,
+                        min_contribution, use_roulette, seed)) {
 
                 sample_count[index]=1;
 	}
 
 }
 
-void prefix_sum(local   int* bit,
-                local   int* sum)
-{
-        size_t lid = get_local_id(0);
-        size_t lsz = get_local_size(0) / 2;
-
-        int offset = 1;
-
-        sum[lid] = bit[lid];
-
-        for (int d = lsz; d > 0; d >>= 1) {
-                barrier(CLK_LOCAL_MEM_FENCE);
-
-                if (lid < d) {
-                        int ai = offset * (2*lid+1)-1;
-                        int bi = ai + offset;
-                        sum[bi] += sum[ai];
-                }
-                offset <<= 1;
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);
-
-        if (lid == 0) {
-                sum[lsz*2 - 1] = 0;
-        }
-        
-        for (int d = 1; d < lsz<<1; d <<= 1) // traverse down tree & build scan
-        {
-                offset >>= 1;
-                barrier(CLK_LOCAL_MEM_FENCE);
-                if (lid < d) {
-                        int ai = offset * (2*lid+1)-1;
-                        int bi = ai + offset;
-                        int t = sum[ai];
-                        sum[ai] = sum[bi];
-                        sum[bi] += t;
-                }
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (lid == 0) {
-                sum[lsz*2] = bit[lsz*2-1] + sum[lsz*2-1];
-        }
-        barrier(CLK_LOCAL_MEM_FENCE);
-}
-
 int compute_new_samples(const SampleTraceInfo info,
                         const Sample sample,
                         global Material* material_list,
                         global unsigned int* material_map,
                         Sample* reflection,
-                        Sample* refraction)
+                        Sample* refraction,
+                        int   index,
+                        float min_contribution,
+                        int   use_roulette,
+                        unsigned int seed)
 {
 
 	if (!info.hit)
@@ -421,18 +478,25 @@ int compute_new_samples(const SampleTraceInfo info,
 
 			k = sqrt(k);
 
-                        new_ray.ori = info.hit_point;
-			new_ray.dir = normalize((w-k)* n - etai*d);
-			new_ray.invDir = 1.f/new_ray.dir;
-			refraction->ray = new_ray;
-			refraction->pixel = sample.pixel;
-			refraction->contribution =
-				sample.contribution * mat.reflectiveness * (1.f-R);
-                        output_count++;
+                        float contribution = 
+                                sample.contribution * mat.reflectiveness * (1.f-R);
+                        if (keep_sample(&contribution, sample.pixel, index, 1,
+                                        min_contribution, use_roulette, seed)) {
+                                new_ray.ori = info.hit_point;
+                                new_ray.dir = normalize((w-k)* n - etai*d);
+                                new_ray.invDir = 1.f/new_ray.dir;
+                                refraction->ray = new_ray;
+                                refraction->pixel = sample.pixel;
+                                refraction->contribution = contribution;
+                                output_count++;
+                        }
 		}
         }
 
-        if (mat.reflectiveness > 0.f) {
+        float contribution = sample.contribution * mat.reflectiveness * R;
+        if (mat.reflectiveness > 0.f &&
+            keep_sample(&contribution, sample.pixel, index, 0,
+                        min_contribution, use_roulette, seed)) {
 
 		d = -d;
                 new_ray.ori = info.hit_point;
@@ -440,10 +504,13 @@ int compute_new_samples(const SampleTraceInfo info,
 		new_ray.invDir = 1.f/new_ray.dir;
 		reflection->ray = new_ray;
 		reflection->pixel = sample.pixel;
-		reflection->contribution =
-			sample.contribution * mat.reflectiveness * R;
+		reflection->contribution = contribution;
                 output_count++;
-	}
+	} else if (output_count) {
+                /* Only the refraction survived, the caller reads the 
+                   first output sample from reflection */
+                *reflection = *refraction;
+        }
 
         return output_count;
 
@@ -459,7 +526,10 @@ gen_sec_ray(global SampleTraceInfo* sample_trace_info,
             local  int* local_output_samples, // Local output (for local ordering)
             local  int* local_prefix_sum, // Local output prefix sum (for local ordering)
             int    old_sample_count,
-            int    max_sample_count)
+            int    max_sample_count,
+            float  min_contribution,
+            int    use_roulette,
+            unsigned int seed)
 {
         int wgsize = (int)get_local_size(0);
         int wi     = (int)get_local_id(0);
@@ -486,7 +556,11 @@ gen_sec_ray(global SampleTraceInfo* sample_trace_info,
                                                     material_list,
                                                     material_map,
                                                     &reflection,
-                                                    &refraction);
+                                                    &refraction,
+                                                    firstSample + wi,
+                                                    min_contribution,
+                                                    use_roulette,
+                                                    seed);
                 }
                 barrier(CLK_LOCAL_MEM_FENCE);
 
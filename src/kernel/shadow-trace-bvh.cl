@@ -58,6 +58,16 @@ typedef struct {
 
 } BVHNode;
 
+/* Top level node over the roots, a leaf holds root -1 - left */
+typedef struct {
+        BBox bbox;
+        int  left;
+        int  right;
+} TopNode;
+
+/* Depth of the top level, median splits keep it at log2 of the roots */
+#define TOP_LEVELS 32
+
 typedef struct {
 
 	bool hit;
@@ -314,6 +324,47 @@ bool trace_shadow_ray(Ray ray,
         return false;
 }
 
+/* Any hit among the roots whose world bounds the ray meets */
+bool
+trace_shadow_roots(Ray ray,
+                   global Vertex* vertex_buffer,
+                   global int* index_buffer,
+                   global BVHNode* bvh_nodes,
+                   global BVHRoot* roots,
+                   global TopNode* top_nodes)
+{
+        int top_stack[TOP_LEVELS];
+        int top_level = 0;
+        int top = 0;
+
+        while (top >= 0) {
+                TopNode node = top_nodes[top];
+                top = -1;
+
+                if (bbox_hit(node.bbox, ray)) {
+                        if (node.left >= 0) {
+                                if (top_level < TOP_LEVELS)
+                                        top_stack[top_level++] = node.right;
+                                top = node.left;
+                                continue;
+                        }
+
+                        int i = -1 - node.left;
+                        Ray tr_ray = transform_ray(ray, roots[i].trInv);
+                        if (trace_shadow_ray(tr_ray, 
+                                             vertex_buffer, 
+                                             index_buffer, 
+                                             bvh_nodes,
+                                             roots[i].node))
+                                return true;
+                }
+
+                if (top_level > 0)
+                        top = top_stack[--top_level];
+        }
+        return false;
+}
+
 kernel void 
 shadow_trace_multi(global SampleTraceInfo* trace_info,
                    global Sample* samples,
@@ -322,7 +373,8 @@ shadow_trace_multi(global SampleTraceInfo* trace_info,
                    global BVHNode* bvh_nodes,
                    constant Lights* lights,
                    global BVHRoot* roots,
-                   int    root_count)
+                   int    root_count,
+                   global TopNode* top_nodes)
 {
 	int index = get_global_id(0);
 
@@ -354,22 +406,9 @@ shadow_trace_multi(global SampleTraceInfo* trace_info,
 	ray.invDir = 1.f/ray.dir;
   	ray.tMin = 0.01f; ray.tMax = 1e37f;
 
-        trace_info[index].shadow_hit = false;
-        for (int i = 0; i < root_count; ++i) {
-
-                Ray tr_ray = transform_ray(ray, roots[i].trInv);
-                bool hit = trace_shadow_ray(tr_ray, 
-                                            vertex_buffer, 
-                                            index_buffer, 
-                                            bvh_nodes,
-                                            roots[i].node);
-
-                if (hit) {
-                        trace_info[index].shadow_hit = true;
-                        return;
-                }
-        }
-        return;
+        trace_info[index].shadow_hit = 
+                trace_shadow_roots(ray, vertex_buffer, index_buffer, 
+                                   bvh_nodes, roots, top_nodes);
 }
 
 kernel void 
@@ -416,3 +455,95 @@ shadow_trace_single(global SampleTraceInfo* trace_info,
                                                         bvh_nodes,
                                                         0);
 }
+
+/*---------------------- Shadow ray compaction ----------------------*/
+
+/* Marks the samples whose shadow test can change the shaded color: a hit,
+   inside the spot cone (LD > 0 in the shader) and facing the light 
+   (dot(n,-L) > 0). The rest are flagged as shadowed right away since the 
+   shader adds no direct light to them either way. */
+kernel void
+mark_shadow_rays(global SampleTraceInfo* trace_info,
+                 constant Lights* lights,
+                 global unsigned int* flags)
+{
+	int index = get_global_id(0);
+	SampleTraceInfo info  = trace_info[index];
+
+        flags[index] = 0;
+
+	if (!info.hit)
+		return;
+
+        float3 L;
+        float  LD;
+        if (lights->light.type == DIR_L) {
+                L = lights->light.directional.dir;
+                LD = 1.f;
+        } else if (lights->light.type == SPOT_L) {
+                L = normalize(info.hit_point - lights->light.spot.pos);
+                LD = dot(L,lights->light.spot.dir) - lights->light.spot.angle;
+        } else {
+                LD = 0.f;
+        }
+
+        if (LD <= 0.f || dot(info.n,-L) <= 0.f) {
+                trace_info[index].shadow_hit = true;
+                return;
+        }
+
+        flags[index] = 1;
+}
+
+Ray __attribute__((always_inline))
+light_ray(SampleTraceInfo info, constant Lights* lights)
+{
+	Ray ray;
+        ray.ori = info.hit_point;
+        if (lights->light.type == DIR_L)
+                ray.dir = -lights->light.directional.dir;
+        else
+                ray.dir = normalize(lights->light.spot.pos - ray.ori);
+        ray.invDir = 1.f/ray.dir;
+  	ray.tMin = 0.01f; ray.tMax = 1e37f;
+        return ray;
+}
+
+kernel void 
+shadow_trace_single_compact(global SampleTraceInfo* trace_info,
+                            global Sample* samples,
+                            global Vertex* vertex_buffer,
+                            global int* index_buffer,
+                            global BVHNode* bvh_nodes,
+                            constant Lights* lights,
+                            global int* ray_ids)
+{
+	int index = ray_ids[get_global_id(0)];
+
+        Ray ray = light_ray(trace_info[index], lights);
+        trace_info[index].shadow_hit = trace_shadow_ray(ray, 
+                                                        vertex_buffer, 
+                                                        index_buffer, 
+                                                        bvh_nodes,
+                                                        0);
+}
+
+kernel void 
+shadow_trace_multi_compact(global SampleTraceInfo* trace_info,
+                           global Sample* samples,
+                           global Vertex* vertex_buffer,
+                           global int* index_buffer,
+                           global BVHNode* bvh_nodes,
+                           constant Lights* lights,
+                           global BVHRoot* roots,
+                           int    root_count,
+                           global TopNode* top_nodes,
+                           global int* ray_ids)
+{
+	int index = ray_ids[get_global_id(0)];
+
+        Ray ray = light_ray(trace_info[index], lights);
+        trace_info[index].shadow_hit = 
+                trace_shadow_roots(ray, vertex_buffer, index_buffer, 
+                                   bvh_nodes, roots, top_nodes);
+}
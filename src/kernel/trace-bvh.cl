@@ -59,6 +59,16 @@ typedef struct {
 
 } BVHNode;
 
+/* Top level node over the roots, a leaf holds root -1 - left */
+typedef struct {
+        BBox bbox;
+        int  left;
+        int  right;
+} TopNode;
+
+/* Depth of the top level, median splits keep it at log2 of the roots */
+#define TOP_LEVELS 32
+
 typedef struct {
 
         bool hit;
@@ -80,6 +90,15 @@ typedef struct {
         float v;
 } RayHit;
 
+/* Per ray traversal counters written by the *_stats kernels. The regular
+   kernels pass a null pointer, which the compiler folds away. */
+typedef struct {
+        unsigned int node_visits;
+        unsigned int box_tests;
+        unsigned int triangle_tests;
+        unsigned int reserved;
+} TraversalStats;
+
 float3 __attribute__((always_inline)) 
 multiply_vector(float3 v, sqmat4 M)
 {
@@ -277,7 +296,11 @@ leaf_hit(RayHit* best_info,
          BVHNode node,
          global Vertex* vertex_buffer,
          global int* index_buffer,
-         Ray ray){
+         Ray ray,
+         TraversalStats* stats){
+
+        if (stats)
+                stats->triangle_tests += node.end_index - node.start_index;
 
         for (int i = node.start_index; i < node.end_index; ++i) {
 
@@ -332,7 +355,8 @@ RayHit trace_ray(Ray ray,
                  global Vertex* vertex_buffer,
                  global int* index_buffer,
                  global BVHNode* bvh_nodes,
-                 int bvh_root)
+                 int bvh_root,
+                 TraversalStats* stats)
 {
         RayHit best_hit;
         best_hit.id = -1;
@@ -356,6 +380,11 @@ RayHit trace_ray(Ray ray,
         while (true) {
                 current_node = bvh_nodes[curr];
 
+                if (stats) {
+                        stats->node_visits++;
+                        stats->box_tests++;
+                }
+
                 if (!bbox_hit(current_node.bbox, ray)) {
 
                         if (level > 0 && level < MAX_LEVELS) {
@@ -373,7 +402,8 @@ RayHit trace_ray(Ray ray,
                                  current_node,
                                  vertex_buffer,
                                  index_buffer,
-                                 ray);
+                                 ray,
+                                 stats);
 
                         if (best_hit.id >= 0)
                                 ray.tMax = best_hit.t;
@@ -417,14 +447,16 @@ RayHit trace_ray(Ray ray,
 }
 
 
-kernel void 
-trace_multi(global SampleTraceInfo* trace_info,
-            global Sample* samples,
-            global Vertex* vertex_buffer,
-            global int* index_buffer,
-            global BVHNode* bvh_nodes,
-            global BVHRoot* roots,
-            int root_count)
+void __attribute__((always_inline))
+trace_multi_ray(global SampleTraceInfo* trace_info,
+                global Sample* samples,
+                global Vertex* vertex_buffer,
+                global int* index_buffer,
+                global BVHNode* bvh_nodes,
+                global BVHRoot* roots,
+                int root_count,
+                global TopNode* top_nodes,
+                TraversalStats* stats)
 {
         int index = get_global_id(0);
         Ray ray = samples[index].ray;
@@ -432,24 +464,48 @@ trace_multi(global SampleTraceInfo* trace_info,
         RayHit best_hit;
         best_hit.id = -1;
         int best_root = -1;
-        
-        for (int i = 0; i < root_count; ++i) {
-
-                Ray tr_ray = transform_ray(ray, roots[i].trInv);
-                RayHit root_hit = trace_ray(tr_ray,vertex_buffer,index_buffer,
-                                            bvh_nodes, roots[i].node);
-
-                /*Compute real t to compare which hit is closest*/
-                transform_hit_info(ray,
-                                   tr_ray,
-                                   &root_hit,
-                                   roots[i].tr);
-
-                if (root_hit.id >= 0 &&
-                    (best_hit.id < 0 || root_hit.t < best_hit.t)) {
-                        best_hit = root_hit;
-                        best_root = i;
+
+        /* Only the roots whose world bounds the ray meets before the
+           closest hit so far are traced */
+        Ray cull_ray = ray;
+        float dir_length = length(ray.dir);
+        int top_stack[TOP_LEVELS];
+        int top_level = 0;
+        int top = 0;
+
+        while (top >= 0) {
+                TopNode node = top_nodes[top];
+                top = -1;
+
+                if (bbox_hit(node.bbox, cull_ray)) {
+                        if (node.left >= 0) {
+                                if (top_level < TOP_LEVELS)
+                                        top_stack[top_level++] = node.right;
+                                top = node.left;
+                                continue;
+                        }
+
+                        int i = -1 - node.left;
+                        Ray tr_ray = transform_ray(ray, roots[i].trInv);
+                        RayHit root_hit = trace_ray(tr_ray,vertex_buffer,index_buffer,
+                                                    bvh_nodes, roots[i].node, stats);
+
+                        /*Compute real t to compare which hit is closest*/
+                        transform_hit_info(ray,
+                                           tr_ray,
+                                           &root_hit,
+                                           roots[i].tr);
+
+                        if (root_hit.id >= 0 &&
+                            (best_hit.id < 0 || root_hit.t < best_hit.t)) {
+                                best_hit = root_hit;
+                                best_root = i;
+                                cull_ray.tMax = best_hit.t / dir_length;
+                        }
                 }
+
+                if (top_level > 0)
+                        top = top_stack[--top_level];
         }
 
         /*Compute normal and texCoord at hit point*/
@@ -462,6 +518,20 @@ trace_multi(global SampleTraceInfo* trace_info,
                 
 }
 
+kernel void 
+trace_multi(global SampleTraceInfo* trace_info,
+            global Sample* samples,
+            global Vertex* vertex_buffer,
+            global int* index_buffer,
+            global BVHNode* bvh_nodes,
+            global BVHRoot* roots,
+            int root_count,
+            global TopNode* top_nodes)
+{
+        trace_multi_ray(trace_info, samples, vertex_buffer, index_buffer,
+                        bvh_nodes, roots, root_count, top_nodes, 0);
+}
+
 kernel void 
 trace_single(global SampleTraceInfo* trace_info,
              global Sample* samples,
@@ -474,8 +544,45 @@ trace_single(global SampleTraceInfo* trace_info,
         RayHit best_hit;
 
         best_hit = trace_ray(ray,vertex_buffer,index_buffer,
-                             bvh_nodes, 0);
+                             bvh_nodes, 0, 0);
 
         complete_trace_info(ray, best_hit, trace_info, vertex_buffer, index_buffer);
         
 }
+
+/* Instrumented variants, ray_stats gets the counters of each ray */
+kernel void 
+trace_multi_stats(global SampleTraceInfo* trace_info,
+                  global Sample* samples,
+                  global Vertex* vertex_buffer,
+                  global int* index_buffer,
+                  global BVHNode* bvh_nodes,
+                  global BVHRoot* roots,
+                  int root_count,
+                  global TopNode* top_nodes,
+                  global TraversalStats* ray_stats)
+{
+        TraversalStats stats = {0, 0, 0, 0};
+        trace_multi_ray(trace_info, samples, vertex_buffer, index_buffer,
+                        bvh_nodes, roots, root_count, top_nodes, &stats);
+        ray_stats[get_global_id(0)] = stats;
+}
+
+kernel void 
+trace_single_stats(global SampleTraceInfo* trace_info,
+                   global Sample* samples,
+                   global Vertex* vertex_buffer,
+                   global int* index_buffer,
+                   global BVHNode* bvh_nodes,
+                   global TraversalStats* ray_stats)
+{
+        int index = get_global_id(0);
+        Ray ray = samples[index].ray;
+        TraversalStats stats = {0, 0, 0, 0};
+
+        RayHit best_hit = trace_ray(ray,vertex_buffer,index_buffer,
+                                    bvh_nodes, 0, &stats);
+
+        complete_trace_info(ray, best_hit, trace_info, vertex_buffer, index_buffer);
+        ray_stats[index] = stats;
+}
@@ -67,6 +67,15 @@ typedef struct
         unsigned int next_node;
 } kdt_level;
 
+/* Per ray traversal counters written by trace_single_stats. The regular
+   kernel passes a null pointer, which the compiler folds away. */
+typedef struct {
+        unsigned int node_visits;
+        unsigned int box_tests;
+        unsigned int triangle_tests;
+        unsigned int reserved;
+} TraversalStats;
+
 void __attribute__((always_inline))
 complete_trace_info(Ray ray, 
                     SampleTraceInfo* hit_info, 
@@ -141,7 +150,8 @@ leaf_hit(KDTNode node,
          global unsigned int* leaf_indices,
          global Vertex* vertex_buffer,
          global int* index_buffer,
-         Ray ray, float t_min, float t_max){
+         Ray ray, float t_min, float t_max,
+         TraversalStats* stats){
 
         SampleTraceInfo hit_info;
         hit_info.hit = false;
@@ -150,6 +160,9 @@ leaf_hit(KDTNode node,
         t_max *= 1.0001f;
         hit_info.t = t_max;
 
+        if (stats)
+                stats->triangle_tests += node.tris_end - node.tris_start;
+
         for (unsigned int i = node.tris_start; i < node.tris_end; ++i) {
                 unsigned int triangle = leaf_indices[i];
 
@@ -246,7 +259,8 @@ SampleTraceInfo trace_ray(Ray ray,
                      global int* index_buffer,
                      global KDTNode* kdt_nodes,
                      global unsigned int* leaf_indices,
-                     BBox           scene_bbox)
+                     BBox           scene_bbox,
+                     TraversalStats* stats)
 {
         SampleTraceInfo hit_info;
         hit_info.hit = false;
@@ -262,6 +276,8 @@ SampleTraceInfo trace_ray(Ray ray,
         unsigned int first_child, second_child;
 
         float t_min, t_max;
+        if (stats)
+                stats->box_tests++;
         kdt_level lev = bbox_hit(scene_bbox, ray);
         t_min = lev.t_min;
         t_max = lev.t_max;
@@ -273,6 +289,8 @@ SampleTraceInfo trace_ray(Ray ray,
         
         while(1) {
                 current_node = kdt_nodes[curr];
+                if (stats)
+                        stats->node_visits++;
 
                 if (current_node.leaf) {
 
@@ -281,7 +299,7 @@ SampleTraceInfo trace_ray(Ray ray,
                                                     leaf_indices,
                                                     vertex_buffer,
                                                     index_buffer,
-                                                    ray, t_min, t_max);
+                                                    ray, t_min, t_max, stats);
                                 if (hit_info.hit)
                                         return hit_info;
                         }
@@ -339,10 +357,35 @@ trace_single(global SampleTraceInfo* sample_trace_info,
         int index = get_global_id(0);
         Ray ray = samples[index].ray;
         SampleTraceInfo trace_info = trace_ray(ray,vertex_buffer,index_buffer,
-                                               kdt_nodes, leaf_indices, scene_bbox);
+                                               kdt_nodes, leaf_indices, scene_bbox, 0);
+        
+        if (trace_info.hit)
+                complete_trace_info(ray, &trace_info, vertex_buffer, index_buffer);
+
+        sample_trace_info[index] = trace_info;
+}
+
+/* Instrumented variant, ray_stats gets the counters of each ray */
+kernel void 
+trace_single_stats(global SampleTraceInfo* sample_trace_info,
+                   global Sample* samples,
+                   global Vertex* vertex_buffer,
+                   global int* index_buffer,
+                   global KDTNode* kdt_nodes,
+                   global unsigned int* leaf_indices,
+                   BBox scene_bbox,
+                   global TraversalStats* ray_stats)
+{
+        int index = get_global_id(0);
+        Ray ray = samples[index].ray;
+        TraversalStats stats = {0, 0, 0, 0};
+        SampleTraceInfo trace_info = trace_ray(ray,vertex_buffer,index_buffer,
+                                               kdt_nodes, leaf_indices, scene_bbox,
+                                               &stats);
         
         if (trace_info.hit)
                 complete_trace_info(ray, &trace_info, vertex_buffer, index_buffer);
 
         sample_trace_info[index] = trace_info;
+        ray_stats[index] = stats;
 }
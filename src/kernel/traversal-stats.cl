@@ -0,0 +1,65 @@
+typedef struct
+{
+        float3 ori;
+        float3 dir;
+        float3 invDir;
+        float tMin;
+        float tMax;
+} Ray;
+
+typedef struct 
+{
+        Ray   ray;
+        int   pixel;
+        float contribution;
+} Sample;
+
+typedef struct {
+        unsigned int node_visits;
+        unsigned int box_tests;
+        unsigned int triangle_tests;
+        unsigned int reserved;
+} TraversalStats;
+
+/* Sums the per ray counters written by the trace_*_stats kernels into
+   totals = {node visits, box tests, triangle tests, max node visits of a
+   ray}. With use_heat, the cost of each ray (node visits + triangle tests)
+   is also added to its pixel in heat. */
+kernel void
+reduce_traversal_stats(global TraversalStats* ray_stats,
+                       global Sample* samples,
+                       global unsigned int* totals,
+                       global unsigned int* heat,
+                       int use_heat)
+{
+        local unsigned int l_totals[4];
+
+        size_t index = get_global_id(0);
+        size_t l_index = get_local_id(0);
+
+        if (l_index == 0) {
+                l_totals[0] = 0;
+                l_totals[1] = 0;
+                l_totals[2] = 0;
+                l_totals[3] = 0;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        TraversalStats stats = ray_stats[index];
+        atomic_add(&l_totals[0], stats.node_visits);
+        atomic_add(&l_totals[1], stats.box_tests);
+        atomic_add(&l_totals[2], stats.triangle_tests);
+        atomic_max(&l_totals[3], stats.node_visits);
+
+        if (use_heat)
+                atomic_add(&heat[samples[index].pixel], 
+                           stats.node_visits + stats.triangle_tests);
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        if (l_index == 0) {
+                atomic_add(&totals[0], l_totals[0]);
+                atomic_add(&totals[1], l_totals[1]);
+                atomic_add(&totals[2], l_totals[2]);
+                atomic_max(&totals[3], l_totals[3]);
+        }
+}
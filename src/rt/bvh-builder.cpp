@@ -1,5 +1,6 @@
 #include <rt/bvh-builder.hpp>
 #include <gpu/scan.hpp>
+#include <algorithm>
 
 #define M_AXIS_BITS  10
 #define M_UINT_COUNT 1 //This value needs to be (1+ (M_AXIS_BITS*3-1)/32)
@@ -113,6 +114,40 @@ static int test_node(std::vector<BVHNode>& nodes,
 }
 #endif
 
+/* Transient memories of a build, deleted on every way out of it so the
+   transient arena rewinds even after a failed build */
+class TransientMemories {
+public:
+        TransientMemories(size_t cq_i) : m_cq(cq_i) {}
+        ~TransientMemories() {
+                if (m_ids.empty())
+                        return;
+                /* The build stopped half way, its queue may still use them */
+                DeviceInterface& device = *DeviceInterface::instance();
+                device.finish_commands(m_cq);
+                for (size_t i = 0; i < m_ids.size(); ++i)
+                        device.delete_memory(m_ids[i]);
+        }
+
+        memory_id add() {
+                memory_id id = DeviceInterface::instance()->new_memory();
+                m_ids.push_back(id);
+                return id;
+        }
+
+        int32_t remove(memory_id id) {
+                std::vector<memory_id>::iterator it = 
+                        std::find(m_ids.begin(), m_ids.end(), id);
+                if (it != m_ids.end())
+                        m_ids.erase(it);
+                return DeviceInterface::instance()->delete_memory(id);
+        }
+
+private:
+        size_t m_cq;
+        std::vector<memory_id> m_ids;
+};
+
 int32_t 
 BVHBuilder::initialize()
 {
@@ -145,7 +180,7 @@ BVHBuilder::initialize()
         builder_names.push_back("process_task");
         
         std::vector<function_id> builder_ids = 
-                device.build_functions("src/kernel/bvh-builder.cl", builder_names);
+                device.defer_functions("src/kernel/bvh-builder.cl", builder_names);
         if (!builder_ids.size())
                 return -1;
 
@@ -169,7 +204,7 @@ BVHBuilder::initialize()
 
 
         std::vector<function_id> sorter_ids = 
-                device.build_functions("src/kernel/bvh-builder-sort.cl", sorter_names);
+                device.defer_functions("src/kernel/bvh-builder-sort.cl", sorter_names);
         if (!sorter_ids.size())
                 return -1;
         morton_sorter_2_id  = sorter_ids[0];
@@ -225,16 +260,17 @@ BVHBuilder::build_lbvh(Scene& scene, size_t cq_i)
         double    partial_time_ms;
         rt_time_t partial_timer;
         size_t triangle_count = scene.triangle_count();
+        TransientMemories transients(cq_i);
 
         //////////////////////////////////////////////////////////////////////////
         //////////   1. Compute BBox for each primitive //////////////////////////
         //////////////////////////////////////////////////////////////////////////
         partial_timer.snap_time();
-        memory_id bboxes_mem_id = device.new_memory();
+        memory_id bboxes_mem_id = transients.add();
         DeviceMemory& bboxes_mem = device.memory(bboxes_mem_id);
         size_t bboxes_size = sizeof(BBox)*triangle_count;
         if (!bboxes_mem.valid())
-                if (bboxes_mem.initialize(bboxes_size))
+                if (bboxes_mem.initialize_transient(bboxes_size))
                         return -1;
 
         if (bboxes_mem.size() < bboxes_size)
@@ -274,12 +310,12 @@ BVHBuilder::build_lbvh(Scene& scene, size_t cq_i)
         ///////////// 2. Create morton code encoding of barycenters //////////////
         //////////////////////////////////////////////////////////////////////////
         partial_timer.snap_time();
-        memory_id morton_mem_id = device.new_memory();
+        memory_id morton_mem_id = transients.add();
         DeviceMemory& morton_mem = device.memory(morton_mem_id);
 
         size_t morton_size = sizeof(cl_uint2) * triangle_count * 2;
         if (!morton_mem.valid())
-                if (morton_mem.initialize(morton_size))
+                if (morton_mem.initialize_transient(morton_size))
                         return -1;
 
         if (morton_mem.size() < morton_size)
@@ -297,10 +333,10 @@ BVHBuilder::build_lbvh(Scene& scene, size_t cq_i)
         size_t real_size = ceil(bbox_count/2.);
         size_t global_size = ceil(real_size/(double)group_size) * group_size;
         while (true) {
-                bbox_out_mem_id  = device.new_memory();
+                bbox_out_mem_id  = transients.add();
                 DeviceMemory& bbox_in_mem = device.memory(bbox_in_mem_id);
                 DeviceMemory& bbox_out_mem = device.memory(bbox_out_mem_id);
-                if (bbox_out_mem.initialize(out_bbox_count * sizeof(BBox))) {
+                if (bbox_out_mem.initialize_transient(out_bbox_count * sizeof(BBox))) {
                         return -1;
                 }
 
@@ -330,7 +366,7 @@ BVHBuilder::build_lbvh(Scene& scene, size_t cq_i)
 
 
         for (size_t i = 0; i < aux_bbox_mems.size()-1; ++i) {
-                device.delete_memory(aux_bbox_mems[i]);
+                transients.remove(aux_bbox_mems[i]);
         }
 
         memory_id last_bbox_out_id = aux_bbox_mems[aux_bbox_mems.size()-1];
@@ -347,7 +383,7 @@ BVHBuilder::build_lbvh(Scene& scene, size_t cq_i)
                 return -1;
         }
         device.enqueue_barrier(cq_i);
-        device.delete_memory(last_bbox_out_id);
+        transients.remove(last_bbox_out_id);
         if (m_logging && m_log != NULL) {
                 device.finish_commands(cq_i);
                 partial_time_ms = partial_timer.msec_since_snap();
@@ -468,14 +504,14 @@ BVHBuilder::build_lbvh(Scene& scene, size_t cq_i)
         DeviceFunction& morton_rearranger   = device.function(morton_rearranger_id);
 
         ////// Rearrange indices
-        memory_id aux_id = device.new_memory();
+        memory_id aux_id = transients.add();
         DeviceMemory& aux_mem = device.memory(aux_id);
         size_t aux_mem_size = scene.index_mem().size();
         aux_mem_size = std::max(aux_mem_size, bboxes_mem.size());
         aux_mem_size = std::max(aux_mem_size, scene.material_map_mem().size());
         aux_mem_size = std::max(aux_mem_size, morton_mem.size());
 
-        if (aux_mem.initialize(aux_mem_size))
+        if (aux_mem.initialize_transient(aux_mem_size))
                 return -1;
 
         if (scene.index_mem().copy_all_to(aux_mem, cq_i)) {
@@ -524,7 +560,7 @@ BVHBuilder::build_lbvh(Scene& scene, size_t cq_i)
                 return -1;
         }
         device.enqueue_barrier(cq_i);
-        device.delete_memory(aux_id);
+        transients.remove(aux_id);
 
         ///////////////////////////////////////////////////////////////////////////////
         ////////////////////// 4. Create bvh nodes ////////////////////////////////////
@@ -552,7 +588,7 @@ BVHBuilder::build_lbvh(Scene& scene, size_t cq_i)
         root_node.m_start_index = 0;
         root_node.m_end_index = triangle_count;
         root_node.m_leaf = 0; // Because we use leaf to encode the level at which we check
-        if (nodes_mem.write(sizeof(BVHNode), &root_node, cq_i)) {
+        if (nodes_mem.write(sizeof(BVHNode), &root_node, 0, cq_i)) {
                 return -1;
         }
         device.enqueue_barrier(cq_i);
@@ -565,10 +601,10 @@ BVHBuilder::build_lbvh(Scene& scene, size_t cq_i)
         }
 
         DeviceMemory& outputCounter_mem = device.memory(outputCounter_mem_id);
-        outputCounter_mem.write(64 * sizeof(cl_uint), outputCounter, cq_i);
+        outputCounter_mem.write(64 * sizeof(cl_uint), outputCounter, 0, cq_i);
 
         DeviceMemory& processedCounter_mem = device.memory(processedCounter_mem_id);
-        processedCounter_mem.write(64 * sizeof(cl_uint), processedCounter, cq_i);
+        processedCounter_mem.write(64 * sizeof(cl_uint), processedCounter, 0, cq_i);
 
         size_t gsize = process_tasks.max_group_size();
         node_time.snap_time();
@@ -708,12 +744,12 @@ BVHBuilder::build_lbvh(Scene& scene, size_t cq_i)
         // }
         //////////////////////////////////
 
-        if (device.delete_memory(bboxes_mem_id)) {
+        if (transients.remove(bboxes_mem_id)) {
                 std::cerr << "Error deleting bboxes memory\n";
                 return -1;
         }
 
-        if (device.delete_memory(morton_mem_id)) {
+        if (transients.remove(morton_mem_id)) {
                 std::cerr << "Error deleting morton memory\n";
                 return -1;
         }
@@ -729,6 +765,7 @@ BVHBuilder::build_lbvh(Scene& scene, size_t cq_i)
         scene.m_accelerator_type = LBVH_ACCELERATOR;
         scene.m_aggregate_bvh_built = true;
         scene.m_aggregate_bvh_transfered = true;
+        scene.m_geometry_version++;
 
         scene.bvh_node_count = node_count;
         for (int i = 0; i < 64; ++i) {
@@ -750,16 +787,17 @@ int32_t BVHBuilder::refit_lbvh(Scene& scene, size_t cq_i)
         double    partial_time_ms;
         rt_time_t partial_timer;
         size_t triangle_count = scene.triangle_count();
+        TransientMemories transients(cq_i);
 
         //////////////////////////////////////////////////////////////////////////
         //////////   Compute BBox for each primitive //////////////////////////
         //////////////////////////////////////////////////////////////////////////
         partial_timer.snap_time();
-        memory_id bboxes_mem_id = device.new_memory();
+        memory_id bboxes_mem_id = transients.add();
         DeviceMemory& bboxes_mem = device.memory(bboxes_mem_id);
         size_t bboxes_size = sizeof(BBox)*triangle_count;
         if (!bboxes_mem.valid())
-                if (bboxes_mem.initialize(bboxes_size))
+                if (bboxes_mem.initialize_transient(bboxes_size))
                         return -1;
 
         if (bboxes_mem.size() < bboxes_size)
@@ -836,7 +874,7 @@ int32_t BVHBuilder::refit_lbvh(Scene& scene, size_t cq_i)
                 device.enqueue_barrier(cq_i);
         }
 
-        if (device.delete_memory(bboxes_mem_id)) {
+        if (transients.remove(bboxes_mem_id)) {
                 std::cerr << "Error deleting bboxes memory\n";
                 return -1;
         }
@@ -846,6 +884,7 @@ int32_t BVHBuilder::refit_lbvh(Scene& scene, size_t cq_i)
                 m_time_ms = m_timer.msec_since_snap();
         }
 
+        scene.m_geometry_version++;
         return 0;
 }
 
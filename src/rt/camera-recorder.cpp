@@ -0,0 +1,211 @@
+#include <rt/camera-recorder.hpp>
+
+#include <cstring>
+#include <iostream>
+
+static const char     CAMERA_PATH_MAGIC[4] = {'R','T','C','P'};
+static const uint32_t CAMERA_PATH_VERSION = 1;
+static const uint32_t CAMERA_FLOATS = 9;
+static const uint32_t OBJECT_FLOATS = 9;
+
+static void write_vec3(std::ofstream& f, const vec3& v)
+{
+        float xyz[3] = {v[0], v[1], v[2]};
+        f.write((const char*)xyz, sizeof(xyz));
+}
+
+static vec3 read_vec3(const float* data)
+{
+        return makeVector(data[0], data[1], data[2]);
+}
+
+CameraRecorder::CameraRecorder()
+{
+        m_recording = false;
+        m_frames = 0;
+        m_object_count = 0;
+}
+
+CameraRecorder::~CameraRecorder()
+{
+        stop();
+}
+
+int32_t
+CameraRecorder::start(const std::string& file, Scene& scene)
+{
+        if (m_recording)
+                return -1;
+
+        m_file.open(file.c_str(), std::ofstream::out | std::ofstream::binary);
+        if (!m_file.is_open()) {
+                std::cerr << "Unable to open camera path file " << file << "\n";
+                return -1;
+        }
+
+        m_frames = 0;
+        m_object_count = scene.object_slot_count();
+
+        m_file.write(CAMERA_PATH_MAGIC, sizeof(CAMERA_PATH_MAGIC));
+        m_file.write((const char*)&CAMERA_PATH_VERSION, sizeof(uint32_t));
+        m_file.write((const char*)&m_object_count, sizeof(uint32_t));
+
+        m_recording = true;
+        return 0;
+}
+
+int32_t
+CameraRecorder::record_frame(Scene& scene)
+{
+        if (!m_recording)
+                return 0;
+
+        write_vec3(m_file, scene.camera.pos);
+        write_vec3(m_file, scene.camera.dir);
+        write_vec3(m_file, scene.camera.up);
+
+        for (uint32_t i = 0; i < m_object_count; ++i) {
+                /* Objects added after start are not recorded */
+                if (i < scene.object_slot_count()) {
+                        GeometricProperties& geom = scene.object(i).geom;
+                        write_vec3(m_file, geom.getPos());
+                        write_vec3(m_file, geom.getRpy());
+                        write_vec3(m_file, geom.getScale());
+                } else {
+                        GeometricProperties identity;
+                        write_vec3(m_file, identity.getPos());
+                        write_vec3(m_file, identity.getRpy());
+                        write_vec3(m_file, identity.getScale());
+                }
+        }
+
+        if (!m_file.good()) {
+                std::cerr << "Error writing camera path\n";
+                return -1;
+        }
+        m_frames++;
+        return 0;
+}
+
+int32_t
+CameraRecorder::stop()
+{
+        if (!m_recording)
+                return 0;
+
+        m_file.close();
+        m_recording = false;
+        return 0;
+}
+
+int32_t
+RecordedCameraTrajectory::load(const std::string& file)
+{
+        std::ifstream in(file.c_str(), std::ifstream::in | std::ifstream::binary);
+        if (!in.good()) {
+                std::cerr << "Unable to open camera path file " << file << "\n";
+                return -1;
+        }
+
+        char magic[4];
+        uint32_t version, object_count;
+        in.read(magic, sizeof(magic));
+        in.read((char*)&version, sizeof(uint32_t));
+        in.read((char*)&object_count, sizeof(uint32_t));
+        if (!in.good() || memcmp(magic, CAMERA_PATH_MAGIC, sizeof(magic)) ||
+            version != CAMERA_PATH_VERSION) {
+                std::cerr << "Invalid camera path file " << file << "\n";
+                return -1;
+        }
+
+        /* The count comes from the file, a frame must fit in what's left 
+           of it before anything is sized from the count */
+        std::streampos header_end = in.tellg();
+        in.seekg(0, std::ifstream::end);
+        size_t data_floats = size_t(in.tellg() - header_end) / sizeof(float);
+        in.seekg(header_end);
+        if (data_floats < CAMERA_FLOATS) {
+                std::cerr << "Camera path file " << file << " has no frames\n";
+                return -1;
+        }
+        if (object_count > (data_floats - CAMERA_FLOATS) / OBJECT_FLOATS) {
+                std::cerr << "Invalid object count " << object_count 
+                          << " in camera path file " << file << "\n";
+                return -1;
+        }
+
+        size_t stride = CAMERA_FLOATS + size_t(OBJECT_FLOATS) * object_count;
+        std::vector<float> frame(stride);
+        m_data.clear();
+        while (in.read((char*)&(frame[0]), stride * sizeof(float)))
+                m_data.insert(m_data.end(), frame.begin(), frame.end());
+
+        m_object_count = object_count;
+        m_frame_count = m_data.size() / stride;
+        frames = m_frame_count;
+        current_frame = 0;
+        m_last_frame = 0;
+
+        if (!m_frame_count) {
+                std::cerr << "Camera path file " << file << " has no frames\n";
+                return -1;
+        }
+        return 0;
+}
+
+void 
+RecordedCameraTrajectory::get_next_camera_params(vec3* cam_pos, vec3* cam_dir, 
+                                                 vec3* cam_up)
+{
+        if (!m_frame_count)
+                return;
+
+        m_last_frame = std::min(current_frame, m_frame_count-1);
+        const float* data = 
+                &m_data[m_last_frame * (CAMERA_FLOATS + OBJECT_FLOATS * m_object_count)];
+        *cam_pos = read_vec3(data);
+        *cam_dir = read_vec3(data+3);
+        *cam_up  = read_vec3(data+6);
+
+        current_frame++;
+        if (repeating && current_frame >= m_frame_count)
+                current_frame = 0;
+}
+
+int32_t
+RecordedCameraTrajectory::apply_object_transforms(Scene& scene)
+{
+        if (!m_frame_count)
+                return -1;
+
+        const float* data = 
+                &m_data[m_last_frame * (CAMERA_FLOATS + OBJECT_FLOATS * m_object_count)];
+        data += CAMERA_FLOATS;
+
+        bool moved = false;
+        uint32_t count = std::min(size_t(m_object_count), scene.object_slot_count());
+        for (uint32_t i = 0; i < count; ++i, data += OBJECT_FLOATS) {
+                Object& obj = scene.object(i);
+                if (!obj.is_valid())
+                        continue;
+
+                vec3 pos = read_vec3(data);
+                vec3 rpy = read_vec3(data+3);
+                vec3 scale = read_vec3(data+6);
+                GeometricProperties& geom = obj.geom;
+                if (pos == geom.getPos() && rpy == geom.getRpy() && 
+                    scale == geom.getScale())
+                        continue;
+
+                geom.setPos(pos);
+                geom.setRpy(rpy);
+                geom.setScale(scale);
+                moved = true;
+        }
+
+        /* Scenes rendered from an aggregate bvh have no roots to update */
+        if (moved && scene.object_count())
+                scene.update_bvh_roots();
+
+        return 0;
+}
@@ -1,5 +1,7 @@
 #include <rt/camera-trajectory.hpp>
 
+#include <algorithm>
+
 void 
 LinearCameraTrajectory::get_next_camera_params(vec3* cam_pos, vec3* cam_dir, vec3* cam_up){
 
@@ -20,3 +22,48 @@ LinearCameraTrajectory::get_next_camera_params(vec3* cam_pos, vec3* cam_dir, vec
         if (repeating && current_frame >= frames)
                 current_frame = 0;
 }
+
+vec3
+SplineCameraTrajectory::interpolate(const std::vector<vec3>& points, float t) const
+{
+        int n = points.size();
+        int i = std::min(int(t), n-2);
+        float u = t - i;
+
+        const vec3& p0 = points[std::max(i-1, 0)];
+        const vec3& p1 = points[i];
+        const vec3& p2 = points[i+1];
+        const vec3& p3 = points[std::min(i+2, n-1)];
+
+        float u2 = u * u;
+        float u3 = u2 * u;
+        return (p1 * 2.f + 
+                (p2 - p0) * u + 
+                (p0 * 2.f - p1 * 5.f + p2 * 4.f - p3) * u2 + 
+                (p1 * 3.f - p0 - p2 * 3.f + p3) * u3) * 0.5f;
+}
+
+void 
+SplineCameraTrajectory::get_next_camera_params(vec3* cam_pos, vec3* cam_dir, vec3* cam_up){
+
+        *cam_up = up_vec;
+        if (positions.empty())
+                return;
+
+        vec3 look_at_pos;
+        if (positions.size() == 1 || frames <= 1) {
+                *cam_pos = positions[0];
+                look_at_pos = look_at_positions[0];
+        } else {
+                uint32_t frame = std::min(current_frame, frames-1);
+                float t = frame * (positions.size()-1) / float(frames-1);
+                *cam_pos = interpolate(positions, t);
+                look_at_pos = interpolate(look_at_positions, t);
+        }
+
+        *cam_dir = (look_at_pos - *cam_pos).normalized();
+
+        current_frame++;
+        if (repeating && current_frame >= frames)
+                current_frame = 0;
+}
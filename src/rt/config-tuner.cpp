@@ -0,0 +1,258 @@
+#include <rt/config-tuner.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static double get_param(const RendererConfig& conf, tuner_param p)
+{
+        switch (p) {
+        case TUNE_TILE_TO_CORES_RATIO: return conf.tile_to_cores_ratio;
+        case TUNE_PRIM_QUAD_SIZE:      return conf.prim_ray_quad_size;
+        case TUNE_PRIM_USE_ZCURVE:     return conf.prim_ray_use_zcurve;
+        case TUNE_SEC_USE_DISC:        return conf.sec_ray_use_disc;
+        case TUNE_SEC_USE_ATOMICS:     return conf.sec_ray_use_atomics;
+        case TUNE_BVH_MAX_DEPTH:       return conf.bvh_depth;
+        case TUNE_BVH_MIN_LEAF_SIZE:   return conf.bvh_min_leaf_size;
+        default:                       return 0;
+        }
+}
+
+static void set_param(RendererConfig& conf, tuner_param p, double v)
+{
+        switch (p) {
+        case TUNE_TILE_TO_CORES_RATIO: conf.tile_to_cores_ratio = v; break;
+        case TUNE_PRIM_QUAD_SIZE:      conf.prim_ray_quad_size = int(v); break;
+        case TUNE_PRIM_USE_ZCURVE:     conf.prim_ray_use_zcurve = int(v); break;
+        case TUNE_SEC_USE_DISC:        conf.sec_ray_use_disc = int(v); break;
+        case TUNE_SEC_USE_ATOMICS:     conf.sec_ray_use_atomics = int(v); break;
+        case TUNE_BVH_MAX_DEPTH:       conf.bvh_depth = int(v); break;
+        case TUNE_BVH_MIN_LEAF_SIZE:   conf.bvh_min_leaf_size = int(v); break;
+        default: break;
+        }
+}
+
+/* 64 bit FNV-1a */
+static uint64_t hash_string(const std::string& s)
+{
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < s.size(); ++i) {
+                h ^= (unsigned char)s[i];
+                h *= 1099511628211ULL;
+        }
+        return h;
+}
+
+ConfigTuner::ConfigTuner()
+{
+        m_warmup_frames = 2;
+        m_frames = 8;
+        m_max_passes = 3;
+        m_best_time = 0;
+
+        double ratios[] = {16, 32, 64, 128, 256, 512};
+        double quads[] = {8, 16, 32, 64};
+        double bools[] = {0, 1};
+        double depths[] = {24, 32, 40, 50};
+        double leaves[] = {1, 2, 4, 8};
+
+        m_candidates[TUNE_TILE_TO_CORES_RATIO].assign(ratios, ratios + 6);
+        m_candidates[TUNE_PRIM_QUAD_SIZE].assign(quads, quads + 4);
+        m_candidates[TUNE_PRIM_USE_ZCURVE].assign(bools, bools + 2);
+        m_candidates[TUNE_SEC_USE_DISC].assign(bools, bools + 2);
+        m_candidates[TUNE_SEC_USE_ATOMICS].assign(bools, bools + 2);
+        m_candidates[TUNE_BVH_MAX_DEPTH].assign(depths, depths + 4);
+        m_candidates[TUNE_BVH_MIN_LEAF_SIZE].assign(leaves, leaves + 4);
+}
+
+void
+ConfigTuner::set_window(uint32_t warmup_frames, uint32_t frames)
+{
+        m_warmup_frames = warmup_frames;
+        m_frames = std::max(frames, 1u);
+}
+
+void
+ConfigTuner::set_max_passes(uint32_t passes)
+{
+        m_max_passes = std::max(passes, 1u);
+}
+
+const char*
+ConfigTuner::param_name(tuner_param p)
+{
+        static const char* names[TUNE_PARAM_COUNT] = {"tile_to_cores_ratio",
+                                                      "prim_quad_size",
+                                                      "prim_use_zcurve",
+                                                      "sec_use_disc",
+                                                      "sec_use_atomics",
+                                                      "bvh_max_depth",
+                                                      "bvh_min_leaf_size"};
+        return names[p];
+}
+
+std::string
+ConfigTuner::scene_key(Renderer& renderer, Scene& scene)
+{
+        char device_name[256] = {0};
+        clGetDeviceInfo(CLInfo::instance()->device_id, CL_DEVICE_NAME,
+                        sizeof(device_name)-1, device_name, NULL);
+
+        /* Vertex positions are left out so animated scenes keep their key */
+        std::ostringstream id;
+        id << device_name 
+           << "|" << renderer.get_framebuffer_w() 
+           << "x" << renderer.get_framebuffer_h()
+           << "|" << scene.triangle_count()
+           << "|" << scene.vertex_count()
+           << "|" << scene.object_count()
+           << "|" << renderer.get_max_bounces()
+           << "|" << renderer.is_static_bvh();
+
+        std::ostringstream key;
+        key << "scene_" << std::hex << hash_string(id.str());
+        return key.str();
+}
+
+int32_t
+ConfigTuner::load(INIReader& ini, const std::string& key, RendererConfig* conf)
+{
+        /* The tile ratio is always written, so it tells if the key exists */
+        float float_val;
+        if (ini.get_float_value(key, param_name(TUNE_TILE_TO_CORES_RATIO), 
+                                float_val))
+                return -1;
+        set_param(*conf, TUNE_TILE_TO_CORES_RATIO, float_val);
+
+        int32_t int_val;
+        for (uint32_t i = TUNE_PRIM_QUAD_SIZE; i < TUNE_PARAM_COUNT; ++i) {
+                if (!ini.get_int_value(key, param_name(tuner_param(i)), int_val))
+                        set_param(*conf, tuner_param(i), int_val);
+        }
+        return 0;
+}
+
+int32_t
+ConfigTuner::save(const std::string& file, const std::string& key,
+                  const RendererConfig& conf, double frame_time)
+{
+        /* Keep all other sections of the file */
+        std::vector<std::string> lines;
+        std::ifstream in(file.c_str());
+        if (in.good()) {
+                std::string line;
+                bool skip = false;
+                while (std::getline(in, line)) {
+                        if (!line.empty() && line[0] == '[')
+                                skip = line == "[" + key + "]";
+                        if (!skip)
+                                lines.push_back(line);
+                }
+        }
+        in.close();
+
+        std::ofstream out(file.c_str());
+        if (!out.good()) {
+                std::cerr << "Unable to write tuning file " << file << "\n";
+                return -1;
+        }
+
+        for (size_t i = 0; i < lines.size(); ++i)
+                out << lines[i] << "\n";
+        if (!lines.empty() && !lines.back().empty())
+                out << "\n";
+
+        out << "[" << key << "]\n";
+        out << "; median frame time " << frame_time << " ms\n";
+        for (uint32_t i = 0; i < TUNE_PARAM_COUNT; ++i)
+                out << param_name(tuner_param(i)) << " = " 
+                    << get_param(conf, tuner_param(i)) << "\n";
+
+        out.close();
+        return 0;
+}
+
+int32_t
+ConfigTuner::measure(Renderer& renderer, Scene& scene, memory_id tex_id,
+                     const RendererConfig& conf, double* frame_time)
+{
+        renderer.config = conf;
+
+        std::vector<double> times;
+        for (uint32_t f = 0; f < m_warmup_frames + m_frames; ++f) {
+                if (renderer.update_configuration() ||
+                    renderer.set_up_frame(tex_id, scene) ||
+                    renderer.render_to_framebuffer(scene) ||
+                    renderer.copy_framebuffer() ||
+                    renderer.conclude_frame(scene)) {
+                        std::cerr << "Tuner: error rendering frame\n";
+                        return -1;
+                }
+                if (f >= m_warmup_frames)
+                        times.push_back(renderer.get_frame_stats().get_frame_time());
+        }
+
+        std::sort(times.begin(), times.end());
+        *frame_time = times[times.size()/2];
+        return 0;
+}
+
+int32_t
+ConfigTuner::tune(Renderer& renderer, Scene& scene, memory_id tex_id)
+{
+        renderer.apply_tuned_configuration(scene);
+
+        m_best = renderer.config;
+        if (measure(renderer, scene, tex_id, m_best, &m_best_time))
+                return -1;
+
+        std::cout << "Tuner: starting at " << m_best_time << " ms\n";
+
+        /* The bvh is only rebuilt with the gpu builder */
+        uint32_t param_count = TUNE_PARAM_COUNT;
+        if (renderer.is_static_bvh())
+                param_count = TUNE_BVH_MAX_DEPTH;
+
+        for (uint32_t pass = 0; pass < m_max_passes; ++pass) {
+                bool improved = false;
+
+                for (uint32_t p = 0; p < param_count; ++p) {
+                        tuner_param param = tuner_param(p);
+                        double current = get_param(m_best, param);
+
+                        for (size_t c = 0; c < m_candidates[p].size(); ++c) {
+                                double value = m_candidates[p][c];
+                                if (value == current)
+                                        continue;
+
+                                RendererConfig conf = m_best;
+                                set_param(conf, param, value);
+
+                                double t;
+                                if (measure(renderer, scene, tex_id, conf, &t))
+                                        return -1;
+
+                                if (t < m_best_time) {
+                                        m_best = conf;
+                                        m_best_time = t;
+                                        improved = true;
+                                        std::cout << "Tuner: " << param_name(param)
+                                                  << " = " << value << ": " 
+                                                  << t << " ms\n";
+                                }
+                        }
+                }
+
+                if (!improved)
+                        break;
+        }
+
+        renderer.config = m_best;
+        renderer.clear_stats();
+        if (renderer.update_configuration())
+                return -1;
+
+        std::cout << "Tuner: best frame time " << m_best_time << " ms\n";
+        return 0;
+}
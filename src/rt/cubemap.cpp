@@ -1,3 +1,4 @@
+#include <vector>
 #include <rt/cubemap.hpp>
 
 int32_t 
@@ -9,6 +10,19 @@ Cubemap::initialize(std::string posx, std::string negx,
         if (!device.good() || m_initialized)
                 return -1;
 
+        if (!CLInfo::instance()->gl_sharing()) {
+                if (load_face_image(posx, &posx_id) ||
+                    load_face_image(negx, &negx_id) ||
+                    load_face_image(posy, &posy_id) ||
+                    load_face_image(negy, &negy_id) ||
+                    load_face_image(posz, &posz_id) ||
+                    load_face_image(negz, &negz_id))
+                        return -1;
+                m_initialized = true;
+                enabled = true;
+                return 0;
+        }
+
 	if (create_tex_gl_from_file(tex_width,tex_height,posx.c_str(),&posx_tex) ||
             create_tex_gl_from_file(tex_width,tex_height,negx.c_str(),&negx_tex) ||
             create_tex_gl_from_file(tex_width,tex_height,posy.c_str(),&posy_tex) ||
@@ -57,6 +71,62 @@ Cubemap::initialize(std::string posx, std::string negx,
 	return 0;
 }
 
+int32_t
+Cubemap::load_face_image(const std::string& file, memory_id* id)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        uint8_t* data;
+        if (read_tex_data_from_file(tex_width, tex_height, file.c_str(), &data))
+                return -1;
+
+        *id = device.new_memory();
+        int32_t err = device.memory(*id).initialize_image(tex_width, tex_height, 
+                                                          data);
+        delete[] data;
+        return err;
+}
+
+int32_t
+Cubemap::copy_from(Cubemap& cubemap, size_t command_queue_i)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        if (!device.good() || CLInfo::instance()->gl_sharing())
+                return -1;
+
+        if (m_initialized && destroy())
+                return -1;
+
+        enabled = cubemap.enabled;
+        if (!cubemap.m_initialized)
+                return 0;
+
+        tex_width = cubemap.tex_width;
+        tex_height = cubemap.tex_height;
+        if (copy_face(cubemap.posx_id, &posx_id, command_queue_i) ||
+            copy_face(cubemap.negx_id, &negx_id, command_queue_i) ||
+            copy_face(cubemap.posy_id, &posy_id, command_queue_i) ||
+            copy_face(cubemap.negy_id, &negy_id, command_queue_i) ||
+            copy_face(cubemap.posz_id, &posz_id, command_queue_i) ||
+            copy_face(cubemap.negz_id, &negz_id, command_queue_i))
+                return -1;
+
+        m_initialized = true;
+        return 0;
+}
+
+int32_t
+Cubemap::copy_face(memory_id src_id, memory_id* id, size_t command_queue_i)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        std::vector<uint8_t> pixels(4 * tex_width * tex_height);
+        if (device.memory(src_id).read_image(tex_width, tex_height, &pixels[0]))
+                return -1;
+
+        *id = device.new_memory(command_queue_i);
+        return device.memory(*id).initialize_image(tex_width, tex_height, 
+                                                   &pixels[0]);
+}
+
 int32_t 
 Cubemap::destroy() 
 {
@@ -72,6 +142,11 @@ Cubemap::destroy()
         device.delete_memory(posz_id);
         device.delete_memory(negz_id);
 
+        if (!CLInfo::instance()->gl_sharing()) {
+                m_initialized = false;
+                return 0;
+        }
+
         delete_tex_gl(posx_tex);
         delete_tex_gl(negx_tex);
         delete_tex_gl(posy_tex);
@@ -2,7 +2,11 @@
 #include <rt/material.hpp>
 
 FrameBuffer::FrameBuffer() 
- : m_initialized(false)
+ : m_accumulate(false)
+ , m_frame_count(0)
+ , m_exposure(1.f)
+ , m_initialized(false)
+ , m_cq(0)
 {}
 
 int32_t 
@@ -20,14 +24,32 @@ FrameBuffer::initialize(size_t sz[2])
 
 	int32_t img_mem_size = sizeof(color_int_cl) * size[0] * size[1];
 
-        img_mem_id = device.new_memory();
+        img_mem_id = device.new_memory(m_cq);
         
         DeviceMemory& img_mem = device.memory(img_mem_id);
         if (img_mem.initialize(img_mem_size, READ_WRITE_MEMORY))
                 return -1;
 
+	/*---------------------- Create accumulation mem ----------------------*/
+        acc_mem_id = device.new_memory(m_cq);
+
+        DeviceMemory& acc_mem = device.memory(acc_mem_id);
+        if (acc_mem.initialize(sizeof(cl_float4) * size[0] * size[1], 
+                               READ_WRITE_MEMORY))
+                return -1;
+        m_frame_count = 0;
+
+	/*---------------------- Create traversal heat mem ----------------------*/
+        heat_id = device.new_memory(m_cq);
+
+        std::vector<cl_uint> zero_heat(size[0] * size[1], 0);
+        DeviceMemory& heat_mem = device.memory(heat_id);
+        if (heat_mem.initialize(sizeof(cl_uint) * zero_heat.size(), &(zero_heat[0]),
+                                READ_WRITE_MEMORY))
+                return -1;
+
 	/*------------------------ Set up image init kernel info ---------------------*/
-        init_id = device.new_function();
+        init_id = device.new_function(m_cq);
         DeviceFunction& init_function = device.function(init_id);
 
         if (init_function.initialize("src/kernel/framebuffer.cl", "init"))
@@ -43,7 +65,7 @@ FrameBuffer::initialize(size_t sz[2])
                 return -1;
 
 	/*------------------------ Set up image copy kernel info ---------------------*/
-        copy_id = device.new_function();
+        copy_id = device.new_function(m_cq);
         DeviceFunction& copy_function = device.function(copy_id);
 
         if (copy_function.initialize("src/kernel/framebuffer.cl", "copy"))
@@ -55,9 +77,23 @@ FrameBuffer::initialize(size_t sz[2])
 
 
 	/* Arguments */
-        if (copy_function.set_arg(0, img_mem))
+        if (copy_function.set_arg(0, img_mem) ||
+            copy_function.set_arg(2, acc_mem))
                 return -1;
 
+	/*------------------------ Set up heatmap kernel info ---------------------*/
+        /* Only built if the heatmap is turned on */
+        heatmap_id = device.new_function(m_cq);
+        device.function(heatmap_id).defer("src/kernel/framebuffer.cl", "heatmap");
+
+	/*------------------------ Set up merge kernel info ---------------------*/
+        /* Only built if several devices render */
+        merge_id = device.new_function(m_cq);
+        device.function(merge_id).defer("src/kernel/framebuffer.cl", "merge");
+        /* Allocated by the first merge of a framebuffer of another context */
+        staging_img_id = device.new_memory(m_cq);
+        staging_heat_id = device.new_memory(m_cq);
+
 	m_timing = false;
         m_initialized = true;
 	return 0;
@@ -82,6 +118,17 @@ FrameBuffer::resize(size_t sz[2])
         if (img_mem.resize(img_mem_size))
                 return -1;
 
+        DeviceMemory& acc_mem = device.memory(acc_mem_id);
+        if (acc_mem.resize(sizeof(cl_float4) * size[0] * size[1]))
+                return -1;
+        m_frame_count = 0;
+
+        std::vector<cl_uint> zero_heat(size[0] * size[1], 0);
+        DeviceMemory& heat_mem = device.memory(heat_id);
+        if (heat_mem.resize(sizeof(cl_uint) * zero_heat.size()) ||
+            heat_mem.write(sizeof(cl_uint) * zero_heat.size(), &(zero_heat[0]), 0, m_cq))
+                return -1;
+
 	/*------------------------ Set init kernel arguments ---------------------*/
         DeviceFunction& init_function = device.function(init_id);
 
@@ -95,7 +142,8 @@ FrameBuffer::resize(size_t sz[2])
 
         size_t copy_work_size[] = {size[0] * size[1], 0, 0};
         copy_function.set_global_size(copy_work_size);
-        if (copy_function.set_arg(0, img_mem))
+        if (copy_function.set_arg(0, img_mem) ||
+            copy_function.set_arg(2, acc_mem))
                 return -1;
 
         return 0;
@@ -114,6 +162,76 @@ FrameBuffer::image_mem()
         return device.memory(img_mem_id);
 }
 
+memory_id
+FrameBuffer::heat_mem_id()
+{
+        return heat_id;
+}
+
+int32_t
+FrameBuffer::resolve_heatmap(float scale)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        if (!device.good() || scale <= 0.f)
+                return -1;
+
+        cl_float inv_scale = 1.f / scale;
+        DeviceFunction& heatmap_function = device.function(heatmap_id);
+        if (heatmap_function.set_arg(0, device.memory(img_mem_id)) ||
+            heatmap_function.set_arg(1, device.memory(heat_id)) ||
+            heatmap_function.set_arg(2, sizeof(cl_float), &inv_scale))
+                return -1;
+
+	if (heatmap_function.enqueue_single_dim(size[0]*size[1], 0, 0, m_cq))
+                return -1;
+        device.enqueue_barrier(m_cq);
+
+        return 0;
+}
+
+int32_t
+FrameBuffer::merge(FrameBuffer& fb)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        if (!device.good() || fb.size[0] != size[0] || fb.size[1] != size[1])
+                return -1;
+
+        DeviceMemory* fb_img_mem = &device.memory(fb.img_mem_id);
+        DeviceMemory* fb_heat_mem = &device.memory(fb.heat_id);
+        if (fb_img_mem->context() != device.memory(img_mem_id).context()) {
+                if (stage(*fb_img_mem, staging_img_id) ||
+                    stage(*fb_heat_mem, staging_heat_id))
+                        return -1;
+                fb_img_mem = &device.memory(staging_img_id);
+                fb_heat_mem = &device.memory(staging_heat_id);
+        }
+
+        DeviceFunction& merge_function = device.function(merge_id);
+        if (merge_function.set_arg(0, device.memory(img_mem_id)) ||
+            merge_function.set_arg(1, device.memory(heat_id)) ||
+            merge_function.set_arg(2, *fb_img_mem) ||
+            merge_function.set_arg(3, *fb_heat_mem))
+                return -1;
+
+	if (merge_function.enqueue_single_dim(size[0]*size[1], 0, 0, m_cq))
+                return -1;
+        device.enqueue_barrier(m_cq);
+
+        return 0;
+}
+
+int32_t
+FrameBuffer::stage(DeviceMemory& mem, memory_id staging_id)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        DeviceMemory& staging = device.memory(staging_id);
+        if (staging.valid() && staging.size() != mem.size() && staging.release())
+                return -1;
+        if (!staging.valid() && staging.initialize(mem.size(), READ_WRITE_MEMORY))
+                return -1;
+        return mem.copy_to(staging, 0, 0, 0, m_cq);
+}
+
 int32_t
 FrameBuffer::clear()
 {
@@ -125,11 +243,11 @@ FrameBuffer::clear()
 		m_clear_timer.snap_time();
 
 	// int32_t ret = device.function(init_id).execute();
-	if (device.function(init_id).enqueue_single_dim(size[0]*size[1]))
+	if (device.function(init_id).enqueue_single_dim(size[0]*size[1], 0, 0, m_cq))
                 return -1;
 
 	if (m_timing) {
-                device.finish_commands();
+                device.finish_commands(m_cq);
 		m_clear_time_ms= m_clear_timer.msec_since_snap();
         }
         
@@ -149,21 +267,55 @@ FrameBuffer::copy(DeviceMemory& tex_mem)
 		m_copy_timer.snap_time();
         
         
-        if (device.function(copy_id).set_arg(1, tex_mem))
+        if (m_accumulate)
+                m_frame_count++;
+        else
+                m_frame_count = 1;
+
+        DeviceFunction& copy_function = device.function(copy_id);
+        if (copy_function.set_arg(1, tex_mem) ||
+            copy_function.set_arg(3, sizeof(cl_int), &m_frame_count) ||
+            copy_function.set_arg(4, sizeof(cl_float), &m_exposure))
                 return -1;
         
-	if (device.function(copy_id).enqueue_single_dim(size[0]*size[1]))
+	if (copy_function.enqueue_single_dim(size[0]*size[1], 0, 0, m_cq))
                 return -1;
-        device.enqueue_barrier();
+        device.enqueue_barrier(m_cq);
 	// int32_t ret = device.function(copy_id).execute();
 	
         if (m_timing) {
-                device.finish_commands();
+                device.finish_commands(m_cq);
                 m_copy_time_ms= m_copy_timer.msec_since_snap();
         }
 	return 0;
 }
 
+void
+FrameBuffer::set_accumulation(bool b)
+{
+        if (b != m_accumulate)
+                m_frame_count = 0;
+        m_accumulate = b;
+}
+
+void
+FrameBuffer::reset_accumulation()
+{
+        m_frame_count = 0;
+}
+
+uint32_t
+FrameBuffer::accumulated_frames()
+{
+        return m_frame_count;
+}
+
+void
+FrameBuffer::set_exposure(float e)
+{
+        m_exposure = e;
+}
+
 void 
 FrameBuffer::timing(bool b)
 {
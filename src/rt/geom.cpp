@@ -39,6 +39,7 @@ GeometricProperties::updateTransform()
 	mat4x4 scaleM = scaleMatrix4x4(scale);
 	M = posM * rpyM * scaleM ;
         Minv = inverse(M);
+        dirty = true;
 }
 
 void 
@@ -0,0 +1,748 @@
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cmath>
+
+#include <cl-gl/opengl-init.hpp>
+#include <cl-gl/opencl-init.hpp>
+#include <gpu/scan.hpp>
+#include <rt/rt.hpp>
+#include <misc/bench-report.hpp>
+
+/*
+ * Microbenchmarks of the device primitives the renderer relies on. Each
+ * primitive is run over a sweep of sizes, a number of trials per size, with 
+ * its output checked against a host reference once per size. Results are 
+ * printed and written as JSON so regressions of a single primitive can be
+ * caught without rendering.
+ *
+ * usage: prim-bench [output.json] [trials] [max_log2_size]
+ */
+
+static const uint32_t MIN_LOG2_SIZE = 10;
+
+/*///////////////////////////// Statistics //////////////////////////////////*/
+
+struct TrialStats {
+
+        TrialStats(std::vector<double> times) {
+                std::sort(times.begin(), times.end());
+                double acc = 0;
+                for (size_t i = 0; i < times.size(); ++i)
+                        acc += times[i];
+                mean = times.empty()? 0 : acc/times.size();
+                double var = 0;
+                for (size_t i = 0; i < times.size(); ++i)
+                        var += (times[i]-mean) * (times[i]-mean);
+                stddev = times.size() > 1? sqrt(var/(times.size()-1)) : 0;
+                min = times.empty()? 0 : times.front();
+                max = times.empty()? 0 : times.back();
+                p50 = percentile(times, 50);
+                p90 = percentile(times, 90);
+        }
+
+        double mean, stddev, min, p50, p90, max;
+};
+
+/*///////////////////////////// Primitives //////////////////////////////////*/
+
+/* A primitive benchmark: setup allocates and fills the inputs for a size,
+   prepare restores inputs a trial modifies (untimed) and run enqueues the 
+   primitive once. Returned times include a finish of the queue. */
+class PrimitiveBench {
+public:
+        virtual ~PrimitiveBench() {}
+        virtual const char* name() = 0;
+        /* Bytes moved per element, used to report bandwidth */
+        virtual double  bytes_per_element() {return 0;}
+        virtual size_t  max_size() {return size_t(-1);}
+        virtual int32_t setup(size_t n) = 0;
+        virtual int32_t prepare() {return 0;}
+        virtual int32_t run() = 0;
+        virtual bool    check() {return true;}
+        virtual void    release() = 0;
+};
+
+static void random_uints(std::vector<cl_uint>& v, cl_uint modulo)
+{
+        for (size_t i = 0; i < v.size(); ++i)
+                v[i] = rand() % modulo;
+}
+
+static void release_mem(memory_id id)
+{
+        DeviceInterface::instance()->delete_memory(id);
+}
+
+//////////////////////////////// Upload / readback
+class UploadBench : public PrimitiveBench {
+public:
+        const char* name() {return "upload";}
+        double bytes_per_element() {return sizeof(cl_uint);}
+        int32_t setup(size_t n) {
+                DeviceInterface& device = *DeviceInterface::instance();
+                host.resize(n);
+                random_uints(host, 1 << 30);
+                mem_id = device.new_memory();
+                return device.memory(mem_id).initialize(n * sizeof(cl_uint));
+        }
+        int32_t run() {
+                DeviceInterface& device = *DeviceInterface::instance();
+                return device.memory(mem_id).write(host.size() * sizeof(cl_uint),
+                                                   &(host[0]));
+        }
+        void release() {release_mem(mem_id);}
+protected:
+        std::vector<cl_uint> host;
+        memory_id mem_id;
+};
+
+class ReadbackBench : public UploadBench {
+public:
+        const char* name() {return "readback";}
+        int32_t setup(size_t n) {
+                if (UploadBench::setup(n) || UploadBench::run())
+                        return -1;
+                out.resize(n);
+                return 0;
+        }
+        int32_t run() {
+                DeviceInterface& device = *DeviceInterface::instance();
+                return device.memory(mem_id).read(out.size() * sizeof(cl_uint),
+                                                  &(out[0]));
+        }
+        bool check() {return out == host;}
+private:
+        std::vector<cl_uint> out;
+};
+
+//////////////////////////////// Scan
+class ScanBench : public PrimitiveBench {
+public:
+        const char* name() {return "scan_uint";}
+        double bytes_per_element() {return 2 * sizeof(cl_uint);}
+        int32_t setup(size_t n) {
+                DeviceInterface& device = *DeviceInterface::instance();
+                host.resize(n);
+                random_uints(host, 4);
+                in_id = device.new_memory();
+                out_id = device.new_memory();
+                if (device.memory(in_id).initialize(n * sizeof(cl_uint), &(host[0]),
+                                                    READ_WRITE_MEMORY) ||
+                    device.memory(out_id).initialize((n+1) * sizeof(cl_uint)))
+                        return -1;
+                return 0;
+        }
+        int32_t run() {
+                DeviceInterface& device = *DeviceInterface::instance();
+                return gpu_scan_uint(device, in_id, host.size(), out_id);
+        }
+        bool check() {
+                DeviceInterface& device = *DeviceInterface::instance();
+                std::vector<cl_uint> out(host.size()+1);
+                if (device.memory(out_id).read(out.size() * sizeof(cl_uint), &(out[0])))
+                        return false;
+                cl_uint acc = 0;
+                for (size_t i = 0; i < host.size(); ++i) {
+                        if (out[i] != acc)
+                                return false;
+                        acc += host[i];
+                }
+                return out[host.size()] == acc;
+        }
+        void release() {release_mem(in_id); release_mem(out_id);}
+private:
+        std::vector<cl_uint> host;
+        memory_id in_id, out_id;
+};
+
+//////////////////////////////// Stream compaction (single pass)
+class CompactBench : public PrimitiveBench {
+public:
+        const char* name() {return "compact";}
+        double bytes_per_element() {return 2 * sizeof(cl_uint);}
+        int32_t setup(size_t n) {
+                DeviceInterface& device = *DeviceInterface::instance();
+                flags.resize(n);
+                random_uints(flags, 2);
+                flags_id = device.new_memory();
+                ids_id = device.new_memory();
+                count_id = device.new_memory();
+                if (device.memory(flags_id).initialize(flags.size() * sizeof(cl_uint),
+                                                       &(flags[0]), READ_WRITE_MEMORY) ||
+                    device.memory(ids_id).initialize(n * sizeof(cl_int)) ||
+                    device.memory(count_id).initialize(sizeof(cl_uint)))
+                        return -1;
+                return 0;
+        }
+        int32_t run() {
+                DeviceInterface& device = *DeviceInterface::instance();
+                return gpu_compact_uint(device, flags_id, flags.size(), 
+                                        ids_id, count_id);
+        }
+        bool check() {
+                DeviceInterface& device = *DeviceInterface::instance();
+                size_t n = flags.size();
+                std::vector<cl_int> ids(n);
+                cl_uint count;
+                if (device.memory(ids_id).read(n * sizeof(cl_int), &(ids[0])) ||
+                    device.memory(count_id).read(sizeof(cl_uint), &count))
+                        return false;
+                size_t j = 0;
+                for (size_t i = 0; i < n; ++i) {
+                        if (flags[i] && ids[j++] != (cl_int)i)
+                                return false;
+                }
+                return j == count;
+        }
+        void release() {
+                release_mem(flags_id); release_mem(ids_id); release_mem(count_id);
+        }
+private:
+        std::vector<cl_uint> flags;
+        memory_id flags_id, ids_id, count_id;
+};
+
+//////////////////////////////// BVH builder primitives
+/* Triangle strip over random points, n triangles use n+2 vertices */
+static void random_strip(size_t n, std::vector<Vertex>& vertices, 
+                         std::vector<Triangle>& triangles)
+{
+        vertices.resize(n+2);
+        for (size_t i = 0; i < vertices.size(); ++i) {
+                vertices[i].position.s[0] = (rand() % 10000) * 0.01f;
+                vertices[i].position.s[1] = (rand() % 10000) * 0.01f;
+                vertices[i].position.s[2] = (rand() % 10000) * 0.01f;
+        }
+        triangles.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+                triangles[i].v[0] = i;
+                triangles[i].v[1] = i+1;
+                triangles[i].v[2] = i+2;
+        }
+}
+
+class PrimitiveBBoxBench : public PrimitiveBench {
+public:
+        PrimitiveBBoxBench(function_id f) : bbox_id(f) {}
+        const char* name() {return "build_primitive_bbox";}
+        double bytes_per_element() {
+                return sizeof(Vertex) + sizeof(Triangle) + sizeof(BBox) + sizeof(cl_uint);
+        }
+        int32_t setup(size_t n) {
+                DeviceInterface& device = *DeviceInterface::instance();
+                random_strip(n, vertices, triangles);
+                vertex_id = device.new_memory();
+                index_id = device.new_memory();
+                bboxes_id = device.new_memory();
+                tris_id = device.new_memory();
+                if (device.memory(vertex_id).initialize(vertices.size() * sizeof(Vertex),
+                                                        &(vertices[0]), READ_ONLY_MEMORY) ||
+                    device.memory(index_id).initialize(n * sizeof(Triangle),
+                                                       &(triangles[0]), READ_ONLY_MEMORY) ||
+                    device.memory(bboxes_id).initialize(n * sizeof(BBox)) ||
+                    device.memory(tris_id).initialize(n * sizeof(cl_uint)))
+                        return -1;
+                return 0;
+        }
+        int32_t run() {
+                DeviceInterface& device = *DeviceInterface::instance();
+                DeviceFunction& f = device.function(bbox_id);
+                if (f.set_arg(0, device.memory(vertex_id)) ||
+                    f.set_arg(1, device.memory(index_id)) ||
+                    f.set_arg(2, device.memory(bboxes_id)) ||
+                    f.set_arg(3, device.memory(tris_id)) ||
+                    f.enqueue_simple(triangles.size()))
+                        return -1;
+                device.enqueue_barrier();
+                return 0;
+        }
+        bool check() {
+                DeviceInterface& device = *DeviceInterface::instance();
+                size_t n = triangles.size();
+                std::vector<BBox> bboxes(n);
+                if (device.memory(bboxes_id).read(n * sizeof(BBox), &(bboxes[0])))
+                        return false;
+                for (size_t i = 0; i < n; ++i) {
+                        const Triangle& t = triangles[i];
+                        BBox ref(vertices[t.v[0]], vertices[t.v[1]], vertices[t.v[2]]);
+                        for (int k = 0; k < 3; ++k) {
+                                if (ref.hi.s[k] != bboxes[i].hi.s[k] ||
+                                    ref.lo.s[k] != bboxes[i].lo.s[k])
+                                        return false;
+                        }
+                }
+                return true;
+        }
+        void release() {
+                release_mem(vertex_id); release_mem(index_id);
+                release_mem(bboxes_id); release_mem(tris_id);
+        }
+private:
+        function_id bbox_id;
+        std::vector<Vertex> vertices;
+        std::vector<Triangle> triangles;
+        memory_id vertex_id, index_id, bboxes_id, tris_id;
+};
+
+/* Same encoding as morton_encode in bvh-builder.cl: the cell of the bbox 
+   center along each axis, with the bits of the three axes interleaved */
+static const cl_int MORTON_DEPTH = 32;
+
+static cl_uint2 morton_code(const BBox& bbox, const BBox& global)
+{
+        cl_uint cells[3];
+        float scale = powf(2.f, ceilf(MORTON_DEPTH / 3.f));
+        for (int k = 0; k < 3; ++k) {
+                float center = (bbox.hi.s[k] + bbox.lo.s[k]) * 0.5f;
+                float inv_size = 1.f / (global.hi.s[k] - global.lo.s[k]);
+                float slice = (center - global.lo.s[k]) * inv_size;
+                slice = std::max(0.f, std::min(1.f, slice));
+                cells[k] = cl_uint(slice * scale);
+        }
+
+        cl_uint2 code;
+        code.s[0] = code.s[1] = 0;
+        int offset = MORTON_DEPTH % 3 ? 3 - MORTON_DEPTH % 3 : 0;
+        int axis = (offset + 1) % 3;
+        for (int i = 0; i < MORTON_DEPTH; ++i) {
+                int src_bit = (i + offset) / 3;
+                code.s[i / 32] |= ((cells[axis] >> src_bit) & 1) << (i % 32);
+                axis = (axis + 1) % 3;
+        }
+        return code;
+}
+
+/* Back from a code to the cells it was made of */
+static void morton_cells(const cl_uint2& code, int32_t* cells)
+{
+        cells[0] = cells[1] = cells[2] = 0;
+        int offset = MORTON_DEPTH % 3 ? 3 - MORTON_DEPTH % 3 : 0;
+        int axis = (offset + 1) % 3;
+        for (int i = 0; i < MORTON_DEPTH; ++i) {
+                int src_bit = (i + offset) / 3;
+                cells[axis] |= ((code.s[i / 32] >> (i % 32)) & 1) << src_bit;
+                axis = (axis + 1) % 3;
+        }
+}
+
+class MortonEncodeBench : public PrimitiveBench {
+public:
+        MortonEncodeBench(function_id f) : encode_id(f) {}
+        const char* name() {return "morton_encode";}
+        double bytes_per_element() {return sizeof(BBox) + sizeof(cl_uint2);}
+        int32_t setup(size_t n) {
+                DeviceInterface& device = *DeviceInterface::instance();
+                std::vector<Vertex> vertices;
+                std::vector<Triangle> triangles;
+                random_strip(n, vertices, triangles);
+                bboxes.resize(n);
+                for (size_t i = 0; i < n; ++i) {
+                        const Triangle& t = triangles[i];
+                        bboxes[i].set(vertices[t.v[0]], vertices[t.v[1]], vertices[t.v[2]]);
+                        if (i == 0)
+                                global = bboxes[i];
+                        else
+                                global.merge(bboxes[i]);
+                }
+                count = n;
+                bboxes_id = device.new_memory();
+                global_id = device.new_memory();
+                morton_id = device.new_memory();
+                if (device.memory(bboxes_id).initialize(n * sizeof(BBox), &(bboxes[0]),
+                                                        READ_ONLY_MEMORY) ||
+                    device.memory(global_id).initialize(sizeof(BBox), &global,
+                                                        READ_ONLY_MEMORY) ||
+                    device.memory(morton_id).initialize(n * sizeof(cl_uint2)))
+                        return -1;
+                return 0;
+        }
+        int32_t run() {
+                DeviceInterface& device = *DeviceInterface::instance();
+                DeviceFunction& f = device.function(encode_id);
+                cl_int depth = MORTON_DEPTH;
+                if (f.set_arg(0, device.memory(bboxes_id)) ||
+                    f.set_arg(1, device.memory(global_id)) ||
+                    f.set_arg(2, device.memory(morton_id)) ||
+                    f.set_arg(3, sizeof(cl_int), &depth) ||
+                    f.enqueue_simple(count))
+                        return -1;
+                device.enqueue_barrier();
+                return 0;
+        }
+        bool check() {
+                DeviceInterface& device = *DeviceInterface::instance();
+                std::vector<cl_uint2> codes(count);
+                if (device.memory(morton_id).read(count * sizeof(cl_uint2), &(codes[0])))
+                        return false;
+                for (size_t i = 0; i < count; ++i) {
+                        int32_t ref[3], out[3];
+                        morton_cells(morton_code(bboxes[i], global), ref);
+                        morton_cells(codes[i], out);
+                        /* Rounding may put a center on a cell boundary in 
+                           the next cell */
+                        for (int k = 0; k < 3; ++k) {
+                                if (abs(ref[k] - out[k]) > 1)
+                                        return false;
+                        }
+                }
+                return true;
+        }
+        void release() {
+                release_mem(bboxes_id); release_mem(global_id); release_mem(morton_id);
+        }
+private:
+        function_id encode_id;
+        size_t count;
+        std::vector<BBox> bboxes;
+        BBox global;
+        memory_id bboxes_id, global_id, morton_id;
+};
+
+/* Same bitonic network as BVHBuilder::build_lbvh */
+class MortonSortBench : public PrimitiveBench {
+public:
+        MortonSortBench(function_id s2, function_id s4, 
+                        function_id s8, function_id s16) {
+                sorter_ids[0] = s2; sorter_ids[1] = s4;
+                sorter_ids[2] = s8; sorter_ids[3] = s16;
+        }
+        const char* name() {return "morton_sort";}
+        int32_t setup(size_t n) {
+                DeviceInterface& device = *DeviceInterface::instance();
+                codes.resize(2*n);
+                random_uints(codes, 1 << 30);
+                identity.resize(n);
+                for (size_t i = 0; i < n; ++i)
+                        identity[i] = i;
+                codes_id = device.new_memory();
+                tris_id = device.new_memory();
+                if (device.memory(codes_id).initialize(codes.size() * sizeof(cl_uint),
+                                                       &(codes[0]), READ_ONLY_MEMORY) ||
+                    device.memory(tris_id).initialize(n * sizeof(cl_uint)))
+                        return -1;
+                return 0;
+        }
+        int32_t prepare() {
+                DeviceInterface& device = *DeviceInterface::instance();
+                return device.memory(tris_id).write(identity.size() * sizeof(cl_uint),
+                                                    &(identity[0]));
+        }
+        int32_t run() {
+                DeviceInterface& device = *DeviceInterface::instance();
+                int size = identity.size();
+                int padded_size = 1;
+                while (padded_size < size)
+                        padded_size <<= 1;
+
+                size_t work_items[4];
+                work_items[0] = size/2 + (size%2);
+                work_items[1] = size/4 + (size-size%4);
+                work_items[2] = size/8 + (size-size%8);
+                work_items[3] = size/16 + (size-size%16);
+
+                for (int s = 0; s < 4; ++s) {
+                        DeviceFunction& sorter = device.function(sorter_ids[s]);
+                        if (sorter.set_arg(0, device.memory(codes_id)) ||
+                            sorter.set_arg(1, device.memory(tris_id)))
+                                return -1;
+                }
+
+                for (int len = 1; len < padded_size; len<<=1) {
+                        int dir = (len<<1);
+                        int inv = ((size-1)&dir) == 0 && dir != padded_size;
+                        int last_step = dir == padded_size;
+                        for (int inc = len; inc > 0; inc >>= 1) {
+                                int s;
+                                if (inc > 4) {
+                                        inc >>= 3; s = 3;
+                                } else if (inc > 2) {
+                                        inc >>= 2; s = 2;
+                                } else if (inc > 1) {
+                                        inc >>= 1; s = 1;
+                                } else {
+                                        s = 0;
+                                }
+                                DeviceFunction& sorter = device.function(sorter_ids[s]);
+                                if (sorter.set_arg(2, sizeof(int), &inc) ||
+                                    sorter.set_arg(3, sizeof(int), &dir) ||
+                                    sorter.set_arg(4, sizeof(int), &inv) ||
+                                    sorter.set_arg(5, sizeof(int), &last_step) ||
+                                    sorter.set_arg(6, sizeof(int), &size) ||
+                                    sorter.enqueue_simple(work_items[s]))
+                                        return -1;
+                                device.enqueue_barrier();
+                        }
+                }
+                return 0;
+        }
+        bool check() {
+                DeviceInterface& device = *DeviceInterface::instance();
+                std::vector<cl_uint> tris(identity.size());
+                if (device.memory(tris_id).read(tris.size() * sizeof(cl_uint), &(tris[0])))
+                        return false;
+                for (size_t i = 1; i < tris.size(); ++i) {
+                        const cl_uint* a = &codes[2*tris[i-1]];
+                        const cl_uint* b = &codes[2*tris[i]];
+                        if (b[1] < a[1] || (b[1] == a[1] && b[0] < a[0]))
+                                return false;
+                }
+                return true;
+        }
+        void release() {release_mem(codes_id); release_mem(tris_id);}
+private:
+        function_id sorter_ids[4];
+        std::vector<cl_uint> codes;
+        std::vector<cl_uint> identity;
+        memory_id codes_id, tris_id;
+};
+
+//////////////////////////////// Framebuffer
+/* Sizes are pixel counts of a square framebuffer */
+class FrameBufferBench : public PrimitiveBench {
+public:
+        FrameBufferBench(bool copy) : m_copy(copy), initialized(false) {}
+        const char* name() {return m_copy? "fb_copy" : "fb_init";}
+        double bytes_per_element() {return sizeof(color_int_cl);}
+        size_t max_size() {return 1 << 22;}
+        int32_t setup(size_t n) {
+                DeviceInterface& device = *DeviceInterface::instance();
+                size_t side = sqrt(double(n)) + 0.5;
+                size_t sz[] = {side, side};
+                if (!initialized) {
+                        if (framebuffer.initialize(sz))
+                                return -1;
+                        initialized = true;
+                } else if (framebuffer.resize(sz)) {
+                        return -1;
+                }
+                if (!m_copy)
+                        return 0;
+                gl_tex = create_tex_gl(side, side);
+                tex_id = device.new_memory();
+                return device.memory(tex_id).initialize_from_gl_texture(gl_tex);
+        }
+        int32_t run() {
+                if (!m_copy)
+                        return framebuffer.clear();
+                DeviceInterface& device = *DeviceInterface::instance();
+                if (device.acquire_graphic_resource(tex_id) ||
+                    framebuffer.copy(device.memory(tex_id)) ||
+                    device.release_graphic_resource(tex_id))
+                        return -1;
+                return 0;
+        }
+        void release() {
+                if (!m_copy)
+                        return;
+                release_mem(tex_id);
+                glDeleteTextures(1, &gl_tex);
+        }
+private:
+        bool m_copy;
+        bool initialized;
+        FrameBuffer framebuffer;
+        GLuint gl_tex;
+        memory_id tex_id;
+};
+
+/*///////////////////////////// Driver //////////////////////////////////////*/
+
+struct BenchResult {
+        std::string name;
+        size_t      size;
+        bool        valid;
+        double      bytes_per_element;
+        std::vector<double> times;
+};
+
+static int32_t run_bench(PrimitiveBench& bench, size_t n, uint32_t trials,
+                         BenchResult* result)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        rt_time_t timer;
+
+        result->name = bench.name();
+        result->size = n;
+        result->bytes_per_element = bench.bytes_per_element();
+        result->times.clear();
+
+        if (bench.setup(n)) {
+                std::cerr << "Failed to set up " << bench.name() << "\n";
+                return -1;
+        }
+
+        /* One untimed run, also used to check the output */
+        if (bench.prepare() || bench.run() || device.finish_commands()) {
+                std::cerr << "Failed to run " << bench.name() << "\n";
+                return -1;
+        }
+        result->valid = bench.check();
+
+        for (uint32_t t = 0; t < trials; ++t) {
+                if (bench.prepare() || device.finish_commands())
+                        return -1;
+                timer.snap_time();
+                if (bench.run() || device.finish_commands())
+                        return -1;
+                result->times.push_back(timer.msec_since_snap());
+        }
+
+        bench.release();
+        return 0;
+}
+
+static void write_json(std::ostream& o, const std::vector<BenchResult>& results,
+                       uint32_t trials)
+{
+        char device_name[256] = {0};
+        clGetDeviceInfo(CLInfo::instance()->device_id, CL_DEVICE_NAME,
+                        sizeof(device_name)-1, device_name, NULL);
+
+        o << "{\n";
+        o << "  \"device\": " << json_string(device_name) << ",\n";
+        o << "  \"trials\": " << trials << ",\n";
+        o << "  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+                const BenchResult& r = results[i];
+                TrialStats s(r.times);
+                double melems = s.p50 > 0 ? r.size / s.p50 * 1e-3 : 0;
+                double gbs = s.p50 > 0 ? 
+                        r.size * r.bytes_per_element / s.p50 * 1e-6 : 0;
+                o << "    {\"primitive\": " << json_string(r.name)
+                  << ", \"size\": " << r.size
+                  << ", \"valid\": " << (r.valid? "true" : "false")
+                  << ", \"time_ms\": {\"mean\": " << s.mean
+                  << ", \"stddev\": " << s.stddev
+                  << ", \"min\": " << s.min
+                  << ", \"p50\": " << s.p50
+                  << ", \"p90\": " << s.p90
+                  << ", \"max\": " << s.max << "}"
+                  << ", \"melems_per_sec\": " << melems
+                  << ", \"gb_per_sec\": " << gbs
+                  << "}" << (i+1 < results.size()? ",\n" : "\n");
+        }
+        o << "  ]\n";
+        o << "}\n";
+}
+
+int main (int argc, char** argv)
+{
+        std::string output = "prim-bench.json";
+        uint32_t trials = 20;
+        uint32_t max_log2_size = 20;
+        if (argc > 1)
+                output = argv[1];
+        if (argc > 2)
+                trials = std::max(atoi(argv[2]), 1);
+        if (argc > 3)
+                max_log2_size = std::max(atoi(argv[3]), int(MIN_LOG2_SIZE));
+
+        /*---------------------- Initialize OpenGL and OpenCL ----------------------*/
+        size_t window_size[] = {1,1};
+        GLInfo* glinfo = GLInfo::instance();
+        if (glinfo->initialize(argc,argv, window_size, "RT primitives") != 0){
+                std::cerr << "Failed to initialize GL" << "\n";
+                return 1;
+        }
+        glutHideWindow();
+
+        CLInfo* clinfo = CLInfo::instance();
+        if (clinfo->initialize(2) != CL_SUCCESS){
+                std::cerr << "Failed to initialize CL" << "\n";
+                return 1;
+        }
+        clinfo->set_sync(false);
+
+        DeviceInterface* device = DeviceInterface::instance();
+        if (device->initialize()) {
+                std::cerr << "Failed to initialize device interface" << "\n";
+                return 1;
+        }
+
+        if (DeviceFunctionLibrary::instance()->initialize()) {
+                std::cerr << "Failed to initialize function library" << "\n";
+                return 1;
+        }
+
+        /*---------------------- Load kernels ----------------------------*/
+        std::vector<std::string> builder_names;
+        builder_names.push_back("build_primitive_bbox");
+        builder_names.push_back("morton_encode");
+        std::vector<function_id> builder_ids = 
+                device->build_functions("src/kernel/bvh-builder.cl", builder_names);
+
+        std::vector<std::string> sorter_names;
+        sorter_names.push_back("morton_sort_g2");
+        sorter_names.push_back("morton_sort_g4");
+        sorter_names.push_back("morton_sort_g8");
+        sorter_names.push_back("morton_sort_g16");
+        std::vector<function_id> sorter_ids = 
+                device->build_functions("src/kernel/bvh-builder-sort.cl", sorter_names);
+
+        if (!builder_ids.size() || !sorter_ids.size()) {
+                std::cerr << "Failed to build kernels" << "\n";
+                return 1;
+        }
+
+        std::vector<PrimitiveBench*> benches;
+        benches.push_back(new UploadBench);
+        benches.push_back(new ReadbackBench);
+        benches.push_back(new ScanBench);
+        benches.push_back(new CompactBench);
+        benches.push_back(new PrimitiveBBoxBench(builder_ids[0]));
+        benches.push_back(new MortonEncodeBench(builder_ids[1]));
+        benches.push_back(new MortonSortBench(sorter_ids[0], sorter_ids[1],
+                                              sorter_ids[2], sorter_ids[3]));
+        benches.push_back(new FrameBufferBench(false));
+        benches.push_back(new FrameBufferBench(true));
+
+        /*---------------------- Run ----------------------------------*/
+        std::vector<BenchResult> results;
+        bool all_valid = true;
+        std::cout << "primitive              size      p50 ms    stddev    Melem/s  ok\n";
+        for (size_t b = 0; b < benches.size(); ++b) {
+                /* Even powers of 2, so framebuffer sizes are square */
+                for (uint32_t l = MIN_LOG2_SIZE; l <= max_log2_size; l += 2) {
+                        size_t n = size_t(1) << l;
+                        if (n > benches[b]->max_size())
+                                break;
+
+                        BenchResult r;
+                        if (run_bench(*benches[b], n, trials, &r))
+                                return 1;
+                        results.push_back(r);
+                        all_valid = all_valid && r.valid;
+
+                        TrialStats s(r.times);
+                        std::ostringstream line;
+                        line.width(22); line.setf(std::ios::left);
+                        line << r.name;
+                        line.unsetf(std::ios::left);
+                        line.width(9);  line << n;
+                        line.width(10); line << s.p50;
+                        line.width(10); line << s.stddev;
+                        line.width(11); line << (s.p50 > 0? n / s.p50 * 1e-3 : 0);
+                        line << "  " << (r.valid? "yes" : "NO");
+                        std::cout << line.str() << "\n";
+                }
+                delete benches[b];
+        }
+
+        std::ofstream out(output.c_str());
+        if (!out.good()) {
+                std::cerr << "Unable to open " << output << "\n";
+                return 1;
+        }
+        write_json(out, results, trials);
+        out.close();
+        std::cout << "Wrote " << output << "\n";
+
+        CLInfo::instance()->set_sync(true);
+        CLInfo::instance()->release_resources();
+
+        /* A failed check is reported through the exit code */
+        return all_valid? 0 : 2;
+}
@@ -7,6 +7,7 @@
 
 PrimaryRayGenerator::PrimaryRayGenerator()
         : m_initialized(false)
+        , m_cq(0)
 {}
 
 int32_t
@@ -26,8 +27,10 @@ PrimaryRayGenerator::initialize()
         kernel_names.push_back("generate_primary_rays_zcurve");
 
         std::vector<function_id> function_ids;
-        function_ids = device.build_functions("src/kernel/primary-ray-generator.cl", 
-                                              kernel_names);
+        /* Compiled on first use, the linear layout usually runs as a
+           specialized variant and the generic kernel is never built */
+        function_ids = device.defer_functions("src/kernel/primary-ray-generator.cl", 
+                                              kernel_names, BuildOptions(), m_cq);
 
         if (!function_ids.size())
                 return -1;
@@ -38,7 +41,7 @@ PrimaryRayGenerator::initialize()
 	m_timing = false;
 	m_spp = 1;
 
-        pixel_samples_id = device.new_memory();
+        pixel_samples_id = device.new_memory(m_cq);
         DeviceMemory& pixel_samples_mem = device.memory(pixel_samples_id);
         pixel_sample_cl single_pixel_sample = {0.f,0.f,1.f};
         if (pixel_samples_mem.initialize(m_spp * sizeof(pixel_sample_cl), 
@@ -49,6 +52,11 @@ PrimaryRayGenerator::initialize()
         m_initialized = true;
         m_use_zcurve  = false;
         m_quad_size   = 32;
+        set_jitter(0.f, 0.f);
+
+        ProgramCache::instance()->prefetch("src/kernel/primary-ray-generator.cl",
+                                           variant_options(),
+                                           CLInfo::instance()->queue_context(m_cq));
 	return 0;
 	
 }
@@ -76,6 +84,16 @@ PrimaryRayGenerator::generate(const Camera& cam, RayBundle& bundle, size_t size[
 
         function_id gen_id = use_zcurve ? generator_zcurve_id : generator_id;
 
+        /* Block layout with the quad size and sample count folded in */
+        if (!use_zcurve) {
+                function_id variant_id = 
+                        device.function_variant("src/kernel/primary-ray-generator.cl",
+                                                "generate_primary_rays",
+                                                variant_options(), m_cq);
+                if (device.valid_function_id(variant_id))
+                        gen_id = variant_id;
+        }
+
         DeviceFunction& generator = device.function(gen_id);
 
 	/*-------------- Set cam parameters as arguments ------------------*/
@@ -117,14 +135,17 @@ PrimaryRayGenerator::generate(const Camera& cam, RayBundle& bundle, size_t size[
         if (generator.set_arg(9, device.memory(pixel_samples_id)))
                 return -1;
 
-        size_t group_size = generator.max_group_size();
+        if (generator.set_arg(10, sizeof(cl_float2), &m_jitter))
+                return -1;
+
+        size_t group_size = generator.work_group_size(ray_count, 0, "", m_cq);
 
 	/*------------------- Execute kernel to create rays ------------*/
-        int32_t ret = generator.enqueue_single_dim(ray_count, group_size, offset);
-        device.enqueue_barrier();
+        int32_t ret = generator.enqueue_single_dim(ray_count, group_size, offset, m_cq);
+        device.enqueue_barrier(m_cq);
 
 	if (m_timing) {
-            device.finish_commands();
+            device.finish_commands(m_cq);
             m_time_ms = m_timer.msec_since_snap();
         }
 
@@ -173,17 +194,27 @@ PrimaryRayGenerator::set_spp(size_t spp, pixel_sample_cl const* pixel_samples)
                 return -1;
 
 	m_spp = spp;
+        ProgramCache::instance()->prefetch("src/kernel/primary-ray-generator.cl",
+                                           variant_options(),
+                                           CLInfo::instance()->queue_context(m_cq));
 
         DeviceMemory& pixel_samples_mem = device.memory(pixel_samples_id);
 
         if (pixel_samples_mem.resize(spp * sizeof(pixel_sample_cl)))
                 return -1;
-        if (pixel_samples_mem.write(spp * sizeof(pixel_sample_cl), pixel_samples))
+        if (pixel_samples_mem.write(spp * sizeof(pixel_sample_cl), pixel_samples, 0, m_cq))
                 return -1;
 
 	return 0;
 }
 
+void
+PrimaryRayGenerator::set_jitter(float ox, float oy)
+{
+        m_jitter.s[0] = ox;
+        m_jitter.s[1] = oy;
+}
+
 size_t
 PrimaryRayGenerator::get_spp() const
 {
@@ -214,4 +245,17 @@ PrimaryRayGenerator::update_configuration(const RendererConfig& conf)
 {
         m_use_zcurve = conf.prim_ray_use_zcurve;
         m_quad_size  = conf.prim_ray_quad_size;
+
+        if (m_initialized && !m_use_zcurve)
+                ProgramCache::instance()->prefetch("src/kernel/primary-ray-generator.cl",
+                                                   variant_options(),
+                                                   CLInfo::instance()->queue_context(m_cq));
+}
+
+BuildOptions
+PrimaryRayGenerator::variant_options() const
+{
+        return BuildOptions().
+                define("PRIMARY_QUAD_SIZE", m_quad_size).
+                define("PRIMARY_SPP", m_spp);
 }
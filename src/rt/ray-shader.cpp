@@ -1,4 +1,23 @@
+#include <algorithm>
+
 #include <rt/ray-shader.hpp>
+#include <gpu/scan.hpp>
+
+/* Orders materials by texture so that buckets sharing a texture are
+   shaded next to each other */
+struct TextureOrder {
+        TextureOrder(const std::vector<material_cl>& mats) : materials(mats) {}
+        bool operator()(uint32_t a, uint32_t b) const {
+                if (materials[a].texture != materials[b].texture)
+                        return materials[a].texture < materials[b].texture;
+                return a < b;
+        }
+        const std::vector<material_cl>& materials;
+};
+
+RayShader::RayShader()
+        : m_cq(0)
+{}
 
 int32_t 
 RayShader::initialize()
@@ -8,23 +27,43 @@ RayShader::initialize()
                 return -1;
 
         /*------------------------ Set up ray shading kernel info ---------------------*/
-        p_shade_id = device.new_function();
-        DeviceFunction& p_shade_function = device.function(p_shade_id);
-
-        if (p_shade_function.initialize("src/kernel/ray-shader.cl", "shade_primary"))
-                return -1;
-
-        p_shade_function.set_dims(1);
-
-
-        s_shade_id = device.new_function();
-        DeviceFunction& s_shade_function = device.function(s_shade_id);
-
-        if (s_shade_function.initialize("src/kernel/ray-shader.cl", "shade_secondary"))
-                return -1;
-
-        s_shade_function.set_dims(1);
-
+        /* The generic kernels are deferred, shading normally runs on the
+           variants built for the scene lights and cubemap */
+        p_shade_id = device.new_function(m_cq);
+        device.function(p_shade_id).defer("src/kernel/ray-shader.cl", "shade_primary");
+
+        s_shade_id = device.new_function(m_cq);
+        device.function(s_shade_id).defer("src/kernel/ray-shader.cl", "shade_secondary");
+
+        /*------------------------ Material sorted shading ----------------------------*/
+        std::vector<std::string> sort_names;
+        sort_names.push_back("shade_sorted");
+        sort_names.push_back("material_histogram");
+        sort_names.push_back("material_scatter");
+
+        std::vector<function_id> sort_ids;
+        sort_ids = device.defer_functions("src/kernel/ray-shader.cl", sort_names,
+                                          BuildOptions(), m_cq);
+        if (!sort_ids.size())
+                return -1;
+
+        sorted_shade_id = sort_ids[0];
+        histogram_id    = sort_ids[1];
+        scatter_id      = sort_ids[2];
+
+        /* Buffers are resized as needed */
+        bucket_map_id = device.new_memory(m_cq);
+        keys_id = device.new_memory(m_cq);
+        counts_id = device.new_memory(m_cq);
+        order_id = device.new_memory(m_cq);
+        if (device.memory(bucket_map_id).initialize(sizeof(cl_uint)) ||
+            device.memory(keys_id).initialize(sizeof(cl_uint)) ||
+            device.memory(counts_id).initialize(sizeof(cl_uint)) ||
+            device.memory(order_id).initialize(sizeof(cl_int)))
+                return -1;
+
+        m_bucket_count = 0;
+        m_sort = false;
         m_timing = false;
         return 0;
 }
@@ -38,6 +77,29 @@ RayShader::shade(RayBundle& rays, HitBundle& hb, Scene& scene,
 
         DeviceInterface& device = *DeviceInterface::instance();
         function_id shade_id = primary? p_shade_id : s_shade_id;
+        const char* shade_name = primary? "shade_primary" : "shade_secondary";
+
+        /* One bucket per material plus one for misses */
+        size_t bucket_count = scene.get_material_list().size() + 1;
+        bool sorted = m_sort && bucket_count <= MAX_SHADE_BUCKETS;
+        if (sorted) {
+                if (sort_by_material(hb, scene, size))
+                        return -1;
+                shade_id = sorted_shade_id;
+                shade_name = "shade_sorted";
+        }
+
+        /* Light type and cubemap use folded into the shading kernel, the
+           generic one is kept in case the variant can't be built */
+        function_id variant_id = 
+                device.function_variant("src/kernel/ray-shader.cl", shade_name,
+                                        BuildOptions().
+                                        define("SHADE_USE_CUBEMAP", (int32_t)cm.enabled).
+                                        define("SHADE_LIGHT_TYPE",
+                                               (int32_t)scene.get_lights().light.type),
+                                        m_cq);
+        if (device.valid_function_id(variant_id))
+                shade_id = variant_id;
 
         DeviceFunction& shade_function = device.function(shade_id);
 
@@ -74,83 +136,145 @@ RayShader::shade(RayBundle& rays, HitBundle& hb, Scene& scene,
         if (shade_function.set_arg(10,cm.negative_z_mem()))
                 return -1;
 
-        /*Texture_0 to Texture_25*/
-        if (shade_function.set_arg(11,scene.texture_atlas.texture_mem(0)))
-                return -1;
-        if (shade_function.set_arg(12,scene.texture_atlas.texture_mem(1)))
-                return -1;
-        if (shade_function.set_arg(13,scene.texture_atlas.texture_mem(2)))
-                return -1;
-        if (shade_function.set_arg(14,scene.texture_atlas.texture_mem(3)))
-                return -1;
-        if (shade_function.set_arg(15,scene.texture_atlas.texture_mem(4)))
-                return -1;
-        if (shade_function.set_arg(16,scene.texture_atlas.texture_mem(5)))
-                return -1;
-        if (shade_function.set_arg(17,scene.texture_atlas.texture_mem(6)))
+        /*Texture atlas and the uv rectangle of each texture in it*/
+        if (shade_function.set_arg(11,scene.get_texture_atlas().atlas_mem()))
                 return -1;
-        if (shade_function.set_arg(18,scene.texture_atlas.texture_mem(7)))
-                return -1;
-        if (shade_function.set_arg(19,scene.texture_atlas.texture_mem(8)))
-                return -1;
-        if (shade_function.set_arg(20,scene.texture_atlas.texture_mem(9)))
-                return -1;
-        if (shade_function.set_arg(21,scene.texture_atlas.texture_mem(10)))
-                return -1;
-        if (shade_function.set_arg(22,scene.texture_atlas.texture_mem(11)))
-                return -1;
-        if (shade_function.set_arg(23,scene.texture_atlas.texture_mem(12)))
-                return -1;
-        if (shade_function.set_arg(24,scene.texture_atlas.texture_mem(13)))
-                return -1;
-        if (shade_function.set_arg(25,scene.texture_atlas.texture_mem(14)))
-                return -1;
-        if (shade_function.set_arg(26,scene.texture_atlas.texture_mem(15)))
-                return -1;
-        if (shade_function.set_arg(27,scene.texture_atlas.texture_mem(16)))
-                return -1;
-        if (shade_function.set_arg(28,scene.texture_atlas.texture_mem(17)))
+
+        if (shade_function.set_arg(12,scene.get_texture_atlas().rects_mem()))
                 return -1;
-        if (shade_function.set_arg(29,scene.texture_atlas.texture_mem(18)))
+
+        cl_uint sample_count = size;
+        if (shade_function.set_arg(13,sizeof(cl_uint), &sample_count))
                 return -1;
-        if (shade_function.set_arg(30,scene.texture_atlas.texture_mem(19)))
+
+        cl_int use_cubemap = cm.enabled;
+        if (shade_function.set_arg(14,sizeof(cl_int), &use_cubemap))
                 return -1;
-        if (shade_function.set_arg(31,scene.texture_atlas.texture_mem(20)))
+
+        if (shade_function.set_arg(15,scene.lights_mem()))
                 return -1;
-        if (shade_function.set_arg(32,scene.texture_atlas.texture_mem(21)))
+
+        if (sorted && shade_function.set_arg(16,device.memory(order_id)))
                 return -1;
-        if (shade_function.set_arg(33,scene.texture_atlas.texture_mem(22)))
+
+        size_t group_size = shade_function.work_group_size(size, 0, "", m_cq);
+        if (shade_function.enqueue_single_dim(size,group_size, 0, m_cq))
                 return -1;
-        if (shade_function.set_arg(34,scene.texture_atlas.texture_mem(23)))
+        device.enqueue_barrier(m_cq);
+
+        if (m_timing) {
+                device.finish_commands(m_cq);
+                m_time_ms = m_timer.msec_since_snap();
+        }
+
+        return 0;
+
+}
+
+int32_t
+RayShader::update_bucket_map(Scene& scene)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        const std::vector<material_cl>& materials = scene.get_material_list();
+
+        std::vector<uint32_t> mat_order(materials.size());
+        for (uint32_t i = 0; i < mat_order.size(); ++i)
+                mat_order[i] = i;
+        std::sort(mat_order.begin(), mat_order.end(), TextureOrder(materials));
+
+        std::vector<cl_uint> bucket_map(materials.size());
+        for (uint32_t i = 0; i < mat_order.size(); ++i)
+                bucket_map[mat_order[i]] = i;
+
+        m_bucket_count = materials.size() + 1;
+
+        /* Only upload the map when the materials changed */
+        if (bucket_map == m_bucket_map || bucket_map.empty())
+                return 0;
+        m_bucket_map = bucket_map;
+
+        DeviceMemory& bucket_map_mem = device.memory(bucket_map_id);
+        size_t map_size = sizeof(cl_uint) * bucket_map.size();
+        if (bucket_map_mem.size() < map_size) {
+                if (bucket_map_mem.resize(map_size))
+                        return -1;
+        }
+        if (bucket_map_mem.write(map_size, &(bucket_map[0]), 0, m_cq))
                 return -1;
-        if (shade_function.set_arg(35,scene.texture_atlas.texture_mem(24)))
+
+        return 0;
+}
+
+int32_t
+RayShader::sort_by_material(HitBundle& hb, Scene& scene, size_t size)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        DeviceFunction& histogram = device.function(histogram_id);
+        DeviceFunction& scatter = device.function(scatter_id);
+
+        DeviceMemory& keys_mem = device.memory(keys_id);
+        DeviceMemory& counts_mem = device.memory(counts_id);
+        DeviceMemory& order_mem = device.memory(order_id);
+
+        if (update_bucket_map(scene))
                 return -1;
-        if (shade_function.set_arg(36,scene.texture_atlas.texture_mem(25)))
+
+        if (keys_mem.size() < sizeof(cl_uint) * size) {
+                if (keys_mem.resize(sizeof(cl_uint) * size))
+                        return -1;
+        }
+
+        if (order_mem.size() < sizeof(cl_int) * size) {
+                if (order_mem.resize(sizeof(cl_int) * size))
+                        return -1;
+        }
+
+        /* The scan needs room for the total after the last bucket */
+        size_t counts_size = sizeof(cl_uint) * (m_bucket_count + 1);
+        if (counts_mem.size() < counts_size) {
+                if (counts_mem.resize(counts_size))
+                        return -1;
+        }
+
+        std::vector<cl_uint> zero_counts(m_bucket_count + 1, 0);
+        if (counts_mem.write(counts_size, &(zero_counts[0]), 0, m_cq))
                 return -1;
 
-        cl_uint sample_count = size;
-        if (shade_function.set_arg(37,sizeof(cl_uint), &sample_count))
+        size_t local_size = sizeof(cl_uint) * m_bucket_count;
+
+        //////////////////// Count samples per bucket ///////////////////////
+        if (histogram.set_arg(0, hb.mem()) ||
+            histogram.set_arg(1, scene.material_map_mem()) ||
+            histogram.set_arg(2, device.memory(bucket_map_id)) ||
+            histogram.set_arg(3, keys_mem) ||
+            histogram.set_arg(4, counts_mem) ||
+            histogram.set_arg(5, local_size, NULL) ||
+            histogram.set_arg(6, sizeof(cl_uint), &m_bucket_count))
                 return -1;
 
-        cl_int use_cubemap = cm.enabled;
-        if (shade_function.set_arg(38,sizeof(cl_int), &use_cubemap))
+        if (histogram.enqueue_single_dim(size, 0, 0, m_cq))
                 return -1;
+        device.enqueue_barrier(m_cq);
 
-        if (shade_function.set_arg(39,scene.lights_mem()))
+        //////////////////// Bucket offsets /////////////////////////////////
+        if (gpu_scan_uint(device, counts_id, m_bucket_count, counts_id, m_cq))
                 return -1;
+        device.enqueue_barrier(m_cq);
 
-        size_t group_size = shade_function.max_group_size();
-        if (shade_function.enqueue_single_dim(size,group_size))
+        //////////////////// Write sample ids bucket by bucket //////////////
+        if (scatter.set_arg(0, keys_mem) ||
+            scatter.set_arg(1, counts_mem) ||
+            scatter.set_arg(2, order_mem) ||
+            scatter.set_arg(3, local_size, NULL) ||
+            scatter.set_arg(4, local_size, NULL) ||
+            scatter.set_arg(5, sizeof(cl_uint), &m_bucket_count))
                 return -1;
-        device.enqueue_barrier();
 
-        if (m_timing) {
-                device.finish_commands();
-                m_time_ms = m_timer.msec_since_snap();
-        }
+        if (scatter.enqueue_single_dim(size, 0, 0, m_cq))
+                return -1;
+        device.enqueue_barrier(m_cq);
 
         return 0;
-
 }
 
 void
@@ -168,4 +292,5 @@ RayShader::get_exec_time()
 void 
 RayShader::update_configuration(const RendererConfig& conf)
 {
+        m_sort = conf.shade_sort_materials;
 }
@@ -45,7 +45,7 @@ RayBundle::~RayBundle()
 }
 
 int32_t 
-RayBundle::initialize(const size_t rays)
+RayBundle::initialize(const size_t rays, size_t command_queue_i)
 {
 	if (rays <= 0 || m_initialized)
 		return -1;
@@ -54,7 +54,7 @@ RayBundle::initialize(const size_t rays)
         if (!device.good())
                 return -1;
 
-        ray_id = device.new_memory();
+        ray_id = device.new_memory(command_queue_i);
         DeviceMemory& ray_mem = device.memory(ray_id);
 
         if (ray_mem.initialize(rays * sizeof(sample_cl), READ_WRITE_MEMORY))
@@ -117,7 +117,7 @@ HitBundle::HitBundle()
 }
 
 int32_t 
-HitBundle::initialize(const size_t sz)
+HitBundle::initialize(const size_t sz, size_t command_queue_i)
 {
 	if (sz <= 0 || m_initialized)
 		return -1;
@@ -126,7 +126,7 @@ HitBundle::initialize(const size_t sz)
         if (!device.good())
                 return -1;
 
-        hit_id = device.new_memory();
+        hit_id = device.new_memory(command_queue_i);
 
         DeviceMemory& hit_mem = device.memory(hit_id);
 
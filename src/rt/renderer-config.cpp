@@ -9,9 +9,20 @@ RendererConfig::RendererConfig()
   , bvh_min_leaf_size(1)
   , sec_ray_use_atomics(false)
   , sec_ray_use_disc(true)
+  , sec_ray_min_contribution(0.)
+  , sec_ray_use_roulette(false)
+  , shadow_ray_compaction(false)
+  , shade_sort_materials(false)
+  , trav_stats(false)
+  , trav_heatmap(false)
+  , trav_heatmap_scale(256.)
+  , fb_accumulate(false)
+  , fb_exposure(1.)
   , prim_ray_quad_size(32)
   , prim_ray_use_zcurve(false)
   , tile_to_cores_ratio(128)
+  , tune_work_sizes(false)
+  , async_build(false)
 {
 }
 
@@ -244,6 +244,7 @@ int32_t RendererT::conclude_frame(Scene& scene, memory_id tex_id)
         stats.frame_acc_time += stats.frame_time;
         for (uint32_t i = 0; i < STAGE_COUNT; ++i)
                 stats.stage_acc_times[i] += stats.stage_times[i];
+        stats.add_to_histograms();
 
         stats.acc_frames++;
         return 0;
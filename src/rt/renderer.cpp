@@ -1,4 +1,5 @@
 #include <rt/renderer.hpp>
+#include <rt/config-tuner.hpp>
 #include <algorithm>
 
 #include <stdio.h>
@@ -6,7 +7,73 @@
 Renderer::Renderer()
 {
         initialized = false;
+        tuning_loaded = false;
+        accumulated_scene = NULL;
+        accumulated_geometry = 0;
+        accumulated_roots = 0;
+        built_scene = NULL;
+        built_geometry = 0;
         config.set_target(this);
+        pthread_mutex_init(&tile_lock, NULL);
+
+        build_scenes[0] = build_scenes[1] = NULL;
+        front_scene = 0;
+        front_ready = false;
+        async_frame = false;
+        build_cq = 1;
+        builder_running = false;
+        builder_quit = false;
+        build_pending = false;
+        build_done = false;
+        build_status = 0;
+        build_time = 0.;
+        build_source = NULL;
+        build_geometry = 0;
+        pthread_mutex_init(&build_lock, NULL);
+        pthread_cond_init(&build_cond, NULL);
+
+        TilePipeline p;
+        p.cq = 0;
+        p.owned = false;
+        p.ray_bundle_1 = &ray_bundle_1;
+        p.ray_bundle_2 = &ray_bundle_2;
+        p.hit_bundle = &hit_bundle;
+        p.framebuffer = &framebuffer;
+        p.prim_ray_gen = &prim_ray_gen;
+        p.sec_ray_gen = &sec_ray_gen;
+        p.ray_shader = &ray_shader;
+        p.tracer = &tracer;
+        p.scene_replica = NULL;
+        p.use_replica = false;
+        p.replica_source = NULL;
+        p.replica_geometry = 0;
+        p.samples_per_ms = 0.;
+        p.ray_count = 0;
+        p.sec_ray_count = 0;
+        pipelines.push_back(p);
+}
+
+Renderer::~Renderer()
+{
+        stop_builder();
+        pthread_mutex_destroy(&build_lock);
+        pthread_cond_destroy(&build_cond);
+
+        for (size_t i = 0; i < pipelines.size(); ++i) {
+                TilePipeline& p = pipelines[i];
+                if (!p.owned)
+                        continue;
+                delete p.ray_bundle_1;
+                delete p.ray_bundle_2;
+                delete p.hit_bundle;
+                delete p.framebuffer;
+                delete p.prim_ray_gen;
+                delete p.sec_ray_gen;
+                delete p.ray_shader;
+                delete p.tracer;
+                delete p.scene_replica;
+        }
+        pthread_mutex_destroy(&tile_lock);
 }
 
 uint32_t Renderer::set_up_frame(const memory_id tex_id, Scene& scene)
@@ -22,12 +89,17 @@ uint32_t Renderer::set_up_frame(const memory_id tex_id, Scene& scene)
         // Keep a copy of tex_id
         target_tex_id = tex_id;
 
+        // Use the tuned configuration of the scene, if there is one
+        if (apply_tuned_configuration(scene))
+                return -1;
+
         //Set time variables to 0
         stats.clear_times();
 
         //Set ray counters to 0
         stats.total_ray_count = 0;
         stats.total_sec_ray_count = 0;
+        stats.traversal.clear();
 
         // Acquire resources for render texture
         if (device.acquire_graphic_resource(target_tex_id)) {
@@ -37,15 +109,34 @@ uint32_t Renderer::set_up_frame(const memory_id tex_id, Scene& scene)
         }
         
         // Clear the framebuffer
+        trace.begin(FB_CLEAR);
         if (framebuffer.clear()) {
                 std::cerr << "Failed to clear framebuffer." << "\n";
                 return -1;
         }
+        trace.end();
         stats.stage_times[FB_CLEAR] = framebuffer.get_clear_exec_time();
 
-        // Create accelerator (if needed)
-        if (update_accelerator(scene))
-                return -1;
+        for (size_t i = 1; i < pipelines.size(); ++i) {
+                if (pipelines[i].framebuffer->clear()) {
+                        std::cerr << "Failed to clear framebuffer." << "\n";
+                        return -1;
+                }
+        }
+
+        // Create accelerator (if needed), or take the one built during
+        // the last frame
+        async_frame = config.async_build && 
+                scene.get_accelerator_type() != KDTREE_ACCELERATOR;
+        if (async_frame) {
+                if (swap_accelerator(scene))
+                        return -1;
+        } else {
+                front_ready = false;
+                build_source = NULL;
+                if (wait_build() || update_accelerator(scene))
+                        return -1;
+        }
 
         return 0;
 }
@@ -56,7 +147,15 @@ uint32_t Renderer::update_accelerator(Scene& scene)
 
         AcceleratorType type = scene.get_accelerator_type();
 
-        if (config.use_lbvh) {
+        /* While accumulating, the bvh is only built again when the geometry
+           changed, and each build restarts the accumulation */
+        bool current = config.fb_accumulate && scene.ready() &&
+                built_scene == &scene && 
+                built_geometry == scene.geometry_version();
+
+        /* Instanced aggregates keep their SAH bvh, see Scene::set_instancing */
+        if (config.use_lbvh && !scene.has_instances() && !current) {
+                trace.begin(BVH_BUILD);
                 if (config.bvh_refit_only && 
                     type == LBVH_ACCELERATOR && 
                     scene.ready()) {
@@ -70,12 +169,211 @@ uint32_t Renderer::update_accelerator(Scene& scene)
                                 return -1;
                         } 
                 }
+                trace.end();
+                built_scene = &scene;
+                built_geometry = scene.geometry_version();
+                reset_accumulation();
+                stats.stage_times[BVH_BUILD] = bvh_builder.get_exec_time();
+        }
+
+        return 0;
+}
+
+int32_t Renderer::start_builder()
+{
+        CLInfo* clinfo = CLInfo::instance();
+
+        /* Second queue of the first device, the others start after them */
+        if (!clinfo->has_command_queue(build_cq) ||
+            (clinfo->device_count() > 1 && clinfo->device_queue(1) == build_cq)) {
+                std::cerr << "Asynchronous builds need two command queues.\n";
+                return -1;
+        }
+
+        for (size_t i = 0; i < 2; ++i) {
+                build_scenes[i] = new Scene;
+                if (build_scenes[i]->initialize()) {
+                        std::cerr << "Error initializing build scene.\n";
+                        return -1;
+                }
+        }
+
+        builder_quit = false;
+        if (pthread_create(&builder, NULL, &builder_thread, this)) {
+                std::cerr << "Error creating builder thread.\n";
+                return -1;
+        }
+        builder_running = true;
+        return 0;
+}
+
+void Renderer::stop_builder()
+{
+        if (builder_running) {
+                pthread_mutex_lock(&build_lock);
+                builder_quit = true;
+                pthread_cond_broadcast(&build_cond);
+                pthread_mutex_unlock(&build_lock);
+                pthread_join(builder, NULL);
+                builder_running = false;
+        }
+        front_ready = false;
+        build_pending = false;
+        build_source = NULL;
+        for (size_t i = 0; i < 2; ++i) {
+                delete build_scenes[i];
+                build_scenes[i] = NULL;
+        }
+}
+
+void* Renderer::builder_thread(void* arg)
+{
+        Renderer* r = (Renderer*)arg;
+        DeviceInterface& device = *DeviceInterface::instance();
+
+        pthread_mutex_lock(&r->build_lock);
+        for (;;) {
+                while (!r->builder_quit && (!r->build_pending || r->build_done))
+                        pthread_cond_wait(&r->build_cond, &r->build_lock);
+                if (r->builder_quit)
+                        break;
+                Scene& back = *r->build_scenes[1 - r->front_scene];
+                pthread_mutex_unlock(&r->build_lock);
+
+                rt_time_t build_timer;
+                build_timer.snap_time();
+
+                /* Always a full build, the back scene holds the nodes of
+                   an older build so there is nothing to refit. Refits are
+                   done in place on the front, see swap_accelerator */
+                int32_t ret = 0;
+                if (r->config.use_lbvh && !back.has_instances())
+                        ret = r->bvh_builder.build_lbvh(back, r->build_cq);
+                else if (back.get_accelerator_type() == SAH_BVH_ACCELERATOR &&
+                         back.valid_aggregate())
+                        ret = back.rebuild_aggregate_bvh(r->build_cq);
+                if (device.finish_commands(r->build_cq))
+                        ret = -1;
+
+                pthread_mutex_lock(&r->build_lock);
+                r->build_status = ret;
+                r->build_time = build_timer.msec_since_snap();
+                r->build_done = true;
+                pthread_cond_broadcast(&r->build_cond);
+        }
+        pthread_mutex_unlock(&r->build_lock);
+        return NULL;
+}
+
+int32_t Renderer::submit_build(Scene& scene)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        Scene& back = *build_scenes[1 - front_scene];
+
+        /* Whatever the application enqueued on the scene goes first */
+        if (device.finish_commands())
+                return -1;
+        bool host_build = !config.use_lbvh || scene.has_instances();
+        if (back.share_mem_from(scene, build_cq) ||
+            (host_build && scene.valid_aggregate() &&
+             back.copy_aggregate_mesh_from(scene))) {
+                std::cerr << "Error copying scene for the builder.\n";
+                return -1;
+        }
+
+        build_source = &scene;
+        build_geometry = scene.geometry_version();
+
+        pthread_mutex_lock(&build_lock);
+        build_pending = true;
+        build_done = false;
+        pthread_cond_broadcast(&build_cond);
+        pthread_mutex_unlock(&build_lock);
+        return 0;
+}
+
+int32_t Renderer::wait_build()
+{
+        pthread_mutex_lock(&build_lock);
+        while (build_pending && !build_done)
+                pthread_cond_wait(&build_cond, &build_lock);
+        bool built = build_pending;
+        int32_t ret = built ? build_status : 0;
+        build_pending = false;
+        if (built && !ret) {
+                front_scene = 1 - front_scene;
+                front_ready = true;
+                stats.stage_times[BVH_BUILD] = build_time;
+        }
+        pthread_mutex_unlock(&build_lock);
+
+        if (ret)
+                std::cerr << "BVH building failed." << "\n";
+        return ret;
+}
+
+int32_t Renderer::swap_accelerator(Scene& scene)
+{
+        if (!builder_running && start_builder()) {
+                std::cerr << "Building synchronously.\n";
+                stop_builder();
+                config.async_build = false;
+                async_frame = false;
+                return update_accelerator(scene);
+        }
+
+        /* Builds are waited for at the end of their frame, one is still
+           pending only if that frame failed */
+        if (wait_build())
+                return -1;
+
+        /* The first frame has nothing built, it waits for its own build */
+        if (!front_ready && (submit_build(scene) || wait_build()))
+                return -1;
+        Scene& front = *build_scenes[front_scene];
+
+        /* A static scene keeps its accelerator. Refits are quick and keep
+           the tree of the last build, which is the front one, so they are
+           done in place before the frame */
+        bool changed = build_source != &scene || 
+                build_geometry != scene.geometry_version();
+        bool refit = config.bvh_refit_only && config.use_lbvh &&
+                !scene.has_instances() && build_source == &scene &&
+                front.get_accelerator_type() == LBVH_ACCELERATOR &&
+                front.ready();
+        if (changed && refit) {
+                trace.begin(BVH_BUILD);
+                if (front.copy_vertices_from(scene) ||
+                    bvh_builder.refit_lbvh(front)) {
+                        std::cout << "BVH refitting failed." << "\n";
+                        return -1;
+                }
+                trace.end();
+                build_geometry = scene.geometry_version();
+                stats.stage_times[BVH_BUILD] = bvh_builder.get_exec_time();
+        } else if (changed && submit_build(scene)) {
+                return -1;
         }
 
-        stats.stage_times[BVH_BUILD] = bvh_builder.get_exec_time();
+        /* Moved objects show in this frame */
+        if (front.update_from(scene)) {
+                std::cerr << "Error updating the roots of the frame scene.\n";
+                return -1;
+        }
         return 0;
 }
 
+Scene& Renderer::frame_scene(Scene& scene)
+{
+        if (!async_frame)
+                return scene;
+
+        /* The camera follows the application with no frame of delay */
+        Scene& front = *build_scenes[front_scene];
+        front.camera = scene.camera;
+        return front;
+}
+
 uint32_t Renderer::update_configuration()
 {
         CLInfo* clinfo = clinfo->instance();
@@ -88,128 +386,399 @@ uint32_t Renderer::update_configuration()
 
         if (tile_size != old_tile_size) {
                 size_t ray_bundle_size = tile_size * 3;
-                size_t hit_bundle_size = ray_bundle_size;
                 
                 std::cout << "ray_bundle_size: " << ray_bundle_size << std::endl;
 
-                if (ray_bundle_1.resize(ray_bundle_size) || 
-                    ray_bundle_2.resize(ray_bundle_size) || 
-                    hit_bundle.resize(hit_bundle_size)) {
+                if (resize_pipelines(ray_bundle_size)) {
                         std::cerr << "Error resizing ray and hit bundles.\n";
                         return -1;
                 }
-                sec_ray_gen.set_max_rays(ray_bundle_1.count());
         }
 
         bvh_builder.update_configuration(config);
-        prim_ray_gen.update_configuration(config);
-        sec_ray_gen.update_configuration(config);
-        tracer.update_configuration(config);
-        ray_shader.update_configuration(config);
+        for (size_t i = 0; i < pipelines.size(); ++i) {
+                TilePipeline& p = pipelines[i];
+                p.prim_ray_gen->update_configuration(config);
+                p.sec_ray_gen->update_configuration(config);
+                p.tracer->update_configuration(config);
+                p.ray_shader->update_configuration(config);
+        }
+
+        framebuffer.set_accumulation(config.fb_accumulate);
+        framebuffer.set_exposure(config.fb_exposure);
+
+        /* Each pipeline has a device of its own, trials are timed and
+           kept per device */
+        WorkSizeTuner::instance()->set_tuning(config.tune_work_sizes);
         
         return 0;
 }
 
-uint32_t Renderer::render_to_framebuffer(Scene& scene)
+/* Radical inverse of i in the given base, used for the accumulation jitter */
+static float halton(uint32_t i, uint32_t base)
+{
+        float f = 1.f;
+        float r = 0.f;
+        while (i > 0) {
+                f /= base;
+                r += f * (i % base);
+                i /= base;
+        }
+        return r;
+}
+
+static bool same_camera(const Camera& a, const Camera& b)
+{
+        for (uint32_t i = 0; i < 3; ++i) {
+                if (a.pos[i] != b.pos[i] || a.dir[i] != b.dir[i] ||
+                    a.up[i] != b.up[i] || a.right[i] != b.right[i])
+                        return false;
+        }
+        return a.fov == b.fov && a.aspect == b.aspect;
+}
+
+void Renderer::update_accumulation(Scene& scene)
+{
+        float jitter[2] = {0.f, 0.f};
+
+        if (config.fb_accumulate) {
+                if (!same_camera(scene.camera, last_camera) ||
+                    accumulated_scene != &scene ||
+                    accumulated_geometry != scene.geometry_version() ||
+                    accumulated_roots != scene.roots_version())
+                        framebuffer.reset_accumulation();
+                last_camera = scene.camera;
+                accumulated_scene = &scene;
+                accumulated_geometry = scene.geometry_version();
+                accumulated_roots = scene.roots_version();
+
+                /* First frame goes through the pixel centers, the next ones
+                   are jittered inside the pixel so the accumulation 
+                   antialiases */
+                uint32_t n = framebuffer.accumulated_frames();
+                if (n > 0) {
+                        jitter[0] = halton(n, 2) - 0.5f;
+                        jitter[1] = halton(n, 3) - 0.5f;
+                }
+        }
+
+        for (size_t i = 0; i < pipelines.size(); ++i)
+                pipelines[i].prim_ray_gen->set_jitter(jitter[0], jitter[1]);
+}
+
+void Renderer::reset_accumulation()
+{
+        framebuffer.reset_accumulation();
+}
+
+/* Below this fraction of the tile size the last tiles are not cut any
+   further */
+#define MIN_TILE_FRACTION 8
+
+bool Renderer::next_tile(size_t pipeline_i, size_t* offset, size_t* tile)
+{
+        pthread_mutex_lock(&tile_lock);
+
+        size_t remaining = frame_samples - next_sample;
+        size_t size = tile_size;
+
+        /* While there's plenty left every pipeline takes whole tiles and the
+           faster ones just come back for more sooner. The last ones are cut 
+           to each pipeline's share of the throughput, so that all of them
+           finish at about the same time */
+        double total_rate = 0.;
+        bool   measured = true;
+        for (size_t i = 0; i < pipelines.size(); ++i) {
+                total_rate += pipelines[i].samples_per_ms;
+                measured = measured && pipelines[i].samples_per_ms > 0.;
+        }
+        if (measured && pipelines.size() > 1) {
+                double share = remaining * pipelines[pipeline_i].samples_per_ms;
+                size = std::min(size, (size_t)(share / total_rate));
+                size = std::max(size, tile_size / MIN_TILE_FRACTION);
+        }
+        size = std::min(size, remaining);
+
+        *offset = next_sample;
+        *tile = size;
+        next_sample += size;
+
+        pthread_mutex_unlock(&tile_lock);
+        return size > 0;
+}
+
+int32_t Renderer::render_tile(Scene& scene, TilePipeline& p,
+                              size_t offset, size_t current_tile_size)
 {
-        CLInfo* clinfo = clinfo->instance();
-        size_t pixel_count  = fb_w * fb_h;
-        size_t sample_count = pixel_count * prim_ray_gen.get_spp();
         size_t fb_size[] = {fb_w, fb_h};
 
-        for (size_t offset = 0; offset < sample_count; offset+= tile_size) {
+        /* Only the first pipeline is timed, and the trace recorder is not
+           meant to be used from several threads */
+        bool record = &p == &pipelines[0];
 
-                RayBundle* ray_in =  &ray_bundle_1;
-                RayBundle* ray_out = &ray_bundle_2;
+        RayBundle* ray_in =  p.ray_bundle_1;
+        RayBundle* ray_out = p.ray_bundle_2;
+        HitBundle& hit_bundle = *p.hit_bundle;
 
-                size_t current_tile_size = tile_size;
-                if (sample_count - offset < tile_size)
-                        current_tile_size = sample_count - offset;
+        if (record) trace.begin(PRIM_RAY_GEN, offset);
+        if (p.prim_ray_gen->generate(scene.camera, *ray_in, fb_size,
+            current_tile_size, offset)) {
+                 std::cerr << "Error seting primary ray bundle.\n";
+                 return -1;
+        }
+        if (record) {
+                trace.end(current_tile_size);
+                stats.stage_times[PRIM_RAY_GEN] += p.prim_ray_gen->get_exec_time();
+        }
 
-                if (prim_ray_gen.generate(scene.camera, *ray_in, fb_size,
-                    current_tile_size, offset)) {
-                         std::cerr << "Error seting primary ray bundle.\n";
-                         return -1;
-                }
+        p.ray_count += current_tile_size;
 
+        if (record) trace.begin(PRIM_TRACE, offset);
+        if (p.tracer->trace(scene, current_tile_size, *ray_in, hit_bundle)) {
+                std::cerr << "Error tracing primary rays.\n";
+                return -1;
+        }
+        if (record) {
+                trace.end(current_tile_size);
+                stats.stage_times[PRIM_TRACE] += p.tracer->get_trace_exec_time();
+                if (p.tracer->traversal_stats_enabled())
+                        stats.traversal.add(p.tracer->get_traversal_stats());
+        }
+
+        if (record) trace.begin(PRIM_SHADOW_TRACE, offset);
+        if (p.tracer->shadow_trace(scene, current_tile_size, *ray_in, hit_bundle)) {
+                std::cerr << "Error shadow tracing primary rays.\n";
+                return - 1;
+        }
+        if (record) {
+                trace.end(current_tile_size);
+                stats.stage_times[PRIM_SHADOW_TRACE] += p.tracer->get_shadow_exec_time();
+        }
 
-                stats.stage_times[PRIM_RAY_GEN] += prim_ray_gen.get_exec_time();
-                stats.total_ray_count += current_tile_size;
+        if (record) trace.begin(SHADE, offset);
+        if (p.ray_shader->shade(*ray_in, hit_bundle, scene,
+            scene.cubemap, *p.framebuffer, current_tile_size,true)){
+                 std::cerr << "Failed to update framebuffer.\n";
+                 return -1;
+        }
+        if (record) {
+                trace.end(current_tile_size);
+                stats.stage_times[SHADE] += p.ray_shader->get_exec_time();
+        }
 
-                if (tracer.trace(scene, current_tile_size, *ray_in, hit_bundle)) {
-                        std::cerr << "Error tracing primary rays.\n";
+        size_t sec_ray_count = current_tile_size;
+        for (uint32_t bounce = 0; bounce < max_bounces; ++bounce) {
+
+                size_t sec_ray_in = sec_ray_count;
+                if (record) trace.begin(SEC_RAY_GEN, offset, bounce);
+                if (p.sec_ray_gen->generate(scene, *ray_in, sec_ray_in, 
+                                            hit_bundle, *ray_out, &sec_ray_count)) {
+                        std::cerr << "Failed to create secondary rays." 
+                                  << "\n";
                         return -1;
                 }
-                stats.stage_times[PRIM_TRACE] += tracer.get_trace_exec_time();
+                if (record) {
+                        trace.end(sec_ray_count);
+                        stats.stage_times[SEC_RAY_GEN] += p.sec_ray_gen->get_exec_time();
+                }
+
+                std::swap(ray_in,ray_out);
+
+                if (!sec_ray_count)
+                        break;
+                if (sec_ray_count == (size_t)ray_out->count())
+                        std::cerr << "Max sec rays reached!\n";
 
-                if (tracer.shadow_trace(scene, current_tile_size, *ray_in, hit_bundle)) {
-                        std::cerr << "Error shadow tracing primary rays.\n";
-                        return - 1;
+                p.ray_count += sec_ray_count;
+                p.sec_ray_count += sec_ray_count;
+
+                if (record) trace.begin(SEC_TRACE, offset, bounce);
+                if (p.tracer->trace(scene, sec_ray_count, 
+                        *ray_in, hit_bundle, true)) {
+                        std::cerr << "Error tracing secondary rays\n";
+                        return -1;
+                }
+                if (record) {
+                        trace.end(sec_ray_count);
+                        stats.stage_times[SEC_TRACE] += p.tracer->get_trace_exec_time();
+                        if (p.tracer->traversal_stats_enabled())
+                                stats.traversal.add(p.tracer->get_traversal_stats());
                 }
-                stats.stage_times[PRIM_SHADOW_TRACE] += tracer.get_shadow_exec_time();
                 
-                if (ray_shader.shade(*ray_in, hit_bundle, scene,
-                    scene.cubemap, framebuffer, current_tile_size,true)){
-                         std::cerr << "Failed to update framebuffer.\n";
-                         return -1;
+                if (record) trace.begin(SEC_SHADOW_TRACE, offset, bounce);
+                if (p.tracer->shadow_trace(scene, sec_ray_count, 
+                        *ray_in, hit_bundle, true)) {
+                        std::cerr << "Error shadow tracing primary rays\n" ;
+                        return -1;
+                }
+                if (record) {
+                        trace.end(sec_ray_count);
+                        stats.stage_times[SEC_SHADOW_TRACE] += 
+                                p.tracer->get_shadow_exec_time();
                 }
-                stats.stage_times[SHADE] += ray_shader.get_exec_time();
-
-                size_t sec_ray_count = current_tile_size;
-                for (uint32_t bounce = 0; bounce < max_bounces; ++bounce) {
 
+                if (record) trace.begin(SHADE, offset, bounce);
+                if (p.ray_shader->shade(*ray_in, hit_bundle, scene,
+                        scene.cubemap, *p.framebuffer, sec_ray_count)){
+                        std::cerr << "Ray shader failed execution.\n";
+                        return -1;
+                }
+                if (record) {
+                        trace.end(sec_ray_count);
+                        stats.stage_times[SHADE] += p.ray_shader->get_exec_time();
+                }
+        }
 
+        return 0;
+}
 
-                        size_t sec_ray_in = sec_ray_count;
-                        if (sec_ray_gen.generate(scene, *ray_in, sec_ray_in, 
-                                                 hit_bundle, *ray_out, &sec_ray_count)) {
-                                std::cerr << "Failed to create secondary rays." 
-                                          << "\n";
+/* Each NUMA node traverses a copy of the scene in its own memory, made
+   by the node itself so its pages are placed there. The whole copy is 
+   redone only when the accelerator or the vertices changed. Otherwise the
+   roots that moved are written, with the lights and materials which are
+   small and not versioned. kd-trees are not copied, those scenes are 
+   shared, which devices of another context can't do: they render no
+   tiles then. Copies to another context go through the host */
+int32_t Renderer::update_replicas(Scene& scene)
+{
+        for (size_t i = 1; i < pipelines.size(); ++i) {
+                TilePipeline& p = pipelines[i];
+                p.use_replica = p.scene_replica && 
+                        scene.get_accelerator_type() != KDTREE_ACCELERATOR;
+                if (!p.use_replica)
+                        continue;
+
+                bool copied = p.replica_source == &scene &&
+                        p.replica_geometry == scene.geometry_version();
+                if (!copied || p.scene_replica->update_from(scene, p.cq)) {
+                        p.replica_source = NULL;
+                        if (p.scene_replica->copy_mem_from(scene, p.cq))
                                 return -1;
-                        }
+                }
+                p.replica_source = &scene;
+                p.replica_geometry = scene.geometry_version();
+        }
+        return 0;
+}
 
-                        // std::cout << "sec ray count: " << sec_ray_count << std::endl;
-                        // exit(0);
+int32_t Renderer::render_tiles(Scene& scene, size_t pipeline_i)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        TilePipeline& p = pipelines[pipeline_i];
+        bool shared = pipelines.size() > 1;
+        Scene& tile_scene = p.use_replica ? *p.scene_replica : scene;
 
+        size_t offset, tile;
+        while (next_tile(pipeline_i, &offset, &tile)) {
+                rt_time_t tile_timer;
+                tile_timer.snap_time();
 
-                        stats.stage_times[SEC_RAY_GEN] += sec_ray_gen.get_exec_time();
+                if (render_tile(tile_scene, p, offset, tile))
+                        return -1;
+                if (!shared)
+                        continue;
 
-                        std::swap(ray_in,ray_out);
+                /* Throughput of the device, from the host side so that
+                   every pipeline is measured the same way */
+                if (device.finish_commands(p.cq))
+                        return -1;
+                double msec = std::max(tile_timer.msec_since_snap(), 1e-3);
+                double rate = tile / msec;
+                if (p.samples_per_ms > 0.)
+                        rate = 0.75 * p.samples_per_ms + 0.25 * rate;
+                pthread_mutex_lock(&tile_lock);
+                p.samples_per_ms = rate;
+                pthread_mutex_unlock(&tile_lock);
+        }
+        return 0;
+}
 
-                        if (!sec_ray_count)
-                                break;
-                        if (sec_ray_count == (size_t)ray_out->count())
-                                std::cerr << "Max sec rays reached!\n";
+struct RenderThreadArguments {
+        Renderer* renderer;
+        Scene*    scene;
+        size_t    pipeline_i;
+        int32_t   ret;
+};
 
-                        stats.total_ray_count += sec_ray_count;
-                        stats.total_sec_ray_count += sec_ray_count;
+void* Renderer::render_thread(void* arg)
+{
+        RenderThreadArguments* args = (RenderThreadArguments*)arg;
+        args->ret = args->renderer->render_tiles(*args->scene, args->pipeline_i);
+        return NULL;
+}
 
-                        if (tracer.trace(scene, sec_ray_count, 
-                                *ray_in, hit_bundle, true)) {
-                                std::cerr << "Error tracing secondary rays\n";
-                                return -1;
-                        }
+uint32_t Renderer::render_to_framebuffer(Scene& app_scene)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        Scene& scene = frame_scene(app_scene);
+        size_t pixel_count  = fb_w * fb_h;
+        size_t sample_count = pixel_count * prim_ray_gen.get_spp();
 
-                        stats.stage_times[SEC_TRACE] += tracer.get_trace_exec_time();
-                        
-                        if (tracer.shadow_trace(scene, sec_ray_count, 
-                                *ray_in, hit_bundle, true)) {
-                                std::cerr << "Error shadow tracing primary rays\n" ;
-                                return -1;
-                        }
+        update_accumulation(scene);
 
-                        stats.stage_times[SEC_SHADOW_TRACE] += 
-                                tracer.get_shadow_exec_time();
+        for (size_t i = 0; i < pipelines.size(); ++i) {
+                pipelines[i].ray_count = 0;
+                pipelines[i].sec_ray_count = 0;
+        }
+        next_sample = 0;
+        frame_samples = sample_count;
 
-                        if (ray_shader.shade(*ray_in, hit_bundle, scene,
-                                scene.cubemap, framebuffer, sec_ray_count)){
-                                std::cerr << "Ray shader failed execution.\n";
-                                return -1;
-                        }
-                        stats.stage_times[SHADE] += ray_shader.get_exec_time();
+        /* The other devices start from the accelerator and scene updates
+           enqueued on the first queue */
+        if (pipelines.size() > 1 && device.finish_commands())
+                return -1;
+        if (update_replicas(scene)) {
+                std::cerr << "Error copying scene to the device nodes.\n";
+                return -1;
+        }
+
+        CLInfo* clinfo = CLInfo::instance();
+        std::vector<pthread_t> threads(pipelines.size());
+        std::vector<bool> running(pipelines.size(), false);
+        std::vector<RenderThreadArguments> args(pipelines.size());
+        for (size_t i = 1; i < pipelines.size(); ++i) {
+                TilePipeline& p = pipelines[i];
+                if (!p.use_replica && clinfo->queue_context(p.cq) != 0)
+                        continue;
+                args[i].renderer = this;
+                args[i].scene = &scene;
+                args[i].pipeline_i = i;
+                args[i].ret = 0;
+                if (pthread_create(&threads[i], NULL, &render_thread, &args[i])) {
+                        std::cerr << "Error creating render thread.\n";
+                        break;
                 }
+                running[i] = true;
+        }
+
+        /* Pipelines without a thread leave their tiles to the others */
+        int32_t ret = render_tiles(scene, 0);
+        for (size_t i = 1; i < threads.size(); ++i) {
+                if (!running[i])
+                        continue;
+                pthread_join(threads[i], NULL);
+                if (args[i].ret)
+                        ret = -1;
+        }
+        if (ret) {
+                std::cerr << "Error rendering tiles.\n";
+                return -1;
         }
 
+        for (size_t i = 0; i < pipelines.size(); ++i) {
+                TilePipeline& p = pipelines[i];
+                stats.total_ray_count += p.ray_count;
+                stats.total_sec_ray_count += p.sec_ray_count;
+                if (i > 0 && framebuffer.merge(*p.framebuffer)) {
+                        std::cerr << "Error merging framebuffers.\n";
+                        return -1;
+                }
+        }
+
+        /* The accelerator built during this frame is the one of the next */
+        if (async_frame && wait_build())
+                return -1;
+
         return 0;
 }
 
@@ -217,10 +786,17 @@ uint32_t Renderer::copy_framebuffer(memory_id tex_id)
 {
         DeviceInterface& device = *DeviceInterface::instance();
 
+        trace.begin(FB_COPY);
+        if (config.trav_heatmap && 
+            framebuffer.resolve_heatmap(config.trav_heatmap_scale)) {
+                std::cerr << "Failed to resolve traversal heatmap." << "\n";
+                return -1;
+        }
         if (!device.good() || framebuffer.copy(device.memory(tex_id))){
                 std::cerr << "Failed to copy framebuffer." << "\n";
                 return -1;
         }
+        trace.end();
         stats.stage_times[FB_COPY] = framebuffer.get_copy_exec_time();
         
         return 0;
@@ -266,8 +842,12 @@ uint32_t Renderer::conclude_frame(Scene& scene, memory_id tex_id)
         stats.frame_acc_time += stats.frame_time;
         for (uint32_t i = 0; i < STAGE_COUNT; ++i)
                 stats.stage_acc_times[i] += stats.stage_times[i];
+        stats.add_to_histograms();
 
         stats.acc_frames++;
+
+        if (trace.end_frame())
+                return -1;
         return 0;
 }
 
@@ -288,8 +868,19 @@ uint32_t Renderer::configure_from_defaults()
         config.use_lbvh = true;
         config.bvh_refit_only = false;
         config.sec_ray_use_disc = false;
+        config.sec_ray_min_contribution = 0.;
+        config.sec_ray_use_roulette = false;
+        config.shadow_ray_compaction = false;
+        config.shade_sort_materials = false;
+        config.trav_stats = false;
+        config.trav_heatmap = false;
+        config.trav_heatmap_scale = 256.;
+        config.fb_accumulate = false;
+        config.fb_exposure = 1.;
         config.prim_ray_quad_size = 32;
         config.prim_ray_use_zcurve = false;
+        config.tune_work_sizes = false;
+        config.async_build = false;
 
         return 0;
 }
@@ -333,6 +924,33 @@ uint32_t Renderer::configure_from_ini_file(std::string file_path)
                 if (!ini.get_int_value("Renderer", "sec_use_disc", int_val))
                         config.sec_ray_use_disc = int_val;
 
+                if (!ini.get_float_value("Renderer", "sec_min_contribution", float_val))
+                        config.sec_ray_min_contribution = float_val;
+
+                if (!ini.get_int_value("Renderer", "sec_use_roulette", int_val))
+                        config.sec_ray_use_roulette = int_val;
+
+                if (!ini.get_int_value("Renderer", "shadow_compaction", int_val))
+                        config.shadow_ray_compaction = int_val;
+
+                if (!ini.get_int_value("Renderer", "shade_sort", int_val))
+                        config.shade_sort_materials = int_val;
+
+                if (!ini.get_int_value("Renderer", "trav_stats", int_val))
+                        config.trav_stats = int_val;
+
+                if (!ini.get_int_value("Renderer", "trav_heatmap", int_val))
+                        config.trav_heatmap = int_val;
+
+                if (!ini.get_float_value("Renderer", "trav_heatmap_scale", float_val))
+                        config.trav_heatmap_scale = float_val;
+
+                if (!ini.get_int_value("Renderer", "fb_accumulate", int_val))
+                        config.fb_accumulate = int_val;
+
+                if (!ini.get_float_value("Renderer", "fb_exposure", float_val))
+                        config.fb_exposure = float_val;
+
                 if (!ini.get_int_value("Renderer", "prim_use_zcurve", int_val))
                         config.prim_ray_use_zcurve = int_val;
 
@@ -341,10 +959,153 @@ uint32_t Renderer::configure_from_ini_file(std::string file_path)
 
                 if (!ini.get_float_value("Renderer", "tile_to_cores_ratio", float_val))
                         config.tile_to_cores_ratio = float_val;
+
+                if (!ini.get_int_value("Renderer", "tune_work_sizes", int_val))
+                        config.tune_work_sizes = int_val;
+
+                if (!ini.get_int_value("Renderer", "async_build", int_val))
+                        config.async_build = int_val;
+
+                if (!ini.get_str_value("Renderer", "tuning_file", str_val))
+                        load_tuned_configurations(str_val);
+        }
+
+        return 0;
+
+}
+
+int32_t Renderer::load_tuned_configurations(std::string file_path)
+{
+        tuning_file = file_path;
+        tuned_scene_key.clear();
+        tuning = INIReader();
+        tuning_loaded = false;
+
+        /* A missing file is not an error, it is created by the tuner */
+        int32_t ini_err = tuning.load_file(file_path);
+        if (ini_err > 0)
+                return 0;
+        if (ini_err < 0) {
+                std::cerr << "Error at tuning file line: " << -ini_err << "\n";
+                return -1;
+        }
+
+        tuning_loaded = true;
+        return 0;
+}
+
+int32_t Renderer::apply_tuned_configuration(Scene& scene)
+{
+        if (!tuning_loaded)
+                return 0;
+
+        std::string key = ConfigTuner::scene_key(*this, scene);
+        if (key == tuned_scene_key)
+                return 0;
+        tuned_scene_key = key;
+
+        if (ConfigTuner::load(tuning, key, &config))
+                return 0;
+
+        std::cout << "Using tuned configuration " << key << "\n";
+        return update_configuration();
+}
+
+/* Submits the builds of every program the bvh path needs at once, so they
+   compile in parallel while the components initialize. Each component 
+   waits only for its own programs, when it first uses them. The kd-tree,
+   traversal stats and scene dependent variants are still built on demand */
+static void prefetch_programs(const RendererConfig& config)
+{
+        ProgramCache* programs = ProgramCache::instance();
+        programs->prefetch("src/kernel/bvh-builder.cl");
+        programs->prefetch("src/kernel/bvh-builder-sort.cl");
+
+        /* Builds run on the first context, tiles on every one */
+        CLInfo* clinfo = CLInfo::instance();
+        for (size_t c = 0; c < clinfo->context_count(); ++c) {
+                BuildOptions none;
+                programs->prefetch("src/kernel/framebuffer.cl", none, c);
+                programs->prefetch("src/kernel/trace-bvh.cl", none, c);
+                programs->prefetch("src/kernel/shadow-trace-bvh.cl", none, c);
+                programs->prefetch("src/kernel/secondary-ray-generator.cl", none, c);
+                programs->prefetch("src/kernel/scan.cl", none, c);
+                if (config.prim_ray_use_zcurve)
+                        programs->prefetch("src/kernel/primary-ray-generator.cl",
+                                           none, c);
+        }
+}
+
+/* One more pipeline for each device after the first, with components of 
+   its own that enqueue on the device's queue. Devices of the first context
+   share the scene and accelerator memory, the runtime moves a copy to each
+   device when it is first used there. Those of other platforms, and the
+   NUMA nodes, keep a replica */
+int32_t Renderer::initialize_pipelines()
+{
+        CLInfo* clinfo = CLInfo::instance();
+        size_t fb_size[] = {fb_w, fb_h};
+        size_t ray_bundle_size = tile_size * 3;
+
+        for (size_t d = 1; d < clinfo->device_count(); ++d) {
+                TilePipeline p = pipelines[0];
+                p.cq = clinfo->device_queue(d);
+                p.owned = true;
+                p.ray_bundle_1 = new RayBundle;
+                p.ray_bundle_2 = new RayBundle;
+                p.hit_bundle = new HitBundle;
+                p.framebuffer = new FrameBuffer;
+                p.prim_ray_gen = new PrimaryRayGenerator;
+                p.sec_ray_gen = new SecondaryRayGenerator;
+                p.ray_shader = new RayShader;
+                p.tracer = new Tracer;
+                if (clinfo->partitioned() || clinfo->queue_context(p.cq) != 0)
+                        p.scene_replica = new Scene;
+                pipelines.push_back(p);
+
+                p.framebuffer->set_command_queue(p.cq);
+                p.tracer->set_command_queue(p.cq);
+                p.prim_ray_gen->set_command_queue(p.cq);
+                p.sec_ray_gen->set_command_queue(p.cq);
+                p.ray_shader->set_command_queue(p.cq);
+
+                if (p.ray_bundle_1->initialize(ray_bundle_size, p.cq) ||
+                    p.ray_bundle_2->initialize(ray_bundle_size, p.cq) ||
+                    p.hit_bundle->initialize(ray_bundle_size, p.cq) ||
+                    p.framebuffer->initialize(fb_size) ||
+                    p.tracer->initialize() ||
+                    p.prim_ray_gen->initialize() ||
+                    p.sec_ray_gen->initialize() ||
+                    p.ray_shader->initialize() ||
+                    (p.scene_replica && p.scene_replica->initialize(p.cq)))
+                        return -1;
+
+                p.tracer->set_heat_mem(p.framebuffer->heat_mem_id());
+                p.sec_ray_gen->set_max_rays(p.ray_bundle_1->count());
+
+                p.prim_ray_gen->update_configuration(config);
+                p.sec_ray_gen->update_configuration(config);
+                p.tracer->update_configuration(config);
+                p.ray_shader->update_configuration(config);
         }
 
+        if (pipelines.size() > 1)
+                std::cout << "Rendering tiles on " << pipelines.size() 
+                          << " devices." << "\n";
         return 0;
+}
 
+int32_t Renderer::resize_pipelines(size_t ray_bundle_size)
+{
+        for (size_t i = 0; i < pipelines.size(); ++i) {
+                TilePipeline& p = pipelines[i];
+                if (p.ray_bundle_1->resize(ray_bundle_size) ||
+                    p.ray_bundle_2->resize(ray_bundle_size) ||
+                    p.hit_bundle->resize(ray_bundle_size))
+                        return -1;
+                p.sec_ray_gen->set_max_rays(p.ray_bundle_1->count());
+        }
+        return 0;
 }
 
 uint32_t Renderer::initialize(std::string log_filename)
@@ -354,6 +1115,13 @@ uint32_t Renderer::initialize(std::string log_filename)
         if (!clinfo->initialized() || initialized)
                 return -1;
 
+        prefetch_programs(config);
+
+        /* Local sizes measured on this device in earlier runs */
+        WorkSizeTuner* work_sizes = WorkSizeTuner::instance();
+        work_sizes->load_profile();
+        work_sizes->set_tuning(config.tune_work_sizes);
+
         log.initialize(log_filename);
         log.silent = false;
         log.enabled = false;
@@ -411,6 +1179,7 @@ uint32_t Renderer::initialize(std::string log_filename)
                 std::cerr << "Failed to initialize tracer." << "\n";
                 return -1;
         }
+        tracer.set_heat_mem(framebuffer.heat_mem_id());
         std::cerr << "Initialized tracer succesfully." << "\n";
 
 
@@ -437,6 +1206,12 @@ uint32_t Renderer::initialize(std::string log_filename)
         }
         std::cout << "Initialized ray shader succesfully." << "\n";
 
+        /*------------------- Initialize other devices' pipelines -------------------*/
+        if (initialize_pipelines()) {
+                std::cerr << "Error initializing device pipelines." << "\n";
+                return -1;
+        }
+
         /*----------------------- Enable timing in all clases -------------------*/
         bvh_builder.timing(true);
         framebuffer.timing(true);
@@ -472,37 +1247,22 @@ uint32_t Renderer::resize_output(size_t width, size_t height)
         tile_size *= config.tile_to_cores_ratio;
         tile_size = std::min(pixel_count, tile_size);
 
-        /*---------------------- Resize ray bundles -----------------------------*/
+        /*------------------------ Resize ray and hit bundles ----------------------*/
         size_t ray_bundle_size = tile_size * 3;
 
-        if (ray_bundle_1.resize(ray_bundle_size)) {
-                std::cerr << "Error resizing ray bundle (new size: " 
+        if (resize_pipelines(ray_bundle_size)) {
+                std::cerr << "Error resizing ray and hit bundles (new size: " 
                           << ray_bundle_size << ")\n";
                 std::cerr.flush();
                 return -1;
         }
 
-        if (ray_bundle_2.resize(ray_bundle_size)) {
-                std::cerr << "Error resizing ray bundle (new size: " 
-                          << ray_bundle_size << ")\n";
-                std::cerr.flush();
-                return -1;
-        }
-
-        /*---------------------- Resize hit bundle -----------------------------*/
-        size_t hit_bundle_size = ray_bundle_size;
-
-        if (hit_bundle.resize(hit_bundle_size)) {
-                std::cerr << "Error resizing hit bundle (new size: " 
-                          << ray_bundle_size << ")\n";
-                std::cerr.flush();
-                return -1;
-        }
-
-        /*------------------------ Resize FrameBuffer ---------------------------*/
-        if (framebuffer.resize(sz)) {
-                std::cerr << "Error resizing framebuffer." << "\n";
-                return -1;
+        /*------------------------ Resize FrameBuffers ---------------------------*/
+        for (size_t i = 0; i < pipelines.size(); ++i) {
+                if (pipelines[i].framebuffer->resize(sz)) {
+                        std::cerr << "Error resizing framebuffer." << "\n";
+                        return -1;
+                }
         }
 
         return 0;
@@ -512,7 +1272,11 @@ uint32_t Renderer::resize_output(size_t width, size_t height)
 int32_t 
 Renderer::set_samples_per_pixel(size_t spp, pixel_sample_cl const* pixel_samples)
 {
-        return prim_ray_gen.set_spp(spp,pixel_samples);
+        for (size_t i = 0; i < pipelines.size(); ++i) {
+                if (pipelines[i].prim_ray_gen->set_spp(spp,pixel_samples))
+                        return -1;
+        }
+        return 0;
 }
 
 size_t
@@ -0,0 +1,421 @@
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <vector>
+
+#include <cl-gl/opengl-init.hpp>
+#include <cl-gl/opencl-init.hpp>
+#include <rt/rt.hpp>
+#include <rt/config-tuner.hpp>
+#include <rt/camera-recorder.hpp>
+#include <misc/bench-report.hpp>
+
+#include <rt/test-params.hpp>
+
+/*
+ * Headless benchmark: renders a fixed number of frames of a scene along its
+ * camera trajectory and writes a JSON report with throughput, frame time
+ * percentiles and the time of every rt_stage.
+ *
+ * The OpenCL context doesn't share GL, the frames are rendered to an image
+ * of the context, so no window nor display is needed.
+ */
+
+struct BenchParams {
+        int         scene;
+        size_t      size[2];
+        int         max_bounces;
+        bool        gpu_bvh;
+        bool        instancing;
+        int         devices;
+        bool        numa_fission;
+        int         warmup_frames;
+        int         frames;
+        bool        tune;
+        std::string output;
+        std::string trace_file;
+        std::string camera_path;
+        std::string cubemap_path;
+};
+
+static double mean(const std::vector<double>& values)
+{
+        if (values.empty())
+                return 0;
+        double acc = 0;
+        for (size_t i = 0; i < values.size(); ++i)
+                acc += values[i];
+        return acc/values.size();
+}
+
+static void write_json_times(std::ostream& o, std::vector<double> values)
+{
+        std::sort(values.begin(), values.end());
+        o << "{\"mean\": " << mean(values)
+          << ", \"min\": " << (values.empty()? 0 : values.front())
+          << ", \"p50\": " << percentile(values, 50)
+          << ", \"p90\": " << percentile(values, 90)
+          << ", \"p95\": " << percentile(values, 95)
+          << ", \"p99\": " << percentile(values, 99)
+          << ", \"max\": " << (values.empty()? 0 : values.back())
+          << "}";
+}
+
+static std::string device_name()
+{
+        char name[256] = {0};
+        clGetDeviceInfo(CLInfo::instance()->device_id, CL_DEVICE_NAME,
+                        sizeof(name)-1, name, NULL);
+        return std::string(name);
+}
+
+static int32_t set_scene(int scene_i, Scene& scene, size_t* window_size,
+                         LinearCameraTrajectory* traj, std::string* name)
+{
+        if (scene_i == 0) {
+                hand_set_scene(scene, window_size);
+                hand_set_cam_traj(traj);
+                *name = "hand";
+        } else if (scene_i == 1) {
+                ben_set_scene(scene, window_size);
+                ben_set_cam_traj(traj);
+                *name = "ben";
+        } else if (scene_i == 2) {
+                boat_set_scene(scene, window_size);
+                boat_set_cam_traj(traj);
+                *name = "boat";
+        } else if (scene_i == 3) {
+                dragon_set_scene(scene, window_size);
+                dragon_set_cam_traj(traj);
+                *name = "dragon";
+        } else { // scene_i > 3
+                buddha_set_scene(scene, window_size);
+                buddha_set_cam_traj(traj);
+                *name = "buddha";
+        }
+        return 0;
+}
+
+static int32_t render_frame(Renderer& renderer, Scene& scene, memory_id tex_id)
+{
+        if (renderer.update_configuration()) {
+                std::cerr << "Error updating renderer configuration\n";
+                return -1;
+        }
+
+        if (renderer.set_up_frame(tex_id, scene)) {
+                std::cerr << "Error in setting up frame" << "\n";
+                return -1;
+        }
+
+        if (renderer.render_to_framebuffer(scene)) {
+                std::cerr << "Error in rendering to framebuffer" << "\n";
+                return -1;
+        }
+
+        if (renderer.copy_framebuffer()) {
+                std::cerr << "Error in copying framebuffer" << "\n";
+                return -1;
+        }
+
+        if (renderer.conclude_frame(scene)) {
+                std::cerr << "Error concluding frame" << "\n";
+                return -1;
+        }
+
+        return 0;
+}
+
+int main (int argc, char** argv)
+{
+        std::string ini_file = "bench.ini";
+        if (argc > 1)
+                ini_file = argv[1];
+
+        BenchParams params;
+        params.scene = 0;
+        params.size[0] = params.size[1] = 512;
+        params.max_bounces = 3;
+        params.gpu_bvh = true;
+        params.instancing = false;
+        params.devices = 1;
+        params.numa_fission = false;
+        params.warmup_frames = 10;
+        params.frames = 100;
+        params.tune = false;
+        params.output = "bench.json";
+        params.cubemap_path = "textures/cubemap/Path/";
+
+        Renderer renderer;
+        renderer.configure_from_defaults();
+        renderer.configure_from_ini_file(ini_file);
+
+        INIReader ini;
+        if (ini.load_file(ini_file)) {
+                std::cerr << "Unable to read " << ini_file << ", using defaults\n";
+        } else {
+                int32_t int_val;
+                ini.get_int_value("RT", "scene", params.scene);
+                if (!ini.get_int_value("RT", "screen_w", int_val))
+                        params.size[0] = int_val;
+                if (!ini.get_int_value("RT", "screen_h", int_val))
+                        params.size[1] = int_val;
+                ini.get_int_value("RT", "max_bounce", params.max_bounces);
+                if (!ini.get_int_value("RT", "gpu_bvh", int_val))
+                        params.gpu_bvh = int_val;
+                if (!ini.get_int_value("RT", "instancing", int_val))
+                        params.instancing = int_val;
+                ini.get_str_value("RT", "cubemap", params.cubemap_path);
+                ini.get_int_value("RT", "devices", params.devices);
+                if (!ini.get_int_value("RT", "numa_fission", int_val))
+                        params.numa_fission = int_val;
+                ini.get_int_value("Bench", "warmup_frames", params.warmup_frames);
+                ini.get_int_value("Bench", "frames", params.frames);
+                ini.get_str_value("Bench", "output", params.output);
+                ini.get_str_value("Bench", "trace", params.trace_file);
+                ini.get_str_value("Bench", "camera_path", params.camera_path);
+                if (!ini.get_int_value("Bench", "tune", int_val))
+                        params.tune = int_val;
+        }
+        if (argc > 2)
+                params.output = argv[2];
+
+        params.frames = std::max(params.frames, 1);
+        params.warmup_frames = std::max(params.warmup_frames, 0);
+        params.max_bounces = std::min(std::max(params.max_bounces, 0), 9);
+        params.devices = std::max(params.devices, 1);
+
+        /*---------------------- Initialize OpenCL -------------------------*/
+        CLInfo* clinfo = CLInfo::instance();
+        /* Device timestamps for the trace need a profiling queue */
+        bool tracing = !params.trace_file.empty();
+        if (clinfo->initialize(2, tracing, params.devices,
+                               params.numa_fission, false) != CL_SUCCESS){
+                std::cerr << "Failed to initialize CL" << "\n";
+                return 1;
+        }
+
+        DeviceInterface* device = DeviceInterface::instance();
+        if (device->initialize()) {
+                std::cerr << "Failed to initialize device interface" << "\n";
+                return 1;
+        }
+
+        if (DeviceFunctionLibrary::instance()->initialize()) {
+                std::cerr << "Failed to initialize function library" << "\n";
+                return 1;
+        }
+
+        memory_id tex_id = device->new_memory();
+        if (device->memory(tex_id).initialize_image(params.size[0], 
+                                                    params.size[1])) {
+                std::cerr << "Failed to create the target image" << "\n";
+                return 1;
+        }
+
+        /*---------------------- Set up scene ---------------------------*/
+        Scene scene;
+        if (scene.initialize()) {
+                std::cerr << "Failed to initialize scene" << "\n";
+                return 1;
+        }
+
+        LinearCameraTrajectory traj;
+        std::string scene_name;
+        set_scene(params.scene, scene, params.size, &traj, &scene_name);
+
+        /* Instances need the host bvh */
+        scene.set_instancing(params.instancing && !params.gpu_bvh);
+        if (scene.create_aggregate_mesh()) {
+                std::cerr << "Failed to create aggregate mesh" << "\n";
+                return 1;
+        }
+
+        if (!params.gpu_bvh) {
+                if (scene.create_aggregate_bvh() ||
+                    scene.transfer_aggregate_bvh_to_device()) {
+                        std::cerr << "Failed to create aggregate bvh" << "\n";
+                        return 1;
+                }
+        }
+
+        if (scene.transfer_aggregate_mesh_to_device()) {
+                std::cerr << "Failed to transfer aggregate mesh to device memory"
+                          << "\n";
+                return 1;
+        }
+
+        const std::string& cm = params.cubemap_path;
+        if (scene.cubemap.initialize(cm + "posx.jpg", cm + "negx.jpg",
+                                     cm + "posy.jpg", cm + "negy.jpg",
+                                     cm + "posz.jpg", cm + "negz.jpg")) {
+                std::cerr << "Failed to initialize cubemap." << "\n";
+                return 1;
+        }
+        scene.cubemap.enabled = true;
+
+        if (renderer.initialize("rt-bench-log")) {
+                std::cerr << "Error initializing renderer.\n";
+                return 1;
+        }
+        renderer.set_static_bvh(!params.gpu_bvh);
+        renderer.set_max_bounces(params.max_bounces);
+        renderer.log.enabled = false;
+
+        /*---------------------- Tune configuration -----------------------*/
+        /* The best configuration found is stored for the scene and used by
+           the measured frames (and by later runs with the same tuning_file) */
+        if (params.tune) {
+                std::string tuning_file = renderer.get_tuning_file();
+                if (tuning_file.empty())
+                        tuning_file = "rt-tuning.ini";
+
+                ConfigTuner tuner;
+                if (tuner.tune(renderer, scene, tex_id))
+                        return 1;
+
+                std::string key = ConfigTuner::scene_key(renderer, scene);
+                if (ConfigTuner::save(tuning_file, key, tuner.best_config(),
+                                      tuner.best_frame_time()) ||
+                    renderer.load_tuned_configurations(tuning_file))
+                        return 1;
+                std::cout << "Saved tuned configuration " << key 
+                          << " to " << tuning_file << "\n";
+        }
+
+        /*---------------------- Render ----------------------------------*/
+        /* A recorded camera path replaces the scene trajectory, and sets the
+           number of measured frames */
+        CameraTrajectory* cam_traj = &traj;
+        RecordedCameraTrajectory recorded_traj;
+        bool replay = !params.camera_path.empty();
+        if (replay) {
+                if (recorded_traj.load(params.camera_path))
+                        return 1;
+                cam_traj = &recorded_traj;
+                params.frames = recorded_traj.frame_count();
+        }
+
+        /* The trajectory is walked over the measured frames only, so a run
+           always covers the same camera positions */
+        cam_traj->set_frames(params.frames);
+        cam_traj->set_repeating(false);
+        float aspect = params.size[0]/(float)params.size[1];
+
+        std::vector<double> frame_times;
+        std::vector<double> stage_times[STAGE_COUNT];
+        double total_time_ms = 0;
+        size_t total_rays = 0;
+        size_t total_sec_rays = 0;
+        TraversalStats traversal;
+
+        int total_frames = params.warmup_frames + params.frames;
+        for (int frame = 0; frame < total_frames; ++frame) {
+                bool warmup = frame < params.warmup_frames;
+
+                vec3 cam_pos, cam_dir, cam_up;
+                if (warmup) {
+                        cam_traj->reset();
+                        cam_traj->get_next_camera_params(&cam_pos, &cam_dir, &cam_up);
+                        cam_traj->reset();
+                } else {
+                        cam_traj->get_next_camera_params(&cam_pos, &cam_dir, &cam_up);
+                }
+                scene.camera.set(cam_pos, cam_dir, cam_up, M_PI/4.f, aspect);
+                if (replay && recorded_traj.apply_object_transforms(scene))
+                        return 1;
+
+                /* Only the measured frames are traced */
+                if (tracing && !warmup && !renderer.trace.recording()) {
+                        if (renderer.trace.start(params.trace_file))
+                                return 1;
+                }
+
+                if (render_frame(renderer, scene, tex_id))
+                        return 1;
+
+                if (warmup)
+                        continue;
+
+                const FrameStats& stats = renderer.get_frame_stats();
+                frame_times.push_back(stats.get_frame_time());
+                for (uint32_t s = 0; s < STAGE_COUNT; ++s)
+                        stage_times[s].push_back(stats.get_stage_time(rt_stage(s)));
+                total_time_ms += stats.get_frame_time();
+                total_rays += stats.get_ray_count();
+                total_sec_rays += stats.get_secondary_ray_count();
+                traversal.add(stats.get_traversal_stats());
+        }
+
+        renderer.trace.stop();
+
+        /*---------------------- Report ----------------------------------*/
+        double seconds = total_time_ms * 0.001;
+        double mrays = seconds > 0 ? total_rays / seconds * 1e-6 : 0;
+
+        std::ofstream out(params.output.c_str());
+        if (!out.good()) {
+                std::cerr << "Unable to open " << params.output << "\n";
+                return 1;
+        }
+
+        Mesh& agg = scene.get_aggregate_mesh();
+        const RendererConfig& conf = renderer.config;
+
+        out << "{\n";
+        out << "  \"scene\": " << json_string(scene_name) << ",\n";
+        out << "  \"device\": " << json_string(device_name()) << ",\n";
+        out << "  \"triangles\": " << agg.triangleCount() << ",\n";
+        out << "  \"width\": " << params.size[0] << ",\n";
+        out << "  \"height\": " << params.size[1] << ",\n";
+        out << "  \"max_bounces\": " << params.max_bounces << ",\n";
+        out << "  \"gpu_bvh\": " << (params.gpu_bvh? "true" : "false") << ",\n";
+        out << "  \"instancing\": " << (params.instancing? "true" : "false") << ",\n";
+        out << "  \"warmup_frames\": " << params.warmup_frames << ",\n";
+        out << "  \"frames\": " << params.frames << ",\n";
+        if (replay)
+                out << "  \"camera_path\": " << json_string(params.camera_path) << ",\n";
+        out << "  \"config\": {"
+            << "\"bvh_refit_only\": " << conf.bvh_refit_only
+            << ", \"bvh_max_depth\": " << conf.bvh_depth
+            << ", \"bvh_min_leaf_size\": " << conf.bvh_min_leaf_size
+            << ", \"sec_use_atomics\": " << conf.sec_ray_use_atomics
+            << ", \"sec_use_disc\": " << conf.sec_ray_use_disc
+            << ", \"prim_use_zcurve\": " << conf.prim_ray_use_zcurve
+            << ", \"prim_quad_size\": " << conf.prim_ray_quad_size
+            << ", \"tile_to_cores_ratio\": " << conf.tile_to_cores_ratio
+            << "},\n";
+        out << "  \"rays\": " << total_rays << ",\n";
+        out << "  \"secondary_rays\": " << total_sec_rays << ",\n";
+        out << "  \"mrays_per_sec\": " << mrays << ",\n";
+        if (traversal.rays) {
+                out << "  \"traversal\": {"
+                    << "\"rays\": " << traversal.rays
+                    << ", \"mean_node_visits\": " << traversal.mean_node_visits()
+                    << ", \"mean_box_tests\": " << traversal.mean_box_tests()
+                    << ", \"mean_triangle_tests\": " << traversal.mean_triangle_tests()
+                    << ", \"max_node_visits\": " << traversal.max_node_visits
+                    << "},\n";
+        }
+        out << "  \"frame_time_ms\": ";
+        write_json_times(out, frame_times);
+        out << ",\n";
+        out << "  \"stage_time_ms\": {\n";
+        for (uint32_t s = 0; s < STAGE_COUNT; ++s) {
+                out << "    \"" << rt_stage_name(rt_stage(s)) << "\": ";
+                write_json_times(out, stage_times[s]);
+                out << (s+1 < STAGE_COUNT? ",\n" : "\n");
+        }
+        out << "  }\n";
+        out << "}\n";
+        out.close();
+
+        std::sort(frame_times.begin(), frame_times.end());
+        std::cout << "Wrote " << params.output << ": " << mrays << " Mrays/s, "
+                  << "median frame " << percentile(frame_times, 50) << " ms\n";
+
+        CLInfo::instance()->set_sync(true);
+        CLInfo::instance()->release_resources();
+
+        return 0;
+}
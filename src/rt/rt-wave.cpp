@@ -5,6 +5,7 @@
 #include <cl-gl/opengl-init.hpp>
 #include <cl-gl/opencl-init.hpp>
 #include <rt/rt.hpp>
+#include <rt/camera-recorder.hpp>
 
 #include <rt/test-params.hpp>
 
@@ -27,6 +28,9 @@ std::vector<Scene> scenes;
 
 GLuint gl_tex;
 
+CameraRecorder cam_recorder;
+std::string    cam_path_filename = "camera-path.rec";
+
 bool  print_fps = true;
 bool logging = false;
 bool logged = false;
@@ -133,6 +137,16 @@ void gl_key(unsigned char key, int x, int y)
         case 'm':
                 current_model = 0;
                 break;
+        case 'r': /* Start / stop recording the camera path */
+                if (cam_recorder.recording()) {
+                        cam_recorder.stop();
+                        std::cout << "Recorded " << cam_recorder.frames() 
+                                  << " frames to " << cam_path_filename << "\n";
+                } else if (!cam_recorder.start(cam_path_filename, scene)) {
+                        std::cout << "Recording camera path to " 
+                                  << cam_path_filename << "\n";
+                }
+                break;
         }
 }
 
@@ -176,6 +190,9 @@ void gl_loop()
 
         //Set camera parameters (if needed)
 
+        if (cam_recorder.record_frame(scene))
+                cam_recorder.stop();
+
         //Render image to framebuffer and copy to set up texture
         //renderer.render_to_texture(scene);
 
@@ -225,6 +242,8 @@ void gl_loop()
                 glRasterPos2f(-0.95f,0.9f);
                 std::stringstream ss;
                 ss << "FPS: " << (1000.f / stats.get_frame_time());
+                if (cam_recorder.recording())
+                        ss << "\n  REC";
                 std::string fps_s = ss.str();
                 for (uint32_t i = 0; i < fps_s.size(); ++i)
                         glutBitmapCharacter(GLUT_BITMAP_HELVETICA_18, *(fps_s.c_str()+i));
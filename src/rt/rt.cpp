@@ -5,6 +5,7 @@
 #include <cl-gl/opengl-init.hpp>
 #include <cl-gl/opencl-init.hpp>
 #include <rt/rt.hpp>
+#include <rt/camera-recorder.hpp>
 
 #include <rt/test-params.hpp>
 
@@ -33,6 +34,9 @@ Scene scene;
 
 GLuint gl_tex;
 
+CameraRecorder cam_recorder;
+std::string    cam_path_filename = "camera-path.rec";
+
 LinearCameraTrajectory cam_traj;
 std::string log_filename;
 
@@ -178,6 +182,16 @@ void gl_key(unsigned char key, int x, int y)
         case 'm':
                 current_model = 0;
                 break;
+        case 'r': /* Start / stop recording the camera path */
+                if (cam_recorder.recording()) {
+                        cam_recorder.stop();
+                        std::cout << "Recorded " << cam_recorder.frames() 
+                                  << " frames to " << cam_path_filename << "\n";
+                } else if (!cam_recorder.start(cam_path_filename, scene)) {
+                        std::cout << "Recording camera path to " 
+                                  << cam_path_filename << "\n";
+                }
+                break;
         }
 }
 
@@ -338,6 +352,9 @@ void gl_loop()
                 scene.camera.set(cam_pos,cam_dir,cam_up, FOV, aspect);
         }
         
+        if (cam_recorder.record_frame(scene))
+                cam_recorder.stop();
+
         debug_stats.stage_acc_times[1] += debug_timer.msec_since_snap();//!!
 
         //Render image to framebuffer and copy to set up texture
@@ -395,6 +412,8 @@ void gl_loop()
                 if (frame < 100) {
                         ss << "\n  LOGGING";
                 }
+                if (cam_recorder.recording())
+                        ss << "\n  REC";
                 // ss << "\n  Quad size: " << renderer.config.prim_ray_quad_size;
                 std::string fps_s = ss.str();
                 for (uint32_t i = 0; i < fps_s.size(); ++i)
@@ -1,12 +1,89 @@
 #include <iostream> //!!
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 
 #include <rt/scene.hpp>
 #include <rt/vector.hpp>
 #include <rt/cl_aux.hpp>
 
+/* Clean roots between two changed ones below this many are uploaded with
+   them rather than splitting the write */
+#define ROOT_WRITE_GAP 8
+/* Past this many writes the whole changed span goes in one */
+#define MAX_ROOT_WRITES 16
+
 static mesh_id invalid_mesh_id();
 // static object_id invalid_object_id();
 
+/* World bounds of a box moved by an affine transform. Empty boxes stay
+   empty */
+static BBox
+transform_bbox(const BBox& b, const cl_sqmat4& tr)
+{
+        float M = std::numeric_limits<float>::max();
+        BBox w;
+        for (int i = 0; i < 3; ++i) {
+                if (b.lo.s[i] > b.hi.s[i]) {
+                        w.lo = makeFloat3(M, M, M);
+                        w.hi = makeFloat3(-M, -M, -M);
+                        return w;
+                }
+        }
+
+        for (int i = 0; i < 3; ++i) {
+                const cl_float4& row = tr.row[i];
+                float center = row.s[3];
+                float extent = 0.f;
+                for (int j = 0; j < 3; ++j) {
+                        center += row.s[j] * 0.5f * (b.lo.s[j] + b.hi.s[j]);
+                        extent += std::fabs(row.s[j]) * 0.5f * (b.hi.s[j] - b.lo.s[j]);
+                }
+                w.lo.s[i] = center - extent;
+                w.hi.s[i] = center + extent;
+        }
+        return w;
+}
+
+/* Orders roots by the center of their world bounds on one axis */
+struct RootCenterLess {
+        const std::vector<BBox>& bounds;
+        int axis;
+        RootCenterLess(const std::vector<BBox>& b, int a) : bounds(b), axis(a) {}
+        bool operator()(uint32_t a, uint32_t b) const {
+                return bounds[a].lo.s[axis] + bounds[a].hi.s[axis] <
+                        bounds[b].lo.s[axis] + bounds[b].hi.s[axis];
+        }
+};
+
+/* Moves a node of a bvh built on its own into a bigger node array */
+static void
+offset_bvh_node(BVHNode& node, uint32_t node_offset, uint32_t tri_offset)
+{
+        node.m_parent += node_offset;
+        if (node.m_leaf) {
+                node.offset_bounds(tri_offset);
+        } else {
+                node.m_l_child += node_offset;
+                node.m_r_child += node_offset;
+        }
+}
+
+/* Aggregate data followed by that of the instanced meshes, as uploaded. 
+   No copy is made when there are no instances */
+template <typename T>
+static const T*
+with_instances(const std::vector<T>& aggregate, const std::vector<T>& instances,
+               std::vector<T>& buffer)
+{
+        if (instances.empty())
+                return aggregate.empty() ? NULL : &aggregate[0];
+        buffer.reserve(aggregate.size() + instances.size());
+        buffer.assign(aggregate.begin(), aggregate.end());
+        buffer.insert(buffer.end(), instances.begin(), instances.end());
+        return &buffer[0];
+}
+
 /*-------------------- Object Methods -------------------------------*/
 
 Object::Object(mesh_id _id) : id(_id){slack = vec3_zero;}
@@ -46,31 +123,85 @@ Scene::Scene()
         m_aggregate_bvh_transfered = false;
         m_aggregate_kdt_transfered = false;
         m_bvhs_transfered = false;
+        m_bvh_roots_moved = false;
+        m_geometry_version = 0;
+        m_roots_version = 0;
+        m_instancing = false;
         m_accelerator_type = SAH_BVH_ACCELERATOR;
+        m_shared_scene = NULL;
+        m_atlas_scene = NULL;
+        m_own_cubemap = false;
+        m_cq = 0;
 }
 
 int32_t
 Scene::copy_mem_from(Scene& scene, size_t cq_i)
 {
-        if (!m_initialized)
-                return -1;
+        return copy_mem(scene, cq_i, false);
+}
+
+int32_t
+Scene::share_mem_from(Scene& scene, size_t cq_i)
+{
+        return copy_mem(scene, cq_i, true);
+}
 
+int32_t
+Scene::copy_vertices_from(Scene& scene, size_t cq_i)
+{
         DeviceInterface& device = *DeviceInterface::instance();
-        if (!device.good())
+        if (!m_initialized || &scene == this || !device.good())
                 return -1;
 
-        /////////// Resize memories
         if (!device.valid_memory_id(vert_id))
-             vert_id = device.new_memory(); 
+             vert_id = device.new_memory(m_cq); 
         DeviceMemory& vert_mem = device.memory(vert_id);
         if (vert_mem.valid())
                 vert_mem.resize(scene.vertex_mem().size());
         else
                 vert_mem.initialize(scene.vertex_mem().size());
 
+        return scene.vertex_mem().copy_all_to(vert_mem, cq_i);
+}
+
+int32_t
+Scene::copy_mem(Scene& scene, size_t cq_i, bool shared)
+{
+        if (!m_initialized || &scene == this)
+                return -1;
 
+        DeviceInterface& device = *DeviceInterface::instance();
+        if (!device.good())
+                return -1;
+
+        /* Images can't be used across contexts, a copy in another one 
+           gets its own atlas and cubemap */
+        CLInfo* clinfo = CLInfo::instance();
+        bool other_context = 
+                clinfo->queue_context(m_cq) != clinfo->queue_context(scene.m_cq);
+        if (other_context && shared)
+                return -1;
+
+        m_shared_scene = shared ? &scene : NULL;
+        if (other_context) {
+                m_atlas_scene = NULL;
+                if (texture_atlas.copy_from(scene.get_texture_atlas()) ||
+                    cubemap.copy_from(scene.cubemap, m_cq))
+                        return -1;
+                m_own_cubemap = true;
+        } else {
+                m_atlas_scene = scene.m_atlas_scene ? scene.m_atlas_scene : &scene;
+        }
+
+        /////////// Vertices are always copied, builds of the copy are 
+        /////////// traced with the vertices they were made from
+        if (copy_vertices_from(scene, cq_i))
+                return -1;
+
+        /////////// Resize memories, shared ones are read from scene 
+        /////////// (see material_list_mem())
         if (!device.valid_memory_id (idx_id))
-                idx_id = device.new_memory();
+                idx_id = device.new_memory(m_cq);
         DeviceMemory& idx_mem = device.memory(idx_id);
         if (idx_mem.valid())
                 idx_mem.resize(scene.index_mem().size());
@@ -79,7 +210,7 @@ Scene::copy_mem_from(Scene& scene, size_t cq_i)
 
 
         if (!device.valid_memory_id (mat_map_id))
-                mat_map_id = device.new_memory();
+                mat_map_id = device.new_memory(m_cq);
         DeviceMemory& mat_map_mem = device.memory(mat_map_id);
         if (mat_map_mem.valid())
                 mat_map_mem.resize(scene.material_map_mem().size());
@@ -88,16 +219,18 @@ Scene::copy_mem_from(Scene& scene, size_t cq_i)
 
 
         if (!device.valid_memory_id (mat_list_id))
-                mat_list_id = device.new_memory();
+                mat_list_id = device.new_memory(m_cq);
         DeviceMemory& mat_list_mem = device.memory(mat_list_id);
-        if (mat_list_mem.valid())
-                mat_list_mem.resize(scene.material_list_mem().size());
-        else
-                mat_list_mem.initialize(scene.material_list_mem().size());
+        if (!shared) {
+                if (mat_list_mem.valid())
+                        mat_list_mem.resize(scene.material_list_mem().size());
+                else
+                        mat_list_mem.initialize(scene.material_list_mem().size());
+        }
 
 
         if (!device.valid_memory_id (bvh_id))
-                bvh_id = device.new_memory();
+                bvh_id = device.new_memory(m_cq);
         DeviceMemory& bvh_mem = device.memory(bvh_id);
         if (bvh_mem.valid() && 
             scene.bvh_nodes_mem().valid() && 
@@ -111,47 +244,146 @@ Scene::copy_mem_from(Scene& scene, size_t cq_i)
         }
 
         if (!device.valid_memory_id (lights_id))
-                lights_id = device.new_memory();
+                lights_id = device.new_memory(m_cq);
         DeviceMemory& lights_mem = device.memory(lights_id);
-        if (lights_mem.valid())
-                lights_mem.resize(scene.lights_mem().size());
-        else
-                lights_mem.initialize(scene.lights_mem().size());
+        if (!shared) {
+                if (lights_mem.valid())
+                        lights_mem.resize(scene.lights_mem().size());
+                else
+                        lights_mem.initialize(scene.lights_mem().size());
+        }
 
-        ///////////// Copy memories
-        if (scene.vertex_mem().copy_all_to(vert_mem, cq_i))
-                return -1;
+        if (!device.valid_memory_id (bvh_roots_id))
+                bvh_roots_id = device.new_memory(m_cq);
+        DeviceMemory& bvh_roots_mem = device.memory(bvh_roots_id);
+        if (scene.bvh_roots_mem().valid()) {
+                if (bvh_roots_mem.valid())
+                        bvh_roots_mem.resize(scene.bvh_roots_mem().size());
+                else
+                        bvh_roots_mem.initialize(scene.bvh_roots_mem().size());
+        }
+
+        if (!device.valid_memory_id (top_nodes_id))
+                top_nodes_id = device.new_memory(m_cq);
+        DeviceMemory& top_nodes_mem = device.memory(top_nodes_id);
+        if (scene.top_nodes_mem().valid()) {
+                if (top_nodes_mem.valid())
+                        top_nodes_mem.resize(scene.top_nodes_mem().size());
+                else
+                        top_nodes_mem.initialize(scene.top_nodes_mem().size());
+        }
 
+        ///////////// Copy memories
         if (scene.index_mem().copy_all_to(idx_mem, cq_i))
                 return -1;
 
-        if (scene.bvh_nodes_mem().copy_all_to(bvh_mem, cq_i))
+        /* Builds write all the nodes */
+        if (!shared && scene.bvh_nodes_mem().copy_all_to(bvh_mem, cq_i))
                 return -1;
 
-        if (scene.material_list_mem().copy_all_to(mat_list_mem, cq_i))
+        if (!shared && scene.material_list_mem().copy_all_to(mat_list_mem, cq_i))
                 return -1;
 
         if (scene.material_map_mem().copy_all_to(mat_map_mem, cq_i))
                 return -1;
 
-        if (scene.lights_mem().copy_all_to(lights_mem, cq_i))
+        if (!shared && scene.lights_mem().copy_all_to(lights_mem, cq_i))
+                return -1;
+
+        if (scene.bvh_roots_mem().valid() &&
+            scene.bvh_roots_mem().copy_all_to(bvh_roots_mem, cq_i))
+                return -1;
+
+        if (scene.top_nodes_mem().valid() &&
+            scene.top_nodes_mem().copy_all_to(top_nodes_mem, cq_i))
                 return -1;
         
         ///////////// Copy state
         m_initialized = true;
-        m_aggregate_mesh_built = true;
+        m_aggregate_mesh_built = scene.m_aggregate_mesh_built;
         m_aggregate_bvh_built = true;
         m_aggregate_bvh_transfered = true;
         m_accelerator_type = scene.get_accelerator_type();
+        m_geometry_version = scene.m_geometry_version;
+        m_roots_version = scene.m_roots_version;
 
-        texture_atlas = scene.texture_atlas;
         camera        = scene.camera;
-        cubemap       = scene.cubemap;
+        if (!other_context)
+                cubemap = scene.cubemap;
         objects       = scene.objects;
         mesh_atlas    = scene.mesh_atlas;
         material_list = scene.material_list;
         material_map  = scene.material_map;
+        bvh_roots     = scene.bvh_roots;
+        root_bounds   = scene.root_bounds;
+        top_nodes     = scene.top_nodes;
+        lights        = scene.lights;
+        instance_groups  = scene.instance_groups;
+        object_instanced = scene.object_instanced;
+
+        return 0;
+}
+
+int32_t
+Scene::update_from(Scene& scene, size_t cq_i)
+{
+        if (!m_initialized || bvh_roots.size() != scene.bvh_roots.size())
+                return -1;
+
+        DeviceInterface& device = *DeviceInterface::instance();
+
+        /* Roots are compared on the host, both sides keep their copy. The
+           node indices may come from another build, only the transforms
+           are taken */
+        RootRuns runs;
+        for (size_t root_idx = 0; root_idx < bvh_roots.size(); ++root_idx) {
+                BVHRoot& root = bvh_roots[root_idx];
+                const BVHRoot& src = scene.bvh_roots[root_idx];
+                if (!memcmp(&root.tr, &src.tr, sizeof(root.tr)) &&
+                    !memcmp(&root.trInv, &src.trInv, sizeof(root.trInv)))
+                        continue;
+                root.tr = src.tr;
+                root.trInv = src.trInv;
+
+                if (!runs.empty() && root_idx - runs.back().second < ROOT_WRITE_GAP)
+                        runs.back().second = root_idx + 1;
+                else
+                        runs.push_back(std::make_pair(root_idx, root_idx + 1));
+        }
+        if (write_root_runs(runs, cq_i) ||
+            (!runs.empty() && refit_top_level(cq_i)))
+                return -1;
+        m_roots_version = scene.m_roots_version;
+        camera = scene.camera;
+        if (m_shared_scene == &scene)
+                return 0;
+
+        DeviceMemory& mat_list_mem = device.memory(mat_list_id);
+        if (mat_list_mem.size() != scene.material_list_mem().size() ||
+            scene.material_list_mem().copy_all_to(mat_list_mem, cq_i))
+                return -1;
+
+        DeviceMemory& lights_mem = device.memory(lights_id);
+        if (scene.lights_mem().copy_all_to(lights_mem, cq_i))
+                return -1;
 
+        material_list = scene.material_list;
+        lights        = scene.lights;
+        return 0;
+}
+
+int32_t
+Scene::copy_aggregate_mesh_from(Scene& scene)
+{
+        if (!m_initialized || !scene.m_aggregate_mesh_built)
+                return -1;
+
+        aggregate_mesh = scene.aggregate_mesh;
+        aggregate_bbox = scene.aggregate_bbox;
+        instance_mesh  = scene.instance_mesh;
+        instance_material_map = scene.instance_material_map;
+        instance_nodes = scene.instance_nodes;
+        m_aggregate_mesh_built = true;
         return 0;
 }
 
@@ -160,24 +392,26 @@ Scene::~Scene()
         destroy();
 }
 int32_t 
-Scene::initialize()
+Scene::initialize(size_t cq_i)
 {
         DeviceInterface& device = *DeviceInterface::instance();
         if (!device.good())
                 return -1;
 
-        if (texture_atlas.initialize())
+        m_cq = cq_i;
+        if (texture_atlas.initialize(m_cq))
                 return -1;
 
-        vert_id = device.new_memory();
-        idx_id = device.new_memory();
-        mat_map_id = device.new_memory();
-        mat_list_id = device.new_memory();
-        bvh_id = device.new_memory();
-        lights_id = device.new_memory();
-        bvh_roots_id = device.new_memory();
-        kdt_nodes_id = device.new_memory();
-        kdt_leaf_tris_id = device.new_memory();
+        vert_id = device.new_memory(m_cq);
+        idx_id = device.new_memory(m_cq);
+        mat_map_id = device.new_memory(m_cq);
+        mat_list_id = device.new_memory(m_cq);
+        bvh_id = device.new_memory(m_cq);
+        lights_id = device.new_memory(m_cq);
+        bvh_roots_id = device.new_memory(m_cq);
+        top_nodes_id = device.new_memory(m_cq);
+        kdt_nodes_id = device.new_memory(m_cq);
+        kdt_leaf_tris_id = device.new_memory(m_cq);
 
 	/*-------------- Move initial light info to device memory---------------*/
         DeviceMemory& light_mem = device.memory(lights_id);
@@ -242,14 +476,21 @@ Scene::transfer_aggregate_mesh_to_device()
 	/*---------------------- Move model data to device -----------------*/
 
         DeviceInterface& device = *DeviceInterface::instance();
-        size_t triangle_count = aggregate_mesh.triangleCount();
-        size_t vertex_count = aggregate_mesh.vertexCount();
+        size_t triangle_count = aggregate_mesh.triangleCount() + 
+                instance_mesh.triangleCount();
+        size_t vertex_count = aggregate_mesh.vertexCount() + 
+                instance_mesh.vertexCount();
+        std::vector<Vertex> vertices;
+        std::vector<Triangle> triangles;
+        std::vector<cl_int> mat_map;
 
         DeviceMemory& vertex_mem = device.memory(vert_id);
         size_t vertex_mem_size = vertex_count * sizeof(Vertex);
-        const void*  vertex_ptr = aggregate_mesh.vertexArray();
+        const void*  vertex_ptr = with_instances(aggregate_mesh.vertices,
+                                                 instance_mesh.vertices, vertices);
         if (!vertex_mem.valid()) {
-                if (vertex_mem.initialize(vertex_mem_size, vertex_ptr, READ_ONLY_MEMORY))
+                if (vertex_mem.initialize_host_mapped(vertex_mem_size, vertex_ptr, 
+                                                      READ_ONLY_MEMORY))
                         return -1;
         } else {
                 if (vertex_mem.resize(vertex_mem_size))
@@ -260,7 +501,8 @@ Scene::transfer_aggregate_mesh_to_device()
 
         DeviceMemory& index_mem = device.memory(idx_id);
         size_t index_mem_size = triangle_count * sizeof(Triangle);
-        const void*  index_ptr = aggregate_mesh.triangleArray();
+        const void*  index_ptr = with_instances(aggregate_mesh.triangles,
+                                                instance_mesh.triangles, triangles);
         if (!index_mem.valid()) {
                 if (index_mem.initialize(index_mem_size, index_ptr, READ_ONLY_MEMORY))
                         return -1;
@@ -273,6 +515,9 @@ Scene::transfer_aggregate_mesh_to_device()
 
 	/*---------------------- Move material data to device ------------*/
 
+        if (texture_atlas.update_atlas())
+                return -1;
+
         DeviceMemory& mat_list_mem = device.memory(mat_list_id);
         const void* mat_list_ptr = &(material_list[0]);
         size_t mat_list_size = sizeof(material_cl) * material_list.size();
@@ -287,8 +532,9 @@ Scene::transfer_aggregate_mesh_to_device()
         }
 
         DeviceMemory& mat_map_mem = device.memory(mat_map_id);
-        const void* mat_map_ptr = &(material_map[0]);
-        size_t mat_map_size = sizeof(cl_int) * material_map.size();
+        const void* mat_map_ptr = with_instances(material_map,
+                                                 instance_material_map, mat_map);
+        size_t mat_map_size = sizeof(cl_int) * triangle_count;
         if (!mat_map_mem.valid()) {
                 if (mat_map_mem.initialize(mat_map_size, mat_map_ptr, READ_ONLY_MEMORY))
                         return -1;
@@ -300,14 +546,16 @@ Scene::transfer_aggregate_mesh_to_device()
         }
 
         /*------------ Attempt to move single bvh_root data to device ------------*/
+        /* Instance roots go with the bvh, see transfer_aggregate_bvh_to_device */
         DeviceMemory& bvh_roots_mem = device.memory(bvh_roots_id);
-        if (!bvh_roots_mem.valid()) {
+        if (instance_groups.empty() && !bvh_roots_mem.valid()) {
 
                 BVHRoot root;
                 root.node = 0;
                 root.tr = root.trInv = mat4x4_to_cl_sqmat4(scaleMatrix4x4(1.f));
                 bvh_roots.clear();
                 bvh_roots.push_back(root);
+                root_bounds.assign(1, aggregate_bbox);
                 const void* bvh_roots_ptr = &root;
                 size_t bvh_roots_size = sizeof(root);
                 if (bvh_roots_mem.initialize(bvh_roots_size, 
@@ -316,7 +564,7 @@ Scene::transfer_aggregate_mesh_to_device()
                         return -1;
         }
         
-
+        m_geometry_version++;
         return 0;
 }
 
@@ -339,13 +587,22 @@ Scene::transfer_aggregate_bvh_to_device()
         /*------------ Attempt to move single bvh_root data to device ------------*/
         
         DeviceMemory& bvh_roots_mem = device.memory(bvh_roots_id);
-        if (!bvh_roots_mem.valid()) {
+        if (!instance_groups.empty()) {
+                size_t bvh_roots_size = bvh_roots.size() * sizeof(BVHRoot);
+                if (bvh_roots_mem.valid() && bvh_roots_mem.release())
+                        return -1;
+                if (bvh_roots_mem.initialize(bvh_roots_size, &bvh_roots[0],
+                                             READ_ONLY_MEMORY) ||
+                    build_top_level())
+                        return -1;
+        } else if (!bvh_roots_mem.valid()) {
 
                 BVHRoot root;
                 root.node = 0;
                 root.tr = root.trInv = mat4x4_to_cl_sqmat4(scaleMatrix4x4(1.f));
                 bvh_roots.clear();
                 bvh_roots.push_back(root);
+                root_bounds.assign(1, aggregate_bbox);
                 const void* bvh_roots_ptr = &root;
                 size_t bvh_roots_size = sizeof(root);
                 if (bvh_roots_mem.initialize(bvh_roots_size, 
@@ -355,6 +612,7 @@ Scene::transfer_aggregate_bvh_to_device()
         }
         
         m_aggregate_bvh_transfered = true;
+        m_geometry_version++;
 
         return 0;
 }
@@ -388,6 +646,7 @@ Scene::transfer_aggregate_kdtree_to_device()
             return -1;
 
         m_aggregate_kdt_transfered = true;
+        m_geometry_version++;
 
         return 0;
 }
@@ -480,8 +739,10 @@ Scene::add_objects(std::vector<mesh_id> mids)
 void 
 Scene::remove_object(object_id id)
 {
-	if (id < (object_id)objects.size())
+	if (id < (object_id)objects.size()) {
 		objects[id].set_mesh_id(invalid_mesh_id());
+                m_bvh_roots_moved = true;
+        }
 }
 
 Object& 
@@ -491,6 +752,129 @@ Scene::object(object_id id)
 	return objects[id];
 }
 
+void
+Scene::group_instances()
+{
+        instance_groups.clear();
+        object_instanced.assign(objects.size(), false);
+        if (!m_instancing || m_accelerator_type != SAH_BVH_ACCELERATOR)
+                return;
+
+        /* Groups of each mesh, one per material its objects use */
+        std::map<mesh_id, std::vector<size_t> > mesh_groups;
+        std::vector<InstanceGroup> groups;
+	for (uint32_t i = 0; i < objects.size(); ++i) {
+		Object& obj = objects[i];
+		if (!obj.is_valid())
+			continue;
+
+                std::vector<size_t>& candidates = mesh_groups[obj.id];
+                size_t g = 0;
+                for (; g < candidates.size(); ++g) {
+                        Object& first = objects[groups[candidates[g]].objects[0]];
+                        if (!std::memcmp(&first.mat, &obj.mat, sizeof(material_cl)))
+                                break;
+                }
+                if (g == candidates.size()) {
+                        candidates.push_back(groups.size());
+                        groups.push_back(InstanceGroup());
+                        groups.back().mesh = obj.id;
+                }
+                groups[candidates[g]].objects.push_back(i);
+        }
+
+        /* A mesh used once is cheaper baked into the aggregate */
+        for (size_t g = 0; g < groups.size(); ++g) {
+                if (groups[g].objects.size() < 2)
+                        continue;
+                instance_groups.push_back(groups[g]);
+                for (size_t o = 0; o < groups[g].objects.size(); ++o)
+                        object_instanced[groups[g].objects[o]] = true;
+        }
+}
+
+int32_t 
+Scene::create_instance_meshes()
+{
+        /* Shared meshes go after the aggregate vertices */
+        instance_mesh = Mesh();
+        instance_material_map.clear();
+        instance_nodes.clear();
+        uint32_t base_vertex = aggregate_mesh.vertexCount();
+
+        for (size_t g = 0; g < instance_groups.size(); ++g) {
+                InstanceGroup& group = instance_groups[g];
+                Mesh& mesh = mesh_atlas[group.mesh];
+
+                /* Built in object space, so it holds for any transform. The
+                   build reorders the triangles of the mesh to match */
+                std::map<mesh_id, BVH>::iterator bvh = instance_bvhs.find(group.mesh);
+                if (bvh == instance_bvhs.end()) {
+                        bvh = instance_bvhs.insert(std::make_pair(group.mesh, BVH())).first;
+                        if (bvh->second.construct(mesh))
+                                return -1;
+                }
+
+                uint32_t tri_start = uint32_t(instance_mesh.triangleCount());
+                group.vertex_start = uint32_t(instance_mesh.vertexCount());
+                group.node_start = uint32_t(instance_nodes.size());
+                for (size_t n = 0; n < bvh->second.m_nodes.size(); ++n) {
+                        BVHNode node = bvh->second.m_nodes[n];
+                        offset_bvh_node(node, group.node_start, tri_start);
+                        instance_nodes.push_back(node);
+                }
+
+                material_list.push_back(objects[group.objects[0]].mat);
+                cl_int map_index = cl_int(material_list.size() - 1);
+                instance_material_map.resize(tri_start + mesh.triangleCount(), 
+                                             map_index);
+
+                vtx_id vertex_offset = vtx_id(base_vertex + group.vertex_start);
+                for (uint32_t v = 0; v < mesh.vertexCount(); ++v)
+                        instance_mesh.vertices.push_back(mesh.vertex(v));
+		for (uint32_t t = 0; t < mesh.triangleCount(); ++t) {
+			Triangle tri = mesh.triangle(t);
+                        tri.v[0] += vertex_offset;
+			tri.v[1] += vertex_offset;
+			tri.v[2] += vertex_offset;
+			instance_mesh.triangles.push_back(tri);
+                }
+        }
+        return 0;
+}
+
+void
+Scene::add_instances_to_aggregate_bvh()
+{
+        uint32_t node_offset = uint32_t(aggregate_bvh.nodeArraySize());
+        uint32_t tri_offset = uint32_t(aggregate_mesh.triangleCount());
+
+        for (size_t n = 0; n < instance_nodes.size(); ++n) {
+                BVHNode node = instance_nodes[n];
+                offset_bvh_node(node, node_offset, tri_offset);
+                aggregate_bvh.m_nodes.push_back(node);
+        }
+
+        /* The aggregate, already in world space, then every instance */
+        BVHRoot root;
+        root.node = 0;
+        root.tr = root.trInv = mat4x4_to_cl_sqmat4(scaleMatrix4x4(1.f));
+        bvh_roots.clear();
+        bvh_roots.push_back(root);
+        root_bounds.assign(1, aggregate_bvh.m_nodes[0].m_bbox);
+        for (size_t g = 0; g < instance_groups.size(); ++g) {
+                InstanceGroup& group = instance_groups[g];
+                for (size_t o = 0; o < group.objects.size(); ++o) {
+                        GeometricProperties& geom = objects[group.objects[o]].geom;
+                        root.node = node_offset + group.node_start;
+                        root.tr = mat4x4_to_cl_sqmat4(geom.getTransformMatrix());
+                        root.trInv = mat4x4_to_cl_sqmat4(geom.getTransformMatrixInv());
+                        bvh_roots.push_back(root);
+                        root_bounds.push_back(instance_nodes[group.node_start].m_bbox);
+                }
+        }
+}
+
 int32_t 
 Scene::create_aggregate_mesh()
 {
@@ -499,10 +883,12 @@ Scene::create_aggregate_mesh()
 	material_map.clear();
     aggregate_mesh = Mesh();
 
+        group_instances();
+
 	for (uint32_t i = 0; i < objects.size(); ++i) {
 		Object& obj = objects[i];
 
-		if (!obj.is_valid())
+		if (!obj.is_valid() || object_instanced[i])
 			continue;
 
 		mesh_id m_id = obj.get_mesh_id();
@@ -533,6 +919,9 @@ Scene::create_aggregate_mesh()
 		base_triangle += uint32_t(mesh.triangleCount());
                 
 	}
+
+        if (create_instance_meshes())
+                return -1;
         
         m_aggregate_mesh_built = true;
 	return 0;
@@ -558,10 +947,66 @@ Scene::create_aggregate_bvh()
 {
         if (aggregate_bvh.construct_and_map(aggregate_mesh, material_map))
                 return -1;
+        if (!instance_groups.empty())
+                add_instances_to_aggregate_bvh();
         m_aggregate_bvh_built = true;
         return 0;
 }
 
+int32_t 
+Scene::rebuild_aggregate_bvh(size_t cq_i)
+{
+        if (!m_initialized || !m_aggregate_mesh_built)
+                return -1;
+
+        if (create_aggregate_bvh())
+                return -1;
+
+        DeviceInterface& device = *DeviceInterface::instance();
+        DeviceMemory& index_mem = device.memory(idx_id);
+        DeviceMemory& mat_map_mem = device.memory(mat_map_id);
+        DeviceMemory& bvh_mem = device.memory(bvh_id);
+
+        DeviceMemory& bvh_roots_mem = device.memory(bvh_roots_id);
+        std::vector<Triangle> triangles;
+        std::vector<cl_int> mat_map;
+
+        size_t triangle_count = aggregate_mesh.triangleCount() + 
+                instance_mesh.triangleCount();
+        size_t index_size = triangle_count * sizeof(Triangle);
+        size_t mat_map_size = triangle_count * sizeof(cl_int);
+        size_t bvh_size = aggregate_bvh.nodeArraySize() * sizeof(BVHNode);
+        size_t bvh_roots_size = bvh_roots.size() * sizeof(BVHRoot);
+
+        const void* index_ptr = with_instances(aggregate_mesh.triangles,
+                                               instance_mesh.triangles, triangles);
+        if (index_mem.resize(index_size) ||
+            index_mem.write(index_size, index_ptr, 0, cq_i))
+                return -1;
+
+        const void* mat_map_ptr = with_instances(material_map,
+                                                 instance_material_map, mat_map);
+        if (mat_map_mem.resize(mat_map_size) ||
+            mat_map_mem.write(mat_map_size, mat_map_ptr, 0, cq_i))
+                return -1;
+
+        if (bvh_mem.resize(bvh_size) ||
+            bvh_mem.write(bvh_size, aggregate_bvh.nodeArray(), 0, cq_i))
+                return -1;
+
+        /* Instance roots point past the aggregate nodes, which may change */
+        if (!instance_groups.empty() &&
+            (bvh_roots_mem.resize(bvh_roots_size) ||
+             bvh_roots_mem.write(bvh_roots_size, &bvh_roots[0], 0, cq_i) ||
+             build_top_level(cq_i)))
+                return -1;
+
+        m_aggregate_bvh_transfered = true;
+        m_accelerator_type = SAH_BVH_ACCELERATOR;
+        m_geometry_version++;
+        return 0;
+}
+
 int32_t 
 Scene::create_aggregate_kdtree()
 {
@@ -595,15 +1040,36 @@ Scene::reorderTriangles(const std::vector<uint32_t>& new_order) {
 uint32_t 
 Scene::update_bvh_roots()
 {
-        if (!m_bvhs_built)
+        if (!m_bvhs_built && !has_instances())
                 return -1;
-        uint32_t root_idx = 0;
-        DeviceInterface& device = *DeviceInterface::instance();
+
+        /* Object of each root. An instanced aggregate has its own root 
+           first, which never moves */
+        std::vector<object_id> root_objects;
+        if (m_bvhs_built) {
+                for (uint32_t obj_idx = 0; obj_idx < objects.size(); ++obj_idx) {
+                        if (objects[obj_idx].is_valid())
+                                root_objects.push_back(obj_idx);
+                }
+        } else {
+                root_objects.push_back(-1);
+                for (size_t g = 0; g < instance_groups.size(); ++g) {
+                        const std::vector<object_id>& group = instance_groups[g].objects;
+                        root_objects.insert(root_objects.end(), group.begin(), group.end());
+                }
+        }
+
+        /* Runs of changed roots, [first, end) */
+        RootRuns runs;
+        bool all = m_bvh_roots_moved;
 
 	/*--------------------- Update roots from object info ---------------------*/
-        for (uint32_t obj_idx = 0; obj_idx < objects.size(); ++obj_idx) {
-                Object& obj = objects[obj_idx];
-                if (!obj.is_valid())
+        size_t root_end = std::min(root_objects.size(), bvh_roots.size());
+        for (size_t root_idx = 0; root_idx < root_end; ++root_idx) {
+                if (root_objects[root_idx] < 0)
+                        continue;
+                Object& obj = objects[root_objects[root_idx]];
+                if (!all && !obj.geom.isDirty())
                         continue;
                 
                 BVHRoot& bvh_root = bvh_roots[root_idx];
@@ -611,26 +1077,171 @@ Scene::update_bvh_roots()
                 const mat4x4& trInv = obj.geom.getTransformMatrixInv();
                 bvh_root.tr = mat4x4_to_cl_sqmat4(tr);
                 bvh_root.trInv = mat4x4_to_cl_sqmat4(trInv);
+                obj.geom.clearDirty();
 
-                ++root_idx;
+                if (!runs.empty() && root_idx - runs.back().second < ROOT_WRITE_GAP)
+                        runs.back().second = root_idx + 1;
+                else
+                        runs.push_back(std::make_pair(root_idx, root_idx + 1));
         }
+        m_bvh_roots_moved = false;
+
 	/*--------------------- Move bvh roots to device memory ---------------------*/
 
+        if (write_root_runs(runs))
+                return -1;
+        /* Moved roots keep their place in the top level, shifted ones
+           get a new one */
+        if (!runs.empty()) {
+                if (all ? build_top_level() : refit_top_level())
+                        return -1;
+                m_roots_version++;
+        }
+        return 0;
+}
+
+int32_t
+Scene::write_root_runs(RootRuns& runs, size_t cq_i)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
         DeviceMemory& bvh_roots_mem = device.memory(bvh_roots_id);
         if (!bvh_roots_mem.valid()) return -1;
-        size_t bvh_roots_size = bvh_roots.size() * sizeof(BVHRoot);
-        const void* bvh_roots_ptr = &(bvh_roots[0]);
-	if (bvh_roots.size()) {
-                if (bvh_roots_mem.write(bvh_roots_size, bvh_roots_ptr,0))
+        if (runs.size() > MAX_ROOT_WRITES) {
+                runs.front().second = runs.back().second;
+                runs.resize(1);
+        }
+        for (size_t r = 0; r < runs.size(); ++r) {
+                size_t offset = runs[r].first * sizeof(BVHRoot);
+                size_t size = (runs[r].second - runs[r].first) * sizeof(BVHRoot);
+                if (bvh_roots_mem.write(size, &bvh_roots[runs[r].first], 
+                                        offset, cq_i))
                         return -1;
         }
         return 0;
 }
 
+void
+Scene::root_world_bounds(std::vector<BBox>& bounds)
+{
+        bounds.resize(bvh_roots.size());
+        for (size_t r = 0; r < bvh_roots.size(); ++r)
+                bounds[r] = transform_bbox(root_bounds[r], bvh_roots[r].tr);
+}
+
+int32_t
+Scene::build_top_node(std::vector<uint32_t>& roots, const std::vector<BBox>& bounds,
+                      size_t first, size_t end)
+{
+        int32_t node_idx = int32_t(top_nodes.size());
+        top_nodes.push_back(TopNode());
+
+        BBox bbox = bounds[roots[first]];
+        BBox centers;
+        for (size_t i = first; i < end; ++i) {
+                const BBox& b = bounds[roots[i]];
+                bbox.merge(b);
+                for (int a = 0; a < 3; ++a) {
+                        float c = b.lo.s[a] + b.hi.s[a];
+                        if (i == first || c < centers.lo.s[a]) centers.lo.s[a] = c;
+                        if (i == first || c > centers.hi.s[a]) centers.hi.s[a] = c;
+                }
+        }
+        top_nodes[node_idx].bbox = bbox;
+
+        if (end - first == 1) {
+                top_nodes[node_idx].left = -1 - int32_t(roots[first]);
+                top_nodes[node_idx].right = -1;
+                return node_idx;
+        }
+
+        /* Median split on the widest axis of the centers, depth stays 
+           log2 of the root count */
+        int axis = 0;
+        for (int a = 1; a < 3; ++a) {
+                if (centers.hi.s[a] - centers.lo.s[a] > 
+                    centers.hi.s[axis] - centers.lo.s[axis])
+                        axis = a;
+        }
+        size_t mid = (first + end) / 2;
+        std::nth_element(roots.begin() + first, roots.begin() + mid, 
+                         roots.begin() + end, RootCenterLess(bounds, axis));
+
+        int32_t left = build_top_node(roots, bounds, first, mid);
+        int32_t right = build_top_node(roots, bounds, mid, end);
+        top_nodes[node_idx].left = left;
+        top_nodes[node_idx].right = right;
+        return node_idx;
+}
+
+int32_t
+Scene::build_top_level(size_t cq_i)
+{
+        top_nodes.clear();
+        if (bvh_roots.empty())
+                return 0;
+        if (root_bounds.size() != bvh_roots.size()) {
+                std::cerr << "Missing bounds of the bvh roots" << std::endl;
+                return -1;
+        }
+
+        std::vector<BBox> bounds;
+        root_world_bounds(bounds);
+        std::vector<uint32_t> roots(bvh_roots.size());
+        for (size_t r = 0; r < roots.size(); ++r)
+                roots[r] = uint32_t(r);
+
+        top_nodes.reserve(2 * roots.size() - 1);
+        build_top_node(roots, bounds, 0, roots.size());
+        return write_top_level(cq_i);
+}
+
+int32_t
+Scene::refit_top_level(size_t cq_i)
+{
+        if (top_nodes.empty())
+                return build_top_level(cq_i);
+
+        std::vector<BBox> bounds;
+        root_world_bounds(bounds);
+
+        /* Children come after their parent */
+        for (size_t n = top_nodes.size(); n-- > 0;) {
+                TopNode& node = top_nodes[n];
+                if (node.left < 0) {
+                        node.bbox = bounds[-1 - node.left];
+                } else {
+                        node.bbox = top_nodes[node.left].bbox;
+                        node.bbox.merge(top_nodes[node.right].bbox);
+                }
+        }
+        return write_top_level(cq_i);
+}
+
+int32_t
+Scene::write_top_level(size_t cq_i)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        if (!device.valid_memory_id(top_nodes_id))
+                top_nodes_id = device.new_memory(m_cq);
+        DeviceMemory& top_nodes_mem = device.memory(top_nodes_id);
+
+        size_t size = top_nodes.size() * sizeof(TopNode);
+        if (!size)
+                return 0;
+        if (!top_nodes_mem.valid()) {
+                if (top_nodes_mem.initialize(size, READ_ONLY_MEMORY))
+                        return -1;
+        } else if (top_nodes_mem.size() != size) {
+                if (top_nodes_mem.resize(size))
+                        return -1;
+        }
+        return top_nodes_mem.write(size, &top_nodes[0], 0, cq_i);
+}
+
 size_t
 Scene::root_count(){
         if (m_aggregate_mesh_built)
-                return 1;
+                return instance_groups.empty() ? 1 : bvh_roots.size();
         else
                 return object_count();
 }
@@ -662,6 +1273,7 @@ Scene::create_bvhs()
                         bvh_root.tr = mat4x4_to_cl_sqmat4(tr);
                         bvh_root.trInv = mat4x4_to_cl_sqmat4(trInv);
                         bvh_roots.push_back(bvh_root);
+                        root_bounds.push_back(bvhs[obj->id].m_nodes[0].m_bbox);
                         continue;
                 }
 
@@ -688,6 +1300,7 @@ Scene::create_bvhs()
                 bvh_root.tr = mat4x4_to_cl_sqmat4(tr);
                 bvh_root.trInv = mat4x4_to_cl_sqmat4(trInv);
                 bvh_roots.push_back(bvh_root);
+                root_bounds.push_back(bvh.m_nodes[0].m_bbox);
 
                 node_offset += bvh.nodeArraySize();
                 tri_offset  += mesh_atlas[obj->id].triangleCount();
@@ -745,7 +1358,7 @@ Scene::transfer_meshes_to_device()
         DeviceMemory& vert_mem = device.memory(vert_id);
         size_t vert_size = vertices.size() * sizeof(Vertex);
         const void* vert_ptr = &(vertices[0]);
-        if (vert_mem.initialize(vert_size, vert_ptr, READ_ONLY_MEMORY))
+        if (vert_mem.initialize_host_mapped(vert_size, vert_ptr, READ_ONLY_MEMORY))
 		return -1;
 
         DeviceMemory& triangle_mem = device.memory(idx_id);
@@ -756,6 +1369,9 @@ Scene::transfer_meshes_to_device()
 
 	/*---------------------- Move material data to device ------------*/
 
+        if (texture_atlas.update_atlas())
+                return -1;
+
         DeviceMemory& mat_list_mem = device.memory(mat_list_id);
         const void* mat_list_ptr = &(material_list[0]);
         size_t mat_list_size = sizeof(material_cl) * material_list.size();
@@ -768,6 +1384,7 @@ Scene::transfer_meshes_to_device()
         if (mat_map_mem.initialize(mat_map_size, mat_map_ptr, READ_ONLY_MEMORY))
                 return -1;
 
+        m_geometry_version++;
         return 0;
 
 }
@@ -823,7 +1440,11 @@ Scene::transfer_bvhs_to_device()
                                              READ_ONLY_MEMORY))
 			return -1;
         }
+        if (build_top_level())
+                return -1;
     m_bvhs_transfered = true;
+    m_geometry_version++;
+    m_roots_version++;
     return 0;
 }
 
@@ -922,6 +1543,7 @@ Scene::update_mesh_vertices(mesh_id mid)
                                         mesh.vertexArray(),
                                         vertex_offset))
                                         return -1;
+                                m_geometry_version++;
                                 return 0;
                         }
                 }
@@ -934,7 +1556,8 @@ Scene::update_mesh_vertices(mesh_id mid)
                 for (uint32_t i = 0; i < objects.size(); ++i) {
                         Object& obj = objects[i];
                         
-                        if (!obj.is_valid())
+                        if (!obj.is_valid() || 
+                            (i < object_instanced.size() && object_instanced[i]))
                                 continue;
 
                         mesh_id m_id = obj.get_mesh_id();
@@ -944,20 +1567,61 @@ Scene::update_mesh_vertices(mesh_id mid)
                                 Mesh& mesh = mesh_atlas[m_id];
                                 GeometricProperties g = obj.geom;
                                 size_t vertex_count = mesh.vertexCount();
+                                DeviceMemory& vertex_mem = device.memory(vert_id);
+                                size_t write_size = vertex_count * sizeof(Vertex);
+                                size_t write_offset = base_vertex * sizeof(Vertex);
+
+                                /* Zero copy: transform straight into the
+                                   memory the device reads */
+                                Vertex* mapped = NULL;
+                                if (vertex_mem.host_mapped()) {
+                                        mapped = (Vertex*)vertex_mem.map(write_size,
+                                                                         write_offset);
+                                        if (!mapped)
+                                                return -1;
+                                }
+
                                 for (uint32_t v = 0; v < vertex_count; ++v) {
                                         Vertex vertex = mesh.vertex(v);
                                         g.transform(vertex);
                                         aggregate_mesh.vertices[base_vertex+v] = vertex;
+                                        if (mapped)
+                                                mapped[v] = vertex;
+                                }
+
+                                if (mapped) {
+                                        if (vertex_mem.unmap(mapped))
+                                                return -1;
+                                } else {
+                                        const void*  vertex_ptr = 
+                                                aggregate_mesh.vertexArray()+base_vertex;
+                                        if (vertex_mem.write(write_size, vertex_ptr,
+                                                             write_offset))
+                                                return -1;
                                 }
-                                DeviceMemory& vertex_mem = device.memory(vert_id);
-                                size_t write_size = vertex_count * sizeof(Vertex);
-                                size_t write_offset = base_vertex * sizeof(Vertex);
-                                const void*  vertex_ptr = aggregate_mesh.vertexArray()+base_vertex;
-                                if (vertex_mem.write(write_size, vertex_ptr, write_offset))
-                                        return -1;
                         }
                         base_vertex += uint32_t(mesh.vertexCount());
                 }
+
+                /* Instanced copies stay in object space. Their bvh no
+                   longer fits the mesh, the next aggregate rebuilds it */
+                for (size_t g = 0; g < instance_groups.size(); ++g) {
+                        InstanceGroup& group = instance_groups[g];
+                        if (group.mesh != mid)
+                                continue;
+                        Mesh& mesh = mesh_atlas[mid];
+                        size_t v0 = group.vertex_start;
+                        size_t write_offset = 
+                                (aggregate_mesh.vertexCount() + v0) * sizeof(Vertex);
+                        for (uint32_t v = 0; v < mesh.vertexCount(); ++v)
+                                instance_mesh.vertices[v0 + v] = mesh.vertex(v);
+                        if (vertex_mem().write(mesh.vertexCount() * sizeof(Vertex),
+                                               mesh.vertexArray(),
+                                               write_offset))
+                                return -1;
+                        instance_bvhs.erase(mid);
+                }
+                m_geometry_version++;
                 return 0;
         } else {
                 return -1;
@@ -979,6 +1643,7 @@ Scene::update_aggregate_mesh_vertices()
         const void*  vertex_ptr = aggregate_mesh.vertexArray();
         if (vertex_mem.write(vertex_mem_size, vertex_ptr, 0))
                     return -1;
+        m_geometry_version++;
         return 0;
 
 }   
@@ -1081,6 +1746,8 @@ Scene::index_mem()
 DeviceMemory& 
 Scene::material_list_mem()
 {
+        if (m_shared_scene)
+                return m_shared_scene->material_list_mem();
         return DeviceInterface::instance()->memory(mat_list_id);
 }
 
@@ -1102,6 +1769,12 @@ Scene::bvh_roots_mem()
         return DeviceInterface::instance()->memory(bvh_roots_id);
 }
 
+DeviceMemory&
+Scene::top_nodes_mem()
+{
+        return DeviceInterface::instance()->memory(top_nodes_id);
+}
+
 DeviceMemory&
 Scene::kdtree_nodes_mem()
 {
@@ -1117,6 +1790,8 @@ Scene::kdtree_leaf_tris_mem()
 DeviceMemory&
 Scene::lights_mem()
 {
+        if (m_shared_scene)
+                return m_shared_scene->lights_mem();
         return DeviceInterface::instance()->memory(lights_id);
 }
 
@@ -1173,13 +1848,24 @@ Scene::destroy()
         mmaps.clear();
         bvh_order.clear();
         bvh_roots.clear();
+        root_bounds.clear();
+        top_nodes.clear();
+        instance_groups.clear();
+        object_instanced.clear();
+        instance_material_map.clear();
+        instance_nodes.clear();
+        instance_bvhs.clear();
 
         aggregate_mesh.destroy();
+        instance_mesh.destroy();
         aggregate_bvh.destroy();
         aggregate_kdtree.destroy();
         lights.destroy();
         aggregate_bbox.reset();
         texture_atlas.destroy();
+        if (m_own_cubemap)
+                cubemap.destroy();
+        m_own_cubemap = false;
 
         m_initialized = false;
         m_aggregate_mesh_built = false;
@@ -1190,6 +1876,8 @@ Scene::destroy()
         m_aggregate_kdt_transfered = false;
         m_bvhs_transfered = false;
         m_accelerator_type = SAH_BVH_ACCELERATOR;
+        m_shared_scene = NULL; /* Release only the own memories */
+        m_atlas_scene = NULL;
 
         if (!device.good())
                 return -1;
@@ -1218,6 +1906,10 @@ Scene::destroy()
                 if (bvh_roots_mem().release())
                         return -1;
 
+        if (top_nodes_mem().valid())
+                if (top_nodes_mem().release())
+                        return -1;
+
         if (kdtree_nodes_mem().valid())
                 if (kdtree_nodes_mem().release())
                         return -1;
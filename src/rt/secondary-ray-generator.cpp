@@ -5,6 +5,10 @@ SecondaryRayGenerator::SecondaryRayGenerator()
 {
         m_initialized = false;
         m_disc = true;
+        m_min_contribution = 0.f;
+        m_use_roulette = 0;
+        m_seed = 0;
+        m_cq = 0;
 }
 
 int32_t 
@@ -26,8 +30,9 @@ SecondaryRayGenerator::initialize()
         kernel_names.push_back("gen_sec_ray");
 
         std::vector<function_id> function_ids;
-        function_ids = device.build_functions("src/kernel/secondary-ray-generator.cl", 
-                                              kernel_names);
+        /* Only the disc or no disc kernels in use get compiled */
+        function_ids = device.defer_functions("src/kernel/secondary-ray-generator.cl", 
+                                              kernel_names, BuildOptions(), m_cq);
         if (!function_ids.size())
                 return -1;
 
@@ -39,14 +44,15 @@ SecondaryRayGenerator::initialize()
 
         const size_t initial_size = 512*2*1024; //Up to ~ 1e6 rays 
 
-        count_id = device.new_memory();
+        count_id = device.new_memory(m_cq);
         DeviceMemory& count_mem = device.memory(count_id);
-        if (count_mem.initialize(initial_size * sizeof(cl_int), READ_WRITE_MEMORY))
+        if (count_mem.initialize_host_mapped(initial_size * sizeof(cl_int), 
+                                             READ_WRITE_MEMORY))
                 return -1;
 
-        counters_id = device.new_memory();
+        counters_id = device.new_memory(m_cq);
         DeviceMemory& counters_mem = device.memory(counters_id);
-        if (counters_mem.initialize(2 * sizeof(cl_int), READ_WRITE_MEMORY))
+        if (counters_mem.initialize_host_mapped(2 * sizeof(cl_int), READ_WRITE_MEMORY))
                 return -1;
 
 	m_timing = false;
@@ -61,6 +67,9 @@ int32_t SecondaryRayGenerator::generate(Scene& scene,
 {
         CLInfo* clinfo = clinfo->instance();
 
+        /* New roulette seed for each bounce, shared by every pass below */
+        m_seed++;
+
         //////////////// No disc
         if (!m_disc) {
                 //////////////// tasks
@@ -183,27 +192,49 @@ SecondaryRayGenerator::gen_scan_disc(Scene& scene, RayBundle& ray_in, size_t ray
             marker.set_arg(2, scene.material_list_mem()) || 
             marker.set_arg(3, scene.material_map_mem()) || 
             marker.set_arg(4, count_mem) ||
-            marker.set_arg(5, sizeof(cl_int), &ray_in_count)) {
+            marker.set_arg(5, sizeof(cl_int), &ray_in_count) ||
+            marker.set_arg(6, sizeof(cl_float), &m_min_contribution) ||
+            marker.set_arg(7, sizeof(cl_int), &m_use_roulette) ||
+            marker.set_arg(8, sizeof(cl_uint), &m_seed)) {
                 return -1;
         }
 
-        if (marker.enqueue_single_dim(rays_in, group_size)) {
+        if (marker.enqueue_single_dim(rays_in, group_size, 0, m_cq)) {
                 return -1;
         }
-        device.enqueue_barrier();
+        device.enqueue_barrier(m_cq);
 
         /*//////////////////////////////////////////////////////////////////*/
 
         ////////////// Compute scan (prefix sum) on count_mem ///////////////////
-        if (gpu_scan_uint(device, count_id, 2*rays_in, count_id)){
+        if (gpu_scan_uint(device, count_id, 2*rays_in, count_id, m_cq)){
                 return -1;
         }
 
-        device.enqueue_barrier();
+        ////////// Use prefix sums generate rays in the right location //////////////
+        /* Enqueued right after the scan, the generator skips samples without
+           new rays, so the count is only read back once everything is queued */
+        if (generator.set_arg(0, hits.mem()) || 
+            generator.set_arg(1, ray_in.mem()) ||
+            generator.set_arg(2, scene.material_list_mem()) || 
+            generator.set_arg(3, scene.material_map_mem()) || 
+            generator.set_arg(4, ray_out.mem()) || 
+            generator.set_arg(5, count_mem) ||
+            generator.set_arg(6, sizeof(cl_int),&ray_in_count) ||
+            generator.set_arg(7, sizeof(cl_int),&max_rays_out) ||
+            generator.set_arg(8, sizeof(cl_float),&m_min_contribution) ||
+            generator.set_arg(9, sizeof(cl_int),&m_use_roulette) ||
+            generator.set_arg(10, sizeof(cl_uint),&m_seed)) {
+                return -1;
+        }
+        if (generator.enqueue_single_dim(rays_in,group_size, 0, m_cq)) {
+                return -1;
+        }
+        device.enqueue_barrier(m_cq);
 
         uint32_t new_ray_count;
         if (count_mem.read(sizeof(cl_int),&new_ray_count,
-                           sizeof(cl_int)*(2*rays_in))) {
+                           sizeof(cl_int)*(2*rays_in), m_cq)) {
                 return -1;
         }
 
@@ -211,32 +242,10 @@ SecondaryRayGenerator::gen_scan_disc(Scene& scene, RayBundle& ray_in, size_t ray
                 return -1;
 
         *rays_out = new_ray_count;
-        // /*//////////////////////////////////////////////////////////////////*/
-
-        // device.finish_commands();//!!
-        // exit(0);//!!
-
-        ////////// Use prefix sums generate rays in the right location //////////////
-        if (*rays_out) {
-                if (generator.set_arg(0, hits.mem()) || 
-                    generator.set_arg(1, ray_in.mem()) ||
-                    generator.set_arg(2, scene.material_list_mem()) || 
-                    generator.set_arg(3, scene.material_map_mem()) || 
-                    generator.set_arg(4, ray_out.mem()) || 
-                    generator.set_arg(5, count_mem) ||
-                    generator.set_arg(6, sizeof(cl_int),&ray_in_count) ||
-                    generator.set_arg(7, sizeof(cl_int),&max_rays_out)) {
-                        return -1;
-                }
-                if (generator.enqueue_single_dim(rays_in,group_size)) {
-                        return -1;
-                }
-                device.enqueue_barrier();
-        }
         /*//////////////////////////////////////////////////////////////////*/
 
 	if (m_timing) {
-                device.finish_commands();
+                device.finish_commands(m_cq);
 		m_time_ms = m_timer.msec_since_snap();
         }
 
@@ -277,25 +286,47 @@ SecondaryRayGenerator::gen_scan(Scene& scene, RayBundle& ray_in, size_t rays_in,
             marker.set_arg(1, ray_in.mem()) ||
             marker.set_arg(2, scene.material_list_mem()) || 
             marker.set_arg(3, scene.material_map_mem()) || 
-            marker.set_arg(4, count_mem)) {
+            marker.set_arg(4, count_mem) ||
+            marker.set_arg(5, sizeof(cl_float), &m_min_contribution) ||
+            marker.set_arg(6, sizeof(cl_int), &m_use_roulette) ||
+            marker.set_arg(7, sizeof(cl_uint), &m_seed)) {
                 return -1;
         }
 
-        if (marker.enqueue_single_dim(rays_in, group_size)) {
+        if (marker.enqueue_single_dim(rays_in, group_size, 0, m_cq)) {
                 return -1;
         }
-        device.enqueue_barrier();
+        device.enqueue_barrier(m_cq);
         /*//////////////////////////////////////////////////////////////////*/
 
         ////////////// Compute scan (prefix sum) on count_mem ///////////////////
-        if (gpu_scan_uint(device, count_id, rays_in, count_id)){
+        if (gpu_scan_uint(device, count_id, rays_in, count_id, m_cq)){
                 return -1;
         }
 
+        ////////// Use prefix sums generate rays in the right location //////////////
+        /* Enqueued right after the scan, the generator skips samples without
+           new rays, so the count is only read back once everything is queued */
+        if (generator.set_arg(0, hits.mem()) || 
+            generator.set_arg(1, ray_in.mem()) ||
+            generator.set_arg(2, scene.material_list_mem()) || 
+            generator.set_arg(3, scene.material_map_mem()) || 
+            generator.set_arg(4, ray_out.mem()) || 
+            generator.set_arg(5, count_mem) ||
+            generator.set_arg(6, sizeof(cl_int),&max_rays_out) ||
+            generator.set_arg(7, sizeof(cl_float),&m_min_contribution) ||
+            generator.set_arg(8, sizeof(cl_int),&m_use_roulette) ||
+            generator.set_arg(9, sizeof(cl_uint),&m_seed)) {
+                return -1;
+        }
+        if (generator.enqueue_single_dim(rays_in,group_size, 0, m_cq)) {
+                return -1;
+        }
+        device.enqueue_barrier(m_cq);
 
         uint32_t new_ray_count;
         if (count_mem.read(sizeof(cl_int),&new_ray_count,
-                           sizeof(cl_int)*(rays_in))) {
+                           sizeof(cl_int)*(rays_in), m_cq)) {
                 return -1;
         }
 
@@ -308,31 +339,12 @@ SecondaryRayGenerator::gen_scan(Scene& scene, RayBundle& ray_in, size_t rays_in,
         }
 
         *rays_out = new_ray_count;
-        // /*//////////////////////////////////////////////////////////////////*/
-
-
-        ////////// Use prefix sums generate rays in the right location //////////////
-        if (*rays_out) {
-                if (generator.set_arg(0, hits.mem()) || 
-                    generator.set_arg(1, ray_in.mem()) ||
-                    generator.set_arg(2, scene.material_list_mem()) || 
-                    generator.set_arg(3, scene.material_map_mem()) || 
-                    generator.set_arg(4, ray_out.mem()) || 
-                    generator.set_arg(5, count_mem) ||
-                    generator.set_arg(6, sizeof(cl_int),&max_rays_out)) {
-                        return -1;
-                }
-                if (generator.enqueue_single_dim(rays_in,group_size)) {
-                        return -1;
-                }
-                device.enqueue_barrier();
-        }
         /*//////////////////////////////////////////////////////////////////*/
 
         // std::cout << "Rays out after generator: " << *rays_out << std::endl;
 
 	if (m_timing) {
-                device.finish_commands();
+                device.finish_commands(m_cq);
 		m_time_ms = m_timer.msec_since_snap();
         }
 
@@ -361,7 +373,7 @@ SecondaryRayGenerator::gen_tasks(Scene& scene, RayBundle& ray_in, size_t rays_in
 
         DeviceMemory& counters_mem = device.memory(counters_id);
         cl_int counters[2] = {0, 0};
-        if (counters_mem.write(sizeof(cl_int) * 2, &counters)) {
+        if (counters_mem.write(sizeof(cl_int) * 2, &counters, 0, m_cq)) {
                 return -1;
         }
 
@@ -376,17 +388,20 @@ SecondaryRayGenerator::gen_tasks(Scene& scene, RayBundle& ray_in, size_t rays_in
             gen_sec.set_arg(6, sizeof(cl_int) * group_size, NULL) ||
             gen_sec.set_arg(7, sizeof(cl_int) * group_size * 2, NULL) ||
             gen_sec.set_arg(8, sizeof(cl_int), &rays_in) ||
-            gen_sec.set_arg(9, sizeof(cl_int), &max_rays_out)) {
+            gen_sec.set_arg(9, sizeof(cl_int), &max_rays_out) ||
+            gen_sec.set_arg(10, sizeof(cl_float), &m_min_contribution) ||
+            gen_sec.set_arg(11, sizeof(cl_int), &m_use_roulette) ||
+            gen_sec.set_arg(12, sizeof(cl_uint), &m_seed)) {
                 return -1;
         }
 
-        if (gen_sec.enqueue_single_dim(group_size * 4, group_size)) {
+        if (gen_sec.enqueue_single_dim(group_size * 4, group_size, 0, m_cq)) {
                 return -1;
         }
-        device.enqueue_barrier();
+        device.enqueue_barrier(m_cq);
         /*//////////////////////////////////////////////////////////////////*/
 
-        if (counters_mem.read(sizeof(cl_int)*2,&counters)) {
+        if (counters_mem.read(sizeof(cl_int)*2,&counters, 0, m_cq)) {
                 return -1;
         }
         *rays_out = counters[1];
@@ -397,7 +412,7 @@ SecondaryRayGenerator::gen_tasks(Scene& scene, RayBundle& ray_in, size_t rays_in
         // std::cout << "output samples: " << counters[1] << std::endl;
 
 	if (m_timing) {
-                device.finish_commands();
+                device.finish_commands(m_cq);
 		m_time_ms = m_timer.msec_since_snap();
         }
 
@@ -443,6 +458,8 @@ SecondaryRayGenerator::update_configuration(const RendererConfig& conf)
 {
 	m_tasks = conf.sec_ray_use_atomics;
 	m_disc = conf.sec_ray_use_disc;
+        m_min_contribution = conf.sec_ray_min_contribution;
+        m_use_roulette = conf.sec_ray_use_roulette;
 }
 
 
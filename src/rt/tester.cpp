@@ -43,6 +43,7 @@ Tester::getSingletonPtr()
 Tester::Tester()
 {
         window_size.width = window_size.height = 1;
+        use_camera_path = false;
 
         for (int i = 0; i < 5; ++i)
                 scenes.push_back(i);
@@ -133,9 +134,21 @@ Tester::initialize(std::string ini_filename)
         for (int i = 0; i < wsizes.size(); ++i) {
                 window_sizes.push_back(resolution_t(wsizes[i], wsizes[i]));
         }
+        //// Recorded camera path (replaces the view positions)
+        std::string camera_path_file;
+        if (!ini.get_str_value("RT", "camera_path", camera_path_file)) {
+                if (camera_path.load(camera_path_file))
+                        return -1;
+                use_camera_path = true;
+                std::cout << "Replaying camera path " << camera_path_file << " ("
+                          << camera_path.frame_count() << " frames)\n";
+        }
         //// View positions
         view_positions = ini.get_int_list("RT", "view_position");
-        if (!view_positions.size()) {
+        if (use_camera_path) {
+                view_positions.clear();
+                view_positions.push_back(0);
+        } else if (!view_positions.size()) {
                 std::cerr << "Missing 'view_position' information in ini file!\n";
                 return -1;
         }
@@ -377,11 +390,14 @@ Tester::loop() {
                     renderer.config.tile_to_cores_ratio  = tile_cores_ratio;
 
                     //// Set camera config
-                    scene.camera.set(stats_camera_pos[view_position],//pos 
-                                     stats_camera_dir[view_position],//dir
-                                     makeVector(0,1,0), //up
-                                     M_PI/4.,
-                                     window_size.width / (float)window_size.height);
+                    if (use_camera_path)
+                            camera_path.reset();
+                    else
+                            scene.camera.set(stats_camera_pos[view_position],//pos 
+                                             stats_camera_dir[view_position],//dir
+                                             makeVector(0,1,0), //up
+                                             M_PI/4.,
+                                             window_size.width / (float)window_size.height);
 
                     if (testConfiguration()) {
                             std::cerr << "Error with configuration " << i << "\n";
@@ -398,15 +414,25 @@ Tester::loop() {
 int 
 Tester::testConfiguration() 
 {
-        for (int i = 0; i < 3; ++i) {
+        int frames = use_camera_path? camera_path.frame_count() : 3;
+        for (int i = 0; i < frames; ++i) {
                 if (!i) {
                         renderer.clear_stats();
                 }
 
+                if (use_camera_path) {
+                        vec3 cam_pos, cam_dir, cam_up;
+                        camera_path.get_next_camera_params(&cam_pos, &cam_dir, &cam_up);
+                        scene.camera.set(cam_pos, cam_dir, cam_up, M_PI/4.,
+                                         window_size.width / (float)window_size.height);
+                        if (camera_path.apply_object_transforms(scene))
+                                return -1;
+                }
+
                 if (renderOneFrame())
                         return -1;
 
-                if (i == 2) {
+                if (i == frames-1) {
                         printStatsValues();
                 }
         }
@@ -610,6 +636,14 @@ Tester::printStatsHeaders()
         renderer.log << ", " << "Shader mean time";
         renderer.log << ", " << "Fb clear mean time"; 
         renderer.log << ", " << "Fb copy mean time";
+        renderer.log << ", " << "Frame p50 time";
+        renderer.log << ", " << "Frame p95 time";
+        renderer.log << ", " << "Frame p99 time";
+        renderer.log << ", " << "Frame max time";
+        for (uint32_t s = 0; s < STAGE_COUNT; ++s) {
+                renderer.log << ", " << rt_stage_name(rt_stage(s)) << " p95 time";
+                renderer.log << ", " << rt_stage_name(rt_stage(s)) << " max time";
+        }
         renderer.log << "\n";
 }
 
@@ -656,6 +690,14 @@ Tester::printStatsValues()
         renderer.log << ", " << stats.get_stage_mean_time(SHADE);
         renderer.log << ", " << stats.get_stage_mean_time(FB_CLEAR);
         renderer.log << ", " << stats.get_stage_mean_time(FB_COPY);
+        renderer.log << ", " << stats.get_frame_percentile(50);
+        renderer.log << ", " << stats.get_frame_percentile(95);
+        renderer.log << ", " << stats.get_frame_percentile(99);
+        renderer.log << ", " << stats.get_max_frame_time();
+        for (uint32_t s = 0; s < STAGE_COUNT; ++s) {
+                renderer.log << ", " << stats.get_stage_percentile(rt_stage(s), 95);
+                renderer.log << ", " << stats.get_stage_max_time(rt_stage(s));
+        }
         renderer.log << "\n";
         
 
@@ -1,7 +1,18 @@
 #include <rt/texture-atlas.hpp>
 
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+TextureAtlas::TextureAtlas()
+        : m_initialized(false)
+        , m_atlas_dirty(false)
+        , m_atlas_built(false)
+        , m_cq(0)
+{}
+
 int32_t
-TextureAtlas::initialize()
+TextureAtlas::initialize(size_t command_queue_i)
 {
         DeviceInterface& device = *DeviceInterface::instance();
         if (!device.good())
@@ -10,15 +21,33 @@ TextureAtlas::initialize()
         if (m_initialized)
                 return 0;
 
-        invalid_tex_mem_id = device.new_memory();
+        m_cq = command_queue_i;
+        invalid_tex_mem_id = device.new_memory(m_cq);
 
         DeviceMemory& invalid_tex_mem = device.memory(invalid_tex_mem_id);
-        GLuint invalid_gl_tex_id = create_tex_gl(1,1);
-        if (invalid_tex_mem.initialize_from_gl_texture(invalid_gl_tex_id))
+        if (CLInfo::instance()->gl_sharing()) {
+                invalid_gl_tex_id = create_tex_gl(1,1);
+                if (invalid_tex_mem.initialize_from_gl_texture(invalid_gl_tex_id))
+                        return -1;
+        } else if (invalid_tex_mem.initialize_image(1,1)) {
                 return -1;
-        if (device.acquire_graphic_resource(invalid_tex_mem_id, true))
+        }
+        if (device.acquire_graphic_resource(invalid_tex_mem_id, true, m_cq))
                 return -1;
 
+        /* Placeholder rectangle so the buffer is valid with no textures */
+        rects_mem_id = device.new_memory(m_cq);
+        DeviceMemory& rects_mem = device.memory(rects_mem_id);
+        cl_float4 full_rect;
+        full_rect.s[0] = full_rect.s[1] = 0.f;
+        full_rect.s[2] = full_rect.s[3] = 1.f;
+        if (rects_mem.initialize(sizeof(cl_float4), &full_rect, READ_ONLY_MEMORY))
+                return -1;
+
+        atlas_mem_id = device.new_memory(m_cq);
+
+        m_atlas_dirty = false;
+        m_atlas_built = false;
         m_initialized = true;
         return 0;
 }
@@ -33,41 +62,232 @@ TextureAtlas::load_texture(std::string filename)
         if (file_map.find(filename) != file_map.end())
                 return file_map[filename];
 
-        if (tex_mem_ids.size() >= MAX_TEXTURE_COUNT)
+        texture_data tex;
+        tex.filename = filename;
+        if (read_pixels(tex))
                 return invalid_tex_id;
 
-        uint32_t tex_width, tex_height;
-        GLuint new_tex_gl_id;
-        if (create_tex_gl_from_file(tex_width, tex_height, 
-                                    filename.c_str(), &new_tex_gl_id))
-                return invalid_tex_id;
+        texture_id new_tex_id = textures.size();
+        textures.push_back(tex);
+        file_map[filename] = new_tex_id;
+        m_atlas_dirty = true;
+        return new_tex_id;
+}
 
-        memory_id new_tex_mem_id = device.new_memory();
-        DeviceMemory& new_tex_mem = device.memory(new_tex_mem_id);
-        // std::cout << "Initializing: " << filename << std::endl;
-        // std::cout << "new_tex_gl_id: " << new_tex_gl_id << std::endl;
-        if (new_tex_mem.initialize_from_gl_texture(new_tex_gl_id))
-                return invalid_tex_id;
-        if (device.acquire_graphic_resource(new_tex_mem_id,true))
-                return invalid_tex_id;
+int32_t
+TextureAtlas::read_pixels(texture_data& tex)
+{
+        uint32_t width, height;
+        uint8_t* data;
+        if (read_tex_data_from_file(width, height, tex.filename.c_str(), &data))
+                return -1;
+        tex.width = width;
+        tex.height = height;
+        tex.pixels.assign(data, data + 4 * width * height);
+        delete[] data;
+        return 0;
+}
 
+size_t
+TextureAtlas::texture_count()
+{
+        return textures.size();
+}
 
-        texture_id new_tex_id = tex_mem_ids.size();
-        // std::cout << "new_tex_id: " << new_tex_id << std::endl;
-        tex_mem_ids.push_back(new_tex_mem_id);
-        gl_tex_ids.push_back(new_tex_gl_id);
-        file_map[filename] = new_tex_id;
-        return new_tex_id;
+static uint32_t next_pow2(uint32_t v)
+{
+        uint32_t p = 1;
+        while (p < v)
+                p <<= 1;
+        return p;
+}
+
+struct taller_texture {
+        taller_texture(const std::vector<uint32_t>& h) : heights(h) {}
+        bool operator()(uint32_t a, uint32_t b) const {
+                return heights[a] > heights[b];
+        }
+        const std::vector<uint32_t>& heights;
+};
+
+int32_t
+TextureAtlas::update_atlas()
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        if (!m_initialized || !device.good())
+                return -1;
+
+        if (!m_atlas_dirty || textures.empty())
+                return 0;
+
+        for (size_t i = 0; i < textures.size(); ++i) {
+                if (textures[i].pixels.empty() && read_pixels(textures[i])) {
+                        std::cerr << "Could not reload texture " 
+                                  << textures[i].filename << ".\n";
+                        return -1;
+                }
+        }
+
+        /*------------------- Shelf packing, tallest first -------------------*/
+        std::vector<uint32_t> order(textures.size());
+        std::vector<uint32_t> heights(textures.size());
+        uint32_t max_width = 0;
+        double   total_area = 0;
+        for (size_t i = 0; i < textures.size(); ++i) {
+                order[i] = i;
+                heights[i] = textures[i].height;
+                max_width = std::max(max_width, textures[i].width);
+                total_area += double(textures[i].width) * textures[i].height;
+        }
+        std::sort(order.begin(), order.end(), taller_texture(heights));
+
+        uint32_t width = std::max(max_width, 
+                                  next_pow2(uint32_t(sqrt(total_area))));
+
+        std::vector<uint32_t> xs(textures.size()), ys(textures.size());
+        uint32_t x = 0, y = 0, shelf_height = 0;
+        for (size_t i = 0; i < order.size(); ++i) {
+                texture_data& tex = textures[order[i]];
+                if (x + tex.width > width) {
+                        x = 0;
+                        y += shelf_height;
+                        shelf_height = 0;
+                }
+                xs[order[i]] = x;
+                ys[order[i]] = y;
+                x += tex.width;
+                shelf_height = std::max(shelf_height, tex.height);
+        }
+        uint32_t height = y + shelf_height;
+
+        CLInfo* clinfo = CLInfo::instance();
+        size_t max_image_width = clinfo->image2d_max_width;
+        size_t max_image_height = clinfo->image2d_max_height;
+        if (clinfo->gl_sharing()) {
+                GLint max_tex_size;
+                glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_tex_size);
+                max_image_width = max_image_height = max_tex_size;
+        }
+        if (width > max_image_width || height > max_image_height) {
+                std::cerr << "Texture atlas of size " << width << "x" << height 
+                          << " exceeds the maximum texture size.\n";
+                return -1;
+        }
+
+        /*------------------- Copy texture data to atlas -------------------*/
+        std::vector<uint8_t> atlas_data(4 * width * height, 0);
+        tex_rects.resize(textures.size());
+        for (size_t i = 0; i < textures.size(); ++i) {
+                texture_data& tex = textures[i];
+                for (uint32_t row = 0; row < tex.height; ++row) {
+                        memcpy(&atlas_data[4 * ((ys[i] + row) * width + xs[i])],
+                               &tex.pixels[4 * row * tex.width],
+                               4 * tex.width);
+                }
+                tex_rects[i].s[0] = xs[i] / (float)width;
+                tex_rects[i].s[1] = ys[i] / (float)height;
+                tex_rects[i].s[2] = tex.width / (float)width;
+                tex_rects[i].s[3] = tex.height / (float)height;
+        }
+
+        /*------------------- Move atlas to device -------------------*/
+        if (release_atlas())
+                return -1;
+
+        DeviceMemory& atlas = device.memory(atlas_mem_id);
+        if (clinfo->gl_sharing()) {
+                atlas_gl_tex_id = create_tex_gl_from_data(width, height, 
+                                                          &atlas_data[0]);
+                if (atlas.initialize_from_gl_texture(atlas_gl_tex_id))
+                        return -1;
+        } else if (atlas.initialize_image(width, height, &atlas_data[0])) {
+                return -1;
+        }
+        for (size_t i = 0; i < textures.size(); ++i)
+                std::vector<uint8_t>().swap(textures[i].pixels);
+        if (device.acquire_graphic_resource(atlas_mem_id, true, m_cq))
+                return -1;
+        m_atlas_built = true;
+
+        DeviceMemory& rects = device.memory(rects_mem_id);
+        size_t rects_size = sizeof(cl_float4) * tex_rects.size();
+        if (rects.resize(rects_size) ||
+            rects.write(rects_size, &tex_rects[0], 0, m_cq))
+                return -1;
+
+        atlas_size[0] = width;
+        atlas_size[1] = height;
+        m_atlas_dirty = false;
+        return 0;
+}
+
+int32_t
+TextureAtlas::release_atlas()
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        if (!m_atlas_built)
+                return 0;
+
+        if (device.release_graphic_resource(atlas_mem_id, true, m_cq) ||
+            device.memory(atlas_mem_id).release())
+                return -1;
+        if (CLInfo::instance()->gl_sharing())
+                delete_tex_gl(atlas_gl_tex_id);
+
+        m_atlas_built = false;
+        return 0;
+}
+
+int32_t
+TextureAtlas::copy_from(TextureAtlas& atlas)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        if (!m_initialized || !atlas.m_initialized || 
+            CLInfo::instance()->gl_sharing())
+                return -1;
+
+        if (release_atlas())
+                return -1;
+
+        if (atlas.m_atlas_built) {
+                std::vector<uint8_t> atlas_data(4 * atlas.atlas_size[0] * 
+                                                atlas.atlas_size[1]);
+                if (atlas.atlas_mem().read_image(atlas.atlas_size[0], 
+                                                 atlas.atlas_size[1],
+                                                 &atlas_data[0]) ||
+                    device.memory(atlas_mem_id).initialize_image(atlas.atlas_size[0],
+                                                                 atlas.atlas_size[1],
+                                                                 &atlas_data[0]))
+                        return -1;
+                m_atlas_built = true;
+        }
+
+        DeviceMemory& rects = device.memory(rects_mem_id);
+        if (rects.resize(atlas.rects_mem().size()) ||
+            atlas.rects_mem().copy_all_to(rects, m_cq))
+                return -1;
+
+        tex_rects = atlas.tex_rects;
+        atlas_size[0] = atlas.atlas_size[0];
+        atlas_size[1] = atlas.atlas_size[1];
+        return 0;
 }
 
 DeviceMemory&
-TextureAtlas::texture_mem(texture_id tex_id)
+TextureAtlas::atlas_mem()
 {
         DeviceInterface& device = *DeviceInterface::instance();
-        if (tex_id < 0 || tex_id >= (signed)tex_mem_ids.size())
+        if (!m_atlas_built)
                 return device.memory(invalid_tex_mem_id);
 
-        return device.memory(tex_mem_ids[tex_id]);
+        return device.memory(atlas_mem_id);
+}
+
+DeviceMemory&
+TextureAtlas::rects_mem()
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        return device.memory(rects_mem_id);
 }
 
 int32_t 
@@ -80,11 +300,9 @@ TextureAtlas::acquire_graphic_resources()
         if (device.acquire_graphic_resource(invalid_tex_mem_id))
                 return -1;
 
-        for (size_t i = 0; i < tex_mem_ids.size(); ++i) {
-                memory_id id = tex_mem_ids[i];
-                if (device.acquire_graphic_resource(id))
-                        return -1;
-        }
+        if (m_atlas_built && device.acquire_graphic_resource(atlas_mem_id))
+                return -1;
+
         return 0;
 }
 
@@ -98,11 +316,8 @@ TextureAtlas::release_graphic_resources()
         if (device.release_graphic_resource(invalid_tex_mem_id))
                 return -1;
 
-        for (size_t i = 0; i < tex_mem_ids.size(); ++i) {
-                memory_id id = tex_mem_ids[i];
-                if (device.release_graphic_resource(id))
-                        return -1;
-        }
+        if (m_atlas_built && device.release_graphic_resource(atlas_mem_id))
+                return -1;
 
         return 0;
 }
@@ -114,21 +329,23 @@ TextureAtlas::destroy()
         if (!m_initialized)
                 return -1;
 
-        std::vector<memory_id>::iterator it;
-        for (it = tex_mem_ids.begin(); it != tex_mem_ids.end(); it++) {
-                device.delete_memory(*it);
+        if (m_atlas_built) {
+                device.memory(atlas_mem_id).release();
+                if (CLInfo::instance()->gl_sharing())
+                        delete_tex_gl(atlas_gl_tex_id);
+                m_atlas_built = false;
         }
-        tex_mem_ids.clear();
-
-        std::vector<GLuint>::iterator gl_it;
-        for (gl_it = gl_tex_ids.begin(); gl_it != gl_tex_ids.end(); gl_it++) {
-                delete_tex_gl(*gl_it);
-        }
-        gl_tex_ids.clear();
+        device.delete_memory(atlas_mem_id);
+        device.delete_memory(rects_mem_id);
 
+        textures.clear();
+        tex_rects.clear();
         file_map.clear();
         device.delete_memory(invalid_tex_mem_id);
-        delete_tex_gl(invalid_gl_tex_id);
+        if (CLInfo::instance()->gl_sharing())
+                delete_tex_gl(invalid_gl_tex_id);
 
+        m_atlas_dirty = false;
         m_initialized = false;
+        return 0;
 }
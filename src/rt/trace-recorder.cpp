@@ -0,0 +1,179 @@
+#include <rt/trace-recorder.hpp>
+
+TraceRecorder::TraceRecorder()
+{
+        m_recording = false;
+        m_device_timestamps = false;
+        m_first_event = true;
+        m_cq_i = 0;
+        m_frame = 0;
+        m_device_origin = 0;
+        m_device_origin_set = false;
+}
+
+TraceRecorder::~TraceRecorder()
+{
+        stop();
+}
+
+int32_t
+TraceRecorder::start(const std::string& file, size_t command_queue_i)
+{
+        CLInfo* clinfo = CLInfo::instance();
+        if (m_recording || !clinfo->initialized() ||
+            !clinfo->has_command_queue(command_queue_i))
+                return -1;
+
+        m_file.open(file.c_str(), std::ofstream::out);
+        if (!m_file.is_open()) {
+                std::cerr << "Unable to open trace file " << file << "\n";
+                return -1;
+        }
+
+        m_cq_i = command_queue_i;
+        m_device_timestamps = clinfo->profiling();
+        m_device_origin_set = false;
+        m_host_origin.snap_time();
+        m_first_event = true;
+        m_frame = 0;
+        m_events.clear();
+
+        m_file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        m_recording = true;
+        return 0;
+}
+
+int32_t
+TraceRecorder::stop()
+{
+        if (!m_recording)
+                return 0;
+
+        release_events();
+        m_file << "\n]}\n";
+        m_file.close();
+        m_recording = false;
+        return 0;
+}
+
+cl_event
+TraceRecorder::enqueue_marker()
+{
+        cl_command_queue cq = CLInfo::instance()->get_command_queue(m_cq_i);
+        cl_event event = NULL;
+        cl_int err = clEnqueueMarker(cq, &event);
+        if (error_cl(err, "clEnqueueMarker"))
+                return NULL;
+        return event;
+}
+
+void
+TraceRecorder::begin(rt_stage stage, int64_t tile_offset, int32_t bounce)
+{
+        if (!m_recording)
+                return;
+
+        TraceEvent e;
+        e.stage = stage;
+        e.tile_offset = tile_offset;
+        e.bounce = bounce;
+        e.ray_count = 0;
+        e.frame = m_frame;
+        e.start_event = e.end_event = NULL;
+        e.start_us = e.end_us = 0;
+        e.ended = false;
+
+        if (m_device_timestamps)
+                e.start_event = enqueue_marker();
+        else
+                e.start_us = m_host_origin.nsec_since_snap() * 1e-3;
+
+        m_events.push_back(e);
+}
+
+void
+TraceRecorder::end(size_t ray_count)
+{
+        if (!m_recording || m_events.empty())
+                return;
+
+        TraceEvent& e = m_events.back();
+        e.ray_count = ray_count;
+        e.ended = true;
+
+        if (m_device_timestamps)
+                e.end_event = enqueue_marker();
+        else
+                e.end_us = m_host_origin.nsec_since_snap() * 1e-3;
+}
+
+int32_t
+TraceRecorder::end_frame()
+{
+        if (!m_recording)
+                return 0;
+
+        for (size_t i = 0; i < m_events.size(); ++i) {
+                TraceEvent& e = m_events[i];
+                if (!e.ended)
+                        continue;
+
+                if (m_device_timestamps) {
+                        if (!e.start_event || !e.end_event)
+                                continue;
+                        cl_ulong t0, t1;
+                        cl_int err;
+                        err = clGetEventProfilingInfo(e.start_event,
+                                                      CL_PROFILING_COMMAND_END,
+                                                      sizeof(cl_ulong), &t0, NULL);
+                        if (error_cl(err, "clGetEventProfilingInfo"))
+                                continue;
+                        err = clGetEventProfilingInfo(e.end_event,
+                                                      CL_PROFILING_COMMAND_END,
+                                                      sizeof(cl_ulong), &t1, NULL);
+                        if (error_cl(err, "clGetEventProfilingInfo"))
+                                continue;
+                        if (!m_device_origin_set) {
+                                m_device_origin = t0;
+                                m_device_origin_set = true;
+                        }
+                        e.start_us = (t0 - m_device_origin) * 1e-3;
+                        e.end_us = (t1 - m_device_origin) * 1e-3;
+                }
+
+                if (!m_first_event)
+                        m_file << ",\n";
+                m_first_event = false;
+
+                m_file << "{\"name\": \"" << rt_stage_name(e.stage) << "\""
+                       << ", \"cat\": \"rt\", \"ph\": \"X\""
+                       << ", \"ts\": " << e.start_us
+                       << ", \"dur\": " << (e.end_us - e.start_us)
+                       << ", \"pid\": 0, \"tid\": " << m_cq_i
+                       << ", \"args\": {\"frame\": " << e.frame
+                       << ", \"tile_offset\": " << e.tile_offset
+                       << ", \"bounce\": " << e.bounce
+                       << ", \"rays\": " << e.ray_count
+                       << ", \"queue\": " << m_cq_i
+                       << ", \"device_time\": "
+                       << (m_device_timestamps? "true" : "false")
+                       << "}}";
+        }
+        m_file.flush();
+
+        release_events();
+        m_frame++;
+        return 0;
+}
+
+void
+TraceRecorder::release_events()
+{
+        for (size_t i = 0; i < m_events.size(); ++i) {
+                if (m_events[i].start_event)
+                        clReleaseEvent(m_events[i].start_event);
+                if (m_events[i].end_event)
+                        clReleaseEvent(m_events[i].end_event);
+        }
+        m_events.clear();
+}
@@ -1,7 +1,13 @@
 #include <rt/tracer.hpp>
+#include <gpu/scan.hpp>
 
 Tracer::Tracer()
-  : m_initialized(false)
+  : m_shadow_compaction(false)
+  , m_traversal_stats(false)
+  , m_heatmap(false)
+  , m_heat_mem_set(false)
+  , m_initialized(false)
+  , m_cq(0)
 {
 }
 
@@ -12,57 +18,87 @@ int32_t Tracer::initialize()
         if (!device.good())
                 return -1;
 
+        /* Every tracing kernel is deferred, only those of the accelerator
+           and modes in use get compiled (on the first frame) */
+
         /* ---------- BVH ray tracing ------------*/
         std::vector<std::string> bvh_kernel_names;
         bvh_kernel_names.push_back("trace_single");
         bvh_kernel_names.push_back("trace_multi");
+        bvh_kernel_names.push_back("trace_single_stats");
+        bvh_kernel_names.push_back("trace_multi_stats");
 
         std::vector<function_id> bvh_function_ids;
-        bvh_function_ids = device.build_functions("src/kernel/trace-bvh.cl", 
-                bvh_kernel_names);
+        bvh_function_ids = device.defer_functions("src/kernel/trace-bvh.cl", 
+                bvh_kernel_names, BuildOptions(), m_cq);
         if (!bvh_function_ids.size())
                 return -1;
 
         bvh_single_tracer_id = bvh_function_ids[0];
         bvh_multi_tracer_id = bvh_function_ids[1];
+        bvh_single_stats_id = bvh_function_ids[2];
+        bvh_multi_stats_id = bvh_function_ids[3];
 
         /* ---------- BVH shadow ray tracing ------------*/
         std::vector<std::string> bvh_shadow_kernel_names;
         bvh_shadow_kernel_names.push_back("shadow_trace_single");
         bvh_shadow_kernel_names.push_back("shadow_trace_multi");
+        bvh_shadow_kernel_names.push_back("shadow_trace_single_compact");
+        bvh_shadow_kernel_names.push_back("shadow_trace_multi_compact");
+        bvh_shadow_kernel_names.push_back("mark_shadow_rays");
 
         std::vector<function_id> bvh_shadow_function_ids;
-        bvh_shadow_function_ids = device.build_functions("src/kernel/shadow-trace-bvh.cl", 
-                bvh_shadow_kernel_names);
+        bvh_shadow_function_ids = device.defer_functions("src/kernel/shadow-trace-bvh.cl", 
+                bvh_shadow_kernel_names, BuildOptions(), m_cq);
         if (!bvh_shadow_function_ids.size())
                 return -1;
 
         bvh_single_shadow_id = bvh_shadow_function_ids[0];
         bvh_multi_shadow_id  = bvh_shadow_function_ids[1];
+        bvh_single_shadow_compact_id = bvh_shadow_function_ids[2];
+        bvh_multi_shadow_compact_id  = bvh_shadow_function_ids[3];
+        shadow_marker_id  = bvh_shadow_function_ids[4];
 
-        /* ------------------- KDTree kernels ----------------- */
+        /* Shadow ray compaction buffers, resized as needed */
+        shadow_flags_id = device.new_memory(m_cq);
+        if (device.memory(shadow_flags_id).initialize(sizeof(cl_uint), 
+                                                      READ_WRITE_MEMORY))
+                return -1;
 
-        /* Single root functions */
-        kdt_single_tracer_id = device.new_function();
-        DeviceFunction& kdt_single_tracer = device.function(kdt_single_tracer_id);
+        shadow_ids_id = device.new_memory(m_cq);
+        if (device.memory(shadow_ids_id).initialize(sizeof(cl_int), 
+                                                    READ_WRITE_MEMORY))
+                return -1;
 
-        if (kdt_single_tracer.initialize("src/kernel/trace-kdt.cl", "trace_single"))
+        shadow_count_id = device.new_memory(m_cq);
+        if (device.memory(shadow_count_id).initialize_host_mapped(sizeof(cl_uint), 
+                                                                  READ_WRITE_MEMORY))
                 return -1;
 
-        kdt_single_tracer.set_dims(1);
+        /* ------------------- KDTree kernels ----------------- */
+
+        /* Single root functions */
+        std::vector<std::string> kdt_kernel_names;
+        kdt_kernel_names.push_back("trace_single");
+        kdt_kernel_names.push_back("trace_single_stats");
 
-        kdt_single_shadow_id = device.new_function();
-        DeviceFunction& kdt_single_shadow = device.function(kdt_single_shadow_id);
-        if (kdt_single_shadow.initialize("src/kernel/shadow-trace-kdt.cl", 
-                "shadow_trace_single"))
+        std::vector<function_id> kdt_function_ids;
+        kdt_function_ids = device.defer_functions("src/kernel/trace-kdt.cl", 
+                kdt_kernel_names, BuildOptions(), m_cq);
+        if (!kdt_function_ids.size())
                 return -1;
 
-        kdt_single_shadow.set_dims(1);
+        kdt_single_tracer_id = kdt_function_ids[0];
+        kdt_single_stats_id = kdt_function_ids[1];
+
+        kdt_single_shadow_id = device.new_function(m_cq);
+        device.function(kdt_single_shadow_id).defer("src/kernel/shadow-trace-kdt.cl", 
+                                                    "shadow_trace_single");
         /*----------------------------*/
 
 
         /* Multi root functions  ( NOT IMPLEMENTED )*/
-        /*      kdt_multi_tracer_id = device.new_function();
+        /*      kdt_multi_tracer_id = device.new_function(m_cq);
         DeviceFunction& kdt_multi_tracer = device.function(kdt_multi_tracer_id);
 
         if (kdt_multi_tracer.initialize("src/kernel/trace-kdt.cl", "???"))
@@ -70,7 +106,7 @@ int32_t Tracer::initialize()
 
         kdt_multi_tracer.set_dims(1);
 
-        kdt_multi_shadow_id = device.new_function();
+        kdt_multi_shadow_id = device.new_function(m_cq);
         DeviceFunction& kdt_multi_shadow = device.function(kdt_multi_shadow_id);
         if (multi_shadow.initialize("src/kernel/shadow-trace-kdt.cl", "???"))
         return -1;
@@ -79,6 +115,21 @@ int32_t Tracer::initialize()
         */
         /*----------------------------*/
 
+        /* ------------------- Traversal statistics ----------------- */
+        trav_reduce_id = device.new_function(m_cq);
+        device.function(trav_reduce_id).defer("src/kernel/traversal-stats.cl", 
+                                              "reduce_traversal_stats");
+
+        /* Per ray counters, resized as needed */
+        ray_trav_stats_id = device.new_memory(m_cq);
+        if (device.memory(ray_trav_stats_id).initialize(sizeof(cl_uint4), 
+                                                        READ_WRITE_MEMORY))
+                return -1;
+
+        trav_totals_id = device.new_memory(m_cq);
+        if (device.memory(trav_totals_id).initialize(4 * sizeof(cl_uint), 
+                                                     READ_WRITE_MEMORY))
+                return -1;
 
         m_timing = false;
         m_initialized = true;
@@ -122,15 +173,20 @@ Tracer::trace(Scene& scene, DeviceMemory& bvh_mem, int32_t ray_count,
         if (tracer.set_arg(6, sizeof(cl_int), &root_cant))
                 return -1;
 
+        if (root_cant > 1 && tracer.set_arg(7, scene.top_nodes_mem()))
+                return -1;
+
         size_t group_size = tracer.max_group_size();
         if (secondary)
                 group_size = std::min(RT::BVH_SECONDARY_GROUP_SIZE, group_size);
-        if (tracer.enqueue_single_dim(ray_count, group_size))
+        group_size = tracer.work_group_size(ray_count, group_size,
+                                            secondary ? "secondary" : "", m_cq);
+        if (tracer.enqueue_single_dim(ray_count, group_size, 0, m_cq))
                 return -1;
-        device.enqueue_barrier();
+        device.enqueue_barrier(m_cq);
 
         if (m_timing) {
-                device.finish_commands();
+                device.finish_commands(m_cq);
                 m_tracer_time_ms = m_tracer_timer.msec_since_snap();
         }
 
@@ -163,7 +219,7 @@ Tracer::trace_kdtree(Scene& scene, int32_t ray_count,
         DeviceInterface& device = *DeviceInterface::instance();
 
         if (scene.root_count() == 1)
-                tracer_id = kdt_single_tracer_id;
+                tracer_id = m_traversal_stats? kdt_single_stats_id : kdt_single_tracer_id;
         else /* NOT IMPLEMENTED */
                 return -1;
 
@@ -194,19 +250,33 @@ Tracer::trace_kdtree(Scene& scene, int32_t ray_count,
         if (tracer.set_arg(6, sizeof(BBox), &scene_bbox))
                 return -1;
 
+        if (m_traversal_stats) {
+                DeviceMemory& ray_stats_mem = device.memory(ray_trav_stats_id);
+                if (ray_stats_mem.size() < sizeof(cl_uint4) * ray_count &&
+                    ray_stats_mem.resize(sizeof(cl_uint4) * ray_count))
+                        return -1;
+                if (tracer.set_arg(7, ray_stats_mem))
+                        return -1;
+        }
+
         size_t group_size = tracer.max_group_size();
         if (secondary)
                 group_size = std::min(RT::KDT_SECONDARY_GROUP_SIZE, group_size);
+        group_size = tracer.work_group_size(ray_count, group_size,
+                                            secondary ? "secondary" : "", m_cq);
 
-        if (tracer.enqueue_single_dim(ray_count, group_size))
+        if (tracer.enqueue_single_dim(ray_count, group_size, 0, m_cq))
                 return -1;
-        device.enqueue_barrier();
+        device.enqueue_barrier(m_cq);
 
         if (m_timing) {
-                device.finish_commands();
+                device.finish_commands(m_cq);
                 m_tracer_time_ms = m_tracer_timer.msec_since_snap();
         }
 
+        if (m_traversal_stats && reduce_traversal_stats(ray_count, rays))
+                return -1;
+
         return 0;
 }
 
@@ -218,9 +288,9 @@ Tracer::trace_bvh(Scene& scene, int32_t ray_count,
         DeviceInterface& device = *DeviceInterface::instance();
 
         if (scene.root_count() == 1)
-                tracer_id = bvh_single_tracer_id;
+                tracer_id = m_traversal_stats? bvh_single_stats_id : bvh_single_tracer_id;
         else 
-                tracer_id = bvh_multi_tracer_id;
+                tracer_id = m_traversal_stats? bvh_multi_stats_id : bvh_multi_tracer_id;
 
         DeviceFunction& tracer = device.function(tracer_id);
 
@@ -250,21 +320,78 @@ Tracer::trace_bvh(Scene& scene, int32_t ray_count,
                 cl_int root_cant = scene.root_count();
                 if (tracer.set_arg(6, sizeof(cl_int), &root_cant))
                         return -1;
+
+                if (tracer.set_arg(7, scene.top_nodes_mem()))
+                        return -1;
+        }
+
+        if (m_traversal_stats) {
+                DeviceMemory& ray_stats_mem = device.memory(ray_trav_stats_id);
+                if (ray_stats_mem.size() < sizeof(cl_uint4) * ray_count &&
+                    ray_stats_mem.resize(sizeof(cl_uint4) * ray_count))
+                        return -1;
+                int32_t stats_arg = scene.root_count() > 1 ? 8 : 5;
+                if (tracer.set_arg(stats_arg, ray_stats_mem))
+                        return -1;
         }
 
         size_t group_size = tracer.max_group_size();
         if (secondary)
                 group_size = std::min(RT::BVH_SECONDARY_GROUP_SIZE, group_size);
+        group_size = tracer.work_group_size(ray_count, group_size,
+                                            secondary ? "secondary" : "", m_cq);
 
-        if (tracer.enqueue_single_dim(ray_count, group_size))
+        if (tracer.enqueue_single_dim(ray_count, group_size, 0, m_cq))
                 return -1;
-        device.enqueue_barrier();
+        device.enqueue_barrier(m_cq);
 
         if (m_timing) {
-                device.finish_commands();
+                device.finish_commands(m_cq);
                 m_tracer_time_ms = m_tracer_timer.msec_since_snap();
         }
 
+        if (m_traversal_stats && reduce_traversal_stats(ray_count, rays))
+                return -1;
+
+        return 0;
+}
+
+int32_t
+Tracer::reduce_traversal_stats(int32_t ray_count, RayBundle& rays)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        DeviceFunction& reduce = device.function(trav_reduce_id);
+        DeviceMemory& totals_mem = device.memory(trav_totals_id);
+
+        cl_uint totals[4] = {0, 0, 0, 0};
+        if (totals_mem.write(sizeof(totals), totals, 0, m_cq))
+                return -1;
+
+        bool use_heat = m_heatmap && m_heat_mem_set;
+        cl_int use_heat_arg = use_heat;
+        /* The heat buffer is only written when use_heat is set */
+        memory_id heat_id = use_heat ? heat_mem_id : trav_totals_id;
+
+        if (reduce.set_arg(0, device.memory(ray_trav_stats_id)) ||
+            reduce.set_arg(1, rays.mem()) ||
+            reduce.set_arg(2, totals_mem) ||
+            reduce.set_arg(3, device.memory(heat_id)) ||
+            reduce.set_arg(4, sizeof(cl_int), &use_heat_arg))
+                return -1;
+
+        if (reduce.enqueue_single_dim(ray_count, 0, 0, m_cq))
+                return -1;
+        device.enqueue_barrier(m_cq);
+
+        if (totals_mem.read(sizeof(totals), totals, 0, m_cq))
+                return -1;
+
+        m_trav_stats.rays = ray_count;
+        m_trav_stats.node_visits = totals[0];
+        m_trav_stats.box_tests = totals[1];
+        m_trav_stats.triangle_tests = totals[2];
+        m_trav_stats.max_node_visits = totals[3];
+
         return 0;
 }
 
@@ -283,6 +410,9 @@ Tracer::shadow_trace(Scene& scene, int32_t ray_count,
                 return shadow_trace_kdtree(scene, ray_count, rays, hits, secondary);
         case (SAH_BVH_ACCELERATOR):
         case (LBVH_ACCELERATOR):
+                if (m_shadow_compaction)
+                        return shadow_trace_bvh_compact(scene, ray_count, 
+                                                        rays, hits, secondary);
                 return shadow_trace_bvh(scene, ray_count, rays, hits, secondary);
         default:
                 return -1;
@@ -331,18 +461,23 @@ Tracer::shadow_trace_bvh(Scene& scene, int32_t ray_count,
                 cl_int root_count = scene.root_count();
                 if (shadow.set_arg(7, sizeof(cl_int), &root_count))
                         return -1;
+
+                if (shadow.set_arg(8, scene.top_nodes_mem()))
+                        return -1;
         }
 
         size_t group_size = shadow.max_group_size();
         if (secondary)
                 group_size = std::min(RT::BVH_SECONDARY_GROUP_SIZE, group_size);
+        group_size = shadow.work_group_size(ray_count, group_size,
+                                            secondary ? "secondary" : "", m_cq);
 
-        if (shadow.enqueue_single_dim(ray_count, group_size))
+        if (shadow.enqueue_single_dim(ray_count, group_size, 0, m_cq))
                 return -1;
-        device.enqueue_barrier();
+        device.enqueue_barrier(m_cq);
 
         if (m_timing) {
-                device.finish_commands();
+                device.finish_commands(m_cq);
                 m_shadow_time_ms = m_shadow_timer.msec_since_snap();
         }
 
@@ -351,6 +486,134 @@ Tracer::shadow_trace_bvh(Scene& scene, int32_t ray_count,
 
 }
 
+int32_t 
+Tracer::compact_shadow_rays(Scene& scene, int32_t ray_count, 
+                            HitBundle& hits, int32_t* compact_count)
+{
+        DeviceInterface& device = *DeviceInterface::instance();
+        DeviceFunction& marker = device.function(shadow_marker_id);
+        DeviceMemory& flags_mem = device.memory(shadow_flags_id);
+        DeviceMemory& ids_mem = device.memory(shadow_ids_id);
+        DeviceMemory& count_mem = device.memory(shadow_count_id);
+
+        if (flags_mem.size() < sizeof(cl_uint) * ray_count) {
+                if (flags_mem.resize(sizeof(cl_uint) * ray_count))
+                        return -1;
+        }
+
+        if (ids_mem.size() < sizeof(cl_int) * ray_count) {
+                if (ids_mem.resize(sizeof(cl_int) * ray_count))
+                        return -1;
+        }
+
+        /////////////// Mark shadow rays that need to be traced //////////////
+        if (marker.set_arg(0, hits.mem()) ||
+            marker.set_arg(1, scene.lights_mem()) ||
+            marker.set_arg(2, flags_mem))
+                return -1;
+
+        if (marker.enqueue_single_dim(ray_count, 0, 0, m_cq))
+                return -1;
+        device.enqueue_barrier(m_cq);
+
+        ////////////// Write marked ray ids contiguously ///////////////////
+        if (gpu_compact_uint(device, shadow_flags_id, ray_count, 
+                             shadow_ids_id, shadow_count_id, m_cq))
+                return -1;
+
+        cl_uint marked_count;
+        if (count_mem.read(sizeof(cl_uint), &marked_count, 0, m_cq))
+                return -1;
+
+        if (marked_count > (cl_uint)ray_count) {
+                std::cerr << "Error: shadow ray compaction reported wrong number of "
+                          << "rays.\n";
+                return -1;
+        }
+
+        *compact_count = marked_count;
+
+        return 0;
+}
+
+int32_t 
+Tracer::shadow_trace_bvh_compact(Scene& scene, int32_t ray_count, 
+        RayBundle& rays, HitBundle& hits, bool secondary)
+{
+        function_id shadow_id;
+        DeviceInterface& device = *DeviceInterface::instance();
+        if (scene.root_count() == 1)
+                shadow_id = bvh_single_shadow_compact_id;
+        else
+                shadow_id = bvh_multi_shadow_compact_id;
+
+        DeviceFunction& shadow = device.function(shadow_id);
+
+        if (m_timing)
+                m_shadow_timer.snap_time();
+
+        int32_t compact_count;
+        if (compact_shadow_rays(scene, ray_count, hits, &compact_count))
+                return -1;
+
+        if (compact_count) {
+
+                if (shadow.set_arg(0, hits.mem()))
+                        return -1;
+
+                if (shadow.set_arg(1, rays.mem()))
+                        return -1;
+
+                if (shadow.set_arg(2, scene.vertex_mem()))
+                        return -1;
+
+                if (shadow.set_arg(3, scene.index_mem()))
+                        return -1;
+
+                if (shadow.set_arg(4, scene.bvh_nodes_mem()))
+                        return -1;
+
+                if (shadow.set_arg(5, scene.lights_mem()))
+                        return -1;
+
+                if (scene.root_count() > 1) {
+
+                        if (shadow.set_arg(6, scene.bvh_roots_mem()))
+                                return -1;
+
+                        cl_int root_count = scene.root_count();
+                        if (shadow.set_arg(7, sizeof(cl_int), &root_count))
+                                return -1;
+
+                        if (shadow.set_arg(8, scene.top_nodes_mem()))
+                                return -1;
+
+                        if (shadow.set_arg(9, device.memory(shadow_ids_id)))
+                                return -1;
+                } else {
+                        if (shadow.set_arg(6, device.memory(shadow_ids_id)))
+                                return -1;
+                }
+
+                size_t group_size = shadow.max_group_size();
+                if (secondary)
+                        group_size = std::min(RT::BVH_SECONDARY_GROUP_SIZE, group_size);
+                group_size = shadow.work_group_size(compact_count, group_size,
+                                                    secondary ? "secondary" : "", m_cq);
+
+                if (shadow.enqueue_single_dim(compact_count, group_size, 0, m_cq))
+                        return -1;
+                device.enqueue_barrier(m_cq);
+        }
+
+        if (m_timing) {
+                device.finish_commands(m_cq);
+                m_shadow_time_ms = m_shadow_timer.msec_since_snap();
+        }
+
+        return 0;
+}
+
 int32_t
 Tracer::shadow_trace(Scene& scene, DeviceMemory& bvh_mem, int32_t ray_count,
         RayBundle& rays, HitBundle& hits, bool secondary)
@@ -394,13 +657,15 @@ Tracer::shadow_trace(Scene& scene, DeviceMemory& bvh_mem, int32_t ray_count,
         size_t group_size = shadow.max_group_size();
         if (secondary)
                 group_size = std::min(RT::BVH_SECONDARY_GROUP_SIZE, group_size);
+        group_size = shadow.work_group_size(ray_count, group_size,
+                                            secondary ? "secondary" : "", m_cq);
 
-        if (shadow.enqueue_single_dim(ray_count, group_size))
+        if (shadow.enqueue_single_dim(ray_count, group_size, 0, m_cq))
                 return -1;
-        device.enqueue_barrier();
+        device.enqueue_barrier(m_cq);
 
         if (m_timing) {
-                device.finish_commands();
+                device.finish_commands(m_cq);
                 m_shadow_time_ms = m_shadow_timer.msec_since_snap();
         }
 
@@ -452,13 +717,15 @@ Tracer::shadow_trace_kdtree(Scene& scene, int32_t ray_count,
         size_t group_size = shadow.max_group_size();
         if (secondary)
                 group_size = std::min(RT::KDT_SECONDARY_GROUP_SIZE, group_size);
+        group_size = shadow.work_group_size(ray_count, group_size,
+                                            secondary ? "secondary" : "", m_cq);
 
-        if (shadow.enqueue_single_dim(ray_count, group_size))
+        if (shadow.enqueue_single_dim(ray_count, group_size, 0, m_cq))
                 return -1;
-        device.enqueue_barrier();
+        device.enqueue_barrier(m_cq);
 
         if (m_timing) {
-                device.finish_commands();
+                device.finish_commands(m_cq);
                 m_shadow_time_ms = m_shadow_timer.msec_since_snap();
         }
 
@@ -483,7 +750,29 @@ Tracer::get_shadow_exec_time()
         return m_shadow_time_ms;
 }
 
+const TraversalStats&
+Tracer::get_traversal_stats()
+{
+        return m_trav_stats;
+}
+
+bool
+Tracer::traversal_stats_enabled()
+{
+        return m_traversal_stats;
+}
+
+void
+Tracer::set_heat_mem(memory_id heat_id)
+{
+        heat_mem_id = heat_id;
+        m_heat_mem_set = true;
+}
+
 void 
 Tracer::update_configuration(const RendererConfig& conf)
 {
+        m_shadow_compaction = conf.shadow_ray_compaction;
+        m_traversal_stats = conf.trav_stats || conf.trav_heatmap;
+        m_heatmap = conf.trav_heatmap;
 }